@@ -14,11 +14,18 @@ extern void* memset(void* dest, int ch, size_t size);
 extern void* memcpy(void* dest, const void* src, size_t size);
 extern void* memmove(void* dest, const void* src, size_t size);
 extern int   memcmp(const void* ptr1, const void* ptr2, size_t n);
+extern void* memchr(const void* ptr, int ch, size_t n);
 extern char*  strcpy(char* dst, const char* src);
+extern char*  strncpy(char* dst, const char* src, size_t n);
 extern size_t strlen(const char* str);
 extern int    strcmp(const char* str1, const char* str2);
+extern int    strncmp(const char* str1, const char* str2, size_t n);
+extern char*  strchr(const char* str, int ch);
 extern char*  strcat(char* dest, const char* src);
 
+// 32-bit FNV-1a hash of a buffer, accelerated like the functions above
+extern uint32_t memhash(const void* data, size_t len);
+
 extern void* malloc(size_t) _NOTHROW;
 extern void* calloc(size_t, size_t) _NOTHROW;
 extern void  free(void*) _NOTHROW;
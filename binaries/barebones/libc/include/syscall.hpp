@@ -17,11 +17,17 @@
 #define SYSCALL_MEMSET    (NATIVE_SYSCALLS_BASE+6)
 #define SYSCALL_MEMMOVE   (NATIVE_SYSCALLS_BASE+7)
 #define SYSCALL_MEMCMP    (NATIVE_SYSCALLS_BASE+8)
+#define SYSCALL_MEMCHR    (NATIVE_SYSCALLS_BASE+9)
 
 #define SYSCALL_STRLEN    (NATIVE_SYSCALLS_BASE+10)
 #define SYSCALL_STRCMP    (NATIVE_SYSCALLS_BASE+11)
+#define SYSCALL_STRCHR    (NATIVE_SYSCALLS_BASE+12)
+#define SYSCALL_STRCPY    (NATIVE_SYSCALLS_BASE+13)
+#define SYSCALL_STRNCPY   (NATIVE_SYSCALLS_BASE+14)
+#define SYSCALL_MEMHASH   (NATIVE_SYSCALLS_BASE+15)
 
 #define SYSCALL_BACKTRACE (NATIVE_SYSCALLS_BASE+19)
+#define SYSCALL_TIMEPAGE  (NATIVE_SYSCALLS_BASE+20)
 
 #define SYSCALL_WRITE  64
 #define SYSCALL_EXIT   93
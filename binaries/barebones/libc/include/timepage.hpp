@@ -0,0 +1,56 @@
+#pragma once
+#include <cstdint>
+#include <ctime>
+#include "syscall.hpp"
+
+// The time page shared read-only by the emulator (see: setup_native_time).
+// It is refreshed every time the emulator resumes the guest, and when asked
+// for with SYSCALL_TIMEPAGE, so reading it never costs a system call.
+struct time_page {
+	uint64_t sequence; // changes with every update
+	int64_t realtime_sec;
+	int64_t realtime_nsec;
+	int64_t monotonic_sec;
+	int64_t monotonic_nsec;
+};
+
+// The page changes behind the back of the compiler, hence volatile
+inline const volatile time_page* get_time_page()
+{
+	static const volatile time_page* page = nullptr;
+	if (page == nullptr)
+		page = (const volatile time_page*) syscall(SYSCALL_TIMEPAGE);
+	return page;
+}
+
+// Refreshes the clocks now, instead of when the guest is next resumed
+inline void refresh_time_page()
+{
+	(void) syscall(SYSCALL_TIMEPAGE);
+}
+
+// Reads CLOCK_REALTIME or CLOCK_MONOTONIC from the time page, which is
+// as coarse as the time slices the emulator runs the guest for. The guest
+// can be stopped in the middle, so the read is retried on updates.
+inline void fast_clock_gettime(clockid_t clock, struct timespec* ts)
+{
+	const volatile time_page* page = get_time_page();
+	uint64_t sequence;
+	do {
+		sequence = page->sequence;
+		if (clock == CLOCK_MONOTONIC) {
+			ts->tv_sec  = page->monotonic_sec;
+			ts->tv_nsec = page->monotonic_nsec;
+		} else {
+			ts->tv_sec  = page->realtime_sec;
+			ts->tv_nsec = page->realtime_nsec;
+		}
+	} while (sequence != page->sequence);
+}
+
+inline int64_t fast_monotonic_ns()
+{
+	struct timespec ts;
+	fast_clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
@@ -59,6 +59,15 @@ void* memmove(void* vdest, const void* vsrc, size_t size)
 	}
 	return dest;
 }
+extern "C"
+uint32_t memhash(const void* data, size_t size)
+{
+	const auto* p = (const unsigned char*) data;
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ p[i]) * 16777619u;
+	return hash;
+}
 
 #else
 
@@ -68,9 +77,14 @@ void* memmove(void* vdest, const void* vsrc, size_t size)
 #define memmove __wrap_memmove
 #define memcmp  __wrap_memcmp
 
+#define memchr  __wrap_memchr
+
 #define strlen  __wrap_strlen
 #define strcmp  __wrap_strcmp
 #define strncmp __wrap_strncmp
+#define strchr  __wrap_strchr
+#define strcpy  __wrap_strcpy
+#define strncpy __wrap_strncpy
 #endif
 
 extern "C" NATIVE_MEM_FUNCATTR
@@ -179,6 +193,77 @@ int strncmp(const char* str1, const char* str2, size_t maxlen)
 	return a0_out;
 }
 
+extern "C" NATIVE_MEM_FUNCATTR
+void* memchr(const void* ptr, int ch, size_t size)
+{
+	register const char* a0 asm("a0") = (const char*)ptr;
+	register int         a1 asm("a1") = ch;
+	register size_t      a2 asm("a2") = size;
+	register void*       a0_out asm("a0");
+	register long syscall_id asm("a7") = SYSCALL_MEMCHR;
+
+	asm volatile ("ecall" : "=r"(a0_out) :
+		"r"(a0), "m"(*(const char(*)[size]) a0),
+		"r"(a1), "r"(a2), "r"(syscall_id));
+	return a0_out;
+}
+
+extern "C" NATIVE_MEM_FUNCATTR
+char* strchr(const char* str, int ch)
+{
+	register const char* a0 asm("a0") = str;
+	register int         a1 asm("a1") = ch;
+	register char*       a0_out asm("a0");
+	register long syscall_id asm("a7") = SYSCALL_STRCHR;
+
+	asm volatile ("ecall" : "=r"(a0_out) :
+		"r"(a0), "m"(*(const char(*)[4096]) a0),
+		"r"(a1), "r"(syscall_id));
+	return a0_out;
+}
+
+extern "C" NATIVE_MEM_FUNCATTR
+char* strcpy(char* dst, const char* src)
+{
+	register char*       a0 asm("a0") = dst;
+	register const char* a1 asm("a1") = src;
+	register long syscall_id asm("a7") = SYSCALL_STRCPY;
+
+	// The length of the string is not known here
+	asm volatile ("ecall"
+		: "+r"(a0) : "r"(a1), "r"(syscall_id) : "memory");
+	return dst;
+}
+
+extern "C" NATIVE_MEM_FUNCATTR
+char* strncpy(char* dst, const char* src, size_t size)
+{
+	register char*       a0 asm("a0") = dst;
+	register const char* a1 asm("a1") = src;
+	register size_t      a2 asm("a2") = size;
+	register long syscall_id asm("a7") = SYSCALL_STRNCPY;
+
+	asm volatile ("ecall"
+	:	"+r"(a0), "=m"(*(char(*)[size]) dst)
+	:	"r"(a1), "m"(*(const char(*)[size]) a1),
+		"r"(a2), "r"(syscall_id));
+	return dst;
+}
+
+extern "C"
+uint32_t memhash(const void* data, size_t size)
+{
+	register const char* a0 asm("a0") = (const char*)data;
+	register size_t      a1 asm("a1") = size;
+	register uint32_t    a0_out asm("a0");
+	register long syscall_id asm("a7") = SYSCALL_MEMHASH;
+
+	asm volatile ("ecall" : "=r"(a0_out) :
+		"r"(a0), "m"(*(const char(*)[size]) a0),
+		"r"(a1), "r"(syscall_id));
+	return a0_out;
+}
+
 #endif
 
 
@@ -190,6 +275,7 @@ wchar_t* wmemcpy(wchar_t* wto, const wchar_t* wfrom, size_t size)
 	return (wchar_t *) memcpy (wto, wfrom, size * sizeof (wchar_t));
 }
 
+#ifndef NATIVE_MEM_SYSCALLS
 extern "C"
 void* memchr(const void *s, int c, size_t n)
 {
@@ -197,7 +283,7 @@ void* memchr(const void *s, int c, size_t n)
         const auto* p = (const unsigned char*) s;
 
         do {
-            if (*p++ == c)
+            if (*p++ == (unsigned char) c)
                 return ((void *)(p - 1));
         } while (--n != 0);
     }
@@ -207,11 +293,10 @@ void* memchr(const void *s, int c, size_t n)
 extern "C"
 char* strcpy(char* dst, const char* src)
 {
-	while ((*dst++ = *src++));
-	*dst = 0;
+	char* d = dst;
+	while ((*d++ = *src++));
 	return dst;
 }
-#ifndef NATIVE_MEM_SYSCALLS
 extern "C"
 size_t strlen(const char* str)
 {
@@ -246,6 +331,26 @@ int strncmp(const char* s1, const char* s2, size_t n)
         return ( *(unsigned char *)s1 - *(unsigned char *)s2 );
     }
 }
+extern "C"
+char* strchr(const char* str, int ch)
+{
+	for (;; str++) {
+		if (*str == (char) ch)
+			return (char*) str;
+		if (*str == 0)
+			return nullptr;
+	}
+}
+extern "C"
+char* strncpy(char* dst, const char* src, size_t size)
+{
+	size_t i = 0;
+	for (; i < size && src[i] != 0; i++)
+		dst[i] = src[i];
+	for (; i < size; i++)
+		dst[i] = 0;
+	return dst;
+}
 #endif
 
 extern "C"
@@ -1,7 +1,7 @@
 #include <libriscv/machine.hpp>
 #include <libriscv/rsp_server.hpp>
 #include "settings.hpp"
-static inline std::vector<uint8_t> load_file(const std::string&);
+static inline std::string_view map_file(const std::string&);
 
 static constexpr uint64_t MAX_MEMORY = 1024 * 1024 * 200;
 
@@ -10,11 +10,12 @@ static void run_sighandler(riscv::Machine<W>&);
 
 template <int W>
 static void run_program(
-	const std::vector<uint8_t>& binary,
+	std::string_view binary,
 	const std::vector<std::string>& args)
 {
 	riscv::Machine<W> machine { binary, {
-		.memory_max = MAX_MEMORY
+		.memory_max = MAX_MEMORY,
+		.map_segments = true
 	}};
 
 	if constexpr (full_linux_guest)
@@ -48,6 +49,7 @@ static void run_program(
 		machine.setup_argv(args);
 		machine.setup_native_heap(1, 0x40000000, 6*1024*1024);
 		machine.setup_native_memory(6);
+		machine.setup_native_time(21);
 		machine.setup_native_threads(30);
 		machine.setup_minimal_syscalls();
 	}
@@ -159,7 +161,8 @@ int main(int argc, const char** argv)
 	}
 	const std::string& filename = args.front();
 
-	const auto binary = load_file(filename);
+	// the binary stays mapped until the emulator exits
+	const auto binary = map_file(filename);
 	assert(binary.size() >= 64);
 
 	try {
@@ -196,23 +199,26 @@ void run_sighandler(riscv::Machine<W>& machine)
 }
 
 #include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
-std::vector<uint8_t> load_file(const std::string& filename)
+std::string_view map_file(const std::string& filename)
 {
-    size_t size = 0;
-    FILE* f = fopen(filename.c_str(), "rb");
-    if (f == NULL) throw std::runtime_error("Could not open file: " + filename);
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Could not open file: " + filename);
 
-    fseek(f, 0, SEEK_END);
-    size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-
-    std::vector<uint8_t> result(size);
-    if (size != fread(result.data(), 1, size, f))
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0)
     {
-        fclose(f);
+        close(fd);
         throw std::runtime_error("Error when reading from file: " + filename);
     }
-    fclose(f);
-    return result;
+    // Pages are only read from disk when the guest touches them,
+    // and they are shared with other emulators running the same program
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        throw std::runtime_error("Could not map file: " + filename);
+    return std::string_view((const char*) data, st.st_size);
 }
@@ -2,8 +2,8 @@
 #include <cassert>
 #include <cstdlib>
 #include <vector>
-static const uintptr_t BEGIN = 0x1000000;
-static const uintptr_t END   = 0x2000000;
+static uintptr_t BEGIN = 0;
+static uintptr_t END   = 0;
 
 inline bool is_within(uintptr_t addr) {
 	return addr >= BEGIN && addr < END;
@@ -18,7 +18,8 @@ struct Allocation {
 	size_t    size;
 };
 
-static Allocation alloc_random(riscv::Arena& arena)
+template <int W>
+static Allocation alloc_random(riscv::Arena<W>& arena)
 {
 	const size_t size = randInt(0, 8000);
 	const uintptr_t addr = arena.malloc(size);
@@ -30,9 +31,12 @@ static Allocation alloc_random(riscv::Arena& arena)
 	return a;
 }
 
-int main()
+template <int W>
+static void test_arena(uintptr_t begin, uintptr_t end)
 {
-	riscv::Arena arena {BEGIN, END};
+	BEGIN = begin;
+	END   = end;
+	riscv::Arena<W> arena (BEGIN, END);
 	std::vector<Allocation> allocs;
 
 	// General allocation test
@@ -70,14 +74,53 @@ int main()
 		}
 	}
 
+	assert(arena.chunks_used() == allocs.size());
+	assert(arena.bytes_used() + arena.bytes_free() == END - BEGIN);
+
+	// Transferred and deserialized arenas have the same allocations
+	riscv::Arena<W> copy {0, 0};
+	arena.transfer(copy);
+	std::vector<uint8_t> state;
+	arena.serialize_to(state);
+	riscv::Arena<W> restored {0, 0};
+	assert(restored.deserialize_from(state.data(), state.size()) == 0);
+	for (auto* other : {&copy, &restored}) {
+		assert(other->chunks_used() == arena.chunks_used());
+		assert(other->bytes_used() == arena.bytes_used());
+		assert(other->bytes_free() == arena.bytes_free());
+		for (auto entry : allocs) {
+			assert(other->size(entry.addr) == entry.size);
+			assert(other->free(entry.addr) == 0);
+		}
+		assert(other->chunks_used() == 0);
+		assert(other->bytes_free() == END - BEGIN);
+	}
+
 	for (auto entry : allocs) {
 		assert(arena.size(entry.addr) == entry.size);
 	  	assert(arena.free(entry.addr) == 0);
 	}
 	assert(arena.bytes_used() == 0);
 	assert(arena.bytes_free() == END - BEGIN);
+	assert(arena.chunks_used() == 0);
+	// Double-free is detected
+	assert(arena.free(allocs.front().addr) < 0);
 	allocs.clear();
 
+	// The whole arena can be allocated again
+	const uintptr_t all = arena.malloc(END - BEGIN);
+	assert(all == BEGIN && arena.bytes_free() == 0);
+	assert(arena.malloc(1) == 0);
+	assert(arena.free(all) == 0);
+}
+
+int main()
+{
+	// 32-bit arena
+	test_arena<4>(0x1000000, 0x2000000);
+	// 64-bit arena, larger than 4GB and placed high
+	test_arena<8>(0x7f0000000000, 0x7f0000000000 + (6ull << 30));
+
 	printf("OK\n");
 }
 
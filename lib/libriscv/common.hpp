@@ -2,6 +2,7 @@
 #include <type_traits>
 #include <functional>
 #include <string>
+#include <string_view>
 
 #ifndef LIKELY
 #define LIKELY(x) __builtin_expect((x), 1)
@@ -82,7 +83,9 @@ namespace riscv
 	template <int W> struct Memory;
 	template <int W> struct MultiThreading;
 	template <int W> struct Multiprocessing;
-	struct Arena;
+	template <int W> struct Arena;
+	template <int W> struct AsyncIO;
+	struct IoUring;
 
 	template <int W>
 	struct MachineOptions
@@ -92,6 +95,19 @@ namespace riscv
 		bool load_program = true;
 		bool protect_segments = true;
 		bool allow_write_exec_segment = false;
+		// Page-congruent segments are not copied, and their pages are
+		// installed on first access, pointing directly into the binary.
+		// Writable segments become copy-on-write. The binary must outlive
+		// the machine, eg. by memory-mapping the ELF file.
+		bool map_segments = false;
+		// Read-only and copy-on-write pages of the program are shared with
+		// identical pages of other machines, through a process-wide store.
+		// See: SharedPages::stats() in page_store.hpp
+		bool deduplicate_pages = false;
+		// ELF interpreter (dynamic linker) for programs with PT_INTERP,
+		// which is loaded into the mmap area. Like the program, it must
+		// outlive the machine.
+		std::string_view interpreter = {};
 		bool verbose_loader = false;
 		// Instruction fusing is an experimental optimizing feature
 		// Can only be enabled with the RISCV_EXPERIMENTAL CMake option
@@ -109,8 +125,26 @@ namespace riscv
 #endif
 	};
 
+	struct SerializeOptions
+	{
+		// Compress page data with the built-in LZ codec
+		bool compress = false;
+		// Store page data at page-aligned offsets, so that the snapshot
+		// image can be memory-mapped and restored without copying.
+		// Page-aligned images are never compressed.
+		bool page_aligned = false;
+	};
+
+	// Streamed snapshot output: must consume all bytes, or return false
+	using serialize_sink_t = std::function<bool(const uint8_t*, size_t)>;
+	// Streamed snapshot input: returns the number of bytes read into the
+	// buffer, like read(2), with 0 at the end and negative on errors
+	using serialize_source_t = std::function<int64_t(uint8_t*, size_t)>;
+
 	template <int W>
 	struct SerializedMachine;
+	struct SerializeWriter;
+	struct DeserializeReader;
 
 	template <class...> constexpr std::false_type always_false {};
 
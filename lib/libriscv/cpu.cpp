@@ -19,9 +19,12 @@ namespace riscv
 	CPU<W>::CPU(Machine<W>& machine, unsigned cpu_id, const Machine<W>& other)
 		: m_machine { machine }, m_cpuid { cpu_id }
 	{
+		// the fork shares the execute segments
 		this->m_exec_data  = other.cpu.m_exec_data;
 		this->m_exec_begin = other.cpu.m_exec_begin;
 		this->m_exec_end   = other.cpu.m_exec_end;
+		this->m_exec_decoder = other.cpu.m_exec_decoder;
+		this->m_exec = other.cpu.m_exec;
 
 		this->registers() = other.cpu.registers();
 #ifdef RISCV_EXT_ATOMICS
@@ -44,15 +47,41 @@ namespace riscv
 	template <int W>
 	void CPU<W>::init_execute_area(const uint8_t* data, address_t begin, address_t length)
 	{
-		this->initialize_exec_segs(data - begin, begin, length);
-	#ifdef RISCV_INSTR_CACHE
-		machine().memory.generate_decoder_cache({}, begin, begin, length);
-	#endif
+		auto& seg = machine().memory.create_execute_segment({}, data, begin, length);
+		this->set_execute_segment(seg);
+	}
+
+	template <int W>
+	void CPU<W>::next_execute_segment(address_t pc)
+	{
+		auto& memory = machine().memory;
+		// Jumps land on the instruction before their destination, which
+		// for the first instruction of a segment is just outside of it
+		const auto* seg = memory.exec_segment_for(pc);
+		if (seg == nullptr)
+			seg = memory.exec_segment_for(pc + 4);
+		if (seg == nullptr)
+			seg = memory.create_dynamic_segment(pc);
+		if (seg == nullptr)
+			seg = memory.create_dynamic_segment(pc + 4);
+		if (UNLIKELY(seg == nullptr)) {
+			trigger_exception(EXECUTION_SPACE_PROTECTION_FAULT, pc);
+		}
+		this->set_execute_segment(*seg);
 	}
 
 	template <int W> __attribute__((noinline))
 	typename CPU<W>::format_t CPU<W>::read_next_instruction_slowpath()
 	{
+		// Entering another execute segment moves the fast-path there,
+		// and executable pages outside of the ELF get their own segment
+		const auto* seg = machine().memory.exec_segment_for(this->pc());
+		if (seg == nullptr)
+			seg = machine().memory.create_dynamic_segment(this->pc());
+		if (seg != nullptr) {
+			this->set_execute_segment(*seg);
+			return format_t { *(uint32_t*) &m_exec_data[this->pc()] };
+		}
 		// Fallback: Read directly from page memory
 		const auto pageno = this->pc() >> Page::SHIFT;
 		// Page cache
@@ -146,7 +175,7 @@ namespace riscv
 		#endif
 			// Retrieve handler directly from the instruction handler cache
 			auto& cache_entry =
-				machine().memory.get_decoder_cache()[this->pc() / DecoderCache<W>::DIVISOR];
+				m_exec_decoder[this->pc() / DecoderCache<W>::DIVISOR];
 		#ifndef RISCV_INSTR_CACHE_PREGEN
 			if (UNLIKELY(!DecoderCache<W>::isset(cache_entry))) {
 				DecoderCache<W>::convert(this->decode(instruction), cache_entry);
@@ -232,6 +261,9 @@ namespace riscv
 		case UNIMPLEMENTED_INSTRUCTION:
 			throw MachineException(UNIMPLEMENTED_INSTRUCTION,
 					"Unimplemented instruction executed", data);
+		case DEADLOCK_REACHED:
+			throw MachineException(DEADLOCK_REACHED,
+					"Deadlock reached", data);
 		default:
 			throw MachineException(UNKNOWN_EXCEPTION,
 					"Unknown exception", intr);
@@ -2,6 +2,7 @@
 #include "common.hpp"
 #include "page.hpp"
 #include "registers.hpp"
+#include "decoded_exec_segment.hpp"
 #ifdef RISCV_EXT_ATOMICS
 #include "rva.hpp"
 #endif
@@ -69,7 +70,7 @@ namespace riscv
 		// Serializes all the machine state + a tiny header to @vec
 		void serialize_to(std::vector<uint8_t>& vec);
 		// Returns the machine to a previously stored state
-		void deserialize_from(const std::vector<uint8_t>&, const SerializedMachine<W>&);
+		void deserialize_from(const uint8_t*, size_t, const SerializedMachine<W>&);
 
 		// Instruction fusing (icache only)
 		using instr_pair = std::pair<instruction_handler<W>&, format_t&>;
@@ -81,7 +82,11 @@ namespace riscv
 		CPU(Machine<W>&, unsigned cpu_id);
 		CPU(Machine<W>&, unsigned cpu_id, const Machine<W>& other); // Fork
 		void init_execute_area(const uint8_t* data, address_t begin, address_t length);
-		void initialize_exec_segs(const uint8_t* data, address_t begin, address_t length);
+		// The current execute segment is used by the instruction fast-path
+		void set_execute_segment(const DecodedExecuteSegment<W>&);
+		// Forces the next instruction (or jump) to look up its segment again
+		void leave_execute_segment() noexcept;
+		const auto* current_execute_segment() const noexcept { return m_exec; }
 		address_t exec_begin() const noexcept { return m_exec_begin; }
 		address_t exec_end()   const noexcept { return m_exec_end; }
 		const uint8_t* exec_seg_data() const noexcept { return m_exec_data; }
@@ -90,13 +95,16 @@ namespace riscv
 		Machine<W>&  m_machine;
 
 		format_t read_next_instruction_slowpath() COLD_PATH();
+		void next_execute_segment(address_t pc) COLD_PATH();
 		void execute(format_t);
 		void emit(std::string& code, const std::string& symb, instr_pair* blk, const TransInfo<W>&) const;
 
-		// ELF programs linear .text segment
+		// The current execute segment
 		const uint8_t* m_exec_data = nullptr;
 		address_t m_exec_begin = 0;
 		address_t m_exec_end   = 0;
+		DecoderData<W>* m_exec_decoder = nullptr;
+		const DecodedExecuteSegment<W>* m_exec = nullptr;
 
 		// Page cache for execution on virtual memory
 		CachedPage<W, const Page> m_cache;
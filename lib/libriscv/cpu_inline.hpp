@@ -16,7 +16,7 @@ inline void CPU<W>::jump(const address_t dst)
 {
 #ifdef RISCV_INBOUND_JUMPS_ONLY
 	if (UNLIKELY(dst < m_exec_begin || dst >= m_exec_end)) {
-		trigger_exception(EXECUTION_SPACE_PROTECTION_FAULT, dst);
+		this->next_execute_segment(dst);
 	}
 #endif
 	// it's possible to jump to a misaligned address
@@ -37,7 +37,7 @@ inline void CPU<W>::aligned_jump(const address_t dst)
 {
 #ifdef RISCV_INBOUND_JUMPS_ONLY
 	if (UNLIKELY(dst < m_exec_begin || dst >= m_exec_end)) {
-		trigger_exception(EXECUTION_SPACE_PROTECTION_FAULT, dst);
+		this->next_execute_segment(dst);
 	}
 #endif
 	this->registers().pc = dst;
@@ -50,9 +50,23 @@ inline void CPU<W>::increment_pc(int delta)
 }
 
 template <int W>
-inline void CPU<W>::initialize_exec_segs(const uint8_t* data, address_t begin, address_t length)
+inline void CPU<W>::set_execute_segment(const DecodedExecuteSegment<W>& seg)
 {
-	m_exec_data = data; m_exec_begin = begin; m_exec_end = begin + length;
+	m_exec = &seg;
+	m_exec_data = seg.exec_data();
+	m_exec_begin = seg.exec_begin();
+	m_exec_end = seg.exec_end();
+	m_exec_decoder = seg.decoder_cache();
+}
+
+template <int W>
+inline void CPU<W>::leave_execute_segment() noexcept
+{
+	// The instruction data is left in place, as it is still
+	// used until the next jump when only inbound jumps are checked
+	m_exec = nullptr;
+	m_exec_begin = 0;
+	m_exec_end = 0;
 }
 
 #ifdef RISCV_DEBUG
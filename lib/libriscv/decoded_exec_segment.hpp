@@ -0,0 +1,66 @@
+#pragma once
+#include "common.hpp"
+#include "types.hpp"
+#include <memory>
+
+namespace riscv
+{
+	template<int W> struct DecoderCache;
+	template<int W> struct DecoderData;
+
+	// An executable segment with its own linear instruction memory and
+	// decoder cache. Segments are immutable after being created, and so
+	// they can be shared between forks and between unrelated machines.
+	template <int W>
+	struct DecodedExecuteSegment
+	{
+		using address_t = address_type<W>;
+
+		bool is_within(address_t addr) const noexcept {
+			return addr >= m_exec_begin && addr < m_exec_end;
+		}
+		bool is_within_pages(address_t addr) const noexcept {
+			return addr >= m_pagedata_base && addr < m_pagedata_base + m_pagedata_size;
+		}
+		address_t exec_begin() const noexcept { return m_exec_begin; }
+		address_t exec_end() const noexcept { return m_exec_end; }
+		// Instruction memory, indexed by virtual address
+		const uint8_t* exec_data() const noexcept { return m_exec_pagedata.get() - m_pagedata_base; }
+
+		address_t pagedata_base() const noexcept { return m_pagedata_base; }
+		size_t pagedata_size() const noexcept { return m_pagedata_size; }
+		uint8_t* pagedata() noexcept { return m_exec_pagedata.get(); }
+		const uint8_t* pagedata() const noexcept { return m_exec_pagedata.get(); }
+
+		// Decoder cache, indexed by virtual address / DIVISOR
+		DecoderData<W>* decoder_cache() const noexcept { return m_exec_decoder; }
+		void set_decoder_cache(DecoderCache<W>* cache, size_t n_pages);
+		size_t decoder_pages() const noexcept { return m_decoder_pages; }
+
+		uint32_t crc32c_hash() const noexcept { return m_crc32c; }
+		void set_crc32c_hash(uint32_t crc) noexcept { m_crc32c = crc; }
+
+		DecodedExecuteSegment(address_t pbase, size_t plen, address_t exec_begin, size_t exec_len);
+		~DecodedExecuteSegment();
+
+	private:
+		address_t m_pagedata_base;
+		size_t    m_pagedata_size;
+		address_t m_exec_begin;
+		address_t m_exec_end;
+		std::unique_ptr<uint8_t[]> m_exec_pagedata;
+		DecoderData<W>*  m_exec_decoder = nullptr;
+		DecoderCache<W>* m_decoder_cache = nullptr;
+		size_t   m_decoder_pages = 0;
+		uint32_t m_crc32c = 0;
+	};
+
+	template <int W>
+	inline DecodedExecuteSegment<W>::DecodedExecuteSegment(
+		address_t pbase, size_t plen, address_t exec_begin, size_t exec_len)
+		: m_pagedata_base(pbase), m_pagedata_size(plen),
+		  m_exec_begin(exec_begin), m_exec_end(exec_begin + exec_len),
+		  m_exec_pagedata(new uint8_t[plen])
+	{
+	}
+}
@@ -1,40 +1,283 @@
 #include "memory.hpp"
 #include "machine.hpp"
 #include "decoder_cache.hpp"
+#include "util/crc32.hpp"
+#include <map>
+#include <mutex>
 #include <stdexcept>
 
 #include "rv32i_instr.hpp"
 
 namespace riscv
 {
+	template <int W>
+	void DecodedExecuteSegment<W>::set_decoder_cache(DecoderCache<W>* cache, size_t n_pages)
+	{
+		delete[] this->m_decoder_cache;
+		this->m_decoder_cache = cache;
+		this->m_decoder_pages = n_pages;
+		this->m_exec_decoder =
+			cache[0].get_base() - m_pagedata_base / DecoderCache<W>::DIVISOR;
+	}
 
-#ifdef RISCV_INSTR_CACHE
 	template <int W>
-	void Memory<W>::generate_decoder_cache(const MachineOptions<W>& options,
-		address_t pbase, address_t addr, size_t len)
+	DecodedExecuteSegment<W>::~DecodedExecuteSegment()
 	{
-		constexpr size_t PMASK = Page::size()-1;
-		const size_t prelen  = addr - pbase;
-		const size_t midlen  = len + prelen;
+		delete[] this->m_decoder_cache;
+	}
+
+	// Execute segments that are identical in every way can be shared
+	// between all machines, eg. a shared library loaded by many tenants.
+	// Machines may run on different host threads, so only segments with
+	// a pregenerated decoder cache are shared, as the CPU otherwise fills
+	// in the cache while running. Translated code belongs to a single
+	// machine, so nothing is shared when binary translation is enabled.
+#if defined(RISCV_INSTR_CACHE) && !defined(RISCV_INSTR_CACHE_PREGEN)
+	static constexpr bool share_execute_segments = false;
+#else
+	static constexpr bool share_execute_segments = !binary_translation_enabled;
+#endif
+
+	template <int W>
+	struct SharedExecuteSegments
+	{
+		using key_t = std::tuple<uint32_t, address_type<W>, size_t, bool>;
+		std::mutex mtx;
+		std::map<key_t, std::weak_ptr<DecodedExecuteSegment<W>>> segments;
+
+		static SharedExecuteSegments& get() {
+			static SharedExecuteSegments shared;
+			return shared;
+		}
+	};
+
+	template <int W>
+	std::shared_ptr<DecodedExecuteSegment<W>>
+	Memory<W>::allocate_execute_segment(const uint8_t* data, address_t vaddr, size_t len, size_t exec_len)
+	{
+		constexpr address_t PMASK = Page::size()-1;
+		const address_t pbase = (vaddr - 0x4) & ~(address_t) PMASK;
+		const size_t prelen  = vaddr - pbase;
+		// The first 4 bytes is instruction alignment
+		// The middle 4 bytes is the STOP instruction
+		// The last 8 bytes is a relative jump (JR -4)
+		const size_t midlen  = len + prelen + 12;
 		const size_t plen =
 			(PMASK & midlen) ? ((midlen + Page::size()) & ~PMASK) : midlen;
+		const size_t postlen = plen - midlen;
+		if (UNLIKELY(prelen > plen || prelen + len > plen || vaddr < prelen)) {
+			throw std::runtime_error("Segment virtual base was bogus");
+		}
+
+		// Create the whole executable memory range
+		auto segment = std::make_shared<DecodedExecuteSegment<W>> (pbase, plen, vaddr, exec_len);
+		auto* pagedata = segment->pagedata();
+		std::memset(&pagedata[0],      0,   prelen);
+		std::memcpy(&pagedata[prelen], data, len);
+		std::memset(&pagedata[prelen + len], 0,   postlen);
+
+		struct {
+			// STOP
+			const uint32_t stop_instr = 0x7ff00073;
+			// JMP -4 (jump back to STOP)
+			const uint32_t jr4_instr = 0xffdff06f;
+		} instrdata;
+		const address_t exit_lenalign = address_t(len + 0x3) & ~address_t(0x3);
+		std::memcpy(&pagedata[prelen + exit_lenalign], &instrdata, sizeof(instrdata));
+		return segment;
+	}
+
+	template <int W>
+	DecodedExecuteSegment<W>& Memory<W>::create_execute_segment(
+		const MachineOptions<W>& options, const void* vdata, address_t vaddr, size_t len)
+	{
+		const auto* data = (const uint8_t*) vdata;
+
+		// Create a STOP instruction at the end of execute area
+		// It is used by vmcall and preempt to stop after a function call
+		const address_t exit_lenalign = address_t(len + 0x3) & ~address_t(0x3);
+
+		auto& shared = SharedExecuteSegments<W>::get();
+		const typename SharedExecuteSegments<W>::key_t key {
+			crc32c(data, len), vaddr, len, options.instruction_fusing
+		};
+		if constexpr (share_execute_segments) {
+			std::lock_guard<std::mutex> lock(shared.mtx);
+			auto it = shared.segments.find(key);
+			if (it != shared.segments.end()) {
+				auto segment = it->second.lock();
+				// The checksum is not a guarantee that the code is the same
+				if (segment != nullptr && segment->exec_begin() == vaddr && std::memcmp(
+					&segment->exec_data()[vaddr], data, len) == 0)
+				{
+					this->install_execute_segment(std::move(segment), vaddr + exit_lenalign);
+					return *m_exec.back();
+				}
+			}
+		}
+
+		auto segment = allocate_execute_segment(data, vaddr, len, len + 4);
+		segment->set_crc32c_hash(std::get<0>(key));
+		// This is what the CPU instruction fetcher will use
+		// 0...len: The regular execute segment
+		// len..+ 4: The STOP function
+		// The binary translator reads the segment from the CPU.
+		this->install_execute_segment(segment, vaddr + exit_lenalign);
+#if defined(RISCV_INSTR_CACHE)
+		// + 8: A jump instruction that prevents crashes if someone
+		// resumes the emulator after a STOP happened. It also helps
+		// the debugger by not causing an exception, and will instead
+		// loop back to the STOP instruction.
+		// The instruction must be a part of the decoder cache.
+		this->generate_decoder_cache(options, *segment);
+		if (m_exec.size() == 1)
+			machine().cpu.set_execute_segment(*segment);
+#endif
+		if constexpr (share_execute_segments) {
+			std::lock_guard<std::mutex> lock(shared.mtx);
+			for (auto it = shared.segments.begin(); it != shared.segments.end();) {
+				if (it->second.expired())
+					it = shared.segments.erase(it);
+				else
+					++it;
+			}
+			shared.segments[key] = segment;
+		}
+		return *segment;
+	}
 
-		const size_t n_pages = plen / Page::size();
+	template <int W>
+	void Memory<W>::install_execute_segment(
+		std::shared_ptr<DecodedExecuteSegment<W>> segment, address_t exit_address)
+	{
+		for (const auto& seg : m_exec) {
+			if (segment->pagedata_base() < seg->pagedata_base() + seg->pagedata_size()
+				&& seg->pagedata_base() < segment->pagedata_base() + segment->pagedata_size())
+				throw std::runtime_error("Overlapping execute segments");
+		}
+		if (m_exec.empty())
+			this->m_exit_address = exit_address;
+		m_exec.push_back(std::move(segment));
+		if (m_exec.size() == 1)
+			machine().cpu.set_execute_segment(*m_exec.front());
+	}
+
+	template <int W>
+	const DecodedExecuteSegment<W>* Memory<W>::create_dynamic_segment(address_t vaddr)
+	{
+		// Gather the run of executable pages around @vaddr that is
+		// not already covered by an ELF execute segment
+		const auto is_dynamic_exec = [this] (address_t pageno) {
+			if (this->is_executable(pageno * Page::size()) || this->is_dynamic_page(pageno))
+				return false;
+			// Pages that keep getting modified are cheaper to run uncached,
+			// except when execution is only possible from segments
+			auto it = m_dynamic_writes.find(pageno);
+			if (it != m_dynamic_writes.end() && it->second >= DYNAMIC_WRITES_MAX) {
+#ifndef RISCV_INBOUND_JUMPS_ONLY
+				return false;
+#endif
+			}
+			return this->get_pageno(pageno).attr.exec;
+		};
+		const address_t pageno = page_number(vaddr);
+		if (!is_dynamic_exec(pageno))
+			return nullptr;
+		address_t begin = pageno;
+		while (begin > 0 && pageno - begin < DYNAMIC_SEGMENT_PAGES / 2 && is_dynamic_exec(begin - 1))
+			begin--;
+		address_t end = pageno + 1;
+		while (end - begin < DYNAMIC_SEGMENT_PAGES && is_dynamic_exec(end))
+			end++;
+
+		const size_t len = (end - begin) * Page::size();
+		std::unique_ptr<uint8_t[]> data { new uint8_t[len] };
+		for (address_t p = begin; p < end; p++) {
+			std::memcpy(&data[(p - begin) * Page::size()],
+				this->get_pageno(p).data(), Page::size());
+		}
+		// The segment ends before its STOP instruction, so that running
+		// off the end looks for the next segment instead of stopping
+		auto segment = allocate_execute_segment(data.get(), begin * Page::size(), len, len);
+#ifdef RISCV_INSTR_CACHE
+		this->generate_decoder_cache(MachineOptions<W>{}, *segment);
+#endif
+
+		// Write-protect the pages, so that modifying the code
+		// invalidates the segment (see create_writable_pageno)
+		for (address_t p = begin; p < end; p++) {
+			auto it = m_pages.find(p);
+			if (it != m_pages.end()) {
+				m_dynamic_pages[p] = it->second.attr.write;
+				it->second.attr.write = false;
+			} else {
+				m_dynamic_pages[p] = false;
+			}
+		}
+		this->invalidate_reset_cache();
+
+		m_dynamic_exec.push_back(std::move(segment));
+		return m_dynamic_exec.back().get();
+	}
+
+	template <int W>
+	void Memory<W>::invalidate_dynamic_segments(address_t begin, address_t end)
+	{
+		if (m_dynamic_exec.empty())
+			return;
+		auto& cpu = machine().cpu;
+		for (auto it = m_dynamic_exec.begin(); it != m_dynamic_exec.end();)
+		{
+			auto& seg = *it;
+			const address_t seg_begin = page_number(seg->exec_begin());
+			const address_t seg_end = page_number(seg->exec_end() + Page::size() - 1);
+			if (seg_begin >= end || begin >= seg_end) {
+				++it;
+				continue;
+			}
+			for (address_t p = seg_begin; p < seg_end; p++) {
+				auto dp = m_dynamic_pages.find(p);
+				if (dp == m_dynamic_pages.end())
+					continue;
+				if (dp->second) {
+					auto pit = m_pages.find(p);
+					if (pit != m_pages.end())
+						pit->second.attr.write = true;
+				}
+				m_dynamic_pages.erase(dp);
+			}
+			// The CPU may be in the middle of an instruction from this
+			// segment, so it is kept alive until the CPU has moved on
+			if (cpu.current_execute_segment() == seg.get()) {
+				cpu.leave_execute_segment();
+				this->m_dynamic_retired = std::move(seg);
+			}
+			it = m_dynamic_exec.erase(it);
+		}
+	}
+
+#ifdef RISCV_INSTR_CACHE
+	template <int W>
+	void Memory<W>::generate_decoder_cache(const MachineOptions<W>& options,
+		DecodedExecuteSegment<W>& segment)
+	{
+		const size_t n_pages = segment.pagedata_size() / Page::size();
 		auto* decoder_array = new DecoderCache<W> [n_pages];
-		this->m_exec_decoder =
-			decoder_array[0].get_base() - pbase / decoder_array->DIVISOR;
-		// there could be an old cache from a machine reset
-		delete[] this->m_decoder_cache;
-		this->m_decoder_cache = &decoder_array[0];
+		segment.set_decoder_cache(decoder_array, n_pages);
+		auto* exec_decoder = segment.decoder_cache();
+		// The STOP and JR instructions are part of the cache
+		const address_t addr = segment.exec_begin();
+		const size_t len = segment.exec_end() - segment.exec_begin() + 4;
 
 #ifdef RISCV_INSTR_CACHE_PREGEN
-		auto* exec_offset = machine().cpu.exec_seg_data();
-		assert(exec_offset && "Must have set CPU execute segment");
+		auto* exec_offset = segment.exec_data();
 
 	#ifdef RISCV_BINARY_TRANSLATION
 		std::string bintr_filename;
+		// Only the main execute segment is translated
+		const bool translate = (m_exec.size() == 1 && m_exec.front().get() == &segment);
 	if constexpr (W != 16) {
-		int load_result = machine().cpu.load_translation(options, &bintr_filename);
+		int load_result = translate ? machine().cpu.load_translation(options, &bintr_filename) : -1;
 		// If we loaded a cached translated program, and fusing is
 		// disabled, then we can fast-path the decoder cache
 		if (load_result == 0 && !options.instruction_fusing) {
@@ -43,7 +286,7 @@ namespace riscv
 			   so it's fine to leave the boundries alone. */
 			for (address_t dst = addr; dst < addr + len;)
 			{
-				auto& entry = m_exec_decoder[dst / DecoderCache<W>::DIVISOR];
+				auto& entry = exec_decoder[dst / DecoderCache<W>::DIVISOR];
 
 				auto& instruction = *(rv32i_instruction*) &exec_offset[dst];
 				if (!DecoderCache<W>::isset(entry)) {
@@ -65,7 +308,7 @@ namespace riscv
 		   so it's fine to leave the boundries alone. */
 		for (address_t dst = addr; dst < addr + len;)
 		{
-			auto& entry = m_exec_decoder[dst / DecoderCache<W>::DIVISOR];
+			auto& entry = exec_decoder[dst / DecoderCache<W>::DIVISOR];
 
 			auto& instruction = *(rv32i_instruction*) &exec_offset[dst];
 			if (binary_translation_enabled || options.instruction_fusing) {
@@ -85,7 +328,7 @@ namespace riscv
 		if constexpr (W != 16) {
 
 #ifdef RISCV_BINARY_TRANSLATION
-		if (!machine().is_binary_translated()) {
+		if (translate && !machine().is_binary_translated()) {
 			machine().cpu.try_translate(options, bintr_filename, addr, ipairs);
 		}
 #endif
@@ -101,11 +344,17 @@ namespace riscv
 		// Default-initialize the whole thing
 		for (size_t p = 0; p < n_pages; p++)
 			decoder_array[p] = {};
+		(void) exec_decoder;
+		(void) addr;
+		(void) len;
 #endif
 		(void) options;
 	}
 #endif
 
+	template struct DecodedExecuteSegment<4>;
+	template struct DecodedExecuteSegment<8>;
+	template struct DecodedExecuteSegment<16>;
 	template struct Memory<4>;
 	template struct Memory<8>;
 	template struct Memory<16>;
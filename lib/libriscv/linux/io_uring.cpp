@@ -0,0 +1,365 @@
+#include "io_uring.hpp"
+
+#include <libriscv/machine.hpp>
+#include <libriscv/threads.hpp>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+namespace riscv {
+static constexpr int SYSCALL_READ   = 63;
+static constexpr int SYSCALL_WRITE  = 64;
+static constexpr int SYSCALL_ACCEPT = 202;
+// Arbitrary maximum length of a single read or write
+static constexpr size_t MAX_IO_LENGTH = 16ull << 20;
+
+IoUring::IoUring(unsigned entries)
+{
+	struct io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	m_fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (m_fd < 0)
+		throw MachineException(ILLEGAL_OPERATION, "io_uring_setup failed", errno);
+
+	m_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	// Newer kernels map both rings at once
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		m_ring_size = m_cq_size = std::max(m_ring_size, m_cq_size);
+
+	m_ring_ptr = mmap(nullptr, m_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+	if (m_ring_ptr == MAP_FAILED) {
+		close(m_fd);
+		throw MachineException(OUT_OF_MEMORY, "Failed to map io_uring", errno);
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		m_cq_ptr = m_ring_ptr;
+	} else {
+		m_cq_ptr = mmap(nullptr, m_cq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+	}
+	m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	m_sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+	if (m_cq_ptr == MAP_FAILED || m_sqes == MAP_FAILED) {
+		if (m_cq_ptr != MAP_FAILED && m_cq_ptr != m_ring_ptr)
+			munmap(m_cq_ptr, m_cq_size);
+		munmap(m_ring_ptr, m_ring_size);
+		close(m_fd);
+		throw MachineException(OUT_OF_MEMORY, "Failed to map io_uring", errno);
+	}
+
+	auto* sq = (char*) m_ring_ptr;
+	m_sq_head = (unsigned*) (sq + params.sq_off.head);
+	m_sq_tail = (unsigned*) (sq + params.sq_off.tail);
+	m_sq_mask = *(unsigned*) (sq + params.sq_off.ring_mask);
+	m_sq_entries = *(unsigned*) (sq + params.sq_off.ring_entries);
+	m_sq_array = (unsigned*) (sq + params.sq_off.array);
+
+	auto* cq = (char*) m_cq_ptr;
+	m_cq_head = (unsigned*) (cq + params.cq_off.head);
+	m_cq_tail = (unsigned*) (cq + params.cq_off.tail);
+	m_cq_mask = *(unsigned*) (cq + params.cq_off.ring_mask);
+	m_cqes = cq + params.cq_off.cqes;
+}
+
+IoUring::~IoUring()
+{
+	munmap(m_sqes, m_sqes_size);
+	if (m_cq_ptr != m_ring_ptr)
+		munmap(m_cq_ptr, m_cq_size);
+	munmap(m_ring_ptr, m_ring_size);
+	close(m_fd);
+}
+
+int IoUring::enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	const int res = syscall(__NR_io_uring_enter, m_fd, to_submit, min_complete, flags, nullptr, 0);
+	return (res < 0) ? -errno : res;
+}
+
+void* IoUring::get_sqe()
+{
+	const unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+	const unsigned tail = *m_sq_tail;
+	// A full submission queue is submitted to make room
+	if (tail - head >= m_sq_entries) {
+		this->submit();
+		if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries)
+			throw MachineException(OUT_OF_MEMORY, "io_uring submission queue is full");
+	}
+	const unsigned index = tail & m_sq_mask;
+	auto* sqe = &((struct io_uring_sqe*) m_sqes)[index];
+	std::memset(sqe, 0, sizeof(*sqe));
+	m_sq_array[index] = index;
+	return sqe;
+}
+
+void IoUring::queue(uint8_t opcode, int fd, uint64_t addr, uint32_t len,
+	uint64_t offset, Request& request)
+{
+	auto* sqe = (struct io_uring_sqe*) this->get_sqe();
+	sqe->opcode = opcode;
+	sqe->fd  = fd;
+	sqe->addr = addr;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = (uintptr_t) &request;
+	__atomic_store_n(m_sq_tail, *m_sq_tail + 1, __ATOMIC_RELEASE);
+	m_queued ++;
+	m_in_flight ++;
+}
+
+void IoUring::cancel(Request& request)
+{
+	auto* sqe = (struct io_uring_sqe*) this->get_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t) &request;
+	// The completion of the cancellation itself is ignored
+	sqe->user_data = 0;
+	__atomic_store_n(m_sq_tail, *m_sq_tail + 1, __ATOMIC_RELEASE);
+	m_queued ++;
+}
+
+unsigned IoUring::submit()
+{
+	if (m_queued == 0)
+		return 0;
+	const int res = this->enter(m_queued, 0, 0);
+	if (res < 0) {
+		if (res == -EAGAIN || res == -EBUSY || res == -EINTR)
+			return 0;
+		throw MachineException(ILLEGAL_OPERATION, "io_uring_enter failed", -res);
+	}
+	m_queued -= res;
+	return res;
+}
+
+unsigned IoUring::poll(unsigned min_complete)
+{
+	this->submit();
+	unsigned completed = 0;
+	while (true)
+	{
+		unsigned head = *m_cq_head;
+		const unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+		{
+			const auto& cqe = ((struct io_uring_cqe*) m_cqes)[head & m_cq_mask];
+			auto* request = (Request*) (uintptr_t) cqe.user_data;
+			const int32_t result = cqe.res;
+			// Release the entry before the callback, which may queue more
+			__atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+			if (request == nullptr)
+				continue;
+			m_in_flight --;
+			completed ++;
+			request->complete(*request, result);
+		}
+		if (completed >= min_complete || m_in_flight == 0)
+			return completed;
+		const int res = this->enter(m_queued, min_complete - completed, IORING_ENTER_GETEVENTS);
+		if (res < 0 && res != -EINTR && res != -EAGAIN && res != -EBUSY)
+			throw MachineException(ILLEGAL_OPERATION, "io_uring_enter failed", -res);
+		if (res > 0)
+			m_queued -= std::min(m_queued, (unsigned) res);
+	}
+}
+
+template <int W>
+AsyncIO<W>::AsyncIO(Machine<W>& machine, IoUring& ring)
+	: m_machine(machine), m_ring(ring) {}
+
+template <int W>
+AsyncIO<W>::~AsyncIO()
+{
+	// The kernel may still write into the requests, so they are
+	// cancelled, and the ring is polled until they have completed
+	m_closing = true;
+	for (auto& it : m_requests)
+		m_ring.cancel(*it.second);
+	while (!m_requests.empty())
+		m_ring.poll(1);
+}
+
+template <int W>
+typename AsyncIO<W>::Request& AsyncIO<W>::create_request(int sysno)
+{
+	auto req = std::make_unique<Request>();
+	req->complete = &AsyncIO<W>::complete;
+	req->aio   = this;
+	req->sysno = sysno;
+	req->tid   = -1;
+	auto* ptr = req.get();
+	m_requests.emplace(ptr, std::move(req));
+	return *ptr;
+}
+
+template <int W>
+void AsyncIO<W>::submit_and_block(Request& req)
+{
+	m_ring.submit();
+	if (m_machine.has_threads())
+	{
+		auto& mt = m_machine.threads();
+		req.tid = mt.get_tid();
+		mt.get_thread()->block(BLOCK_REASON);
+		// Stops the machine when there is nothing else to run
+		mt.wakeup_next();
+		return;
+	}
+	// Nothing else to run: the machine waits for I/O
+	m_waiting = true;
+	m_machine.stop();
+}
+
+template <int W>
+void AsyncIO<W>::complete(IoUring::Request& ireq, int32_t result)
+{
+	auto& req = static_cast<Request&> (ireq);
+	AsyncIO<W>& aio = *req.aio;
+	auto it = aio.m_requests.find(&req);
+	std::unique_ptr<Request> owner = std::move(it->second);
+	aio.m_requests.erase(it);
+	if (aio.m_closing)
+		return;
+
+	auto& machine = aio.m_machine;
+	address_t retval = result;
+	try {
+		if (req.sysno == SYSCALL_READ && result > 0) {
+			machine.copy_to_guest(req.addr, req.buffer.data(), result);
+		}
+		else if (req.sysno == SYSCALL_ACCEPT && result >= 0) {
+			// Assign and translate the new fd to virtual fd
+			retval = machine.fds().assign_socket(result);
+			if (req.addr != 0) {
+				// Truncated to the guest sockaddr, with the full length returned
+				machine.copy_to_guest(req.addr, req.buffer.data(),
+					std::min(req.guest_socklen, req.socklen));
+				machine.copy_to_guest(req.addrlen, &req.socklen, sizeof(req.socklen));
+			}
+		}
+	} catch (const MachineException&) {
+		retval = -EFAULT;
+	}
+
+	if (req.tid < 0) {
+		machine.cpu.reg(REG_ARG0) = retval;
+		aio.m_waiting = false;
+		return;
+	}
+	// Resumes the thread right away when the machine is idle
+	machine.threads().make_runnable(req.tid, retval);
+}
+
+template <int W>
+bool AsyncIO<W>::waiting() const noexcept
+{
+	if (m_machine.has_threads())
+		return m_machine.threads().idle();
+	return m_waiting;
+}
+
+template <int W>
+bool AsyncIO<W>::submit_read()
+{
+	auto& machine = m_machine;
+	const auto [vfd, address, len] =
+		machine.template sysargs<int, address_type<W>, address_type<W>> ();
+	// VirtualFS files are read by the blocking handler, from memory
+	if (vfd == 0 || !machine.has_file_descriptors() || machine.fds().is_virtual(vfd))
+		return false;
+
+	const int real_fd = machine.fds().get(vfd);
+	if (real_fd < 0) {
+		machine.set_result(-EBADF);
+		return true;
+	}
+	if (len > MAX_IO_LENGTH) {
+		machine.set_result(-ENOMEM);
+		return true;
+	}
+	auto& req = this->create_request(SYSCALL_READ);
+	req.addr = address;
+	req.buffer.resize(len);
+	// Reads from the current file position
+	m_ring.queue(IORING_OP_READ, real_fd,
+		(uintptr_t) req.buffer.data(), len, uint64_t(-1), req);
+	this->submit_and_block(req);
+	return true;
+}
+
+template <int W>
+bool AsyncIO<W>::submit_write()
+{
+	auto& machine = m_machine;
+	const auto [vfd, address, len] =
+		machine.template sysargs<int, address_type<W>, address_type<W>> ();
+	if (vfd == 1 || vfd == 2 || !machine.has_file_descriptors()
+		|| machine.fds().is_virtual(vfd) || !machine.fds().permit_write(vfd))
+		return false;
+
+	const int real_fd = machine.fds().get(vfd);
+	if (real_fd < 0) {
+		machine.set_result(-EBADF);
+		return true;
+	}
+	if (len > MAX_IO_LENGTH) {
+		machine.set_result(-ENOMEM);
+		return true;
+	}
+	auto& req = this->create_request(SYSCALL_WRITE);
+	// The data is copied, as the guest may change it before the write
+	req.buffer.resize(len);
+	machine.copy_from_guest(req.buffer.data(), address, len);
+	m_ring.queue(IORING_OP_WRITE, real_fd,
+		(uintptr_t) req.buffer.data(), len, uint64_t(-1), req);
+	this->submit_and_block(req);
+	return true;
+}
+
+template <int W>
+bool AsyncIO<W>::submit_accept()
+{
+	auto& machine = m_machine;
+	const auto [sockfd, g_addr, g_addrlen] =
+		machine.template sysargs<int, address_type<W>, address_type<W>> ();
+	if (!machine.has_file_descriptors() || !machine.fds().permit_sockets)
+		return false;
+
+	const int real_fd = machine.fds().translate(sockfd);
+	uint32_t guest_socklen = 0;
+	if (g_addr != 0)
+		machine.copy_from_guest(&guest_socklen, g_addrlen, sizeof(guest_socklen));
+
+	auto& req = this->create_request(SYSCALL_ACCEPT);
+	req.addr = g_addr;
+	req.addrlen = g_addrlen;
+	req.guest_socklen = guest_socklen;
+	req.buffer.resize(128);
+	req.socklen = req.buffer.size();
+	m_ring.queue(IORING_OP_ACCEPT, real_fd,
+		(uintptr_t) req.buffer.data(), 0, (uintptr_t) &req.socklen, req);
+	this->submit_and_block(req);
+	return true;
+}
+
+template <int W>
+void Machine<W>::setup_io_uring(IoUring& ring)
+{
+	this->m_aio.reset(new AsyncIO<W>(*this, ring));
+}
+
+template struct AsyncIO<4>;
+template struct AsyncIO<8>;
+template struct AsyncIO<16>;
+template void Machine<4>::setup_io_uring(IoUring&);
+template void Machine<8>::setup_io_uring(IoUring&);
+
+} // riscv
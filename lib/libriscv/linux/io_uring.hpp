@@ -0,0 +1,131 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "../types.hpp"
+
+namespace riscv {
+template <int W> struct Machine;
+
+// A minimal io_uring instance, used directly through the system calls.
+// One ring is usually shared by all the machines that are run from the
+// same host thread, so that the host thread can wait for I/O completing
+// in any of them, instead of blocking in each system call.
+struct IoUring
+{
+	struct Request {
+		// Called from poll() with the result of the operation
+		void (*complete)(Request&, int32_t result) = nullptr;
+	};
+
+	explicit IoUring(unsigned entries = 256);
+	~IoUring();
+	IoUring(const IoUring&) = delete;
+	IoUring& operator=(const IoUring&) = delete;
+
+	// Queues an operation that completes @request. The meaning of the
+	// arguments depends on the opcode, as in struct io_uring_sqe.
+	// Queued operations are submitted on the next submit() or poll().
+	void queue(uint8_t opcode, int fd, uint64_t addr, uint32_t len,
+		uint64_t offset, Request& request);
+	// Asks the kernel to cancel the operation of @request, if it is
+	// still in flight. The request is completed as usual.
+	void cancel(Request& request);
+	// Submits the queued operations, and returns how many were submitted
+	unsigned submit();
+	// Submits, and completes the finished operations, waiting until at
+	// least @min_complete have finished. Returns the number completed.
+	unsigned poll(unsigned min_complete = 0);
+	// Operations that are queued or in flight
+	size_t in_flight() const noexcept { return m_in_flight; }
+
+private:
+	void* get_sqe();
+	int enter(unsigned to_submit, unsigned min_complete, unsigned flags);
+
+	int m_fd = -1;
+	size_t m_in_flight = 0;
+	unsigned m_queued = 0;
+	// Submission queue
+	unsigned* m_sq_head = nullptr;
+	unsigned* m_sq_tail = nullptr;
+	unsigned  m_sq_mask = 0;
+	unsigned  m_sq_entries = 0;
+	unsigned* m_sq_array = nullptr;
+	void*     m_sqes = nullptr;
+	// Completion queue
+	unsigned* m_cq_head = nullptr;
+	unsigned* m_cq_tail = nullptr;
+	unsigned  m_cq_mask = 0;
+	void*     m_cqes = nullptr;
+	// Mappings of the rings and the submission entries
+	void*  m_ring_ptr = nullptr;
+	size_t m_ring_size = 0;
+	void*  m_cq_ptr = nullptr;
+	size_t m_cq_size = 0;
+	size_t m_sqes_size = 0;
+};
+
+// Asynchronous I/O of a machine, through a shared IoUring. Guest reads,
+// writes and accepts are submitted to the ring by the Linux system call
+// handlers, whichever system call table is used, and the guest thread that
+// made the system call is blocked until they complete, while the other
+// threads keep running. When there is nothing else to run, the machine
+// is stopped instead, and waiting() is true until the I/O completes and
+// the machine can be resumed with simulate(). The ring is polled by the
+// host, eg. when all of its machines are waiting:
+//   while (...) {
+//       for (auto& m : machines) if (!m.async_io().waiting()) m.simulate(...);
+//       ring.poll(1);
+//   }
+template <int W>
+struct AsyncIO
+{
+	using address_t = address_type<W>;
+	// Guest threads blocked on I/O have this block reason
+	static constexpr int BLOCK_REASON = -0x10000;
+
+	struct Request : public IoUring::Request {
+		AsyncIO* aio;
+		int sysno;
+		int tid;           // the blocked thread, or -1 for the machine
+		address_t addr;    // guest buffer, or guest sockaddr for accept
+		address_t addrlen; // guest socklen_t for accept
+		std::vector<uint8_t> buffer;
+		uint32_t socklen = 0;
+		uint32_t guest_socklen = 0; // size of the guest sockaddr for accept
+	};
+
+	// True when the machine is stopped until some I/O completes
+	bool waiting() const noexcept;
+	// I/O operations of this machine that have not completed
+	size_t pending() const noexcept { return m_requests.size(); }
+	IoUring& ring() noexcept { return m_ring; }
+
+	// Start the read, write or accept of the current system call, and
+	// return false when it is left to the blocking system call handler
+	// instead, eg. for the standard pipes
+	bool submit_read();
+	bool submit_write();
+	bool submit_accept();
+
+	Request& create_request(int sysno);
+	// Submits the request, and blocks the current guest thread, or stops
+	// the machine, until it completes.
+	void submit_and_block(Request&);
+
+	AsyncIO(Machine<W>&, IoUring&);
+	~AsyncIO();
+private:
+	static void complete(IoUring::Request&, int32_t result);
+
+	Machine<W>& m_machine;
+	IoUring&    m_ring;
+	bool        m_waiting = false;
+	bool        m_closing = false;
+	std::unordered_map<const Request*, std::unique_ptr<Request>> m_requests;
+};
+
+} // riscv
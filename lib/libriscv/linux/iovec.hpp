@@ -0,0 +1,129 @@
+#pragma once
+#include <libriscv/machine.hpp>
+#include <cstddef>
+#include <sys/uio.h>
+
+namespace riscv {
+
+template <int W>
+struct guest_iovec {
+	address_type<W> iov_base;
+	address_type<W> iov_len;
+};
+
+// Host iovecs pointing directly into guest pages, so that vectored system
+// calls never copy through temporary buffers. Page protections are checked
+// while gathering. When the host iovecs run out, the gathered range is cut
+// short, which becomes a partial read or write, as with any other file.
+template <int W>
+struct HostIovecs
+{
+	using address_t = address_type<W>;
+	static constexpr size_t MAX_BUFFERS = 1024; // IOV_MAX
+	static constexpr size_t MAX_GUEST_IOVECS = 1024;
+
+	// Gathers [addr, len) from guest memory. Writable buffers are for
+	// reading into guest memory. Returns the number of bytes gathered.
+	size_t gather(Memory<W>&, address_t addr, size_t len, bool writable);
+	// Gathers every buffer of a guest iovec array. Returns false if the
+	// array is too long.
+	bool gather_guest_iovecs(Machine<W>&, address_t g_iov, size_t g_count, bool writable);
+	// Reads into the guest ranges @vec in rounds that start at FIRST_ROUND
+	// bytes and double, so that copy-on-write pages are un-shared only when
+	// a read reaches them. Another round follows only a round that was
+	// filled. @read(iov, bytes) does one read, after @bytes have been read.
+	template <typename Func>
+	static ssize_t read_rounds(Memory<W>&, const guest_iovec<W>* vec, size_t count, Func&& read);
+	static constexpr size_t FIRST_ROUND = 64u << 10;
+
+	const struct iovec* iov() const noexcept {
+		return reinterpret_cast<const struct iovec*> (buffers);
+	}
+	int    count() const noexcept { return m_count; }
+	size_t bytes() const noexcept { return m_bytes; }
+	void   clear() noexcept { m_count = 0; m_bytes = 0; }
+
+	vBuffer buffers[MAX_BUFFERS];
+private:
+	int    m_count = 0;
+	size_t m_bytes = 0;
+};
+static_assert(sizeof(vBuffer) == sizeof(struct iovec)
+	&& offsetof(vBuffer, ptr) == offsetof(struct iovec, iov_base)
+	&& offsetof(vBuffer, len) == offsetof(struct iovec, iov_len),
+	"vBuffer must have the layout of struct iovec");
+
+template <int W>
+inline size_t HostIovecs<W>::gather(Memory<W>& memory, address_t addr, size_t len, bool writable)
+{
+	const size_t remaining = MAX_BUFFERS - m_count;
+	if (remaining == 0 || len == 0)
+		return 0;
+	// Enough buffers for the range, even when no pages are adjacent
+	const size_t max_len = remaining * Page::size() - (addr & (Page::size()-1));
+	len = std::min(len, max_len);
+
+	vBuffer* first = &buffers[m_count];
+	m_count += (writable)
+		? memory.gather_writable_buffers_from_range(remaining, first, addr, len)
+		: memory.gather_buffers_from_range(remaining, first, addr, len);
+	m_bytes += len;
+	return len;
+}
+
+template <int W>
+inline bool HostIovecs<W>::gather_guest_iovecs(Machine<W>& machine,
+	address_t g_iov, size_t g_count, bool writable)
+{
+	if (g_count > MAX_GUEST_IOVECS)
+		return false;
+	guest_iovec<W> vec[MAX_GUEST_IOVECS];
+	machine.copy_from_guest(vec, g_iov, g_count * sizeof(guest_iovec<W>));
+
+	for (size_t i = 0; i < g_count; i++)
+	{
+		const size_t len = vec[i].iov_len;
+		if (this->gather(machine.memory, vec[i].iov_base, len, writable) < len)
+			break;
+	}
+	return true;
+}
+
+template <int W>
+template <typename Func>
+inline ssize_t HostIovecs<W>::read_rounds(Memory<W>& memory,
+	const guest_iovec<W>* vec, size_t count, Func&& read)
+{
+	HostIovecs<W> iov;
+	// The next guest range, and how far into it the reads have come
+	size_t i = 0;
+	size_t skip = 0;
+	size_t round = FIRST_ROUND;
+	ssize_t bytes = 0;
+	do {
+		iov.clear();
+		size_t budget = round;
+		while (i < count && budget != 0)
+		{
+			const size_t len = std::min<size_t>(vec[i].iov_len - skip, budget);
+			const size_t gathered = iov.gather(memory, vec[i].iov_base + skip, len, true);
+			budget -= gathered;
+			skip += gathered;
+			if (skip == vec[i].iov_len) {
+				i++;
+				skip = 0;
+			}
+			if (gathered < len) break; // Out of host iovecs
+		}
+		const ssize_t res = read(iov, (size_t)bytes);
+		if (res < 0)
+			return (bytes == 0) ? res : bytes;
+		bytes += res;
+		if ((size_t)res < iov.bytes())
+			break;
+		round *= 2;
+	} while (i < count);
+	return bytes;
+}
+
+} // riscv
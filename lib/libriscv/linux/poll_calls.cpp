@@ -0,0 +1,294 @@
+#include <libriscv/machine.hpp>
+
+//#define POLLCALL_VERBOSE 1
+#ifdef POLLCALL_VERBOSE
+#define SYSPRINT(fmt, ...) printf(fmt, ##__VA_ARGS__)
+#else
+#define SYSPRINT(fmt, ...) /* fmt */
+#endif
+
+#include <poll.h>
+#include <sys/epoll.h>
+
+namespace riscv {
+// Arbitrary maximums of fds and events in a single call
+static constexpr unsigned MAX_POLL_FDS = 1024;
+static constexpr int MAX_EPOLL_EVENTS = 1024;
+
+// struct epoll_event is packed on some hosts, but never on RISC-V
+struct guest_epoll_event {
+	uint32_t events;
+	uint64_t data;
+};
+static_assert(sizeof(guest_epoll_event) == 16, "RISC-V epoll_event is 16 bytes");
+
+template <int W>
+struct guest_timespec {
+	address_type<W> tv_sec;
+	address_type<W> tv_nsec;
+};
+
+template <int W>
+static int timeout_from_guest(Machine<W>& machine, address_type<W> g_ts)
+{
+	if (g_ts == 0)
+		return -1;
+	guest_timespec<W> ts;
+	machine.copy_from_guest(&ts, g_ts, sizeof(ts));
+	using signed_t = std::make_signed_t<address_type<W>>;
+	const int64_t ms = int64_t((signed_t)ts.tv_sec) * 1000
+		+ ((signed_t)ts.tv_nsec + 999999) / 1000000;
+	return (ms > INT32_MAX) ? INT32_MAX : std::max(int64_t(0), ms);
+}
+
+// Polls the host fds without blocking. When nothing is ready and the guest
+// is willing to wait, the park hook may take over the waiting instead, and
+// then false is returned. Otherwise the host thread blocks in poll().
+template <int W>
+static bool poll_or_park(Machine<W>& machine,
+	std::vector<struct pollfd>& pfds, int timeout, int& result)
+{
+	auto& fds = machine.fds();
+	// A parked machine has already waited, and does not wait again
+	const bool resumed = fds.parked;
+	fds.parked = false;
+
+	result = ::poll(pfds.data(), pfds.size(), 0);
+	if (result != 0 || timeout == 0 || resumed)
+		return true;
+
+	if (fds.on_park != nullptr) {
+		std::vector<FileDescriptors::ParkFd> park_fds;
+		park_fds.reserve(pfds.size());
+		for (const auto& pfd : pfds) {
+			if (pfd.fd >= 0)
+				park_fds.push_back({pfd.fd, pfd.events});
+		}
+		if (fds.on_park(machine.template get_userdata<void>(), park_fds, timeout)) {
+			// Make the system call again, when the machine is resumed
+			fds.parked = true;
+			machine.cpu.increment_pc(-4);
+			machine.stop();
+			return false;
+		}
+	}
+	result = ::poll(pfds.data(), pfds.size(), timeout);
+	return true;
+}
+
+template <int W>
+static void syscall_epoll_create1(Machine<W>& machine)
+{
+	const auto [flags] = machine.template sysargs<int> ();
+	SYSPRINT("SYSCALL epoll_create1, flags: %x\n", flags);
+
+	const int real_fd = epoll_create1(flags);
+	if (real_fd >= 0) {
+		machine.set_result(machine.fds().assign_file(real_fd));
+	} else {
+		machine.set_result(-errno);
+	}
+}
+
+template <int W>
+static void syscall_epoll_ctl(Machine<W>& machine)
+{
+	const auto [vepoll, op, vfd, g_event] =
+		machine.template sysargs<int, int, int, address_type<W>> ();
+	SYSPRINT("SYSCALL epoll_ctl, epoll_fd: %d op: %d fd: %d\n", vepoll, op, vfd);
+
+	const int epoll_fd = machine.fds().get(vepoll);
+	const int real_fd = machine.fds().translate(vfd);
+	if (epoll_fd < 0 || real_fd < 0) {
+		machine.set_result(-EBADF);
+		return;
+	}
+	struct epoll_event event {};
+	if (g_event != 0) {
+		guest_epoll_event gev;
+		machine.copy_from_guest(&gev, g_event, sizeof(gev));
+		event.events = gev.events;
+		// The guest data is returned as-is by epoll_pwait
+		event.data.u64 = gev.data;
+	}
+	const int res = epoll_ctl(epoll_fd, op, real_fd, &event);
+	machine.set_result_or_error(res);
+}
+
+template <int W>
+static void syscall_epoll_pwait(Machine<W>& machine)
+{
+	const auto [vepoll, g_events, maxevents, timeout] =
+		machine.template sysargs<int, address_type<W>, int, int> ();
+	SYSPRINT("SYSCALL epoll_pwait, epoll_fd: %d maxevents: %d timeout: %d\n",
+		vepoll, maxevents, timeout);
+
+	const int epoll_fd = machine.fds().get(vepoll);
+	if (epoll_fd < 0) {
+		machine.set_result(-EBADF);
+		return;
+	}
+	if (maxevents <= 0 || maxevents > MAX_EPOLL_EVENTS) {
+		machine.set_result(-EINVAL);
+		return;
+	}
+	// The epoll fd itself becomes readable when any of its fds are ready
+	std::vector<struct pollfd> pfds { { epoll_fd, POLLIN, 0 } };
+	int result;
+	if (!poll_or_park(machine, pfds, timeout, result))
+		return;
+	if (result < 0) {
+		machine.set_result(-errno);
+		return;
+	}
+
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	const int count = epoll_wait(epoll_fd, events, maxevents, 0);
+	if (count < 0) {
+		machine.set_result(-errno);
+		return;
+	}
+	guest_epoll_event gevents[MAX_EPOLL_EVENTS];
+	for (int i = 0; i < count; i++) {
+		gevents[i].events = events[i].events;
+		gevents[i].data   = events[i].data.u64;
+	}
+	machine.copy_to_guest(g_events, gevents, count * sizeof(guest_epoll_event));
+	machine.set_result(count);
+}
+
+template <int W>
+static void syscall_ppoll(Machine<W>& machine)
+{
+	const auto [g_fds, nfds, g_timeout] =
+		machine.template sysargs<address_type<W>, unsigned, address_type<W>> ();
+	SYSPRINT("SYSCALL ppoll, fds: 0x%lX nfds: %u\n", (long)g_fds, nfds);
+
+	if (nfds > MAX_POLL_FDS) {
+		machine.set_result(-EINVAL);
+		return;
+	}
+	// struct pollfd has the same layout on RISC-V
+	std::vector<struct pollfd> guest_pfds(nfds);
+	machine.copy_from_guest(guest_pfds.data(), g_fds, nfds * sizeof(struct pollfd));
+
+	std::vector<struct pollfd> pfds = guest_pfds;
+	for (auto& pfd : pfds) {
+		// Negative fds are ignored, as are fds the guest may not access
+		if (pfd.fd >= 0) {
+			pfd.fd = machine.fds().translate(pfd.fd);
+			if (pfd.fd < 0) pfd.fd = -1;
+		}
+	}
+	int result;
+	if (!poll_or_park(machine, pfds, timeout_from_guest(machine, g_timeout), result))
+		return;
+	if (result < 0) {
+		machine.set_result(-errno);
+		return;
+	}
+	for (unsigned i = 0; i < nfds; i++) {
+		guest_pfds[i].revents = pfds[i].revents;
+		// Unknown fds are invalid, rather than ignored
+		if (guest_pfds[i].fd >= 0 && pfds[i].fd < 0) {
+			guest_pfds[i].revents = POLLNVAL;
+			result ++;
+		}
+	}
+	machine.copy_to_guest(g_fds, guest_pfds.data(), nfds * sizeof(struct pollfd));
+	machine.set_result(result);
+}
+
+template <int W>
+static void syscall_pselect6(Machine<W>& machine)
+{
+	const auto [nfds, g_readfds, g_writefds, g_exceptfds, g_timeout] =
+		machine.template sysargs<int, address_type<W>, address_type<W>,
+			address_type<W>, address_type<W>> ();
+	SYSPRINT("SYSCALL pselect6, nfds: %d\n", nfds);
+
+	if (nfds < 0) {
+		machine.set_result(-EINVAL);
+		return;
+	}
+	// Guest files and sockets are numbered from FileDescriptors::FILE_D_BASE,
+	// beyond FD_SETSIZE, so only the standard fds can be selected.
+	// Larger sets are not supported, and poll or epoll has to be used.
+	if (nfds > (int)MAX_POLL_FDS) {
+		machine.set_result(-ENOSYS);
+		return;
+	}
+	// The guest fd_sets are bitmaps of guest words, which are
+	// little-endian, so they can be handled as bytes
+	const size_t setsize = ((nfds + W * 8 - 1) / (W * 8)) * W;
+	std::array<std::vector<uint8_t>, 3> sets;
+	const std::array<address_type<W>, 3> g_sets { g_readfds, g_writefds, g_exceptfds };
+	static constexpr short events[3] = { POLLIN, POLLOUT, POLLPRI };
+	for (int s = 0; s < 3; s++) {
+		if (g_sets[s] == 0) continue;
+		sets[s].resize(setsize);
+		machine.copy_from_guest(sets[s].data(), g_sets[s], setsize);
+	}
+
+	std::vector<struct pollfd> pfds;
+	std::vector<int> vfds;
+	for (int vfd = 0; vfd < nfds; vfd++) {
+		short ev = 0;
+		for (int s = 0; s < 3; s++) {
+			if (!sets[s].empty() && (sets[s][vfd / 8] & (1 << (vfd % 8))))
+				ev |= events[s];
+		}
+		if (ev == 0) continue;
+		const int real_fd = machine.fds().translate(vfd);
+		if (real_fd < 0) {
+			machine.set_result(-EBADF);
+			return;
+		}
+		pfds.push_back({ real_fd, ev, 0 });
+		vfds.push_back(vfd);
+	}
+
+	int result;
+	if (!poll_or_park(machine, pfds, timeout_from_guest(machine, g_timeout), result))
+		return;
+	if (result < 0) {
+		machine.set_result(-errno);
+		return;
+	}
+	// Rebuild the sets with only the ready fds, counting each bit
+	int count = 0;
+	for (auto& set : sets)
+		std::fill(set.begin(), set.end(), 0);
+	for (size_t i = 0; i < pfds.size(); i++) {
+		const int vfd = vfds[i];
+		for (int s = 0; s < 3; s++) {
+			const short ready = (s == 0) ? (POLLIN | POLLHUP | POLLERR)
+				: (s == 1) ? (POLLOUT | POLLERR) : POLLPRI;
+			if (!sets[s].empty() && (pfds[i].events & events[s])
+				&& (pfds[i].revents & ready)) {
+				sets[s][vfd / 8] |= 1 << (vfd % 8);
+				count ++;
+			}
+		}
+	}
+	for (int s = 0; s < 3; s++) {
+		if (g_sets[s] != 0)
+			machine.copy_to_guest(g_sets[s], sets[s].data(), setsize);
+	}
+	machine.set_result(count);
+}
+
+template <int W>
+void add_poll_syscalls(Machine<W>& machine)
+{
+	machine.install_syscall_handler(20, syscall_epoll_create1<W>);
+	machine.install_syscall_handler(21, syscall_epoll_ctl<W>);
+	machine.install_syscall_handler(22, syscall_epoll_pwait<W>);
+	machine.install_syscall_handler(72, syscall_pselect6<W>);
+	machine.install_syscall_handler(73, syscall_ppoll<W>);
+}
+
+template void add_poll_syscalls<4>(Machine<4>&);
+template void add_poll_syscalls<8>(Machine<8>&);
+
+} // riscv
@@ -1,5 +1,9 @@
 #include <libriscv/machine.hpp>
 #include <libriscv/threads.hpp>
+#include "iovec.hpp"
+#ifdef RISCV_IO_URING
+#include "io_uring.hpp"
+#endif
 
 //#define SYSCALL_VERBOSE 1
 #ifdef SYSCALL_VERBOSE
@@ -18,8 +22,10 @@ static constexpr bool verbose_syscalls = false;
 #undef sa_handler
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/uio.h>
 #define SA_ONSTACK	0x08000000
@@ -27,12 +33,10 @@ static constexpr bool verbose_syscalls = false;
 namespace riscv {
 	template <int W>
 	void add_socket_syscalls(Machine<W>&);
-
-template <int W>
-struct guest_iovec {
-	address_type<W> iov_base;
-	address_type<W> iov_len;
-};
+	template <int W>
+	void add_poll_syscalls(Machine<W>&);
+	// Arbitrary maximum length of stdin reads and stdout writes
+	static constexpr size_t MAX_STDIO_LENGTH = 16ull << 20;
 
 template <int W>
 static void syscall_stub_zero(Machine<W>& machine) {
@@ -120,6 +124,96 @@ static void syscall_sigaction(Machine<W>& machine)
 	machine.set_result(0);
 }
 
+// Path-based system calls go to the VirtualFS when there is one, except
+// for a host FD with an empty path and AT_EMPTY_PATH
+template <int W>
+static bool vfs_path(Machine<W>& machine, int dir_fd, const char* path, int flags)
+{
+	auto& fds = machine.fds();
+	if (path[0] == 0 && (flags & AT_EMPTY_PATH))
+		return fds.is_virtual(dir_fd);
+	return fds.vfs != nullptr;
+}
+
+// Resolves a path in the VirtualFS, relative to a virtual directory FD,
+// or to the root for AT_FDCWD and absolute paths
+template <int W>
+static const VirtualFS::Node* vfs_lookup(Machine<W>& machine,
+	int dir_fd, const char* path, int flags, int& error)
+{
+	auto& fds = machine.fds();
+	const VirtualFS::Node* base = nullptr;
+	if (dir_fd != AT_FDCWD && path[0] != '/') {
+		const VirtualFile* dir = fds.get_virtual(dir_fd);
+		if (dir == nullptr) {
+			error = -EBADF;
+			return nullptr;
+		}
+		if (path[0] == 0 && (flags & AT_EMPTY_PATH))
+			return dir->node;
+		if (!dir->node->is_dir()) {
+			error = -ENOTDIR;
+			return nullptr;
+		}
+		base = dir->node;
+	}
+	return fds.vfs->lookup(base, path, !(flags & AT_SYMLINK_NOFOLLOW), error);
+}
+
+// Copies from a virtual file at @offset, straight into guest memory
+template <int W>
+static ssize_t vfs_read(const VirtualFile& file, const HostIovecs<W>& iov, uint64_t offset)
+{
+	if (file.node->is_dir())
+		return -EISDIR;
+	size_t bytes = 0;
+	for (int i = 0; i < iov.count(); i++)
+	{
+		const auto& buffer = iov.buffers[i];
+		const size_t len = file.node->read(offset + bytes, buffer.ptr, buffer.len);
+		bytes += len;
+		if (len < buffer.len) break;
+	}
+	return bytes;
+}
+template <int W>
+static ssize_t vfs_read_rounds(Machine<W>& machine, const VirtualFile& file,
+	const guest_iovec<W>* vec, size_t count, uint64_t offset)
+{
+	if (file.node->is_dir())
+		return -EISDIR;
+	return HostIovecs<W>::read_rounds(machine.memory, vec, count,
+		[&file, offset] (const HostIovecs<W>& iov, size_t bytes) {
+			return vfs_read(file, iov, offset + bytes);
+		});
+}
+
+// Reads from a host file into guest memory. Regular files are read in
+// rounds (see HostIovecs::read_rounds), but streams and datagrams must be
+// read with one system call, and so their buffers are gathered up front.
+// A negative @offset reads from the file position.
+template <int W>
+static ssize_t host_read(Machine<W>& machine, int real_fd,
+	const guest_iovec<W>* vec, size_t count, int64_t offset = -1)
+{
+	auto host_readv = [real_fd, offset] (const HostIovecs<W>& iov, size_t bytes) {
+		if (offset < 0)
+			return ::readv(real_fd, iov.iov(), iov.count());
+		return ::preadv(real_fd, iov.iov(), iov.count(), offset + bytes);
+	};
+	struct stat st;
+	if (fstat(real_fd, &st) == 0 && S_ISREG(st.st_mode))
+		return HostIovecs<W>::read_rounds(machine.memory, vec, count, host_readv);
+
+	HostIovecs<W> iov;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (iov.gather(machine.memory, vec[i].iov_base, vec[i].iov_len, true) < vec[i].iov_len)
+			break;
+	}
+	return host_readv(iov, 0);
+}
+
 template <int W>
 void syscall_lseek(Machine<W>& machine)
 {
@@ -129,6 +223,21 @@ void syscall_lseek(Machine<W>& machine)
 	SYSPRINT("SYSCALL lseek, fd: %d, offset: 0x%lX, whence: %d\n",
 		fd, (long)offset, whence);
 
+	if (machine.has_file_descriptors()) {
+		if (auto* file = machine.fds().get_virtual(fd)) {
+			int64_t res = offset;
+			if (whence == SEEK_CUR)
+				res += file->offset;
+			else if (whence == SEEK_END)
+				res += file->node->size;
+			else if (whence != SEEK_SET)
+				res = -EINVAL;
+			if (res >= 0)
+				file->offset = res;
+			machine.set_result(res >= 0 ? res : -EINVAL);
+			return;
+		}
+	}
 	const int real_fd = machine.fds().get(fd);
 	int64_t res = lseek(real_fd, offset, whence);
 	if (res >= 0) {
@@ -144,40 +253,41 @@ static void syscall_read(Machine<W>& machine)
 	const auto address = machine.sysarg(1);
 	const size_t len   = machine.sysarg(2);
 	SYSPRINT("SYSCALL read, addr: 0x%lX, len: %zu\n", (long)address, len);
+#ifdef RISCV_IO_URING
+	if (machine.has_async_io() && machine.async_io().submit_read())
+		return;
+#endif
 	// We have special stdin handling
 	if (fd == 0) {
-		// Arbitrary maximum read length
-		if (len > 1024 * 1024 * 16) {
+		if (len > MAX_STDIO_LENGTH) {
 			machine.set_result(-ENOMEM);
 			return;
 		}
-		// TODO: We can use gather buffers here to avoid the copy
-		auto buffer = std::unique_ptr<char[]> (new char[len]);
-		long result = machine.stdin_read(buffer.get(), len);
-		if (result > 0) {
-			machine.copy_to_guest(address, buffer.get(), result);
+		// Read directly into guest memory, page by page
+		long bytes = 0;
+		for (const auto span : machine.memory.writable_spans(address, len))
+		{
+			const long result = machine.stdin_read((char *)span.data, span.size);
+			if (result < 0) {
+				if (bytes == 0) bytes = result;
+				break;
+			}
+			bytes += result;
+			if ((size_t)result < span.size) break;
 		}
-		machine.set_result(result);
+		machine.set_result(bytes);
 		return;
 	} else if (machine.has_file_descriptors()) {
-		const int real_fd = machine.fds().get(fd);
-		// Gather up to 1MB of pages we can read into
-		riscv::vBuffer buffers[256];
-		size_t cnt =
-			machine.memory.gather_buffers_from_range(256, buffers, address, len);
-		// TODO: Could probably be a readv call
-		size_t bytes = 0;
-		for (size_t i = 0; i < cnt; i++) {
-			ssize_t res = read(real_fd, buffers[i].ptr, buffers[i].len);
-			if (res >= 0) {
-				bytes += res;
-				if ((size_t)res < buffers[i].len) break;
-			} else {
-				machine.set_result_or_error(res);
-				return;
-			}
+		// Read directly into guest memory
+		const guest_iovec<W> vec { address, (address_type<W>) len };
+		if (auto* file = machine.fds().get_virtual(fd)) {
+			const ssize_t res = vfs_read_rounds(machine, *file, &vec, 1, file->offset);
+			if (res > 0) file->offset += res;
+			machine.set_result(res);
+			return;
 		}
-		machine.set_result(bytes);
+		const int real_fd = machine.fds().get(fd);
+		machine.set_result_or_error(host_read(machine, real_fd, &vec, 1));
 		return;
 	}
 	machine.set_result(-EBADF);
@@ -190,38 +300,27 @@ static void syscall_write(Machine<W>& machine)
 	const size_t len   = machine.sysarg(2);
 	SYSPRINT("SYSCALL write, fd: %d addr: 0x%lX, len: %zu\n",
 		vfd, (long)address, len);
+#ifdef RISCV_IO_URING
+	if (machine.has_async_io() && machine.async_io().submit_write())
+		return;
+#endif
 	// We only accept standard output pipes, for now :)
 	if (vfd == 1 || vfd == 2) {
-		// Zero-copy retrieval of buffers (64kb)
-		riscv::vBuffer buffers[16];
-		size_t cnt =
-			machine.memory.gather_buffers_from_range(16, buffers, address, len);
-		for (size_t i = 0; i < cnt; i++) {
-			machine.print(buffers[i].ptr, buffers[i].len);
+		if (len > MAX_STDIO_LENGTH) {
+			machine.set_result(-ENOMEM);
+			return;
 		}
+		// Zero-copy retrieval of buffers
+		machine.print_guest(address, len);
 		machine.set_result(len);
 		return;
 	} else if (machine.has_file_descriptors() && machine.fds().permit_write(vfd)) {
-		int real_fd = machine.fds().get(vfd);
-		// Zero-copy retrieval of buffers (256kb)
-		riscv::vBuffer buffers[64];
-		size_t cnt =
-			machine.memory.gather_buffers_from_range(64, buffers, address, len);
-		size_t bytes = 0;
-		// Could probably be a writev call, tbh
-		for (size_t i = 0; i < cnt; i++) {
-			ssize_t res = write(real_fd, buffers[i].ptr, buffers[i].len);
-			if (res >= 0) {
-				bytes += res;
-				// Detect partial writes
-				if ((size_t)res < buffers[i].len) break;
-			} else {
-				// Detect write errors
-				machine.set_result_or_error(res);
-				return;
-			}
-		}
-		machine.set_result(bytes);
+		const int real_fd = machine.fds().get(vfd);
+		// Write directly from guest memory, with one system call
+		HostIovecs<W> iov;
+		iov.gather(machine.memory, address, len, false);
+		const ssize_t res = ::writev(real_fd, iov.iov(), iov.count());
+		machine.set_result_or_error(res);
 		return;
 	}
 	machine.set_result(-EBADF);
@@ -236,37 +335,290 @@ static void syscall_writev(Machine<W>& machine)
 	if constexpr (false) {
 		printf("SYSCALL writev, iov: %#X  cnt: %d\n", iov_g, count);
 	}
-	if (count < 0 || count > 256) {
+	if (count < 0 || count > (int)HostIovecs<W>::MAX_GUEST_IOVECS) {
 		machine.set_result(-EINVAL);
 		return;
 	}
-	// We only accept standard output pipes, for now :)
 	if (fd == 1 || fd == 2) {
 		const size_t size = sizeof(guest_iovec<W>) * count;
 
-		std::vector<guest_iovec<W>> vec(count);
-		machine.memory.memcpy_out(vec.data(), iov_g, size);
+		guest_iovec<W> vec[HostIovecs<W>::MAX_GUEST_IOVECS];
+		machine.memory.memcpy_out(vec, iov_g, size);
 
-		ssize_t res = 0;
-		for (const auto& iov : vec)
+		size_t total = 0;
+		for (int i = 0; i < count; i++)
+			total += std::min<size_t>(vec[i].iov_len, MAX_STDIO_LENGTH + 1);
+		if (total > MAX_STDIO_LENGTH) {
+			machine.set_result(-ENOMEM);
+			return;
+		}
+		for (int i = 0; i < count; i++)
 		{
+			const auto& iov = vec[i];
 			auto src_g = (address_type<W>) iov.iov_base;
 			auto len_g = (size_t) iov.iov_len;
 			/* Zero-copy retrieval of buffers */
-			riscv::vBuffer buffers[4];
-			size_t cnt =
-				machine.memory.gather_buffers_from_range(4, buffers, src_g, len_g);
-			for (size_t i = 0; i < cnt; i++) {
-				machine.print(buffers[i].ptr, buffers[i].len);
+			machine.print_guest(src_g, len_g);
+		}
+		machine.set_result(total);
+		return;
+	} else if (machine.has_file_descriptors() && machine.fds().permit_write(fd)) {
+		const int real_fd = machine.fds().get(fd);
+		HostIovecs<W> iov;
+		iov.gather_guest_iovecs(machine, iov_g, count, false);
+		const ssize_t res = ::writev(real_fd, iov.iov(), iov.count());
+		machine.set_result_or_error(res);
+		return;
+	}
+	machine.set_result(-EBADF);
+}
+
+template <int W>
+static void syscall_readv(Machine<W>& machine)
+{
+	const auto [fd, iov_g, count] =
+		machine.template sysargs<int, address_type<W>, int> ();
+	SYSPRINT("SYSCALL readv, fd: %d iov: 0x%lX cnt: %d\n", fd, (long)iov_g, count);
+
+	if (count < 0 || count > (int)HostIovecs<W>::MAX_GUEST_IOVECS) {
+		machine.set_result(-EINVAL);
+		return;
+	}
+	guest_iovec<W> vec[HostIovecs<W>::MAX_GUEST_IOVECS];
+	if (fd == 0) {
+		machine.copy_from_guest(vec, iov_g, count * sizeof(guest_iovec<W>));
+		const long bytes = HostIovecs<W>::read_rounds(machine.memory, vec, count,
+		[&machine] (const HostIovecs<W>& iov, size_t) {
+			long bytes = 0;
+			for (int i = 0; i < iov.count(); i++)
+			{
+				const long result = machine.stdin_read(iov.buffers[i].ptr, iov.buffers[i].len);
+				if (result < 0) {
+					if (bytes == 0) bytes = result;
+					break;
+				}
+				bytes += result;
+				if ((size_t)result < iov.buffers[i].len) break;
 			}
-			res += len_g;
+			return bytes;
+		});
+		machine.set_result(bytes);
+		return;
+	} else if (machine.has_file_descriptors()) {
+		machine.copy_from_guest(vec, iov_g, count * sizeof(guest_iovec<W>));
+		if (auto* file = machine.fds().get_virtual(fd)) {
+			const ssize_t res = vfs_read_rounds(machine, *file, vec, count, file->offset);
+			if (res > 0) file->offset += res;
+			machine.set_result(res);
+			return;
 		}
-		machine.set_result(res);
+		const int real_fd = machine.fds().get(fd);
+		machine.set_result_or_error(host_read(machine, real_fd, vec, count));
 		return;
 	}
 	machine.set_result(-EBADF);
 }
 
+// 64-bit file offsets are split in two registers on 32-bit
+template <int W>
+static int64_t offset_from_regs(Machine<W>& machine, int reg)
+{
+	if constexpr (W == 4) {
+		return (int64_t) ((uint64_t)machine.sysarg(reg) | ((uint64_t)machine.sysarg(reg + 1) << 32));
+	} else {
+		return (int64_t) machine.sysarg(reg);
+	}
+}
+
+// pread64, pwrite64, preadv and pwritev
+template <int W, bool Write, bool Vectored>
+static void syscall_pio(Machine<W>& machine)
+{
+	const int  vfd     = machine.template sysarg<int>(0);
+	const auto address = machine.sysarg(1);
+	const size_t len   = machine.sysarg(2);
+	const int64_t offset = offset_from_regs(machine, 3);
+	SYSPRINT("SYSCALL p%s%s, fd: %d addr: 0x%lX len: %zu offset: %ld\n",
+		Write ? "write" : "read", Vectored ? "v" : "64", vfd, (long)address, len, (long)offset);
+
+	if (!machine.has_file_descriptors() || (Write && !machine.fds().permit_write(vfd))) {
+		machine.set_result(-EBADF);
+		return;
+	}
+	if (offset < 0) {
+		machine.set_result(-EINVAL);
+		return;
+	}
+	if constexpr (Write) {
+		HostIovecs<W> iov;
+		if constexpr (Vectored) {
+			if (!iov.gather_guest_iovecs(machine, address, len, false)) {
+				machine.set_result(-EINVAL);
+				return;
+			}
+		} else {
+			iov.gather(machine.memory, address, len, false);
+		}
+		const int real_fd = machine.fds().get(vfd);
+		machine.set_result_or_error(::pwritev(real_fd, iov.iov(), iov.count(), offset));
+	} else {
+		guest_iovec<W> vec[HostIovecs<W>::MAX_GUEST_IOVECS];
+		size_t count = 1;
+		if constexpr (Vectored) {
+			if (len > HostIovecs<W>::MAX_GUEST_IOVECS) {
+				machine.set_result(-EINVAL);
+				return;
+			}
+			machine.copy_from_guest(vec, address, len * sizeof(guest_iovec<W>));
+			count = len;
+		} else {
+			vec[0] = { address, (address_type<W>) len };
+		}
+		if (auto* file = machine.fds().get_virtual(vfd)) {
+			machine.set_result(vfs_read_rounds(machine, *file, vec, count, offset));
+			return;
+		}
+		const int real_fd = machine.fds().get(vfd);
+		machine.set_result_or_error(host_read(machine, real_fd, vec, count, offset));
+	}
+}
+
+// The transfer system calls take optional pointers to file offsets, which
+// are then used and updated instead of the file positions
+template <int W>
+static loff_t* guest_offset(Machine<W>& machine, address_type<W> g_offset, loff_t& offset)
+{
+	if (g_offset == 0)
+		return nullptr;
+	machine.copy_from_guest(&offset, g_offset, sizeof(offset));
+	return &offset;
+}
+
+template <int W>
+static bool transfer_permitted(Machine<W>& machine, int out_vfd)
+{
+	return machine.has_file_descriptors()
+		&& (out_vfd == 1 || out_vfd == 2 || machine.fds().permit_write(out_vfd));
+}
+
+// Writes host memory to a guest FD, where the standard pipes are printed
+template <int W>
+static ssize_t write_to_fd(Machine<W>& machine, int vfd, const void* data, size_t len, loff_t* offset)
+{
+	if (vfd == 1 || vfd == 2) {
+		machine.print((const char *)data, len);
+		return len;
+	}
+	const int real_fd = machine.fds().get(vfd);
+	const ssize_t res = (offset != nullptr)
+		? ::pwrite(real_fd, data, len, *offset) : ::write(real_fd, data, len);
+	if (res < 0)
+		return -errno;
+	if (offset != nullptr)
+		*offset += res;
+	return res;
+}
+
+// Moves data between two guest FDs without going through guest memory.
+// VirtualFS files are written straight from the shared tree, and output to
+// the standard pipes is printed through a host buffer. Otherwise the data
+// is moved between the host FDs by @host_transfer, eg. with sendfile().
+template <int W, typename Transfer>
+static ssize_t transfer(Machine<W>& machine, int in_vfd, loff_t* off_in,
+	int out_vfd, loff_t* off_out, size_t count, Transfer host_transfer)
+{
+	auto& fds = machine.fds();
+	if (auto* file = fds.get_virtual(in_vfd)) {
+		const VirtualFS::Node& node = *file->node;
+		if (!node.is_file())
+			return -EINVAL;
+		const uint64_t pos = (off_in != nullptr) ? *off_in : file->offset;
+		if (pos >= node.size)
+			return 0;
+		const ssize_t res = write_to_fd(machine, out_vfd, node.data() + pos,
+			std::min<uint64_t>(count, node.size - pos), off_out);
+		if (res > 0) {
+			if (off_in != nullptr) *off_in += res;
+			else file->offset += res;
+		}
+		return res;
+	}
+	const int real_in = fds.get(in_vfd);
+	if (real_in < 0)
+		return -EBADF;
+	if (out_vfd == 1 || out_vfd == 2) {
+		char buffer[16384];
+		count = std::min(count, sizeof(buffer));
+		const ssize_t res = (off_in != nullptr)
+			? ::pread(real_in, buffer, count, *off_in) : ::read(real_in, buffer, count);
+		if (res < 0)
+			return -errno;
+		if (off_in != nullptr)
+			*off_in += res;
+		machine.print(buffer, res);
+		return res;
+	}
+	const int real_out = fds.get(out_vfd);
+	if (real_out < 0)
+		return -EBADF;
+	const ssize_t res = host_transfer(real_in, off_in, real_out, off_out, count);
+	return (res < 0) ? -errno : res;
+}
+
+template <int W>
+static void syscall_sendfile(Machine<W>& machine)
+{
+	const auto [out_vfd, in_vfd, g_offset, count] =
+		machine.template sysargs<int, int, address_type<W>, address_type<W>> ();
+	SYSPRINT("SYSCALL sendfile, out: %d in: %d offset: 0x%lX count: %zu\n",
+		out_vfd, in_vfd, (long)g_offset, (size_t)count);
+
+	if (!transfer_permitted(machine, out_vfd)) {
+		machine.set_result(-EBADF);
+		return;
+	}
+	loff_t offset;
+	loff_t* off_in = guest_offset(machine, g_offset, offset);
+	const ssize_t res = transfer(machine, in_vfd, off_in, out_vfd, nullptr, count,
+		[] (int in, loff_t* off_in, int out, loff_t*, size_t count) {
+			return ::sendfile64(out, in, off_in, count);
+		});
+	if (res >= 0 && off_in != nullptr)
+		machine.copy_to_guest(g_offset, off_in, sizeof(loff_t));
+	machine.set_result(res);
+}
+
+// splice and copy_file_range
+template <int W, bool Splice>
+static void syscall_splice(Machine<W>& machine)
+{
+	const auto [in_vfd, g_off_in, out_vfd, g_off_out, count, flags] =
+		machine.template sysargs<int, address_type<W>, int, address_type<W>,
+			address_type<W>, unsigned> ();
+	SYSPRINT("SYSCALL %s, in: %d out: %d count: %zu flags: %#x\n",
+		Splice ? "splice" : "copy_file_range", in_vfd, out_vfd, (size_t)count, flags);
+
+	if (!transfer_permitted(machine, out_vfd)) {
+		machine.set_result(-EBADF);
+		return;
+	}
+	loff_t in_offset, out_offset;
+	loff_t* off_in  = guest_offset(machine, g_off_in, in_offset);
+	loff_t* off_out = guest_offset(machine, g_off_out, out_offset);
+	const ssize_t res = transfer(machine, in_vfd, off_in, out_vfd, off_out, count,
+		[flags] (int in, loff_t* off_in, int out, loff_t* off_out, size_t count) {
+			if constexpr (Splice)
+				return ::splice(in, off_in, out, off_out, count, flags);
+			else
+				return ::copy_file_range(in, off_in, out, off_out, count, flags);
+		});
+	if (res >= 0 && off_in != nullptr)
+		machine.copy_to_guest(g_off_in, off_in, sizeof(loff_t));
+	if (res >= 0 && off_out != nullptr)
+		machine.copy_to_guest(g_off_out, off_out, sizeof(loff_t));
+	machine.set_result(res);
+}
+
 template <int W>
 static void syscall_openat(Machine<W>& machine)
 {
@@ -280,6 +632,26 @@ static void syscall_openat(Machine<W>& machine)
 	SYSPRINT("SYSCALL openat, dir_fd: %d path: %s flags: %X\n",
 		dir_fd, path, flags);
 
+	if (machine.has_file_descriptors() && machine.fds().vfs != nullptr) {
+		// The VirtualFS is read-only
+		if ((flags & O_ACCMODE) != O_RDONLY || (flags & (O_CREAT | O_TRUNC))) {
+			machine.set_result(-EROFS);
+			return;
+		}
+		int error = 0;
+		auto* node = vfs_lookup(machine, dir_fd, path,
+			(flags & O_NOFOLLOW) ? AT_SYMLINK_NOFOLLOW : 0, error);
+		if (node == nullptr) {
+			machine.set_result(error);
+		} else if (node->is_symlink()) {
+			machine.set_result(-ELOOP);
+		} else if ((flags & O_DIRECTORY) && !node->is_dir()) {
+			machine.set_result(-ENOTDIR);
+		} else {
+			machine.set_result(machine.fds().assign_virtual({ node, 0, flags }));
+		}
+		return;
+	}
 	if (machine.has_file_descriptors() && machine.fds().permit_filesystem) {
 
 		if (machine.fds().filter_open != nullptr) {
@@ -315,6 +687,11 @@ static void syscall_close(riscv::Machine<W>& machine)
 		machine.set_result(0);
 		return;
 	} else if (machine.has_file_descriptors()) {
+		if (machine.fds().is_virtual(vfd)) {
+			const bool erased = machine.fds().virtual_files.erase(vfd) != 0;
+			machine.set_result(erased ? 0 : -EBADF);
+			return;
+		}
 		const int res = machine.fds().erase(vfd);
 		if (res > 0) {
 			::close(res);
@@ -332,6 +709,10 @@ static void syscall_dup(Machine<W>& machine)
 	SYSPRINT("SYSCALL dup, fd: %d\n", vfd);
 
 	if (machine.has_file_descriptors()) {
+		if (auto* file = machine.fds().get_virtual(vfd)) {
+			machine.set_result(machine.fds().assign_virtual(*file));
+			return;
+		}
 		int real_fd = machine.fds().translate(vfd);
 		int res = dup(real_fd);
 		machine.set_result_or_error(res);
@@ -351,6 +732,25 @@ static void syscall_fcntl(Machine<W>& machine)
 	SYSPRINT("SYSCALL fcntl, fd: %d  cmd: 0x%X\n", vfd, cmd);
 
 	if (machine.has_file_descriptors()) {
+		if (auto* file = machine.fds().get_virtual(vfd)) {
+			switch (cmd) {
+			case F_DUPFD:
+			case F_DUPFD_CLOEXEC:
+				machine.set_result(machine.fds().assign_virtual(*file));
+				return;
+			case F_GETFD:
+			case F_SETFD:
+			case F_SETFL:
+				machine.set_result(0);
+				return;
+			case F_GETFL:
+				machine.set_result(file->flags);
+				return;
+			default:
+				machine.set_result(-EINVAL);
+				return;
+			}
+		}
 		int real_fd = machine.fds().translate(vfd);
 		int res = fcntl(real_fd, cmd, arg1, arg2, arg3);
 		machine.set_result_or_error(res);
@@ -407,6 +807,20 @@ void syscall_readlinkat(Machine<W>& machine)
 		return;
 	}
 
+	if (machine.has_file_descriptors() && vfs_path(machine, vfd, path, 0)) {
+		int error = 0;
+		auto* node = vfs_lookup(machine, vfd, path, AT_SYMLINK_NOFOLLOW, error);
+		if (node == nullptr) {
+			machine.set_result(error);
+		} else if (!node->is_symlink()) {
+			machine.set_result(-EINVAL);
+		} else {
+			const size_t len = std::min<size_t>(bufsize, node->target.size());
+			machine.copy_to_guest(g_buf, node->target.data(), len);
+			machine.set_result(len);
+		}
+		return;
+	}
 	if (machine.has_file_descriptors()) {
 
 		if (machine.fds().filter_open != nullptr) {
@@ -471,6 +885,19 @@ inline void copy_stat_buffer(struct stat& st, struct riscv_stat& rst)
 	rst.rv_ctime = st.st_ctime;
 	rst.rv_ctime_nsec = st.st_ctim.tv_nsec;
 }
+inline void copy_stat_buffer(const VirtualFS::Node& node, struct riscv_stat& rst)
+{
+	rst = {};
+	rst.st_ino = node.ino;
+	rst.st_mode = node.mode;
+	rst.st_nlink = node.is_dir() ? 2 : 1;
+	rst.st_size = node.size;
+	rst.st_blksize = Page::size();
+	rst.st_blocks = (node.size + 511) / 512;
+	rst.rv_atime = node.mtime;
+	rst.rv_mtime = node.mtime;
+	rst.rv_ctime = node.mtime;
+}
 
 template <int W>
 static void syscall_fstatat(Machine<W>& machine)
@@ -487,6 +914,17 @@ static void syscall_fstatat(Machine<W>& machine)
 	SYSPRINT("SYSCALL fstatat, fd: %d path: %s buf: 0x%lX flags: %#x)\n",
 			vfd, path, (long)g_buf, flags);
 
+	if (machine.has_file_descriptors() && vfs_path(machine, vfd, path, flags)) {
+		int error = 0;
+		auto* node = vfs_lookup(machine, vfd, path, flags, error);
+		if (node != nullptr) {
+			struct riscv_stat rst;
+			copy_stat_buffer(*node, rst);
+			machine.copy_to_guest(g_buf, &rst, sizeof(rst));
+		}
+		machine.set_result(node != nullptr ? 0 : error);
+		return;
+	}
 	if (machine.has_file_descriptors()) {
 
 		int real_fd = machine.fds().translate(vfd);
@@ -515,6 +953,13 @@ static void syscall_fstat(Machine<W>& machine)
 			vfd, (long)g_buf);
 
 	if (machine.has_file_descriptors()) {
+		if (auto* file = machine.fds().get_virtual(vfd)) {
+			struct riscv_stat rst;
+			copy_stat_buffer(*file->node, rst);
+			machine.copy_to_guest(g_buf, &rst, sizeof(rst));
+			machine.set_result(0);
+			return;
+		}
 
 		int real_fd = machine.fds().translate(vfd);
 
@@ -547,6 +992,26 @@ static void syscall_statx(Machine<W>& machine)
 	SYSPRINT("SYSCALL statx, fd: %d path: %s flags: %x buf: 0x%lX)\n",
 			dir_fd, path, flags, (long)buffer);
 
+	if (machine.has_file_descriptors() && vfs_path(machine, dir_fd, path, flags)) {
+		int error = 0;
+		auto* node = vfs_lookup(machine, dir_fd, path, flags, error);
+		if (node != nullptr) {
+			struct statx st {};
+			st.stx_mask = STATX_BASIC_STATS;
+			st.stx_blksize = Page::size();
+			st.stx_nlink = node->is_dir() ? 2 : 1;
+			st.stx_mode = node->mode;
+			st.stx_ino  = node->ino;
+			st.stx_size = node->size;
+			st.stx_blocks = (node->size + 511) / 512;
+			st.stx_atime.tv_sec = node->mtime;
+			st.stx_ctime.tv_sec = node->mtime;
+			st.stx_mtime.tv_sec = node->mtime;
+			machine.copy_to_guest(buffer, &st, sizeof(struct statx));
+		}
+		machine.set_result(node != nullptr ? 0 : error);
+		return;
+	}
 	if (machine.has_file_descriptors()) {
 		if (machine.fds().filter_stat != nullptr) {
 			if (!machine.fds().filter_stat(machine.template get_userdata<void>(), path)) {
@@ -566,6 +1031,101 @@ static void syscall_statx(Machine<W>& machine)
 	machine.set_result(-ENOSYS);
 }
 
+template <int W>
+static void syscall_getdents64(Machine<W>& machine)
+{
+	const auto [vfd, g_dirp, count] =
+		machine.template sysargs<int, address_type<W>, unsigned> ();
+	SYSPRINT("SYSCALL getdents64, fd: %d dirp: 0x%lX count: %u\n",
+		vfd, (long)g_dirp, count);
+
+	if (!machine.has_file_descriptors()) {
+		machine.set_result(-EBADF);
+		return;
+	}
+	// struct linux_dirent64 is the same on every architecture
+	std::vector<uint8_t> buffer(std::min(count, 65536u));
+	auto* file = machine.fds().get_virtual(vfd);
+	if (file == nullptr) {
+		const int real_fd = machine.fds().get(vfd);
+		const long res = ::syscall(SYS_getdents64, real_fd, buffer.data(), buffer.size());
+		if (res > 0)
+			machine.copy_to_guest(g_dirp, buffer.data(), res);
+		machine.set_result_or_error(res);
+		return;
+	}
+	const VirtualFS::Node& dir = *file->node;
+	if (!dir.is_dir()) {
+		machine.set_result(-ENOTDIR);
+		return;
+	}
+	// Entries 0 and 1 are "." and "..", followed by the children
+	size_t pos = 0;
+	auto it = dir.children.begin();
+	std::advance(it, std::min<size_t>(std::max<uint64_t>(file->offset, 2) - 2, dir.children.size()));
+	for (uint64_t index = file->offset; ; index++)
+	{
+		const VirtualFS::Node* node;
+		std::string_view name;
+		if (index == 0) {
+			node = &dir; name = ".";
+		} else if (index == 1) {
+			node = dir.parent; name = "..";
+		} else if (it != dir.children.end()) {
+			node = it->second; name = it->first;
+		} else break;
+
+		const size_t reclen = (19 + name.size() + 1 + 7) & ~size_t(7);
+		if (pos + reclen > buffer.size()) {
+			if (pos == 0) {
+				machine.set_result(-EINVAL);
+				return;
+			}
+			break;
+		}
+		uint8_t* ent = &buffer[pos];
+		const uint64_t ino = node->ino;
+		const int64_t  off = index + 1;
+		const uint16_t len = reclen;
+		std::memcpy(&ent[0], &ino, 8);
+		std::memcpy(&ent[8], &off, 8);
+		std::memcpy(&ent[16], &len, 2);
+		ent[18] = (node->mode & VirtualFS::TYPE_MASK) >> 12; // d_type
+		std::memcpy(&ent[19], name.data(), name.size());
+		std::memset(&ent[19 + name.size()], 0, reclen - 19 - name.size());
+		pos += reclen;
+		file->offset = index + 1;
+		if (index >= 2) ++it;
+	}
+	machine.copy_to_guest(g_dirp, buffer.data(), pos);
+	machine.set_result(pos);
+}
+
+template <int W>
+static void syscall_faccessat(Machine<W>& machine)
+{
+	const auto [dir_fd, g_path, mode] =
+		machine.template sysargs<int, address_type<W>, int> ();
+
+	char path[PATH_MAX];
+	machine.copy_from_guest(path, g_path, sizeof(path)-1);
+	path[sizeof(path)-1] = 0;
+
+	SYSPRINT("SYSCALL faccessat, fd: %d path: %s mode: %x\n",
+		dir_fd, path, mode);
+
+	if (machine.has_file_descriptors() && machine.fds().vfs != nullptr) {
+		int error = 0;
+		auto* node = vfs_lookup(machine, dir_fd, path, 0, error);
+		if (node == nullptr)
+			machine.set_result(error);
+		else
+			machine.set_result((mode & W_OK) ? -EROFS : 0);
+		return;
+	}
+	machine.set_result(-ENOSYS);
+}
+
 template <int W>
 static void syscall_gettimeofday(Machine<W>& machine)
 {
@@ -645,6 +1205,103 @@ static void syscall_brk(Machine<W>& machine)
 	machine.set_result(new_end);
 }
 
+// Maps a host file into guest memory, through a host mmap, so that the
+// file data is accessed without copying, and shared with other machines
+// through the page cache. Private mappings are copy-on-write.
+template <int W>
+static void mmap_file(Machine<W>& machine, address_type<W> addr_g,
+	address_type<W> length, int prot, int flags, int vfd, uint64_t offset)
+{
+	const VirtualFile* vfile = machine.fds().get_virtual(vfd);
+	const int real_fd = machine.fds().get(vfd);
+	if (real_fd < 0 && vfile == nullptr) {
+		machine.set_result(-EBADF);
+		return;
+	}
+	if (offset % Page::size() != 0 || length == 0 || (addr_g % Page::size()) != 0) {
+		machine.set_result(-EINVAL);
+		return;
+	}
+	const bool shared = (flags & MAP_SHARED) != 0;
+	const bool writable = (prot & PROT_WRITE) != 0;
+	if (shared && writable && (vfile != nullptr || !machine.fds().permit_file_write)) {
+		machine.set_result(-EACCES);
+		return;
+	}
+	uint64_t file_size;
+	if (vfile != nullptr) {
+		if (!vfile->node->is_file()) {
+			machine.set_result(-ENODEV);
+			return;
+		}
+		file_size = vfile->node->size;
+	} else {
+		struct stat st;
+		if (fstat(real_fd, &st) < 0) {
+			machine.set_result(-errno);
+			return;
+		}
+		if (!S_ISREG(st.st_mode)) {
+			machine.set_result(-ENODEV);
+			return;
+		}
+		file_size = st.st_size;
+	}
+	// Only the pages that overlap the file are mapped, the rest are zero
+	size_t file_length = 0;
+	if (file_size > offset) {
+		file_length = std::min<uint64_t>(length, file_size - offset);
+		file_length = (file_length + Page::size()-1) & ~size_t(Page::size()-1);
+	}
+	void* ptr = nullptr;
+	std::shared_ptr<void> backing;
+	if (file_length > 0 && vfile != nullptr) {
+		// VirtualFS pages are mapped directly, and stay alive with the VirtualFS
+		ptr = const_cast<uint8_t*> (vfile->node->data() + offset);
+		backing = std::shared_ptr<void> (machine.fds().vfs, ptr);
+	} else if (file_length > 0) {
+		ptr = ::mmap(nullptr, file_length, PROT_READ | ((shared && writable) ? PROT_WRITE : 0),
+			shared ? MAP_SHARED : MAP_PRIVATE, real_fd, offset);
+		if (ptr == MAP_FAILED) {
+			machine.set_result(-errno);
+			return;
+		}
+		backing = std::shared_ptr<void> { ptr,
+			[file_length] (void* data) { ::munmap(data, file_length); } };
+	}
+
+	auto& nextfree = machine.memory.mmap_address();
+	address_type<W> dst = nextfree;
+	if ((flags & MAP_FIXED) && addr_g != 0)
+		dst = addr_g;
+	if (dst == nextfree)
+		nextfree += length;
+	// Anything already mapped in the range is replaced
+	machine.memory.free_pages(dst, length);
+	const PageAttributes attr {
+		.read  = bool(prot & PROT_READ),
+		.write = shared && writable,
+		.exec  = bool(prot & PROT_EXEC),
+		.is_cow = !shared && writable,
+	};
+	if (file_length > 0) {
+		// only a writable shared host mapping may be written in place
+		machine.memory.insert_non_owned_memory(dst, ptr, file_length, attr, std::move(backing),
+			(shared && writable) ? Memory<W>::HOST_WRITES_SHARED : Memory<W>::HOST_WRITES_COW);
+	}
+	if (length > file_length) {
+		machine.memory.memzero(dst + file_length, length - file_length);
+		machine.memory.set_page_attr(dst + file_length, length - file_length, {
+			.read  = bool(prot & PROT_READ),
+			.write = writable,
+			.exec  = bool(prot & PROT_EXEC)
+		});
+	}
+	SYSPRINT("<<< mmap(fd %d, offset %lu, len %zu) = 0x%lX\n",
+		vfd, (long)offset, (size_t)length, (long)dst);
+	machine.set_result(dst);
+}
+
 template <int W>
 static void add_mman_syscalls(Machine<W>& machine)
 {
@@ -678,16 +1335,31 @@ static void add_mman_syscalls(Machine<W>& machine)
 					(long)addr_g, (size_t)length);
 			return;
 		}
-		if (length % Page::size() == 0) {
+		if (length % Page::size() != 0) {
 			length = (length + (Page::size()-1)) & ~address_type<W>(Page::size()-1);
 		}
+		if (!(flags & MAP_ANONYMOUS) && machine.has_file_descriptors()) {
+			const int vfd = machine.template sysarg<int>(4);
+			// 32-bit RISC-V has mmap2, with the offset in 4k units
+			const uint64_t offset = (W == 4)
+				? uint64_t(machine.sysarg(5)) * 4096 : uint64_t(machine.sysarg(5));
+			mmap_file(machine, addr_g, length, prot, flags, vfd, offset);
+			return;
+		}
 		auto& nextfree = machine.memory.mmap_address();
 		if (addr_g == 0 || addr_g == nextfree)
 		{
-			// anon pages need to be zeroed
+			// anon pages need to be zeroed, which shares the CoW zero page
 			if (flags & MAP_ANONYMOUS) {
-				// ... but they are already CoW
-				//machine.memory.memset(nextfree, 0, length);
+				machine.memory.memzero(nextfree, length);
+			}
+			// eg. executable mappings for guest JIT code
+			if (prot & PROT_EXEC) {
+				machine.memory.set_page_attr(nextfree, length, {
+					.read  = bool(prot & PROT_READ),
+					.write = bool(prot & PROT_WRITE),
+					.exec  = bool(prot & PROT_EXEC)
+				});
 			}
 			machine.set_result(nextfree);
 			SYSPRINT("<<< mmap(addr 0x%lX, len %zu, ...) = 0x%lX\n",
@@ -747,6 +1419,22 @@ static void add_mman_syscalls(Machine<W>& machine)
 		});
 		machine.set_result(0);
 	});
+	// riscv_flush_icache
+	machine.install_syscall_handler(259,
+	[] (Machine<W>& machine) {
+		const auto start = machine.sysarg(0);
+		const auto end   = machine.sysarg(1);
+		SYSPRINT(">>> riscv_flush_icache(0x%lX, 0x%lX)\n",
+			(long)start, (long)end);
+		if (start < end) {
+			machine.memory.invalidate_dynamic_segments(
+				Memory<W>::page_number(start),
+				Memory<W>::page_number(end + Page::size() - 1));
+			// Re-enter the current execute segment (inbound jumps only)
+			machine.cpu.jump(machine.cpu.pc());
+		}
+		machine.set_result(0);
+	});
 	// madvise
 	machine.install_syscall_handler(233,
 	[] (Machine<W>& machine) {
@@ -763,7 +1451,9 @@ static void add_mman_syscalls(Machine<W>& machine)
 				machine.set_result(0);
 				return;
 			case MADV_DONTNEED:
-				machine.memory.free_pages(addr, len);
+				// the pages read as zeroes again, keeping their protections
+				machine.memory.memzero(addr,
+					(len + Page::size()-1) & ~address_type<W>(Page::size()-1));
 				machine.set_result(0);
 				return;
 			case MADV_REMOVE:
@@ -808,11 +1498,22 @@ void Machine<W>::setup_linux_syscalls(bool filesystem, bool sockets)
 	// ioctl
 	this->install_syscall_handler(29, syscall_ioctl<W>);
 	// faccessat
-	this->install_syscall_handler(48, syscall_stub_nosys<W>);
+	this->install_syscall_handler(48, syscall_faccessat<W>);
 
 	this->install_syscall_handler(56, syscall_openat<W>);
 	this->install_syscall_handler(57, syscall_close<W>);
+	this->install_syscall_handler(61, syscall_getdents64<W>);
+	this->install_syscall_handler(65, syscall_readv<W>);
 	this->install_syscall_handler(66, syscall_writev<W>);
+	// pread64, pwrite64, preadv, pwritev
+	this->install_syscall_handler(67, syscall_pio<W, false, false>);
+	this->install_syscall_handler(68, syscall_pio<W, true, false>);
+	this->install_syscall_handler(69, syscall_pio<W, false, true>);
+	this->install_syscall_handler(70, syscall_pio<W, true, true>);
+	// sendfile, splice, copy_file_range
+	this->install_syscall_handler(71, syscall_sendfile<W>);
+	this->install_syscall_handler(76, syscall_splice<W, true>);
+	this->install_syscall_handler(285, syscall_splice<W, false>);
 	this->install_syscall_handler(78, syscall_readlinkat<W>);
 	// 79: fstatat
 	this->install_syscall_handler(79, syscall_fstatat<W>);
@@ -858,6 +1559,7 @@ void Machine<W>::setup_linux_syscalls(bool filesystem, bool sockets)
 		signal(SIGPIPE, SIG_IGN);
 
 		m_fds.reset(new FileDescriptors);
+		add_poll_syscalls(*this);
 		if (sockets)
 			add_socket_syscalls(*this);
 	}
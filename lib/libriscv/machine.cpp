@@ -4,8 +4,12 @@
 #include "rv32i_instr.hpp"
 #include "threads.hpp"
 #include "util/auxvec.hpp"
+#ifdef RISCV_IO_URING
+#include "linux/io_uring.hpp"
+#endif
 #include <errno.h>
 #include <time.h>
+#include <chrono>
 #include <random>
 extern "C" {
 	ssize_t write(int fd, const void *buf, size_t count);
@@ -47,9 +51,14 @@ namespace riscv
 	{
 		this->m_counter = other.m_counter;
 		this->m_max_counter = other.m_max_counter;
+		this->m_syscalls = other.m_syscalls;
 		if (other.m_mt) {
 			m_mt.reset(new MultiThreading {*this, *other.m_mt});
 		}
+		if (other.m_time_page) {
+			this->m_time_page_addr = other.m_time_page_addr;
+			this->map_time_page();
+		}
 	}
 
 	template <int W>
@@ -61,6 +70,92 @@ namespace riscv
 	{
 	}
 
+	template <int W>
+	void Machine<W>::set_output_buffering(size_t threshold, bool flush_on_stop)
+	{
+		this->flush_output();
+		if (threshold == 0) {
+			m_output = nullptr;
+			return;
+		}
+		m_output.reset(new OutputBuffer { {}, threshold, flush_on_stop });
+		m_output->data.reserve(threshold);
+	}
+
+	// The guest view of the time page (see: setup_native_time). The guest
+	// may be stopped in the middle of reading it, and so the sequence
+	// number changes with every update.
+	struct GuestTimePage {
+		uint64_t sequence;
+		int64_t realtime_sec;
+		int64_t realtime_nsec;
+		int64_t monotonic_sec;
+		int64_t monotonic_nsec;
+	};
+
+	template <int W>
+	void Machine<W>::update_time_page() noexcept
+	{
+		using namespace std::chrono;
+		const auto rt   = system_clock::now().time_since_epoch();
+		const auto mono = steady_clock::now().time_since_epoch();
+		auto* page = reinterpret_cast<GuestTimePage*> (m_time_page->buffer8.data());
+		page->sequence++;
+		page->realtime_sec   = duration_cast<seconds>(rt).count();
+		page->realtime_nsec  = duration_cast<nanoseconds>(rt % seconds(1)).count();
+		page->monotonic_sec  = duration_cast<seconds>(mono).count();
+		page->monotonic_nsec = duration_cast<nanoseconds>(mono % seconds(1)).count();
+	}
+
+	template <int W>
+	void Machine<W>::map_time_page()
+	{
+		// The page is written by the host, and is read-only for the guest
+		m_time_page = std::make_shared<PageData>();
+		memory.free_pages(m_time_page_addr, Page::size());
+		memory.insert_non_owned_memory(m_time_page_addr, m_time_page->buffer8.data(),
+			Page::size(), { .read = true, .write = false }, m_time_page,
+			Memory<W>::HOST_WRITES_NEVER);
+		this->update_time_page();
+	}
+
+	template <int W>
+	void Machine<W>::simulate_slices(uint64_t max_instr)
+	{
+		// The time page is refreshed, and threads are preempted,
+		// in between running the machine one slice at a time. Only
+		// the outermost run is preempted, as a vmcall() or preempt()
+		// has to finish on the thread it was made on.
+		const uint64_t time_slice = (m_time_page != nullptr) ? TIME_PAGE_INTERVAL : 0;
+		const uint64_t thread_slice = (m_mt != nullptr && m_vmcalls == 0) ? m_mt->time_slice : 0;
+		if (time_slice == 0 && thread_slice == 0) {
+			cpu.simulate(max_instr);
+			return;
+		}
+		const uint64_t end = (max_instr > UINT64_MAX - m_counter) ?
+			UINT64_MAX : m_counter + max_instr;
+		uint64_t thread_left = thread_slice;
+		while (true)
+		{
+			const uint64_t remaining = end - m_counter;
+			uint64_t slice = remaining;
+			if (time_slice != 0)
+				slice = std::min(slice, time_slice);
+			if (thread_slice != 0)
+				slice = std::min(slice, thread_left);
+			cpu.simulate(slice);
+			// Stopped, or out of instructions
+			if (m_max_counter == 0 || remaining <= slice)
+				return;
+			if (time_slice != 0)
+				this->update_time_page();
+			if (thread_slice != 0 && (thread_left -= slice) == 0) {
+				m_mt->preempt();
+				thread_left = thread_slice;
+			}
+		}
+	}
+
 	template <int W>
 	void Machine<W>::unknown_syscall_handler(Machine<W>& machine)
 	{
@@ -176,7 +271,14 @@ namespace riscv
 			const auto* phd = &binary_phdr[i];
 			push_down(*this, dst, phd, sizeof(typename riscv::Elf<W>::Phdr));
 		}
-		const auto phdr_location = dst;
+		auto phdr_location = dst;
+		// The dynamic linker finds the load bias of the program by
+		// comparing AT_PHDR with PT_PHDR, so it must be the real location
+		for (unsigned i = 0; i < phdr_count; i++)
+		{
+			if (binary_phdr[i].p_type == PT_PHDR)
+				phdr_location = memory.elf_base() + binary_phdr[i].p_vaddr;
+		}
 
 		// Arguments to main()
 		std::vector<address_type<W>> argv;
@@ -202,9 +304,9 @@ namespace riscv
 		push_aux<W>(argv, {AT_PHNUM, phdr_count});
 
 		// Misc
-		push_aux<W>(argv, {AT_BASE, 0});
+		push_aux<W>(argv, {AT_BASE, this->memory.interpreter_base()});
 		push_aux<W>(argv, {AT_FLAGS, 0});
-		push_aux<W>(argv, {AT_ENTRY, this->memory.start_address()});
+		push_aux<W>(argv, {AT_ENTRY, this->memory.program_entry()});
 		push_aux<W>(argv, {AT_HWCAP, 0});
 		push_aux<W>(argv, {AT_UID, 0});
 		push_aux<W>(argv, {AT_EUID, 0});
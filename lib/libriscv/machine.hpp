@@ -145,8 +145,19 @@ namespace riscv
 
 		// Stdout, stderr
 		void print(const char*, size_t) const;
+		// Prints guest memory, which the printer is given directly, page by
+		// page, unless the range is small enough to be buffered
+		void print_guest(address_t addr, size_t len) const;
 		auto& get_printer() const noexcept { return m_printer; }
-		void set_printer(printer_func pf = m_default_printer) { m_printer = std::move(pf); }
+		void set_printer(printer_func pf = m_default_printer) { flush_output(); m_printer = std::move(pf); }
+		// Optional output buffering: stdout and stderr are gathered, and given
+		// to the printer @threshold bytes at a time, instead of once per system
+		// call. Larger writes go to the printer directly from guest memory.
+		// The buffer is also flushed when simulate() returns (unless
+		// @flush_on_stop is false), when the printer is changed, and by
+		// flush_output(). A threshold of 0 disables buffering.
+		void set_output_buffering(size_t threshold, bool flush_on_stop = true);
+		void flush_output() const;
 		// Stdin
 		long stdin_read(char*, size_t) const;
 		auto& get_stdin() const noexcept { return m_stdin; }
@@ -168,8 +179,15 @@ namespace riscv
 			for (auto& h : arr) h = unknown_syscall_handler;
 			return arr;
 		}
-		static inline std::array<syscall_t, RISCV_SYSCALLS_MAX>
-			syscall_handlers = initialize_syscalls();
+		using syscall_table_t = std::array<syscall_t, RISCV_SYSCALLS_MAX>;
+		static inline syscall_table_t syscall_handlers = initialize_syscalls();
+		// The system call table used by this machine, which is the static
+		// table above unless another one is set. A custom table can give a
+		// group of machines their own policy, eg. by starting from a copy of
+		// syscall_handlers. It is not owned by the machine, and forks
+		// inherit it by reference.
+		const syscall_table_t& syscall_table() const noexcept { return *m_syscalls; }
+		void set_syscall_table(const syscall_table_t& table) noexcept { m_syscalls = &table; }
 		static inline void (*on_unhandled_syscall) (Machine&, int) = [] (Machine<W>& m, int num) {
 				auto txt = "Unhandled system call: " + std::to_string(num) + "\n"; m.debug_print(txt.c_str(), txt.size());
 			};
@@ -181,11 +199,22 @@ namespace riscv
 			= [] (Machine<W>&, int, int, int) {};
 
 		// Optional custom native-performance arena
-		const Arena& arena() const;
-		Arena& arena();
+		const Arena<W>& arena() const;
+		Arena<W>& arena();
 		void setup_native_heap(size_t sysnum, uint64_t addr, size_t size);
 		// Optional custom memory-related system calls
 		void setup_native_memory(size_t sysnum);
+		// Optional shared time page: the realtime and monotonic clocks in a
+		// read-only guest page, refreshed before each simulate(), every
+		// TIME_PAGE_INTERVAL instructions and by system call @sysnum, which
+		// returns its address. Guests can then read the time without a system
+		// call per timestamp. The page can never be made writable. Forks get
+		// their own page at the same address. After restoring a snapshot,
+		// set it up again.
+		void setup_native_time(size_t sysnum);
+		static constexpr uint64_t TIME_PAGE_INTERVAL = 100'000;
+		address_t time_page() const noexcept { return m_time_page_addr; }
+		void update_time_page() noexcept;
 
 		// System calls, files and threads implementations
 		bool has_file_descriptors() const noexcept { return m_fds != nullptr; }
@@ -200,11 +229,21 @@ namespace riscv
 		// Threads: Access to thread internal structures
 		const MultiThreading<W>& threads() const noexcept { return *m_mt; }
 		MultiThreading<W>& threads() noexcept { return *m_mt; }
+		bool has_threads() const noexcept { return m_mt != nullptr; }
 		int gettid() const;
 		// FileDescriptors: Access to translation between guest fds
 		// and real system fds. The destructor also closes all opened files.
 		const FileDescriptors& fds() const;
 		FileDescriptors& fds();
+#ifdef RISCV_IO_URING
+		// Asynchronous I/O: Guest reads, writes and accepts are submitted
+		// to a ring shared with other machines, instead of blocking.
+		void setup_io_uring(IoUring&);
+		bool has_async_io() const noexcept { return m_aio != nullptr; }
+		AsyncIO<W>& async_io() noexcept { return *m_aio; }
+#else
+		bool has_async_io() const noexcept { return false; }
+#endif
 		// Multiprocessing structure, lazily created
 		Multiprocessing<W>& smp();
 		// Signal structure, lazily created
@@ -222,31 +261,70 @@ namespace riscv
 		bool is_binary_translated() const { return memory.is_binary_translated(); }
 
 		// Serializes all the machine state + a tiny header to @vec
-		void serialize_to(std::vector<uint8_t>& vec);
+		// Zero pages are elided, and page data is optionally compressed.
+		void serialize_to(std::vector<uint8_t>& vec, const SerializeOptions& = {});
+		// Streams the serialized state to a file descriptor or sink, without
+		// building the snapshot in memory first. Returns 0 on success.
+		int serialize_to(int fd, const SerializeOptions& = {});
+		int serialize_to(serialize_sink_t sink, const SerializeOptions& = {});
 		// Returns the machine to a previously stored state
 		// NOTE: All previous memory traps are lost, syscall handlers,
 		// destructor callbacks are kept. Page fault handler and
-		// symbol lookup cache is also kept. Returns 0 on success.
+		// symbol lookup cache is also kept. Returns 0 on success, and
+		// on failure the machine is left unchanged.
 		int deserialize_from(const std::vector<uint8_t>&);
+		// Returns the machine to a state streamed from a file descriptor or source
+		int deserialize_from(int fd);
+		int deserialize_from(serialize_source_t source);
+		// Returns the machine to the state stored in a snapshot image file.
+		// The file is memory-mapped, and pages stored page-aligned (see
+		// SerializeOptions) become copy-on-write views of the mapping, so
+		// restoring costs only page table entries, and processes share the
+		// same physical memory through the page cache. Returns 0 on success.
+		int deserialize_mapped(const std::string& filename);
 
 	private:
 		static void unknown_syscall_handler(Machine<W>&);
 		template<typename... Args, std::size_t... indices>
 		auto resolve_args(std::index_sequence<indices...>) const;
 		void setup_native_heap_internal(const size_t);
+		void map_time_page();
+		void simulate_slices(uint64_t max_instructions);
+		// Counts the vmcall() and preempt() calls in progress, whose
+		// function must return on the guest thread it was called on
+		struct VMCallScope {
+			VMCallScope(Machine& m) : machine(m) { machine.m_vmcalls++; }
+			~VMCallScope() { machine.m_vmcalls--; }
+			Machine& machine;
+		};
+		void serialize_to(SerializeWriter&, const SerializeOptions&);
+		int deserialize_from(DeserializeReader&, std::shared_ptr<const uint8_t> image);
 		void timeout_exception(uint64_t);
 
 		uint64_t     m_counter = 0;
 		uint64_t     m_max_counter = 0;
+		unsigned     m_vmcalls = 0;
+		const syscall_table_t* m_syscalls = &syscall_handlers;
 		void*        m_userdata = nullptr;
 		printer_func m_printer = m_default_printer;
 		printer_func m_debug_printer = m_default_printer;
 		stdin_func   m_stdin = m_default_stdin;
-		std::unique_ptr<Arena> m_arena;
+		std::unique_ptr<Arena<W>> m_arena;
 		std::unique_ptr<MultiThreading<W>> m_mt;
 		std::unique_ptr<FileDescriptors> m_fds;
 		std::unique_ptr<Multiprocessing<W>> m_smp = nullptr;
 		std::unique_ptr<Signals<W>> m_signals = nullptr;
+		struct OutputBuffer {
+			std::string data;
+			size_t threshold;
+			bool   flush_on_stop;
+		};
+		std::unique_ptr<OutputBuffer> m_output = nullptr;
+		std::shared_ptr<PageData> m_time_page = nullptr;
+		address_t    m_time_page_addr = 0;
+#ifdef RISCV_IO_URING
+		std::unique_ptr<AsyncIO<W>> m_aio = nullptr;
+#endif
 		const unsigned m_multiprocessing_workers;
 		static_assert((W == 4 || W == 8 || W == 16), "Must be either 32-bit, 64-bit or 128-bit ISA");
 		static printer_func m_default_printer;
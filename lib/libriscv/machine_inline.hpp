@@ -12,7 +12,14 @@ template <int W>
 template <bool Throw>
 inline void Machine<W>::simulate(uint64_t max_instr)
 {
-	cpu.simulate(max_instr);
+	if (m_time_page != nullptr)
+		this->update_time_page();
+	if (m_time_page != nullptr || m_mt != nullptr)
+		this->simulate_slices(max_instr);
+	else
+		cpu.simulate(max_instr);
+	if (m_output != nullptr && m_output->flush_on_stop)
+		this->flush_output();
 	if constexpr (Throw) {
 		if (UNLIKELY(m_max_counter != 0))
 			timeout_exception(max_instr);
@@ -29,7 +36,40 @@ inline void Machine<W>::reset()
 template <int W>
 inline void Machine<W>::print(const char* buffer, size_t len) const
 {
-	this->m_printer(buffer, len);
+	if (LIKELY(m_output == nullptr)) {
+		this->m_printer(buffer, len);
+		return;
+	}
+	auto& output = *m_output;
+	if (output.data.size() + len > output.threshold) {
+		this->flush_output();
+		// Large writes skip the buffer
+		if (len >= output.threshold) {
+			this->m_printer(buffer, len);
+			return;
+		}
+	}
+	output.data.append(buffer, len);
+}
+template <int W>
+inline void Machine<W>::print_guest(address_t addr, size_t len) const
+{
+	if (m_output != nullptr && len < m_output->threshold) {
+		for (const auto span : memory.spans(addr, len))
+			this->print((const char *)span.data, span.size);
+		return;
+	}
+	this->flush_output();
+	for (const auto span : memory.spans(addr, len))
+		this->m_printer((const char *)span.data, span.size);
+}
+template <int W>
+inline void Machine<W>::flush_output() const
+{
+	if (m_output != nullptr && !m_output->data.empty()) {
+		this->m_printer(m_output->data.data(), m_output->data.size());
+		m_output->data.clear();
+	}
 }
 template <int W>
 inline long Machine<W>::stdin_read(char* buffer, size_t len) const
@@ -57,13 +97,13 @@ void Machine<W>::install_syscall_handlers(std::initializer_list<std::pair<size_t
 template <int W>
 inline void Machine<W>::system_call(size_t sysnum)
 {
-	const auto& handler = Machine::syscall_handlers.at(sysnum);
+	const auto& handler = m_syscalls->at(sysnum);
 	handler(*this);
 }
 template <int W>
 inline void Machine<W>::unchecked_system_call(size_t syscall_number)
 {
-	const auto& handler = Machine::syscall_handlers[syscall_number];
+	const auto& handler = (*m_syscalls)[syscall_number];
 	handler(*this);
 }
 
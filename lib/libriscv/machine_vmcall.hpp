@@ -34,7 +34,8 @@ inline address_type<W> Machine<W>::vmcall(address_t call_addr, Args&&... args)
 	this->cpu.reset_stack_pointer();
 	// setup calling convention
 	this->setup_call(call_addr, std::forward<Args>(args)...);
-	// execute function
+	// execute function, without switching threads
+	VMCallScope scope { *this };
 	if (MAXI != 0)
 		this->simulate<Throw>(MAXI);
 	else
@@ -65,7 +66,8 @@ address_type<W> Machine<W>::preempt(address_t call_addr, Args&&... args)
 	// setup calling convention
 	this->setup_call(call_addr, std::forward<Args>(args)...);
 	this->realign_stack();
-	// execute function
+	// execute function, without switching threads
+	VMCallScope scope { *this };
 	try {
 		if (MAXI != 0)
 			this->simulate<Throw>(MAXI);
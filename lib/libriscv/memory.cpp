@@ -2,6 +2,7 @@
 
 #include "machine.hpp"
 #include "decoder_cache.hpp"
+#include "page_store.hpp"
 #include <stdexcept>
 #ifdef RISCV_BINARY_TRANSLATION
 #include <dlfcn.h> // Linux-only
@@ -40,6 +41,8 @@ namespace riscv
 		} else {
 			throw MachineException(OUT_OF_MEMORY, "Max memory was zero", 0);
 		}
+		this->m_deduplicate = options.deduplicate_pages;
+		this->m_memory_max = options.memory_max;
 		if (!m_binary.empty()) {
 			// Add a zero-page at the start of address space
 			this->initial_paging();
@@ -66,9 +69,6 @@ namespace riscv
 			m_ropages.pages.release();
 		}
 #endif
-#ifdef RISCV_INSTR_CACHE
-		delete[] m_decoder_cache;
-#endif
 #ifdef RISCV_BINARY_TRANSLATION
 		if (m_bintr_dl)
 			dlclose(m_bintr_dl);
@@ -85,7 +85,10 @@ namespace riscv
 	template <int W>
 	void Memory<W>::clear_all_pages()
 	{
+		for (const auto& it : m_pages)
+			this->release_shared_pagedata(it.second);
 		this->m_pages.clear();
+		this->m_host_mappings.clear();
 		this->m_rd_cache = {};
 		this->m_wr_cache = {};
 	}
@@ -100,25 +103,27 @@ namespace riscv
 	}
 
 	template <int W>
-	void Memory<W>::binary_load_ph(const MachineOptions<W>& options, const Phdr* hdr)
+	void Memory<W>::binary_load_ph(const MachineOptions<W>& options,
+		std::string_view binary, const Phdr* hdr, const address_t bias)
 	{
-		const auto*  src = m_binary.data() + hdr->p_offset;
+		const auto*  src = binary.data() + hdr->p_offset;
 		const size_t len = hdr->p_filesz;
-		if (m_binary.size() <= hdr->p_offset ||
+		const address_t vaddr = hdr->p_vaddr + bias;
+		if (binary.size() <= hdr->p_offset ||
 			hdr->p_offset + len < hdr->p_offset)
 		{
 			throw std::runtime_error("Bogus ELF program segment offset");
 		}
-		if (m_binary.size() < hdr->p_offset + len) {
+		if (binary.size() < hdr->p_offset + len) {
 			throw std::runtime_error("Not enough room for ELF program segment");
 		}
-		if (hdr->p_vaddr + len < hdr->p_vaddr) {
+		if (vaddr + len < vaddr || vaddr < hdr->p_vaddr) {
 			throw std::runtime_error("Bogus ELF segment virtual base");
 		}
 
 		if (options.verbose_loader) {
 		printf("* Loading program of size %zu from %p to virtual %p\n",
-				len, src, (void*) (uintptr_t) hdr->p_vaddr);
+				len, src, (void*) (uintptr_t) vaddr);
 		}
 		// segment permissions
 		const PageAttributes attr {
@@ -131,65 +136,13 @@ namespace riscv
 				attr.read, attr.write, attr.exec);
 		}
 
-		if (attr.exec && machine().cpu.exec_seg_data() == nullptr)
+		if (attr.exec)
 		{
-			constexpr address_t PMASK = Page::size()-1;
-			const address_t pbase = (hdr->p_vaddr - 0x4) & ~(address_t) PMASK;
-			const size_t prelen  = hdr->p_vaddr - pbase;
-			// The first 4 bytes is instruction alignment
-			// The middle 4 bytes is the STOP instruction
-			// The last 8 bytes is a relative jump (JR -4)
-			const size_t midlen  = len + prelen + 12;
-			const size_t plen =
-				(PMASK & midlen) ? ((midlen + Page::size()) & ~PMASK) : midlen;
-			const size_t postlen = plen - midlen;
-			//printf("Addr 0x%X Len %zx becomes 0x%X->0x%X PRE %zx MIDDLE %zu POST %zu TOTAL %zu\n",
-			//	hdr->p_vaddr, len, pbase, pbase + plen, prelen, len, postlen, plen);
-			if (UNLIKELY(prelen > plen || prelen + len > plen)) {
-				throw std::runtime_error("Segment virtual base was bogus");
-			}
-			// Create the whole executable memory range
-			m_exec_pagedata.reset(new uint8_t[plen]);
-			m_exec_pagedata_size = plen;
-			m_exec_pagedata_base = pbase;
-			std::memset(&m_exec_pagedata[0],      0,   prelen);
-			std::memcpy(&m_exec_pagedata[prelen], src, len);
-			std::memset(&m_exec_pagedata[prelen + len], 0,   postlen);
-
-			// Create a STOP instruction at the end of execute area
-			// It is used by vmcall and preempt to stop after a function call
-			address_t exit_lenalign = address_t(len + 0x3) & ~address_t(0x3);
-			this->m_exit_address = hdr->p_vaddr + exit_lenalign;
-			struct {
-				// STOP
-				const uint32_t stop_instr = 0x7ff00073;
-				// JMP -4 (jump back to STOP)
-				const uint32_t jr4_instr = 0xffdff06f;
-			} instrdata;
-			std::memcpy(&m_exec_pagedata[prelen + exit_lenalign], &instrdata, sizeof(instrdata));
-
-			// This is what the CPU instruction fetcher will use
-			// 0...len: The regular execute segment
-			// len..+ 4: The STOP function
-			auto* exec_offset = m_exec_pagedata.get() - pbase;
-			machine().cpu.initialize_exec_segs(exec_offset, hdr->p_vaddr, len + 4);
-#if defined(RISCV_INSTR_CACHE)
-			// + 8: A jump instruction that prevents crashes if someone
-			// resumes the emulator after a STOP happened. It also helps
-			// the debugger by not causing an exception, and will instead
-			// loop back to the STOP instruction.
-			// The instruction must be a part of the decoder cache.
-			this->generate_decoder_cache(options, pbase, hdr->p_vaddr, len + 8);
-#endif
-			(void) options;
+			// Every executable segment gets its own decoder cache
+			this->create_execute_segment(options, src, vaddr, len);
 			// Nothing more to do here, if execute-only
 			if (!attr.read)
 				return;
-		} else if (attr.exec) {
-#ifdef RISCV_INSTR_CACHE
-			throw std::runtime_error(
-				"Binary can not have more than one executable segment!");
-#endif
 		}
 		// We would normally never allow this
 		if (attr.exec && attr.write) {
@@ -199,25 +152,96 @@ namespace riscv
 			}
 		}
 
+		// Only the program itself can be paged in lazily
+		if (options.map_segments && options.protect_segments && binary.data() == m_binary.data()) {
+			if (this->map_segment(hdr, vaddr, attr))
+				return;
+		}
+
 #ifdef RISCV_RODATA_SEGMENT_IS_SHARED
 		if (attr.read && !attr.write && m_ropages.end == 0) {
-			serialize_pages(m_ropages, hdr->p_vaddr, src, len, attr);
+			serialize_pages(m_ropages, vaddr, src, len, attr);
+			if (options.deduplicate_pages) {
+				for (size_t i = 0; i < m_ropages.end - m_ropages.begin; i++) {
+					auto& page = m_ropages.pages[i];
+					auto* data = this->shared_pagedata(page.page());
+					page.m_page.release();
+					page.m_page.reset(data);
+				}
+				m_ropages.data = nullptr;
+			}
 			return;
 		}
 #endif
 
 		// Load into virtual memory
-		this->memcpy(hdr->p_vaddr, src, len);
+		this->memcpy(vaddr, src, len);
 
 		if (options.protect_segments) {
-			this->set_page_attr(hdr->p_vaddr, len, attr);
+			this->set_page_attr(vaddr, len, attr);
 		}
 		else {
 			// this might help execute simplistic barebones programs
-			this->set_page_attr(hdr->p_vaddr, len, {
+			this->set_page_attr(vaddr, len, {
 				 .read = true, .write = true, .exec = true
 			});
 		}
+		if (options.deduplicate_pages) {
+			this->deduplicate_pages(vaddr, len);
+		}
+	}
+
+	template <int W>
+	PageData* Memory<W>::shared_pagedata(const PageData& data)
+	{
+		auto shared = SharedPages::get(data);
+		auto* pagedata = const_cast<PageData*> (shared.get());
+		m_shared_pages.emplace(pagedata, std::move(shared));
+		return pagedata;
+	}
+
+	// Each page sharing the data holds one of its references, which is
+	// dropped when the page is freed or replaced
+	template <int W>
+	void Memory<W>::release_shared_pagedata(const Page& page)
+	{
+		if (m_shared_pages.empty() || !page.has_data())
+			return;
+		auto it = m_shared_pages.find(&page.page());
+		if (it != m_shared_pages.end())
+			m_shared_pages.erase(it);
+	}
+
+	template <int W>
+	bool Memory<W>::is_shared_backed(const Page& page) const noexcept
+	{
+		return !m_shared_pages.empty() && page.has_data()
+			&& m_shared_pages.count(&page.page()) != 0;
+	}
+
+	template <int W>
+	void Memory<W>::deduplicate_pages(address_t dst, size_t len)
+	{
+		const address_t end = page_number(dst + len + Page::size() - 1);
+		for (address_t pageno = page_number(dst); pageno < end; pageno++)
+		{
+			auto it = m_pages.find(pageno);
+			if (it == m_pages.end())
+				continue;
+			auto& page = it->second;
+			// Only owned pages, and not pages with traps or cached guest code
+			if (page.attr.non_owning || !page.has_data() || page.has_trap()
+				|| is_dynamic_page(pageno))
+				continue;
+			auto* data = this->shared_pagedata(page.page());
+			if (page.attr.write) {
+				page.attr.write  = false;
+				page.attr.is_cow = true;
+			}
+			page.m_page.reset(data);
+			page.attr.non_owning = true;
+		}
+		this->invalidate_reset_cache();
 	}
 
 	template <int W>
@@ -269,25 +293,67 @@ namespace riscv
 #endif
 	}
 
-	// ELF32 and ELF64 loader
 	template <int W>
-	void Memory<W>::binary_loader(const MachineOptions<W>& options)
+	bool Memory<W>::map_segment(const Phdr* hdr, const address_t vaddr, PageAttributes attr)
 	{
-		if (UNLIKELY(m_binary.size() < sizeof(Ehdr))) {
+		constexpr address_t PMASK = Page::size()-1;
+		const size_t len = hdr->p_filesz;
+		// Pages can only be taken from the binary when the segment
+		// has the same offset within a page in the file and in memory
+		if ((vaddr & PMASK) != (hdr->p_offset & PMASK))
+			return false;
+		// The first and last page may be shared with other segments,
+		// or contain zero-initialized data, so only whole pages are mapped
+		const address_t begin = (vaddr + PMASK) & ~PMASK;
+		const address_t end   = (vaddr + len) & ~PMASK;
+		if (begin >= end)
+			return false;
+
+		const auto* src = m_binary.data() + hdr->p_offset;
+		if (vaddr < begin) {
+			this->memcpy(vaddr, src, begin - vaddr);
+			this->set_page_attr(vaddr, begin - vaddr, attr);
+		}
+		if (end < vaddr + len) {
+			this->memcpy(end, &src[end - vaddr], vaddr + len - end);
+			this->set_page_attr(end, vaddr + len - end, attr);
+		}
+		m_mapped.push_back({
+			.begin  = page_number(begin),
+			.end    = page_number(end),
+			.offset = size_t(hdr->p_offset + (begin - vaddr)),
+			.attr   = attr
+		});
+		return true;
+	}
+
+	template <int W>
+	const typename Memory<W>::Ehdr* Memory<W>::elf_validate(std::string_view binary) const
+	{
+		if (UNLIKELY(binary.size() < sizeof(Ehdr))) {
 			throw std::runtime_error("ELF program too short");
 		}
-		const auto* elf = (Ehdr*) m_binary.data();
+		const auto* elf = (Ehdr*) binary.data();
 		if (UNLIKELY(!validate_header<Ehdr> (elf))) {
 			throw std::runtime_error("Invalid ELF header! Mixup between 32- and 64-bit?");
 		}
-		if (UNLIKELY(elf->e_type != ET_EXEC)) {
-			throw std::runtime_error("ELF program is not an executable type. Trying to load a dynamic library?");
+		if (UNLIKELY(elf->e_type != ET_EXEC && elf->e_type != ET_DYN)) {
+			throw std::runtime_error("ELF program is not an executable type");
+		}
+		// Shared libraries are ET_DYN too, but they have no entry point
+		if (UNLIKELY(elf->e_entry == 0)) {
+			throw std::runtime_error("ELF program has no entry point. Trying to load a dynamic library?");
 		}
 		if (UNLIKELY(elf->e_machine != EM_RISCV)) {
 			throw std::runtime_error("ELF program is not a RISC-V executable. Wrong architecture.");
 		}
+		return elf;
+	}
 
-		// enumerate & load loadable segments
+	template <int W>
+	const typename Memory<W>::Phdr* Memory<W>::elf_program_headers(
+		std::string_view binary, const Ehdr* elf) const
+	{
 		const auto program_headers = elf->e_phnum;
 		if (UNLIKELY(program_headers <= 0)) {
 			throw std::runtime_error("ELF with no program-headers");
@@ -298,16 +364,11 @@ namespace riscv
 		if (UNLIKELY(elf->e_phoff > 0x4000)) {
 			throw std::runtime_error("ELF program-headers have bogus offset");
 		}
-		if (UNLIKELY(elf->e_phoff + program_headers * sizeof(Phdr) > m_binary.size())) {
+		if (UNLIKELY(elf->e_phoff + program_headers * sizeof(Phdr) > binary.size())) {
 			throw std::runtime_error("ELF program-headers are outside the binary");
 		}
 
-		const auto* phdr = (Phdr*) (m_binary.data() + elf->e_phoff);
-		const auto program_begin = phdr->p_vaddr;
-		this->m_start_address = elf->e_entry;
-		this->m_stack_address = program_begin;
-
-		int seg = 0;
+		const auto* phdr = (Phdr*) (binary.data() + elf->e_phoff);
 		for (const auto* hdr = phdr; hdr < phdr + program_headers; hdr++)
 		{
 			// Detect overlapping segments
@@ -320,45 +381,107 @@ namespace riscv
 					throw std::runtime_error("Overlapping ELF segments");
 				}
 			}
+		}
+		return phdr;
+	}
 
+	// ELF32 and ELF64 loader
+	template <int W>
+	void Memory<W>::binary_loader(const MachineOptions<W>& options)
+	{
+		const auto* elf = elf_validate(m_binary);
+		const auto* phdr = elf_program_headers(m_binary, elf);
+		// Position-independent programs are loaded at a fixed base
+		const address_t bias = (elf->e_type == ET_DYN) ? DYLINK_BASE : 0;
+		const auto program_begin = phdr->p_vaddr + bias;
+		this->m_elf_base = bias;
+		this->m_start_address = elf->e_entry + bias;
+		this->m_program_entry = this->m_start_address;
+		this->m_stack_address = program_begin;
+
+		bool needs_interpreter = false;
+		for (const auto* hdr = phdr; hdr < phdr + elf->e_phnum; hdr++)
+		{
 			switch (hdr->p_type)
 			{
 				case PT_LOAD:
 					// loadable program segments
 					if (options.load_program) {
-						binary_load_ph(options, hdr);
+						binary_load_ph(options, m_binary, hdr, bias);
 					}
-					seg++;
+					break;
+				case PT_INTERP:
+					// dynamically linked programs start in the interpreter
+					needs_interpreter = true;
 					break;
 				case PT_GNU_STACK:
 					// This seems to be a mark for executable stack. Big NO!
 					break;
 				case PT_GNU_RELRO:
-					//throw std::runtime_error(
-					//	"Dynamically linked ELF binaries are not supported");
 					break;
 			}
 		}
 		// It's very easy for the stack address to wrap around during
 		// setup if we allow it to start this low. Instead, we set it
-		// to the end of the address space.
-		if (this->m_stack_address <= 0x20000) {
+		// to the end of the address space. Position-independent programs
+		// have no room for a stack below them either.
+		if (this->m_stack_address <= 0x20000 || bias != 0) {
 			this->m_stack_address = ~(address_t)0 - 0xFFF;
 		}
 
-
-		//this->relocate_section(".rela.dyn", ".symtab");
+		if (needs_interpreter) {
+			if (options.interpreter.empty()) {
+				throw std::runtime_error("ELF program is dynamically linked, but there is no interpreter");
+			}
+			if (options.load_program) {
+				this->interpreter_loader(options);
+			}
+		}
 
 		if (options.verbose_loader) {
 		printf("* Entry is at %p\n", (void*) (uintptr_t) this->start_address());
 		}
 	}
 
+	template <int W>
+	void Memory<W>::interpreter_loader(const MachineOptions<W>& options)
+	{
+		const auto interp = options.interpreter;
+		const auto* elf = elf_validate(interp);
+		if (UNLIKELY(elf->e_type != ET_DYN)) {
+			throw std::runtime_error("ELF interpreter is not position-independent");
+		}
+		const auto* phdr = elf_program_headers(interp, elf);
+
+		// The interpreter is placed at the start of the mmap area
+		constexpr address_t PMASK = Page::size()-1;
+		const address_t bias = (m_mmap_address + PMASK) & ~PMASK;
+		address_t end = bias;
+		for (const auto* hdr = phdr; hdr < phdr + elf->e_phnum; hdr++)
+		{
+			if (hdr->p_type == PT_LOAD) {
+				binary_load_ph(options, interp, hdr, bias);
+				end = std::max(end, address_t(bias + hdr->p_vaddr + hdr->p_memsz));
+			}
+		}
+		this->m_mmap_address = (end + PMASK) & ~PMASK;
+		this->m_interp_base = bias;
+		// The interpreter will jump to the program entry when done
+		this->m_start_address = elf->e_entry + bias;
+
+		if (options.verbose_loader) {
+		printf("* Interpreter is at %p, entry at %p\n",
+			(void*) (uintptr_t) bias, (void*) (uintptr_t) this->start_address());
+		}
+	}
+
 	template <int W>
 	void Memory<W>::machine_loader(
 		const Machine<W>& master, const MachineOptions<W>&)
 	{
 		this->m_page_fault_handler = master.memory.m_page_fault_handler;
+		// loaned pages from host mappings keep them alive in the fork too
+		this->m_host_mappings = master.memory.m_host_mappings;
 
 		// Hardly any pages are dont_fork, so we estimate that
 		// all master pages will be loaned.
@@ -370,7 +493,9 @@ namespace riscv
 			if (page.attr.dont_fork) continue;
 			// Make every page non-owning
 			auto attr = page.attr;
-			if (attr.write) {
+			// pages of cached guest JIT code may be temporarily read-only
+			auto dp = master.memory.m_dynamic_pages.find(it.first);
+			if (attr.write || (dp != master.memory.m_dynamic_pages.end() && dp->second)) {
 				attr.write = false;
 				attr.is_cow = true;
 			}
@@ -381,16 +506,24 @@ namespace riscv
 			);
 		}
 		this->m_start_address = master.memory.m_start_address;
+		this->m_program_entry = master.memory.m_program_entry;
+		this->m_elf_base      = master.memory.m_elf_base;
+		this->m_interp_base   = master.memory.m_interp_base;
 		this->m_stack_address = master.memory.m_stack_address;
 		this->m_exit_address = master.memory.m_exit_address;
 		this->m_mmap_address = master.memory.m_mmap_address;
-
-		// base address, size and PC-relative data pointer for instructions
-		this->m_exec_pagedata_base = master.memory.m_exec_pagedata_base;
-		this->m_exec_pagedata_size = master.memory.m_exec_pagedata_size;
-#ifdef RISCV_INSTR_CACHE
-		this->m_exec_decoder = master.memory.m_exec_decoder;
-#endif
+		// forks share the binary, and so also the mapped segments
+		this->m_mapped = master.memory.m_mapped;
+		this->m_deduplicate = master.memory.m_deduplicate;
+		this->m_memory_max = master.memory.m_memory_max;
+
+		// execute segments and their decoder caches are immutable
+		this->m_exec = master.memory.m_exec;
+		// as is cached guest JIT code, which copy-on-write invalidates
+		this->m_dynamic_exec = master.memory.m_dynamic_exec;
+		this->m_dynamic_retired = master.memory.m_dynamic_retired;
+		for (const auto& it : master.memory.m_dynamic_pages)
+			this->m_dynamic_pages.emplace(it.first, false);
 
 #ifdef RISCV_RODATA_SEGMENT_IS_SHARED
 		this->m_ropages.begin = master.memory.m_ropages.begin;
@@ -519,14 +652,19 @@ namespace riscv
 		const size_t symtab_ents = sym_hdr->sh_size / sizeof(typename Elf<W>::Sym);
 		const char* strtab = elf_offset<char>(str_hdr->sh_offset);
 
+		// symbols are relative to the load bias
+		const address_t base = this->m_elf_base;
+		if (address < base) return {};
+		address -= base;
+
 		const auto result =
-			[] (const char* strtab, address_t addr, const auto* sym)
+			[base] (const char* strtab, address_t addr, const auto* sym)
 		{
 			const char* symname = &strtab[sym->st_name];
 			char* dma = __cxa_demangle(symname, nullptr, nullptr, nullptr);
 			return Callsite {
 				.name = (dma) ? dma : symname,
-				.address = sym->st_value,
+				.address = address_t(sym->st_value + base),
 				.offset = (uint32_t) (addr - sym->st_value),
 				.size   = sym->st_size
 			};
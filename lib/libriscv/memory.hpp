@@ -1,19 +1,21 @@
 #pragma once
 #include "elf.hpp"
 #include "page.hpp"
+#include "decoded_exec_segment.hpp"
 #include <cassert>
 #include <cstring>
 #ifdef RISCV_USE_RH_HASH
 #include <robin_hood.h>
 #endif
 #include <map>
+#include <unordered_map>
 #include "util/buffer.hpp" // <string>
+#include "util/memspan.hpp"
 
 namespace riscv
 {
 	template<int W> struct Machine;
-	template<int W> struct DecoderCache;
-	template<int W> struct DecoderData;
+	template<int W, bool Writable> struct MemorySpans;
 	struct vBuffer { char* ptr; size_t len; };
 
 	template<int W>
@@ -26,6 +28,7 @@ namespace riscv
 		using page_write_cb_t = std::function<void(Memory&, address_t, Page&)>;
 		static constexpr address_t BRK_MAX    = 0x1000000;
 		static constexpr address_t HEAP_START = 0x40000000;
+		static constexpr address_t DYLINK_BASE = 0x40000;
 
 		template <typename T>
 		T read(address_t src);
@@ -37,6 +40,9 @@ namespace riscv
 		void write(address_t dst, T value);
 
 		void memset(address_t dst, uint8_t value, size_t len);
+		// Zeroes memory without allocating: whole pages become the shared CoW
+		// zero page, keeping their attributes, and only the edges are written
+		void memzero(address_t dst, size_t len);
 		void memcpy(address_t dst, const void* src, size_t);
 		void memcpy(address_t dst, Machine<W>& srcm, address_t src, address_t len);
 		void memcpy_out(void* dst, address_t src, size_t) const;
@@ -45,24 +51,37 @@ namespace riscv
 		   Throws an exception if there was a protection violation.
 		   Returns the number of buffers filled, or an exception if not enough. */
 		size_t gather_buffers_from_range(size_t cnt, vBuffer[], address_t addr, size_t len);
+		/* Same as above, for writing into guest memory, eg. when reading from a
+		   file. Pages are made writable, and copy-on-write pages are copied. */
+		size_t gather_writable_buffers_from_range(size_t cnt, vBuffer[], address_t addr, size_t len);
+		// Iterable chunk-wise views of the data at address, split at page
+		// boundaries, with page protections checked (see memory_spans.hpp)
+		MemorySpans<W, false> spans(address_t addr, size_t len) const;
+		MemorySpans<W, true>  writable_spans(address_t addr, size_t len);
 		// Gives a chunk-wise view of the data at address, with a callback
 		// invocation at each page boundary. @offs is the current byte offset.
-		void foreach(address_t addr, size_t len,
-			std::function<void(Memory&, address_t offs, const uint8_t*, size_t)> callback);
-		void foreach(address_t addr, size_t len,
-			std::function<void(const Memory&, address_t offs, const uint8_t*, size_t)>) const;
+		// callback(Memory&, address_t offs, const uint8_t* data, size_t len)
+		template <typename Callback>
+		void foreach(address_t addr, size_t len, Callback&& callback);
+		template <typename Callback>
+		void foreach(address_t addr, size_t len, Callback&& callback) const;
 		// Gives a sequential view of the data at address, with the possibility
 		// of optimizing away a copy if the data crosses no page-boundaries.
-		void memview(address_t addr, size_t len,
-			std::function<void(Memory&, const uint8_t*, size_t)> callback);
-		void memview(address_t addr, size_t len,
-			std::function<void(const Memory&, const uint8_t*, size_t)> callback) const;
+		// callback(Memory&, const uint8_t* data, size_t len)
+		template <typename Callback>
+		void memview(address_t addr, size_t len, Callback&& callback);
+		template <typename Callback>
+		void memview(address_t addr, size_t len, Callback&& callback) const;
 		// Gives const-ref access to pod-type T viewed as sequential memory. (See above)
-		template <typename T>
-		void memview(address_t addr, std::function<void(const T&)> callback) const;
+		template <typename T, typename Callback>
+		void memview(address_t addr, Callback&& callback) const;
 		// Compare bounded memory
 		int memcmp(address_t p1, address_t p2, size_t len) const;
 		int memcmp(const void* p1, address_t p2, size_t len) const;
+		// Compare zero-terminated strings, reading at most @maxlen bytes
+		int strncmp(address_t p1, address_t p2, size_t maxlen) const;
+		// Address of the first @value in bounded memory, or 0 if not found
+		address_t memchr(address_t addr, uint8_t value, size_t len) const;
 		// Gather fragmented virtual memory into an array of buffers
 		riscv::Buffer rvbuffer(address_t addr, size_t len, size_t maxlen = 1 << 24) const;
 		// Read a zero-terminated string directly from guests memory
@@ -70,6 +89,13 @@ namespace riscv
 		size_t strlen(address_t addr, size_t maxlen = 4096) const;
 
 		address_t start_address() const noexcept { return this->m_start_address; }
+		// The entry point of the program, which is different from
+		// the start address when there is an ELF interpreter
+		address_t program_entry() const noexcept { return this->m_program_entry; }
+		// Load bias of the program, non-zero for position-independent programs
+		address_t elf_base() const noexcept { return this->m_elf_base; }
+		// Load bias of the ELF interpreter, or zero when there is none
+		address_t interpreter_base() const noexcept { return this->m_interp_base; }
 		address_t stack_initial() const noexcept { return this->m_stack_address; }
 		void set_stack_initial(address_t addr) { this->m_stack_address = addr; }
 		address_t exit_address() const noexcept;
@@ -96,6 +122,9 @@ namespace riscv
 		// Helpers for memory usage
 		size_t pages_active() const noexcept { return m_pages.size(); }
 		size_t owned_pages_active() const noexcept;
+		size_t mapped_segments() const noexcept { return m_mapped.size(); }
+		// The memory_max of the machine options, also inherited by forks
+		uint64_t memory_max() const noexcept { return m_memory_max; }
 		// Page handling
 		const auto& pages() const noexcept { return m_pages; }
 		auto& pages() noexcept { return m_pages; }
@@ -134,13 +163,51 @@ namespace riscv
 		// create pages for non-owned (shared) memory with given attributes
 		void insert_non_owned_memory(
 			address_t dst, void* src, size_t size, PageAttributes = {});
+		// How guest writes reach host memory after the pages are re-protected
+		enum HostWrites : uint8_t {
+			HOST_WRITES_COW,    // private copies, eg. private file mappings
+			HOST_WRITES_SHARED, // in place, eg. writable shared file mappings
+			HOST_WRITES_NEVER,  // the pages can never be made writable
+		};
+		// same as above, and @backing is kept alive for as long as any of the
+		// pages are mapped, eg. a host mmap of a file. Forks share the backing.
+		void insert_non_owned_memory(address_t dst, void* src, size_t size,
+			PageAttributes, std::shared_ptr<void> backing,
+			HostWrites writes = HOST_WRITES_COW);
+		size_t host_mappings() const noexcept { return m_host_mappings.size(); }
+		// replace owned pages with identical pages shared with other machines,
+		// through the process-wide page store. Writable pages become CoW.
+		void deduplicate_pages(address_t dst, size_t size);
+
+		// Returns true if the address is inside an executable code segment
+		bool is_executable(address_t addr) const noexcept;
+
+		// Creates an executable segment from a copy of @data, with its own
+		// decoder cache. Identical segments are shared between machines
+		// when the decoder cache is pregenerated (RISCV_INSTR_CACHE_PREGEN).
+		DecodedExecuteSegment<W>& create_execute_segment(const MachineOptions<W>&,
+			const void* data, address_t vaddr, size_t len);
+		// Returns the executable segment containing @vaddr, or nullptr
+		const DecodedExecuteSegment<W>* exec_segment_for(address_t vaddr) const noexcept;
+		const auto& execute_segments() const noexcept { return m_exec; }
 
-		// Returns true if the address is inside the executable code segment
-		bool is_executable(address_t addr);
+		// Executable pages outside of the ELF segments, eg. guest JIT code,
+		// get decoder-cached segments on demand. The pages are write-protected,
+		// and writing to them (or FENCE.I) invalidates the segments again.
+		const DecodedExecuteSegment<W>* create_dynamic_segment(address_t vaddr);
+		void invalidate_dynamic_segments(address_t begin_pageno, address_t end_pageno);
+		void invalidate_dynamic_segments() { invalidate_dynamic_segments(0, ~address_t(0)); }
+		size_t dynamic_segments() const noexcept { return m_dynamic_exec.size(); }
+		static constexpr address_t DYNAMIC_SEGMENT_PAGES = 256;
+		// Pages invalidated this many times are no longer cached
+		static constexpr unsigned DYNAMIC_WRITES_MAX = 16;
 
 #ifdef RISCV_INSTR_CACHE
-		void generate_decoder_cache(const MachineOptions<W>&, address_t pbase, address_t va, size_t len);
-		auto* get_decoder_cache() const { return m_exec_decoder; }
+		void generate_decoder_cache(const MachineOptions<W>&, DecodedExecuteSegment<W>&);
+		// The decoder cache of the main (first) execute segment
+		DecoderData<W>* get_decoder_cache() const {
+			return m_exec.empty() ? nullptr : m_exec.front()->decoder_cache();
+		}
 #endif
 
 		const auto& binary() const noexcept { return m_binary; }
@@ -149,10 +216,22 @@ namespace riscv
 		bool is_binary_translated() const { return m_bintr_dl != nullptr; }
 		void set_binary_translated(void* dl) const { m_bintr_dl = dl; }
 
-		// serializes all the machine state + a tiny header to @vec
-		void serialize_to(std::vector<uint8_t>& vec);
-		// returns the machine to a previously stored state
-		void deserialize_from(const std::vector<uint8_t>&, const SerializedMachine<W>&);
+		// serializes all pages as runs, returning the number of pages
+		size_t serialize_to(SerializeWriter&, const SerializeOptions&) const;
+		// the number of pages that serialize_to() stores
+		size_t serialized_page_count() const;
+		// stored memory is read in full before it replaces the current
+		// memory, so that a failed restore leaves the machine unchanged
+		struct Snapshot;
+		// reads the stored pages into @snapshot, or returns negative on error
+		// when @image is set, page-aligned data is shared directly from it
+		int deserialize_from(DeserializeReader&, const SerializedMachine<W>&,
+			std::shared_ptr<const uint8_t> image, Snapshot&) const;
+		// mapped segments are stored as binary offsets, to be re-mapped
+		void serialize_segments(std::vector<uint8_t>&) const;
+		int deserialize_segments(const uint8_t*, size_t, Snapshot&) const;
+		// returns the memory to a previously read snapshot
+		void restore_from(const SerializedMachine<W>&, Snapshot&&);
 
 		Memory(Machine<W>&, std::string_view, MachineOptions<W>);
 		Memory(Machine<W>&, const Machine<W>&, MachineOptions<W>);
@@ -165,19 +244,40 @@ namespace riscv
 			std::unique_ptr<uint8_t[]> data = nullptr;
 			bool contains(address_t pg) const noexcept { return pg >= begin && pg < end; }
 		};
+		struct MappedSegment {
+			address_t begin = 0;
+			address_t end = 0;
+			size_t offset = 0; // binary offset of the first page
+			PageAttributes attr;
+			bool contains(address_t pg) const noexcept { return pg >= begin && pg < end; }
+		};
 		inline auto& create_attr(const address_t address);
 		void clear_all_pages();
+		bool is_image_backed(const Page&) const noexcept;
+		bool is_serialized(address_t pageno, const Page&) const noexcept;
+		bool is_shared_backed(const Page&) const noexcept;
+		const Page* install_mapped_page(address_t pageno) const;
+		void unmap_segments(address_t begin, address_t end);
+		void unmap_host_mappings(address_t begin, address_t end);
+		bool is_host_mapped(address_t pageno) const noexcept;
+		HostWrites host_writes(address_t pageno) const noexcept;
+		void set_shared_page_attr(address_t pageno, Page&, PageAttributes);
 		void initial_paging();
+		std::shared_ptr<DecodedExecuteSegment<W>> allocate_execute_segment(
+			const uint8_t* data, address_t vaddr, size_t len, size_t exec_len);
+		void install_execute_segment(std::shared_ptr<DecodedExecuteSegment<W>>, address_t exit_address);
+		bool is_dynamic_page(address_t pageno) const noexcept;
+		PageData* shared_pagedata(const PageData&);
+		void release_shared_pagedata(const Page&);
+		void copy_on_write(address_t pageno, Page&);
 		[[noreturn]] static void protection_fault(address_t);
 		const PageData& cached_readable_page(address_t, size_t) const;
 		PageData& cached_writable_page(address_t);
 		// Helpers
-		template <typename T>
-		static void foreach_helper(T& mem, address_t addr, size_t len,
-			std::function<void(T&, address_t, const uint8_t*, size_t)> callback);
-		template <typename T>
-		static void memview_helper(T& mem, address_t addr, size_t len,
-			std::function<void(T&, const uint8_t*, size_t)> callback);
+		template <typename T, typename Callback>
+		static void foreach_helper(T& mem, address_t addr, size_t len, Callback&& callback);
+		template <typename T, typename Callback>
+		static void memview_helper(T& mem, address_t addr, size_t len, Callback&& callback);
 		// ELF stuff
 		using Ehdr = typename Elf<W>::Ehdr;
 		using Phdr = typename Elf<W>::Phdr;
@@ -197,9 +297,13 @@ namespace riscv
 			return &symtab[symidx];
 		}
 		// ELF loader
+		const Ehdr* elf_validate(std::string_view binary) const;
+		const Phdr* elf_program_headers(std::string_view binary, const Ehdr*) const;
 		void binary_loader(const MachineOptions<W>&);
-		void binary_load_ph(const MachineOptions<W>&, const Phdr*);
+		void interpreter_loader(const MachineOptions<W>&);
+		void binary_load_ph(const MachineOptions<W>&, std::string_view binary, const Phdr*, address_t bias);
 		void serialize_pages(MemoryArea&, address_t, const char*, size_t, PageAttributes);
+		bool map_segment(const Phdr*, address_t vaddr, PageAttributes);
 		// Machine copy-on-write fork
 		void machine_loader(const Machine<W>&, const MachineOptions<W>&);
 
@@ -221,8 +325,28 @@ namespace riscv
 #ifdef RISCV_RODATA_SEGMENT_IS_SHARED
 		MemoryArea m_ropages;
 #endif
+		// segments that are paged in lazily from the binary
+		std::vector<MappedSegment> m_mapped;
+		// pages shared with other machines, see: deduplicate_pages()
+		std::unordered_multimap<const PageData*, std::shared_ptr<const PageData>> m_shared_pages;
+		bool m_deduplicate = false;
+		uint64_t m_memory_max = 0;
+		// host memory backing non-owned pages, eg. mmap-ed files
+		struct HostMapping {
+			address_t begin; // page numbers
+			address_t end;
+			std::shared_ptr<void> backing;
+			HostWrites writes;
+		};
+		std::vector<HostMapping> m_host_mappings;
+		// snapshot image backing non-owned pages after a mapped restore
+		std::shared_ptr<const uint8_t> m_image = nullptr;
+		size_t m_image_size = 0;
 
 		address_t m_start_address = 0;
+		address_t m_program_entry = 0;
+		address_t m_elf_base      = 0;
+		address_t m_interp_base   = 0;
 		address_t m_stack_address = 0;
 		address_t m_exit_address  = 0;
 		address_t m_mmap_address  = HEAP_START + BRK_MAX;
@@ -230,16 +354,19 @@ namespace riscv
 
 		const std::string_view m_binary;
 
-		// ELF programs linear .text segment
-		std::unique_ptr<uint8_t[]> m_exec_pagedata = nullptr;
-		size_t    m_exec_pagedata_size = 0;
-		address_t m_exec_pagedata_base = 0;
-#ifdef RISCV_INSTR_CACHE
-		DecoderData<W>* m_exec_decoder = nullptr;
-		DecoderCache<W>* m_decoder_cache = nullptr;
-#endif
+		// ELF programs linear executable segments, the first being the main one
+		std::vector<std::shared_ptr<DecodedExecuteSegment<W>>> m_exec;
+		// On-demand segments for executable pages outside of the ELF
+		std::vector<std::shared_ptr<DecodedExecuteSegment<W>>> m_dynamic_exec;
+		// The last invalidated segment that the CPU was executing from
+		std::shared_ptr<DecodedExecuteSegment<W>> m_dynamic_retired;
+		// Pages covered by dynamic segments, and whether they were writable
+		std::unordered_map<address_t, bool> m_dynamic_pages;
+		// Number of times a page has been written to after being cached
+		std::unordered_map<address_t, unsigned> m_dynamic_writes;
 		mutable void* m_bintr_dl = nullptr;
 	};
 #include "memory_inline.hpp"
+#include "memory_spans.hpp"
 #include "memory_helpers.hpp"
 }
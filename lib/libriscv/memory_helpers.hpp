@@ -55,42 +55,26 @@ void Memory<W>::memcpy_out(void* vdst, address_t src, size_t len) const
 }
 
 template <int W>
-template <typename T>
-inline void Memory<W>::foreach_helper(T& mem, address_t addr, size_t len,
-	std::function<void(T&, address_t, const uint8_t*, size_t)> callback)
+template <typename T, typename Callback>
+inline void Memory<W>::foreach_helper(T& mem, address_t addr, size_t len, Callback&& callback)
 {
 	address_t boff = 0;
-	while (len != 0)
+	for (const auto span : mem.spans(addr, len))
 	{
-		const size_t offset = addr & (Page::size()-1);
-		const size_t size = std::min(Page::size() - offset, len);
-		const auto& page = mem.get_page(addr);
-		if (page.attr.read) {
-			callback(mem, boff, page.data() + offset, size);
-		} else {
-			protection_fault(addr);
-		}
-
-		addr += size;
-		boff += size;
-		len  -= size;
+		callback(mem, boff, span.data, span.size);
+		boff += span.size;
 	}
 }
 template <int W>
-template <typename T>
-inline void Memory<W>::memview_helper(T& mem, address_t addr, size_t len,
-	std::function<void(T&, const uint8_t*, size_t)> callback)
+template <typename T, typename Callback>
+inline void Memory<W>::memview_helper(T& mem, address_t addr, size_t len, Callback&& callback)
 {
 	const size_t offset = addr & (Page::size()-1);
 	// fast-path
 	if (LIKELY(offset + len <= Page::size()))
 	{
-		const auto& page = mem.get_page(addr);
-		if (page.attr.read) {
-			callback(mem, page.data() + offset, len);
-		} else {
-			protection_fault(addr);
-		}
+		const auto& page = mem.get_readable_pageno(page_number(addr));
+		callback(mem, page.data() + offset, len);
 		return;
 	}
 	// slow path
@@ -100,45 +84,40 @@ inline void Memory<W>::memview_helper(T& mem, address_t addr, size_t len,
 }
 
 template <int W>
-void Memory<W>::foreach(address_t addr, size_t len,
-	std::function<void(const Memory<W>&, address_t, const uint8_t*, size_t)> callback) const
+template <typename Callback>
+inline void Memory<W>::foreach(address_t addr, size_t len, Callback&& callback) const
 {
-	foreach_helper(*this, addr, len, std::move(callback));
+	foreach_helper(*this, addr, len, std::forward<Callback>(callback));
 }
 template <int W>
-void Memory<W>::foreach(address_t addr, size_t len,
-	std::function<void(Memory<W>&, address_t, const uint8_t*, size_t)> callback)
+template <typename Callback>
+inline void Memory<W>::foreach(address_t addr, size_t len, Callback&& callback)
 {
-	foreach_helper(*this, addr, len, std::move(callback));
+	foreach_helper(*this, addr, len, std::forward<Callback>(callback));
 }
 template <int W>
-void Memory<W>::memview(address_t addr, size_t len,
-	std::function<void(const Memory<W>&, const uint8_t*, size_t)> callback) const
+template <typename Callback>
+inline void Memory<W>::memview(address_t addr, size_t len, Callback&& callback) const
 {
-	memview_helper(*this, addr, len, std::move(callback));
+	memview_helper(*this, addr, len, std::forward<Callback>(callback));
 }
 template <int W>
-void Memory<W>::memview(address_t addr, size_t len,
-	std::function<void(Memory<W>&, const uint8_t*, size_t)> callback)
+template <typename Callback>
+inline void Memory<W>::memview(address_t addr, size_t len, Callback&& callback)
 {
-	memview_helper(*this, addr, len, std::move(callback));
+	memview_helper(*this, addr, len, std::forward<Callback>(callback));
 }
 template <int W>
-template <typename T>
-void Memory<W>::memview(address_t addr,
-	std::function<void(const T&)> callback) const
+template <typename T, typename Callback>
+inline void Memory<W>::memview(address_t addr, Callback&& callback) const
 {
 	static_assert(std::is_trivial_v<T>, "Type T must be Plain-Old-Data");
 	const size_t offset = addr & (Page::size()-1);
 	// fast-path
 	if (LIKELY(offset + sizeof(T) <= Page::size()))
 	{
-		const auto& page = this->get_page(addr);
-		if (page.attr.read) {
-			callback(*(const T*) &page.data()[offset]);
-		} else {
-			protection_fault(addr);
-		}
+		const auto& page = this->get_readable_pageno(page_number(addr));
+		callback(*(const T*) &page.data()[offset]);
 		return;
 	}
 	// slow path
@@ -160,7 +139,7 @@ std::string Memory<W>::memstring(address_t addr, const size_t max_len) const
 		const char* start = (const char*) &page.data()[offset];
 		const char* pgend = (const char*) &page.data()[std::min(Page::size(), offset + max_len)];
 		//
-		const char* reader = start + strnlen(start, pgend - start);
+		const char* reader = start + span_strnlen(start, pgend - start);
 		result.append(start, reader);
 		// early exit
 		if (LIKELY(reader < pgend)) {
@@ -177,7 +156,7 @@ std::string Memory<W>::memstring(address_t addr, const size_t max_len) const
 		const char* start = (const char*) page.data();
 		const char* endptr = (const char*) &page.data()[max_bytes];
 
-		const char* reader = start + strnlen(start, max_bytes);
+		const char* reader = start + span_strnlen(start, max_bytes);
 		result.append(start, reader);
 		// if we didn't stop at the page border, we must be done
 		if (reader < endptr)
@@ -218,120 +197,150 @@ template <int W>
 size_t Memory<W>::strlen(address_t addr, size_t maxlen) const
 {
 	size_t len = 0;
-
-	do {
-		const address_t offset = addr & (Page::size()-1);
-		const address_t pageno = page_number(addr);
-		const Page& page = this->get_readable_pageno(pageno);
+	while (len < maxlen)
+	{
+		const size_t offset = addr & (Page::size()-1);
+		const Page& page = this->get_readable_pageno(page_number(addr));
 
 		const char* start = (const char*) &page.data()[offset];
-		const size_t max_bytes = Page::size() - offset;
-		const size_t thislen = strnlen(start, max_bytes);
+		const size_t max_bytes = std::min(Page::size() - offset, maxlen - len);
+		const size_t thislen = span_strnlen(start, max_bytes);
 		len += thislen;
 		if (thislen != max_bytes) break;
-		addr += len;
-	} while (len < maxlen);
-
-	if (len <= maxlen)
-		return len;
-	return maxlen;
+		addr += thislen;
+	}
+	return len;
 }
 
 template <int W>
 int Memory<W>::memcmp(address_t p1, address_t p2, size_t len) const
 {
-	// NOTE: fast implementation if no pointer crosses page boundary
-	const auto pageno1 = this->page_number(p1);
-	const auto pageno2 = this->page_number(p2);
-	if (pageno1 == ((p1 + len-1) >> Page::SHIFT) &&
-		pageno2 == ((p2 + len-1) >> Page::SHIFT)) {
-		auto& page1 = this->get_readable_pageno(pageno1);
-		auto& page2 = this->get_readable_pageno(pageno2);
-
-		const uint8_t* s1 = page1.data() + p1 % Page::SIZE;
-		const uint8_t* s2 = page2.data() + p2 % Page::SIZE;
-		return __builtin_memcmp(s1, s2, len);
-	}
-	else // slow path (optimizable)
+	// Compare the longest spans that cross no page boundary
+	while (len > 0)
 	{
-		uint8_t v1 = 0;
-		uint8_t v2 = 0;
-		while (len > 0) {
-			const auto pageno1 = this->page_number(p1);
-			const auto pageno2 = this->page_number(p2);
-			auto& page1 = this->get_readable_pageno(pageno1);
-			auto& page2 = this->get_readable_pageno(pageno2);
-
-			v1 = page1.data()[p1 % Page::SIZE];
-			v2 = page2.data()[p2 % Page::SIZE];
-			if (v1 != v2) break;
-			p1++;
-			p2++;
-			len--;
-		}
-		return len == 0 ? 0 : (v1 - v2);
+		const size_t offset1 = p1 & (Page::size()-1);
+		const size_t offset2 = p2 & (Page::size()-1);
+		const size_t size =
+			std::min(std::min(Page::size() - offset1, Page::size() - offset2), len);
+		auto& page1 = this->get_readable_pageno(page_number(p1));
+		auto& page2 = this->get_readable_pageno(page_number(p2));
+
+		const uint8_t* s1 = page1.data() + offset1;
+		const uint8_t* s2 = page2.data() + offset2;
+		const size_t diff = span_mismatch(s1, s2, size);
+		if (diff != size)
+			return s1[diff] - s2[diff];
+
+		p1 += size;
+		p2 += size;
+		len -= size;
 	}
+	return 0;
 }
 template <int W>
 int Memory<W>::memcmp(const void* ptr1, address_t p2, size_t len) const
 {
-	const char* s1 = (const char*) ptr1;
-	// NOTE: fast implementation if no pointer crosses page boundary
-	const auto pageno2 = this->page_number(p2);
-	if (pageno2 == ((p2 + len-1) >> Page::SHIFT)) {
-		auto& page2 = this->get_readable_pageno(pageno2);
-
-		const uint8_t* s2 = page2.data() + p2 % Page::SIZE;
-		return __builtin_memcmp(s1, s2, len);
+	const uint8_t* s1 = (const uint8_t*) ptr1;
+	while (len > 0)
+	{
+		const size_t offset2 = p2 & (Page::size()-1);
+		const size_t size = std::min(Page::size() - offset2, len);
+		auto& page2 = this->get_readable_pageno(page_number(p2));
+
+		const uint8_t* s2 = page2.data() + offset2;
+		const size_t diff = span_mismatch(s1, s2, size);
+		if (diff != size)
+			return s1[diff] - s2[diff];
+
+		s1 += size;
+		p2 += size;
+		len -= size;
 	}
-	else // slow path (optimizable)
+	return 0;
+}
+
+template <int W>
+int Memory<W>::strncmp(address_t p1, address_t p2, size_t maxlen) const
+{
+	// Compare the longest spans that cross no page boundary, and only
+	// continue into the next pages when there was no zero-terminator
+	while (maxlen > 0)
 	{
-		uint8_t v2 = 0;
-		while (len > 0) {
-			const auto pageno2 = this->page_number(p2);
-			auto& page2 = this->get_readable_pageno(pageno2);
-
-			v2 = page2.data()[p2 % Page::SIZE];
-			if (*s1 != v2) break;
-			s1++;
-			p2++;
-			len--;
-		}
-		return len == 0 ? 0 : (*s1 - v2);
+		const size_t offset1 = p1 & (Page::size()-1);
+		const size_t offset2 = p2 & (Page::size()-1);
+		const size_t size =
+			std::min(std::min(Page::size() - offset1, Page::size() - offset2), maxlen);
+		auto& page1 = this->get_readable_pageno(page_number(p1));
+		auto& page2 = this->get_readable_pageno(page_number(p2));
+
+		const uint8_t* s1 = page1.data() + offset1;
+		const uint8_t* s2 = page2.data() + offset2;
+		const size_t diff = span_mismatch(s1, s2, size);
+		// equal strings, terminated before the first difference
+		if (span_strnlen((const char*) s1, diff) != diff)
+			return 0;
+		if (diff != size)
+			return s1[diff] - s2[diff];
+
+		p1 += size;
+		p2 += size;
+		maxlen -= size;
 	}
+	return 0;
+}
+
+template <int W>
+address_type<W> Memory<W>::memchr(address_t addr, uint8_t value, size_t len) const
+{
+	for (const auto span : this->spans(addr, len))
+	{
+		auto* found = (const uint8_t*) std::memchr(span.data, value, span.size);
+		if (found != nullptr)
+			return addr + (found - span.data);
+		addr += span.size;
+	}
+	return 0;
 }
 
 template <int W>
 void Memory<W>::memcpy(
 	address_t dst, Machine<W>& srcm, address_t src, address_t len)
 {
-	if ((dst & (W-1)) == (src & (W-1))) {
-		while ((src & (W-1)) != 0 && len > 0) {
-			this->template write<uint8_t> (dst++,
-				srcm.memory.template read<uint8_t> (src++));
-			len --;
-		}
-		while (len >= 16) {
-			this->template write<uint32_t> (dst + 0,
-				srcm.memory.template read<uint32_t> (src + 0));
-			this->template write<uint32_t> (dst + 1*W,
-				srcm.memory.template read<uint32_t> (src + 1*W));
-			this->template write<uint32_t> (dst + 2*W,
-				srcm.memory.template read<uint32_t> (src + 2*W));
-			this->template write<uint32_t> (dst + 3*W,
-				srcm.memory.template read<uint32_t> (src + 3*W));
-			dst += 16; src += 16; len -= 16;
-		}
-		while (len >= W) {
-			this->template write<uint32_t> (dst,
-				srcm.memory.template read<uint32_t> (src));
-			dst += W; src += W; len -= W;
+	if (&srcm.memory == this && dst > src && dst - src < len)
+	{
+		// Overlapping, with the destination ahead of the source: copy
+		// the spans backwards, so that no source byte is overwritten
+		// before it has been read
+		while (len > 0)
+		{
+			const size_t end_dst = ((dst + len - 1) & (Page::size()-1)) + 1;
+			const size_t end_src = ((src + len - 1) & (Page::size()-1)) + 1;
+			const size_t size = std::min(std::min(end_dst, end_src), size_t(len));
+			len -= size;
+			auto& dpage = this->create_writable_pageno(page_number(dst + len));
+			auto& spage = this->get_readable_pageno(page_number(src + len));
+
+			std::memmove(dpage.data() + ((dst + len) & (Page::size()-1)),
+				spage.data() + ((src + len) & (Page::size()-1)), size);
 		}
+		return;
 	}
-	while (len > 0) {
-		this->template write<uint8_t> (dst++,
-			srcm.memory.template read<uint8_t> (src++));
-		len --;
+	// Copy the longest spans that cross no page boundary
+	while (len > 0)
+	{
+		const size_t offset_dst = dst & (Page::size()-1);
+		const size_t offset_src = src & (Page::size()-1);
+		const size_t size =
+			std::min(std::min(Page::size() - offset_dst, Page::size() - offset_src), size_t(len));
+		auto& dpage = this->create_writable_pageno(page_number(dst));
+		auto& spage = srcm.memory.get_readable_pageno(page_number(src));
+
+		// The source may be this machine, with the destination behind it
+		std::memmove(dpage.data() + offset_dst, spage.data() + offset_src, size);
+
+		dst += size;
+		src += size;
+		len -= size;
 	}
 }
 
@@ -364,3 +373,33 @@ size_t Memory<W>::gather_buffers_from_range(
 	}
 	return index;
 }
+
+template <int W>
+size_t Memory<W>::gather_writable_buffers_from_range(
+	size_t cnt, vBuffer buffers[], address_t addr, size_t len)
+{
+	size_t index = 0;
+	vBuffer* last = nullptr;
+	while (len != 0 && index < cnt)
+	{
+		const size_t offset = addr & (Page::SIZE-1);
+		const size_t size = std::min(Page::SIZE - offset, len);
+		auto& page = create_writable_pageno(page_number(addr));
+
+		auto* ptr = (char*) &page.data()[offset];
+		if (last && ptr == last->ptr + last->len) {
+			last->len += size;
+		} else {
+			last = &buffers[index];
+			last->ptr = ptr;
+			last->len = size;
+			index ++;
+		}
+		addr += size;
+		len -= size;
+	}
+	if (UNLIKELY(len != 0)) {
+		throw MachineException(OUT_OF_MEMORY, "Out of buffers", index);
+	}
+	return index;
+}
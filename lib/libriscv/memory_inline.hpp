@@ -89,6 +89,10 @@ inline const Page& Memory<W>::get_exec_pageno(const address_t pageno) const
 	if (LIKELY(it != m_pages.end())) {
 		return it->second;
 	}
+	if (UNLIKELY(!m_mapped.empty())) {
+		if (const Page* page = install_mapped_page(pageno))
+			return *page;
+	}
 	CPU<W>::trigger_exception(EXECUTION_SPACE_PROTECTION_FAULT);
 }
 
@@ -104,6 +108,10 @@ inline const Page& Memory<W>::get_pageno(const address_t pageno) const
 		return m_ropages.pages[pageno - m_ropages.begin];
 	}
 #endif
+	if (UNLIKELY(!m_mapped.empty())) {
+		if (const Page* page = install_mapped_page(pageno))
+			return *page;
+	}
 	return m_page_readf_handler(*this, pageno);
 }
 
@@ -166,7 +174,7 @@ template <int W>
 inline address_type<W> Memory<W>::resolve_address(const std::string& name) const
 {
 	auto* sym = resolve_symbol(name.c_str());
-	return (sym) ? sym->st_value : 0x0;
+	return (sym) ? sym->st_value + m_elf_base : 0x0;
 }
 
 template <int W>
@@ -190,7 +198,31 @@ inline void Memory<W>::set_exit_address(address_t addr)
 }
 
 template <int W>
-inline bool Memory<W>::is_executable(address_t addr)
+inline bool Memory<W>::is_executable(address_t addr) const noexcept
+{
+	for (const auto& seg : m_exec) {
+		if (seg->is_within_pages(addr))
+			return true;
+	}
+	return false;
+}
+
+template <int W>
+inline const DecodedExecuteSegment<W>* Memory<W>::exec_segment_for(address_t vaddr) const noexcept
+{
+	for (const auto& seg : m_exec) {
+		if (seg->is_within(vaddr))
+			return seg.get();
+	}
+	for (const auto& seg : m_dynamic_exec) {
+		if (seg->is_within(vaddr))
+			return seg.get();
+	}
+	return nullptr;
+}
+
+template <int W>
+inline bool Memory<W>::is_dynamic_page(address_t pageno) const noexcept
 {
-	return addr >= m_exec_pagedata_base && addr < m_exec_pagedata_base + m_exec_pagedata_size;
+	return !m_dynamic_pages.empty() && m_dynamic_pages.count(pageno) != 0;
 }
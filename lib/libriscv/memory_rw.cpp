@@ -19,8 +19,17 @@ namespace riscv
 			Page& page = it->second;
 			if (LIKELY(page.attr.write)) {
 				return page;
-			} else if (page.attr.is_cow) {
-				m_page_write_handler(*this, pageno, page);
+			}
+			if (UNLIKELY(is_dynamic_page(pageno))) {
+				// Modifying cached code: drop the decoded segments,
+				// which also restores the original write permission
+				m_dynamic_writes[pageno]++;
+				this->invalidate_dynamic_segments(pageno, pageno + 1);
+				if (page.attr.write)
+					return page;
+			}
+			if (page.attr.is_cow) {
+				this->copy_on_write(pageno, page);
 				return page;
 			}
 		} else {
@@ -29,6 +38,16 @@ namespace riscv
 				this->protection_fault(pageno * Page::size());
 			}
 		#endif
+			if (UNLIKELY(!m_mapped.empty())) {
+				if (auto* mapped = install_mapped_page(pageno)) {
+					Page& page = const_cast<Page&> (*mapped);
+					if (page.attr.is_cow) {
+						this->copy_on_write(pageno, page);
+						return page;
+					}
+					this->protection_fault(pageno * Page::size());
+				}
+			}
 			// Handler must produce a new page, or throw
 			Page& page = m_page_fault_handler(*this, pageno);
 			if (LIKELY(page.attr.write))
@@ -37,6 +56,21 @@ namespace riscv
 		this->protection_fault(pageno * Page::size());
 	}
 
+	template <int W>
+	void Memory<W>::copy_on_write(address_t pageno, Page& page)
+	{
+		const PageData* old_data = page.has_data() ? &page.page() : nullptr;
+		m_page_write_handler(*this, pageno, page);
+		// The page no longer holds a reference to shared data
+		if (UNLIKELY(!m_shared_pages.empty()) && old_data != nullptr
+			&& (!page.has_data() || &page.page() != old_data))
+		{
+			auto it = m_shared_pages.find(old_data);
+			if (it != m_shared_pages.end())
+				m_shared_pages.erase(it);
+		}
+	}
+
 	template <int W>
 	void Memory<W>::free_pages(address_t dst, size_t len)
 	{
@@ -46,14 +80,179 @@ namespace riscv
 		{
 			auto it = m_pages.find(pageno);
 			if (it != m_pages.end()) {
+				this->release_shared_pagedata(it->second);
 				m_pages.erase(it);
 			}
 			pageno ++;
 		}
+		this->invalidate_dynamic_segments(page_number(dst), end);
+		this->unmap_segments(page_number(dst), end);
+		if (!m_host_mappings.empty())
+			this->unmap_host_mappings(page_number(dst), end);
 		// TODO: This can be improved by invalidating matches only
 		this->invalidate_reset_cache();
 	}
 
+	template <int W>
+	void Memory<W>::memzero(address_t dst, size_t len)
+	{
+		constexpr address_t PMASK = Page::size()-1;
+		const address_t begin = (dst + PMASK) & ~PMASK;
+		const address_t end   = (dst + len) & ~PMASK;
+		if (begin >= end || begin < dst || dst + len < dst) {
+			this->memset(dst, 0, len);
+			return;
+		}
+		// Partial pages at the edges are written to
+		this->memset(dst, 0, begin - dst);
+		this->memset(end, 0, dst + len - end);
+		// Cached guest JIT code is dropped, as with any other write
+		this->invalidate_dynamic_segments(page_number(begin), page_number(end));
+
+		auto* zero_data = const_cast<PageData*> (&Page::cow_page().page());
+		auto zero_page = [&] (address_t pageno, Page& page) {
+			if (page.has_data() && &page.page() == zero_data)
+				return;
+			// Trapped pages must see the writes
+			if (UNLIKELY(page.has_trap())) {
+				this->memset(pageno * Page::size(), 0, Page::size());
+				return;
+			}
+			auto attr = page.attr;
+			if (attr.write) {
+				attr.write  = false;
+				attr.is_cow = true;
+			}
+			this->release_shared_pagedata(page);
+			page.~Page();
+			new (&page) Page{attr, zero_data};
+		};
+		const address_t first = page_number(begin);
+		const address_t last  = page_number(end);
+	#ifdef RISCV_RODATA_SEGMENT_IS_SHARED
+		if (UNLIKELY(m_ropages.end > first && m_ropages.begin < last)) {
+			this->protection_fault(std::max(first, m_ropages.begin) * Page::size());
+		}
+	#endif
+		// Unused pages already read as zeroes, unless there is
+		// a custom page read handler, eg. for shared page tables
+		using readf_t = const Page&(*)(const Memory<W>&, address_t);
+		const auto* readf = m_page_readf_handler.template target<readf_t>();
+		const bool unused_is_zero = readf != nullptr && *readf == default_page_read;
+
+		if (unused_is_zero && m_mapped.empty() && last - first > m_pages.size())
+		{
+			// Large ranges, eg. anonymous mappings, visit only the used pages
+			for (auto& it : m_pages) {
+				if (it.first >= first && it.first < last)
+					zero_page(it.first, it.second);
+			}
+			this->invalidate_reset_cache();
+			return;
+		}
+		for (address_t pageno = first; pageno < last; pageno++)
+		{
+			auto it = m_pages.find(pageno);
+			if (it == m_pages.end()) {
+				if (m_mapped.empty() || install_mapped_page(pageno) == nullptr) {
+					if (!unused_is_zero) {
+						m_pages.emplace(std::piecewise_construct,
+							std::forward_as_tuple(pageno),
+							std::forward_as_tuple(Page::cow_page().attr, zero_data));
+					}
+					continue;
+				}
+				it = m_pages.find(pageno);
+			}
+			zero_page(pageno, it->second);
+		}
+		this->invalidate_reset_cache();
+	}
+
+	template <int W>
+	const Page* Memory<W>::install_mapped_page(const address_t pageno) const
+	{
+		for (const auto& seg : m_mapped)
+		{
+			if (!seg.contains(pageno))
+				continue;
+			auto attr = seg.attr;
+			attr.non_owning = true;
+			if (attr.write) {
+				attr.write  = false;
+				attr.is_cow = true;
+			}
+			const auto* data = m_binary.data() + seg.offset
+				+ (pageno - seg.begin) * Page::size();
+			// Installing a page from the binary does not change the
+			// contents of memory, which is why this is allowed in const.
+			auto& self = const_cast<Memory<W>&> (*this);
+			if (m_deduplicate) {
+				data = (const char*) self.shared_pagedata(*(const PageData*) data);
+			}
+			auto& pages = self.m_pages;
+			const auto it = pages.emplace(std::piecewise_construct,
+				std::forward_as_tuple(pageno),
+				std::forward_as_tuple(attr, (PageData*) data)
+			);
+			this->invalidate_cache(pageno, &it.first->second);
+			return &it.first->second;
+		}
+		return nullptr;
+	}
+
+	template <int W>
+	void Memory<W>::unmap_segments(address_t begin, address_t end)
+	{
+		for (size_t i = 0; i < m_mapped.size(); i++)
+		{
+			auto& seg = m_mapped[i];
+			if (seg.end <= begin || seg.begin >= end)
+				continue;
+			// the part after the range is kept as its own segment
+			MappedSegment tail = seg;
+			tail.offset += (end - seg.begin) * Page::size();
+			tail.begin = end;
+			seg.end = std::min(seg.end, begin);
+			if (seg.end <= seg.begin) {
+				m_mapped.erase(m_mapped.begin() + i);
+				i--;
+			}
+			if (tail.end > tail.begin)
+				m_mapped.push_back(tail);
+		}
+	}
+
+	template <int W>
+	void Memory<W>::unmap_host_mappings(address_t begin, address_t end)
+	{
+		for (size_t i = 0; i < m_host_mappings.size(); i++)
+		{
+			auto& hm = m_host_mappings[i];
+			if (hm.end <= begin || hm.begin >= end)
+				continue;
+			// the part after the range keeps the backing alive too
+			HostMapping tail = hm;
+			tail.begin = end;
+			hm.end = std::min(hm.end, begin);
+			if (hm.end <= hm.begin) {
+				m_host_mappings.erase(m_host_mappings.begin() + i);
+				i--;
+			}
+			if (tail.end > tail.begin)
+				m_host_mappings.push_back(std::move(tail));
+		}
+	}
+	template <int W>
+	bool Memory<W>::is_host_mapped(address_t pageno) const noexcept
+	{
+		for (const auto& hm : m_host_mappings) {
+			if (pageno >= hm.begin && pageno < hm.end)
+				return true;
+		}
+		return false;
+	}
+
 	template <int W>
 	void Memory<W>::default_page_write(Memory<W>&, address_t, Page& page)
 	{
@@ -141,17 +340,80 @@ namespace riscv
 		// TODO: Can be improved by invalidating more intelligently
 		this->invalidate_reset_cache();
 	}
+	template <int W>
+	void Memory<W>::insert_non_owned_memory(address_t dst, void* src, size_t size,
+		PageAttributes attr, std::shared_ptr<void> backing, HostWrites writes)
+	{
+		this->insert_non_owned_memory(dst, src, size, attr);
+		m_host_mappings.push_back({
+			page_number(dst), page_number(dst + size), std::move(backing), writes
+		});
+	}
+	template <int W>
+	typename Memory<W>::HostWrites Memory<W>::host_writes(address_t pageno) const noexcept
+	{
+		for (const auto& hm : m_host_mappings) {
+			if (pageno >= hm.begin && pageno < hm.end)
+				return hm.writes;
+		}
+		return HOST_WRITES_COW;
+	}
+
+	// Non-owned and copy-on-write pages are re-protected in place, as
+	// their data belongs to someone else. Making them writable makes
+	// them copy-on-write, unless the host memory may be written to.
+	template <int W>
+	void Memory<W>::set_shared_page_attr(address_t pageno, Page& page, PageAttributes options)
+	{
+		if (!page.has_data() && (options.read || options.write || options.exec))
+			this->protection_fault(pageno * Page::size());
+		page.attr.read = options.read;
+		page.attr.exec = options.exec;
+		if (!options.write) {
+			page.attr.write  = false;
+			page.attr.is_cow = false;
+			return;
+		}
+		if (page.attr.write || page.attr.is_cow)
+			return;
+		switch (this->host_writes(pageno)) {
+		case HOST_WRITES_SHARED:
+			page.attr.write = true;
+			return;
+		case HOST_WRITES_NEVER:
+			this->protection_fault(pageno * Page::size());
+		case HOST_WRITES_COW:
+			page.attr.is_cow = true;
+			return;
+		}
+	}
 
 	template <int W> void
 	Memory<W>::set_page_attr(address_t dst, size_t len, PageAttributes options)
 	{
 		const bool is_default = options.is_default();
+		// Changing the protection of cached code invalidates it
+		this->invalidate_dynamic_segments(page_number(dst),
+			page_number(dst + len + Page::size() - 1));
 		while (len > 0)
 		{
 			const size_t size = std::min(Page::size(), len);
 			const address_t pageno = page_number(dst);
+			auto it = m_pages.find(pageno);
+			// pages mapped lazily from the binary are installed first
+			if (it == m_pages.end() && !m_mapped.empty() && install_mapped_page(pageno) != nullptr)
+				it = m_pages.find(pageno);
+			if (it != m_pages.end() && (it->second.attr.non_owning || it->second.attr.is_cow)) {
+				this->set_shared_page_attr(pageno, it->second, options);
+			}
+			else if (it != m_pages.end() && !it->second.attr.write) {
+				// owned pages can be re-protected, eg. W^X guest JIT
+				it->second.attr.read  = options.read;
+				it->second.attr.write = options.write;
+				it->second.attr.exec  = options.exec;
+			}
 			// unfortunately, have to create pages for non-default attrs
-			if (!is_default) {
+			else if (!is_default) {
 				this->create_writable_pageno(pageno).attr = options;
 			} else {
 				// set attr on non-COW pages only!
@@ -166,6 +428,7 @@ namespace riscv
 			dst += size;
 			len -= size;
 		}
+		this->invalidate_reset_cache();
 	}
 
 	template <int W>
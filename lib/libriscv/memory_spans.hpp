@@ -0,0 +1,83 @@
+#pragma once
+
+// Zero-overhead view of a range of guest memory, as the chunks
+// that cross no page boundary. Page protections are checked as
+// the range is iterated, which throws on violations:
+//   for (const auto span : memory.spans(addr, len))
+//       fwrite(span.data, 1, span.size, stdout);
+// Writable spans create (or copy-on-write) the pages they visit.
+template <int W, bool Writable>
+struct MemorySpans
+{
+	using address_t = address_type<W>;
+	using memory_t = std::conditional_t<Writable, Memory<W>, const Memory<W>>;
+	using data_t = std::conditional_t<Writable, uint8_t, const uint8_t>;
+
+	struct Span {
+		data_t* data;
+		size_t  size;
+	};
+
+	struct iterator
+	{
+		Span operator*() const noexcept { return m_span; }
+		iterator& operator++() {
+			m_addr += m_span.size;
+			m_len  -= m_span.size;
+			this->load();
+			return *this;
+		}
+		bool operator!=(const iterator& other) const noexcept {
+			return m_len != other.m_len;
+		}
+
+		iterator(memory_t& mem, address_t addr, size_t len)
+			: m_mem(mem), m_addr(addr), m_len(len) { this->load(); }
+	private:
+		void load();
+		memory_t& m_mem;
+		address_t m_addr;
+		size_t    m_len;
+		Span      m_span { nullptr, 0 };
+	};
+
+	iterator begin() const { return { m_mem, m_addr, m_len }; }
+	iterator end() const { return { m_mem, m_addr, 0 }; }
+	size_t size() const noexcept { return m_len; }
+
+	MemorySpans(memory_t& mem, address_t addr, size_t len)
+		: m_mem(mem), m_addr(addr), m_len(len) {}
+private:
+	memory_t& m_mem;
+	const address_t m_addr;
+	const size_t    m_len;
+};
+
+template <int W, bool Writable>
+inline void MemorySpans<W, Writable>::iterator::load()
+{
+	if (m_len == 0)
+		return;
+	const size_t offset = m_addr & (Page::size()-1);
+	const size_t size = std::min(Page::size() - offset, m_len);
+	const auto pageno = Memory<W>::page_number(m_addr);
+	if constexpr (Writable) {
+		auto& page = m_mem.create_writable_pageno(pageno);
+		m_span = { page.data() + offset, size };
+	} else {
+		auto& page = m_mem.get_readable_pageno(pageno);
+		m_span = { page.data() + offset, size };
+	}
+}
+
+template <int W>
+inline MemorySpans<W, false> Memory<W>::spans(address_t addr, size_t len) const
+{
+	return { *this, addr, len };
+}
+
+template <int W>
+inline MemorySpans<W, true> Memory<W>::writable_spans(address_t addr, size_t len)
+{
+	return { *this, addr, len };
+}
@@ -4,49 +4,73 @@
 //
 #pragma once
 #include "common.hpp"
+#include <array>
 #include <cstddef>
 #include <cassert>
+#include <cstring>
 #include <deque>
-#include <functional>
+#include <map>
+#include <unordered_map>
+#include <vector>
 
 namespace riscv
 {
-struct Arena;
+template <int W> struct Arena;
 
+// Arena pointers are 32-bit for RV32, which keeps chunks compact,
+// and 64-bit otherwise, which lets the arena be anywhere for RV64.
+template <int W>
 struct ArenaChunk
 {
-	using PointerType = uint32_t;
+	using PointerType = std::conditional_t<W == 4, uint32_t, uint64_t>;
 
 	ArenaChunk() = default;
 	ArenaChunk(ArenaChunk* n, ArenaChunk* p, size_t s, bool f, PointerType d)
 		: next(n), prev(p), size(s), free(f), data(d) {}
 
+	// neighboring chunks, in address order
 	ArenaChunk* next = nullptr;
 	ArenaChunk* prev = nullptr;
 	size_t size = 0;
 	bool   free = false;
 	PointerType data = 0;
-
-	ArenaChunk* find(PointerType ptr);
-	ArenaChunk* find_free(size_t size);
-	void   merge_next(Arena&);
-	void   split_next(Arena&, size_t size);
+	// free chunks in a small size-class bin
+	ArenaChunk* next_free = nullptr;
+	ArenaChunk* prev_free = nullptr;
 };
 
+// The arena is a list of chunks in address order, where neighboring
+// free chunks are always merged. Free chunks are kept in size-class
+// bins: small chunks in exact-size free lists, with a bitmap of the
+// non-empty lists, and large chunks in a tree ordered by size and then
+// address, for best-fit allocations. Allocated chunks are found by
+// address in a hash map, and so free() never walks the list. Each
+// allocation costs a hash map node, and large free chunks a tree node,
+// which makes large allocations and frees O(log n) in the free chunks.
+template <int W>
 struct Arena
 {
-	using PointerType = ArenaChunk::PointerType;
+	using ArenaChunk = riscv::ArenaChunk<W>;
+	using PointerType = typename ArenaChunk::PointerType;
+	static constexpr size_t ALIGNMENT = sizeof(size_t);
+	static constexpr size_t SMALL_BINS = 64;
+	// Chunks from this size and up are large chunks
+	static constexpr size_t LARGE_SIZE = (SMALL_BINS + 1) * ALIGNMENT;
+
 	Arena(PointerType base, PointerType end);
 
 	PointerType malloc(size_t size);
 	size_t      size(PointerType src, bool allow_free = false);
 	signed int  free(PointerType);
 
-	size_t bytes_free() const;
-	size_t bytes_used() const;
-	size_t chunks_used() const noexcept { return m_chunks.size(); }
+	size_t bytes_free() const noexcept { return m_bytes_total - m_bytes_used; }
+	size_t bytes_used() const noexcept { return m_bytes_used; }
+	size_t chunks_used() const noexcept { return m_used.size(); }
 
 	void transfer(Arena& dest) const;
+	// Serialization of the chunk list, for machine snapshots
+	void serialize_to(std::vector<uint8_t>& vec) const;
+	int  deserialize_from(const uint8_t* data, size_t size);
 
 	inline ArenaChunk& base_chunk() {
 		return m_base_chunk;
@@ -57,184 +81,295 @@ struct Arena
 	ArenaChunk* find_chunk(PointerType ptr);
 
 private:
-	inline size_t word_align(size_t size) {
-		return (size + (sizeof(size_t) - 1)) & ~(sizeof(size_t) - 1);
+	static inline size_t word_align(size_t size) {
+		return (size + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1);
 	}
-	void foreach(std::function<void(const ArenaChunk&)>) const;
+	static inline size_t small_bin(size_t size) {
+		return size / ALIGNMENT - 1;
+	}
+	void insert_free(ArenaChunk*);
+	void remove_free(ArenaChunk*);
+	ArenaChunk* take_free(size_t size);
+	void merge_next(ArenaChunk*);
+	void split_next(ArenaChunk*, size_t size);
+	void reset();
+	template <typename Callback>
+	void foreach(Callback&& callback) const;
 
 	std::deque<ArenaChunk> m_chunks;
 	std::vector<ArenaChunk*> m_free_chunks;
 	ArenaChunk  m_base_chunk;
+
+	std::array<ArenaChunk*, SMALL_BINS> m_small {};
+	uint64_t m_small_bits = 0;
+	std::map<std::pair<size_t, PointerType>, ArenaChunk*> m_large;
+	std::unordered_map<PointerType, ArenaChunk*> m_used;
+	size_t m_bytes_total = 0;
+	size_t m_bytes_used  = 0;
 };
 
-// find exact free chunk that matches ptr
-inline ArenaChunk* ArenaChunk::find(PointerType ptr)
+template <int W>
+template <typename... Args>
+inline ArenaChunk<W>* Arena<W>::new_chunk(Args&&... args)
 {
-	ArenaChunk* ch = this;
-	while (ch != nullptr) {
-		if (!ch->free && ch->data == ptr)
-			return ch;
-		ch = ch->next;
+	if (UNLIKELY(m_free_chunks.empty())) {
+		m_chunks.emplace_back(std::forward<Args>(args)...);
+		return &m_chunks.back();
 	}
-	return nullptr;
+	auto* chunk = m_free_chunks.back();
+	m_free_chunks.pop_back();
+	return new (chunk) ArenaChunk {std::forward<Args>(args)...};
 }
-// find free chunk that has at least given size
-inline ArenaChunk* ArenaChunk::find_free(size_t size)
+template <int W>
+inline void Arena<W>::free_chunk(ArenaChunk* chunk)
 {
-    ArenaChunk* ch = this;
-	while (ch != nullptr) {
-		if (ch->free && ch->size >= size)
-			return ch;
-		ch = ch->next;
-	}
-	return nullptr;
+	m_free_chunks.push_back(chunk);
 }
-// merge this and next into this chunk
-inline void ArenaChunk::merge_next(Arena& arena)
+template <int W>
+inline ArenaChunk<W>* Arena<W>::find_chunk(PointerType ptr)
 {
-	ArenaChunk* freech = this->next;
-	this->size += freech->size;
-	this->next = freech->next;
-	if (this->next) {
-		this->next->prev = this;
-	}
-	arena.free_chunk(freech);
+	auto it = m_used.find(ptr);
+	return (it != m_used.end()) ? it->second : nullptr;
 }
 
-inline void ArenaChunk::split_next(Arena& arena, size_t size)
+template <int W>
+inline void Arena<W>::insert_free(ArenaChunk* ch)
 {
-	ArenaChunk* newch = arena.new_chunk(
-		this->next,
-		this,
-		this->size - size,
-		true,
-		this->data + (PointerType) size
-	);
-	if (this->next) {
-		this->next->prev = newch;
+	// slivers at the very end of an unaligned arena are never binned
+	if (UNLIKELY(ch->size < ALIGNMENT))
+		return;
+	if (ch->size < LARGE_SIZE) {
+		const size_t bin = small_bin(ch->size);
+		ch->prev_free = nullptr;
+		ch->next_free = m_small[bin];
+		if (ch->next_free)
+			ch->next_free->prev_free = ch;
+		m_small[bin] = ch;
+		m_small_bits |= uint64_t(1) << bin;
+	} else {
+		m_large.emplace(std::make_pair(ch->size, ch->data), ch);
 	}
-	this->next = newch;
-	this->size = size;
 }
-
-template <typename... Args>
-inline ArenaChunk* Arena::new_chunk(Args&&... args)
+template <int W>
+inline void Arena<W>::remove_free(ArenaChunk* ch)
 {
-	if (UNLIKELY(m_free_chunks.empty())) {
-		m_chunks.emplace_back(std::forward<Args>(args)...);
-		return &m_chunks.back();
+	if (UNLIKELY(ch->size < ALIGNMENT))
+		return;
+	if (ch->size < LARGE_SIZE) {
+		const size_t bin = small_bin(ch->size);
+		if (ch->prev_free)
+			ch->prev_free->next_free = ch->next_free;
+		else
+			m_small[bin] = ch->next_free;
+		if (ch->next_free)
+			ch->next_free->prev_free = ch->prev_free;
+		if (m_small[bin] == nullptr)
+			m_small_bits &= ~(uint64_t(1) << bin);
+	} else {
+		m_large.erase(std::make_pair(ch->size, ch->data));
 	}
-	auto* chunk = m_free_chunks.back();
-	m_free_chunks.pop_back();
-	return new (chunk) ArenaChunk {std::forward<Args>(args)...};
 }
-inline void Arena::free_chunk(ArenaChunk* chunk)
+// remove and return the smallest free chunk that has at least given size
+template <int W>
+inline ArenaChunk<W>* Arena<W>::take_free(size_t size)
 {
-	m_free_chunks.push_back(chunk);
+	if (size < LARGE_SIZE) {
+		const uint64_t bins = m_small_bits & (~uint64_t(0) << small_bin(size));
+		if (bins != 0) {
+			ArenaChunk* ch = m_small[__builtin_ctzll(bins)];
+			remove_free(ch);
+			return ch;
+		}
+	}
+	auto it = m_large.lower_bound(std::make_pair(size, PointerType(0)));
+	if (it == m_large.end())
+		return nullptr;
+	ArenaChunk* ch = it->second;
+	m_large.erase(it);
+	return ch;
 }
-inline ArenaChunk* Arena::find_chunk(PointerType ptr)
+// merge this and next into this chunk
+template <int W>
+inline void Arena<W>::merge_next(ArenaChunk* ch)
 {
-	for (auto& chunk : m_chunks) {
-		if (!chunk.free && chunk.data == ptr)
-			return &chunk;
+	ArenaChunk* freech = ch->next;
+	ch->size += freech->size;
+	ch->next = freech->next;
+	if (ch->next) {
+		ch->next->prev = ch;
 	}
-	return nullptr;
+	this->free_chunk(freech);
+}
+// split off the end of this chunk into a new free chunk
+template <int W>
+inline void Arena<W>::split_next(ArenaChunk* ch, size_t size)
+{
+	ArenaChunk* newch = this->new_chunk(
+		ch->next,
+		ch,
+		ch->size - size,
+		true,
+		ch->data + (PointerType) size
+	);
+	if (ch->next) {
+		ch->next->prev = newch;
+	}
+	ch->next = newch;
+	ch->size = size;
+	this->insert_free(newch);
 }
 
-inline Arena::PointerType Arena::malloc(size_t size)
+template <int W>
+inline typename Arena<W>::PointerType Arena<W>::malloc(size_t size)
 {
 	size_t length = word_align(size);
-	length = std::max(length, (size_t) 8);
-	ArenaChunk* ch = base_chunk().find_free(length);
+	length = std::max(length, ALIGNMENT);
+	ArenaChunk* ch = take_free(length);
 
 	if (ch != nullptr) {
-		ch->split_next(*this, length);
+		if (ch->size > length)
+			this->split_next(ch, length);
 		ch->free = false;
+		m_used.emplace(ch->data, ch);
+		m_bytes_used += ch->size;
 		return ch->data;
 	}
 	return 0;
 }
 
-inline size_t Arena::size(PointerType ptr, bool allow_free)
+template <int W>
+inline size_t Arena<W>::size(PointerType ptr, bool)
 {
-	ArenaChunk* ch = base_chunk().find(ptr);
-	if (UNLIKELY(ch == nullptr || (ch->free && !allow_free)))
+	ArenaChunk* ch = find_chunk(ptr);
+	if (UNLIKELY(ch == nullptr))
 		return 0;
 	return ch->size;
 }
 
-inline int Arena::free(PointerType ptr)
+template <int W>
+inline int Arena<W>::free(PointerType ptr)
 {
-	ArenaChunk* ch = base_chunk().find(ptr);
-	if (UNLIKELY(ch == nullptr))
+	auto it = m_used.find(ptr);
+	if (UNLIKELY(it == m_used.end()))
 		return -1;
+	ArenaChunk* ch = it->second;
+	m_used.erase(it);
+	m_bytes_used -= ch->size;
 
 	ch->free = true;
 	// merge chunks ahead and behind us
 	if (ch->next && ch->next->free) {
-		ch->merge_next(*this);
+		this->remove_free(ch->next);
+		this->merge_next(ch);
 	}
 	if (ch->prev && ch->prev->free) {
 		ch = ch->prev;
-		ch->merge_next(*this);
+		this->remove_free(ch);
+		this->merge_next(ch);
 	}
+	this->insert_free(ch);
 	return 0;
 }
 
-inline Arena::Arena(PointerType arena_base, PointerType arena_end)
+template <int W>
+inline Arena<W>::Arena(PointerType arena_base, PointerType arena_end)
 {
 	m_base_chunk.size = arena_end - arena_base;
 	m_base_chunk.data = arena_base;
 	m_base_chunk.free = true;
+	m_bytes_total = m_base_chunk.size;
+	this->insert_free(&m_base_chunk);
+}
+
+template <int W>
+inline void Arena<W>::reset()
+{
+	m_chunks.clear();
+	m_free_chunks.clear();
+	m_small = {};
+	m_small_bits = 0;
+	m_large.clear();
+	m_used.clear();
+	m_bytes_total = 0;
+	m_bytes_used  = 0;
 }
 
-inline void Arena::foreach(std::function<void(const ArenaChunk&)> callback) const
+template <int W>
+template <typename Callback>
+inline void Arena<W>::foreach(Callback&& callback) const
 {
 	const ArenaChunk* ch = &this->m_base_chunk;
-    while (ch != nullptr) {
+	while (ch != nullptr) {
 		callback(*ch);
 		ch = ch->next;
 	}
 }
 
-inline size_t Arena::bytes_free() const
+struct SerializedArenaChunk
 {
-	size_t size = 0;
-	foreach([&size] (const ArenaChunk& chunk) {
-		if (chunk.free) size += chunk.size;
-	});
-	return size;
-}
-inline size_t Arena::bytes_used() const
+	uint64_t data;
+	uint64_t size;
+	uint32_t free;
+	uint32_t reserved;
+};
+
+template <int W>
+inline void Arena<W>::serialize_to(std::vector<uint8_t>& vec) const
 {
-	size_t size = 0;
-	foreach([&size] (const ArenaChunk& chunk) {
-		if (!chunk.free) size += chunk.size;
+	foreach([&vec] (const ArenaChunk& chunk) {
+		const SerializedArenaChunk schunk {
+			.data = chunk.data,
+			.size = chunk.size,
+			.free = chunk.free,
+			.reserved = 0
+		};
+		auto* ptr = (const uint8_t*) &schunk;
+		vec.insert(vec.end(), ptr, ptr + sizeof(schunk));
 	});
-	return size;
 }
 
-inline void Arena::transfer(Arena& dest) const
+template <int W>
+inline int Arena<W>::deserialize_from(const uint8_t* data, size_t size)
 {
-	dest.m_base_chunk = m_base_chunk;
-	dest.m_chunks.clear();
-	dest.m_free_chunks.clear();
-
-	ArenaChunk* last = &dest.m_base_chunk;
+	if (size == 0 || size % sizeof(SerializedArenaChunk) != 0)
+		return -1;
+	this->reset();
 
-	const ArenaChunk* chunk = m_base_chunk.next;
-	while (chunk != nullptr)
+	ArenaChunk* last = nullptr;
+	for (size_t off = 0; off < size; off += sizeof(SerializedArenaChunk))
+	{
+		SerializedArenaChunk schunk;
+		std::memcpy(&schunk, &data[off], sizeof(schunk));
+		ArenaChunk* chunk = (last == nullptr) ?
+			&m_base_chunk : &m_chunks.emplace_back();
+		*chunk = ArenaChunk { nullptr, last,
+			schunk.size, schunk.free != 0, (PointerType) schunk.data };
+		if (last != nullptr)
+			last->next = chunk;
+		last = chunk;
+	}
+	// older snapshots may have neighboring free chunks, and empty chunks
+	for (ArenaChunk* ch = &m_base_chunk; ch != nullptr; ch = ch->next)
 	{
-		dest.m_chunks.push_back(*chunk);
-		auto& new_chunk = dest.m_chunks.back();
-		new_chunk.prev = last;
-		new_chunk.next = nullptr;
-		last->next = &new_chunk;
-		/* New last before next iteration */
-		last = &new_chunk;
-
-		chunk = chunk->next;
+		while (ch->next && (ch->next->size == 0 || (ch->free && ch->next->free)))
+			this->merge_next(ch);
+		m_bytes_total += ch->size;
+		if (ch->free) {
+			this->insert_free(ch);
+		} else {
+			m_used.emplace(ch->data, ch);
+			m_bytes_used += ch->size;
+		}
 	}
+	return 0;
+}
+
+template <int W>
+inline void Arena<W>::transfer(Arena& dest) const
+{
+	std::vector<uint8_t> chunks;
+	this->serialize_to(chunks);
+	dest.deserialize_from(chunks.data(), chunks.size());
 }
 
 } // namespace riscv
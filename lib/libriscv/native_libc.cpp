@@ -1,5 +1,6 @@
 #include "machine.hpp"
 #include "native_heap.hpp"
+#include <limits>
 #include <stdexcept>
 
 //#define HPRINT(fmt, ...) printf(fmt, ##__VA_ARGS__)
@@ -8,6 +9,8 @@
 #define MPRINT(fmt, ...) /* */
 
 namespace riscv {
+// The longest string that the string system calls will look at
+static constexpr size_t STRING_MAX = 1 << 24;
 
 template <int W>
 void Machine<W>::setup_native_heap_internal(const size_t syscall_base)
@@ -31,8 +34,8 @@ void Machine<W>::setup_native_heap_internal(const size_t syscall_base)
 		auto data = machine.arena().malloc(len);
 		HPRINT("SYSCALL calloc(%u, %u) = 0x%X\n", count, size, data);
 		if (data != 0) {
-			// TODO: optimize this (CoW), **can throw**
-			machine.memory.memset(data, 0, len);
+			// Untouched pages are not allocated, **can throw**
+			machine.memory.memzero(data, len);
 		}
 		machine.set_result(data);
 	});
@@ -123,13 +126,13 @@ void Machine<W>::setup_native_heap_internal(const size_t syscall_base)
 }
 
 template <int W>
-const Arena& Machine<W>::arena() const {
+const Arena<W>& Machine<W>::arena() const {
 	if (UNLIKELY(m_arena == nullptr))
 		throw MachineException(ILLEGAL_OPERATION, "Arena not created on this machine");
 	return *m_arena;
 }
 template <int W>
-Arena& Machine<W>::arena() {
+Arena<W>& Machine<W>::arena() {
 	if (UNLIKELY(m_arena == nullptr))
 		throw MachineException(ILLEGAL_OPERATION, "Arena not created on this machine");
 	return *m_arena;
@@ -137,7 +140,11 @@ Arena& Machine<W>::arena() {
 template <int W>
 void Machine<W>::setup_native_heap(size_t sysnum, uint64_t base, size_t max_memory)
 {
-	m_arena.reset(new Arena(base, base + max_memory));
+	using PointerType = typename Arena<W>::PointerType;
+	if (base + max_memory < base
+		|| base + max_memory > std::numeric_limits<PointerType>::max())
+		throw MachineException(ILLEGAL_OPERATION, "Native heap arena is outside of the address space", base);
+	m_arena.reset(new Arena<W>(base, base + max_memory));
 
 	this->setup_native_heap_internal(sysnum);
 }
@@ -204,6 +211,15 @@ void Machine<W>::setup_native_memory(const size_t syscall_base)
 		MPRINT("SYSCALL memcmp(%#X, %#X, %u)\n", p1, p2, len);
 		m.increment_counter(2 * len);
 		m.set_result(m.memory.memcmp(p1, p2, len));
+	}}, {syscall_base+4, [] (Machine<W>& m) {
+		// Memchr n+4
+		auto [addr, value, len] =
+			m.sysargs<address_type<W>, int, address_type<W>> ();
+		const auto found = m.memory.memchr(addr, value, len);
+		m.increment_counter(found ? found - addr : len);
+		m.set_result(found);
+		MPRINT("SYSCALL memchr(%#lX, %d, %lu) = %#lX\n",
+			(long) addr, value, (long) len, (long) found);
 	}}, {syscall_base+5, [] (Machine<W>& m) {
 		// Strlen n+5
 		auto [addr] = m.sysargs<address_type<W>> ();
@@ -217,19 +233,54 @@ void Machine<W>::setup_native_memory(const size_t syscall_base)
 		auto [a1, a2, maxlen] =
 			m.sysargs<address_type<W>, address_type<W>, uint32_t> ();
 		MPRINT("SYSCALL strncmp(%#lX, %#lX, %u)\n", (long)a1, (long)a2, maxlen);
-		uint32_t len = 0;
-		while (len < maxlen) {
-			const uint8_t v1 = m.memory.template read<uint8_t> (a1 ++);
-			const uint8_t v2 = m.memory.template read<uint8_t> (a2 ++);
-			if (v1 != v2 || v1 == 0) {
-				m.increment_counter(2 + 2 * len);
-				m.set_result(v1 - v2);
-				return;
-			}
-			len ++;
+		m.increment_counter(2 + 2 * m.memory.strlen(a1, maxlen));
+		m.set_result(m.memory.strncmp(a1, a2, maxlen));
+	}}, {syscall_base+7, [] (Machine<W>& m) {
+		// Strchr n+7
+		auto [addr, value] = m.sysargs<address_type<W>, int> ();
+		const size_t len = m.memory.strlen(addr, STRING_MAX);
+		// The zero-terminator is part of the string
+		const auto found = m.memory.memchr(addr, value, len + 1);
+		m.increment_counter(2 * len);
+		m.set_result(found);
+		MPRINT("SYSCALL strchr(%#lX, %d) = %#lX\n",
+			(long) addr, value, (long) found);
+	}}, {syscall_base+8, [] (Machine<W>& m) {
+		// Strcpy n+8
+		auto [dst, src] = m.sysargs<address_type<W>, address_type<W>> ();
+		const size_t len = m.memory.strlen(src, STRING_MAX);
+		m.memory.memcpy(dst, m, src, len + 1);
+		m.increment_counter(2 * len);
+		m.set_result(len);
+		MPRINT("SYSCALL strcpy(%#lX, %#lX) = %lu\n",
+			(long) dst, (long) src, (long) len);
+	}}, {syscall_base+9, [] (Machine<W>& m) {
+		// Strncpy n+9
+		auto [dst, src, g_maxlen] =
+			m.sysargs<address_type<W>, address_type<W>, address_type<W>> ();
+		// The zero-padding is bounded like the string itself
+		const size_t maxlen = std::min<size_t>(g_maxlen, STRING_MAX);
+		const size_t len = m.memory.strlen(src, maxlen);
+		m.memory.memcpy(dst, m, src, len);
+		// The rest of the destination is zero-padded
+		m.memory.memset(dst + len, 0, maxlen - len);
+		m.increment_counter(2 * maxlen);
+		m.set_result(len);
+		MPRINT("SYSCALL strncpy(%#lX, %#lX, %lu) = %lu\n",
+			(long) dst, (long) src, (long) maxlen, (long) len);
+	}}, {syscall_base+10, [] (Machine<W>& m) {
+		// Hash n+10: 32-bit FNV-1a of a buffer, which guests can also
+		// compute on their own and get the same result
+		auto [addr, len] = m.sysargs<address_type<W>, address_type<W>> ();
+		uint32_t hash = 2166136261u;
+		for (const auto span : m.memory.spans(addr, len)) {
+			for (size_t i = 0; i < span.size; i++)
+				hash = (hash ^ span.data[i]) * 16777619u;
 		}
-		m.increment_counter(2 + 2 * len);
-		m.set_result(0);
+		m.increment_counter(2 * len);
+		m.set_result(hash);
+		MPRINT("SYSCALL hash(%#lX, %lu) = %#X\n",
+			(long) addr, (long) len, hash);
 	}}, {syscall_base+14, [] (Machine<W>& m) {
 		// Print backtrace n+14
 		m.memory.print_backtrace(
@@ -240,6 +291,24 @@ void Machine<W>::setup_native_memory(const size_t syscall_base)
 	}}});
 }
 
+template <int W>
+void Machine<W>::setup_native_time(const size_t sysnum)
+{
+	// The page stays at the same address when set up again
+	if (m_time_page_addr == 0) {
+		m_time_page_addr = memory.mmap_address();
+		memory.mmap_address() += Page::size();
+	}
+	this->map_time_page();
+
+	this->install_syscall_handler(sysnum,
+	[] (Machine<W>& m) {
+		// Time page n+0: refreshes the clocks, and returns the page
+		m.update_time_page();
+		m.set_result(m.time_page());
+	});
+}
+
 template struct Machine<4>;
 template struct Machine<8>;
 } // riscv
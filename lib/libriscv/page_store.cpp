@@ -0,0 +1,74 @@
+#include "page_store.hpp"
+
+#include "util/crc32.hpp"
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace riscv
+{
+	struct SharedPageStore
+	{
+		std::mutex mtx;
+		// The checksum is not a guarantee that the pages are identical,
+		// so each checksum has a list of pages to compare against.
+		std::unordered_map<uint32_t, std::vector<std::weak_ptr<const PageData>>> pages;
+
+		static SharedPageStore& get() {
+			static SharedPageStore store;
+			return store;
+		}
+	};
+
+	std::shared_ptr<const PageData> SharedPages::get(const PageData& data)
+	{
+		const uint32_t hash = crc32c(data.buffer8.data(), Page::size());
+		auto& store = SharedPageStore::get();
+
+		std::lock_guard<std::mutex> lock(store.mtx);
+		auto& bucket = store.pages[hash];
+		for (auto it = bucket.begin(); it != bucket.end();)
+		{
+			auto page = it->lock();
+			if (page == nullptr) {
+				it = bucket.erase(it);
+				continue;
+			}
+			if (std::memcmp(page->buffer8.data(), data.buffer8.data(), Page::size()) == 0)
+				return page;
+			++it;
+		}
+		auto page = std::make_shared<const PageData> (data);
+		bucket.push_back(page);
+		return page;
+	}
+
+	SharedPages::Stats SharedPages::stats()
+	{
+		auto& store = SharedPageStore::get();
+		Stats stats;
+
+		std::lock_guard<std::mutex> lock(store.mtx);
+		for (auto it = store.pages.begin(); it != store.pages.end();)
+		{
+			auto& bucket = it->second;
+			for (auto pit = bucket.begin(); pit != bucket.end();)
+			{
+				const long refs = pit->use_count();
+				if (refs == 0) {
+					pit = bucket.erase(pit);
+					continue;
+				}
+				stats.pages ++;
+				stats.references += refs;
+				++pit;
+			}
+			if (bucket.empty())
+				it = store.pages.erase(it);
+			else
+				++it;
+		}
+		return stats;
+	}
+}
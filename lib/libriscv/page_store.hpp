@@ -0,0 +1,24 @@
+#pragma once
+#include "page.hpp"
+
+namespace riscv
+{
+	// A process-wide store of page contents, shared between unrelated
+	// machines, eg. many tenants loading largely identical programs.
+	// Identical pages are stored once, and live for as long as some
+	// machine is holding a reference to them.
+	struct SharedPages
+	{
+		// Returns the shared copy of @data, inserting it if needed
+		static std::shared_ptr<const PageData> get(const PageData& data);
+
+		struct Stats {
+			size_t pages = 0;      // unique pages in the store
+			size_t references = 0; // total number of pages shared
+			size_t bytes_saved() const noexcept {
+				return (references - pages) * Page::size();
+			}
+		};
+		static Stats stats();
+	};
+}
@@ -1,7 +1,9 @@
 #pragma once
 #include <functional>
 #include <map>
+#include <vector>
 #include "types.hpp"
+#include "vfs.hpp"
 
 namespace riscv {
 
@@ -24,6 +26,20 @@ struct FileDescriptors
     real_fd_type erase(int vfd);
 
 	bool is_socket(int) const;
+	// Virtual FDs of files opened in the VirtualFS
+	bool is_virtual(int vfd) const noexcept {
+		return vfd >= VIRTUAL_D_BASE && vfd < SOCKET_D_BASE;
+	}
+	int assign_virtual(const VirtualFile& file) {
+		const int vfd = virtual_counter++;
+		virtual_files.emplace(vfd, file);
+		return vfd;
+	}
+	VirtualFile* get_virtual(int vfd) {
+		if (!is_virtual(vfd)) return nullptr;
+		auto it = virtual_files.find(vfd);
+		return (it != virtual_files.end()) ? &it->second : nullptr;
+	}
 	bool permit_write(int vfd) {
 		if (is_socket(vfd)) return true;
 		else return permit_file_write;
@@ -35,10 +51,18 @@ struct FileDescriptors
 
 
 	static constexpr int FILE_D_BASE = 0x1000;
+	static constexpr int VIRTUAL_D_BASE = 0x20001000;
 	static constexpr int SOCKET_D_BASE = 0x40001000;
 	int file_counter = FILE_D_BASE;
+	int virtual_counter = VIRTUAL_D_BASE;
 	int socket_counter = SOCKET_D_BASE;
 
+	// An in-memory filesystem, shared read-only between machines. When set,
+	// path-based system calls are served from it, instead of the host
+	// filesystem, and the files opened from it are virtual FDs.
+	std::shared_ptr<const VirtualFS> vfs = nullptr;
+	std::map<int, VirtualFile> virtual_files;
+
 	bool permit_filesystem = false;
 	bool permit_file_write = false;
 	bool permit_sockets = false;
@@ -46,6 +70,21 @@ struct FileDescriptors
 	std::function<bool(void*, const char*)> filter_open = nullptr;
 	std::function<bool(void*, const char*)> filter_stat = nullptr;
 	std::function<bool(void*, uint64_t)> filter_ioctl = nullptr;
+
+	// A host fd, and the poll events that a parked machine waits for
+	struct ParkFd {
+		real_fd_type fd;
+		short events;
+	};
+	// Called when the guest would block in epoll_pwait, ppoll or pselect6,
+	// with the host fds it waits for and the timeout in milliseconds (-1 for
+	// infinite). Returning true parks the machine instead of blocking: it is
+	// stopped, and when it is resumed, on readiness or after the timeout, the
+	// system call is made again without waiting. Eg. an event loop can add
+	// the fds to its own epoll set, and serve many machines from one thread.
+	std::function<bool(void*, const std::vector<ParkFd>&, int)> on_park = nullptr;
+	// True while a machine is parked in a system call
+	bool parked = false;
 };
 
 inline int FileDescriptors::assign(FileDescriptors::real_fd_type real_fd, bool socket)
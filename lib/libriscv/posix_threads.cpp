@@ -1,6 +1,16 @@
 #include "threads.hpp"
 
 namespace riscv {
+	// Futex operations, from linux/futex.h
+	static constexpr int FUTEX_WAIT = 0;
+	static constexpr int FUTEX_WAKE = 1;
+	static constexpr int FUTEX_REQUEUE = 3;
+	static constexpr int FUTEX_CMP_REQUEUE = 4;
+	static constexpr int FUTEX_WAIT_BITSET = 9;
+	static constexpr int FUTEX_WAKE_BITSET = 10;
+	static constexpr int FUTEX_CMD_MASK = ~(128 | 256); // PRIVATE, CLOCK_REALTIME
+	static constexpr uint32_t FUTEX_BITSET_MATCH_ANY = 0xFFFFFFFF;
+	static constexpr int PRIO_PROCESS = 0;
 
 template <int W>
 void Machine<W>::setup_posix_threads()
@@ -71,6 +81,36 @@ void Machine<W>::setup_posix_threads()
 		}
 		machine.stop();
 	});
+	// setpriority
+	this->install_syscall_handler(140,
+	[] (Machine<W>& machine) {
+		const auto [which, who, prio] = machine.template sysargs <int, int, int> ();
+		THPRINT(machine,
+			">>> setpriority(%d, %d, %d)\n", which, who, prio);
+		if (which != PRIO_PROCESS) {
+			machine.set_result(-EINVAL);
+			return;
+		}
+		auto& threads = machine.threads();
+		const int tid = (who == 0) ? threads.get_tid() : who;
+		machine.set_result(threads.set_priority(tid, prio) ? 0 : -ESRCH);
+	});
+	// getpriority
+	this->install_syscall_handler(141,
+	[] (Machine<W>& machine) {
+		const auto [which, who] = machine.template sysargs <int, int> ();
+		if (which != PRIO_PROCESS) {
+			machine.set_result(-EINVAL);
+			return;
+		}
+		auto& threads = machine.threads();
+		auto* thread = threads.get_thread((who == 0) ? threads.get_tid() : who);
+		// The system call returns 20 - nice, so that it is never negative
+		if (thread != nullptr)
+			machine.set_result(20 - thread->priority);
+		else
+			machine.set_result(-ESRCH);
+	});
 	// gettid
 	this->install_syscall_handler(178,
 	[] (Machine<W>& machine) {
@@ -81,35 +121,64 @@ void Machine<W>::setup_posix_threads()
 	// futex
 	this->install_syscall_handler(98,
 	[] (Machine<W>& machine) {
-		#define FUTEX_WAIT 0
-		#define FUTEX_WAKE 1
 		const auto addr = machine.template sysarg<address_type<W>> (0);
 		const int futex_op = machine.template sysarg<int> (1);
-		const int      val = machine.template sysarg<int> (2);
+		const uint32_t val = machine.template sysarg<uint32_t> (2);
 		THPRINT(machine,
-			">>> futex(0x%lX, op=%d, val=%d)\n", (long) addr, futex_op, val);
-		if ((futex_op & 0xF) == FUTEX_WAIT)
-	    {
+			">>> futex(0x%lX, op=%d, val=%d)\n", (long) addr, futex_op, (int) val);
+		auto& threads = machine.threads();
+		const int cmd = futex_op & FUTEX_CMD_MASK;
+		switch (cmd) {
+		case FUTEX_WAIT:
+		case FUTEX_WAIT_BITSET: {
+			const uint32_t bitset = (cmd == FUTEX_WAIT) ?
+				FUTEX_BITSET_MATCH_ANY : machine.template sysarg<uint32_t> (5);
+			if (bitset == 0) {
+				machine.set_result(-EINVAL);
+				return;
+			}
+			if (machine.memory.template read<uint32_t> (addr) != val) {
+				machine.set_result(-EAGAIN);
+				return;
+			}
+			const bool timed = machine.template sysarg<address_type<W>> (3) != 0;
 			THPRINT(machine,
-				"FUTEX: Waiting for unlock... uaddr=0x%lX val=%d\n", (long) addr, val);
-			while (machine.memory.template read<address_type<W>> (addr) == (address_t)val) {
-				if (machine.threads().suspend_and_yield()) {
-					return;
-				}
+				"FUTEX: Waiting for unlock... uaddr=0x%lX val=%d\n", (long) addr, (int) val);
+			if (threads.futex_wait(addr, bitset, timed))
+				return;
+			// Nothing else can run, so nothing can wake us up
+			if (!timed)
 				machine.cpu.trigger_exception(DEADLOCK_REACHED);
-			}
-			machine.set_result(0);
+			machine.set_result(-ETIMEDOUT);
 			return;
-		} else if ((futex_op & 0xF) == FUTEX_WAKE) {
+		}
+		case FUTEX_WAKE:
+		case FUTEX_WAKE_BITSET: {
+			const uint32_t bitset = (cmd == FUTEX_WAKE) ?
+				FUTEX_BITSET_MATCH_ANY : machine.template sysarg<uint32_t> (5);
+			if (bitset == 0) {
+				machine.set_result(-EINVAL);
+				return;
+			}
 			THPRINT(machine,
-				"FUTEX: Waking others on %d\n", val);
-			if (machine.threads().suspend_and_yield()) {
+				"FUTEX: Waking %d others on 0x%lX\n", (int) val, (long) addr);
+			machine.set_result(threads.futex_wake(addr, val, bitset));
+			return;
+		}
+		case FUTEX_REQUEUE:
+		case FUTEX_CMP_REQUEUE: {
+			const auto requeue = machine.template sysarg<uint32_t> (3);
+			const auto addr2 = machine.template sysarg<address_type<W>> (4);
+			if (cmd == FUTEX_CMP_REQUEUE &&
+				machine.memory.template read<uint32_t> (addr) != machine.template sysarg<uint32_t> (5)) {
+				machine.set_result(-EAGAIN);
 				return;
 			}
-			machine.set_result(0);
+			machine.set_result(threads.futex_requeue(addr, val, addr2, requeue));
 			return;
 		}
-		machine.set_result(-EINVAL);
+		}
+		machine.set_result(-ENOSYS);
 	});
 	// clone
 	this->install_syscall_handler(220,
@@ -29,6 +29,10 @@ namespace riscv
 			return (m_reservations.erase(addr) != 0);
 		}
 
+		// Outstanding reservations, eg. for serialization
+		auto& reservations() noexcept { return m_reservations; }
+		const auto& reservations() const noexcept { return m_reservations; }
+
 	private:
 		inline void check_alignment(int size, address_t addr)
 		{
@@ -960,11 +960,19 @@ namespace riscv
 	}, DECODED_INSTR(OP32).printer);
 
 	INSTRUCTION(FENCE,
-	[] (auto&, rv32i_instruction /* instr */) {
+	[] (auto& cpu, rv32i_instruction instr) {
 		// literally do nothing, unless...
+		if (UNLIKELY(instr.Itype.funct3 == 0x1)) {
+			// FENCE.I: code written by the guest must become visible
+			cpu.machine().memory.invalidate_dynamic_segments();
+			// Re-enter the current execute segment (inbound jumps only)
+			cpu.jump(cpu.pc());
+		}
 	},
-	[] (char* buffer, size_t len, auto&, rv32i_instruction) -> int {
+	[] (char* buffer, size_t len, auto&, rv32i_instruction instr) -> int {
 		// printer
+		if (instr.Itype.funct3 == 0x1)
+			return snprintf(buffer, len, "FENCE.I");
 		return snprintf(buffer, len, "FENCE");
 	});
 }
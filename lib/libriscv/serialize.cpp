@@ -1,8 +1,27 @@
 #include <libriscv/machine.hpp>
+#include "native_heap.hpp"
+#include "threads.hpp"
+#include "util/lzpage.hpp"
+#include <algorithm>
+#include <cerrno>
+#ifndef WIN32
+#include <climits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
 
 namespace riscv
 {
 	static const uint64_t MAGiC_V4LUE = 0x9c36ab9301aed873;
+	// Version 0: Every owned page stored individually, uncompressed
+	// Version 1: Page runs with zero-page elision and optional compression
+	// Version 2: Sections for CPU, memory, threads, arena, files and signals
+	static const uint16_t SERIALIZE_VERSION = 2;
 	template <int W>
 	struct SerializedMachine
 	{
@@ -11,7 +30,7 @@ namespace riscv
 		uint16_t reg_size;
 		uint16_t page_size;
 		uint16_t attr_size;
-		uint16_t reserved;
+		uint16_t version;
 		uint16_t cpu_offset;
 		uint16_t mem_offset;
 
@@ -27,17 +46,788 @@ namespace riscv
 		uint64_t addr;
 		PageAttributes attr;
 	};
+	// Since version 2 the header is followed by sections, each with
+	// a size, so that readers can skip sections they don't know.
+	enum SerializedSectionId : uint32_t
+	{
+		SECTION_END     = 0,
+		SECTION_CPU     = 1,
+		SECTION_MEMORY  = 2,
+		SECTION_THREADS = 3,
+		SECTION_ARENA   = 4,
+		SECTION_FDS     = 5,
+		SECTION_SIGNALS = 6,
+		SECTION_SEGMENTS = 7,
+		SECTION_COUNT
+	};
+	enum SerializedSectionFlags : uint32_t
+	{
+		// The section has no size, and is delimited by its own contents
+		SECTION_UNSIZED = 0x1,
+	};
+	// Sections other than memory are read into memory, and may not
+	// be larger than this, nor larger than the memory of the machine
+	static constexpr uint64_t SECTION_SIZE_MAX = 1ull << 30;
+	struct SerializedSection
+	{
+		uint32_t id;
+		uint32_t flags;
+		uint64_t size;
+	};
+	struct SerializedMemory
+	{
+		uint64_t mmap_address;
+		uint64_t reserved;
+	};
+	// Segment pages that are mapped from the binary are not stored
+	struct SerializedSegment
+	{
+		uint64_t begin;
+		uint64_t end;
+		uint64_t offset;
+		PageAttributes attr;
+	};
+	struct SerializedThreads
+	{
+		int32_t  counter;
+		int32_t  current;
+		uint32_t n_threads;
+		uint32_t n_suspended;
+		uint32_t n_blocked;
+		uint32_t n_futex_waiters;
+	};
+	// Waiters are stored in the order of their futex queues
+	struct SerializedFutexWaiter
+	{
+		int32_t  tid;
+		uint32_t bitset;
+		uint64_t addr;
+		uint32_t timed;
+		uint32_t reserved;
+	};
+	struct SerializedThreadPriority
+	{
+		int32_t tid;
+		int32_t priority;
+	};
+	template <int W>
+	struct SerializedThread
+	{
+		int32_t  tid;
+		int32_t  block_reason;
+		uint64_t stack_base;
+		uint64_t stack_size;
+		uint64_t clear_tid;
+		Registers<W> regs;
+	};
+	struct SerializedFileDescriptors
+	{
+		int32_t  file_counter;
+		int32_t  socket_counter;
+		uint32_t n_files;
+		uint32_t n_virtual; // VirtualFS files, stored after the host files
+		int32_t  virtual_counter;
+		uint32_t reserved;
+	};
+	// Followed by the path of the open file
+	struct SerializedFile
+	{
+		int32_t  vfd;
+		int32_t  flags;
+		int64_t  offset;
+		uint32_t path_len;
+		uint32_t reserved;
+	};
+	struct SerializedSignalAction
+	{
+		uint64_t handler;
+		uint32_t altstack;
+		uint32_t reserved;
+	};
+	template <int W>
+	struct SerializedSignalThread
+	{
+		int32_t  tid;
+		int32_t  ss_flags;
+		uint64_t ss_sp;
+		uint64_t ss_size;
+		Registers<W> sigret;
+	};
+	enum SerializedRunFlags : uint16_t
+	{
+		RUN_ZERO       = 0x1, // All-zero pages, no page data follows
+		RUN_COMPRESSED = 0x2, // Each page is prefixed by its 32-bit length
+		RUN_ALIGNED    = 0x4, // Page data starts at the next page-aligned offset
+	};
+	// A run of contiguous pages with identical attributes,
+	// followed by the page data. A run with no pages terminates.
+	struct SerializedPageRun
+	{
+		uint64_t pageno;
+		uint32_t count;
+		uint16_t flags;
+		uint16_t reserved;
+		PageAttributes attr;
+	};
+
+	// Snapshot output, either appended to a vector, or streamed to a file
+	// descriptor or sink. Small items are staged in a buffer, while page
+	// data is referenced in place until the next flush, which avoids
+	// building the whole snapshot in memory.
+	struct SerializeWriter
+	{
+		static constexpr size_t STAGING_MAX  = 65536;
+		static constexpr size_t SEGMENTS_MAX = 1024;
+
+		SerializeWriter(std::vector<uint8_t>& vec)
+			: m_vec(&vec), m_begin(vec.size()) {}
+		SerializeWriter(int fd)
+			: m_fd(fd), m_staging(new uint8_t[STAGING_MAX]) {}
+		SerializeWriter(serialize_sink_t sink)
+			: m_sink(std::move(sink)), m_staging(new uint8_t[STAGING_MAX]) {}
+
+		template <typename T>
+		void append(const T& value) { this->write((const uint8_t*) &value, sizeof(T)); }
+		// Copies the data
+		void write(const uint8_t* data, size_t len);
+		// The data must stay unchanged until the next flush
+		void write_ref(const uint8_t* data, size_t len);
+		void pad(size_t len);
+		// Bytes written since the start of the snapshot
+		size_t offset() const noexcept {
+			if (m_vec) return m_vec->size() - m_begin;
+			return m_written + m_pending;
+		}
+		bool is_vector() const noexcept { return m_vec != nullptr; }
+		// Returns 0, or a negative error
+		int flush();
+
+	private:
+		struct Segment {
+			const uint8_t* data;
+			size_t len;
+		};
+		std::vector<uint8_t>* m_vec = nullptr;
+		size_t m_begin = 0;
+		int    m_fd = -1;
+		serialize_sink_t m_sink = nullptr;
+		std::unique_ptr<uint8_t[]> m_staging = nullptr;
+		size_t m_staged = 0;
+		std::vector<Segment> m_segments;
+		size_t m_pending = 0;
+		size_t m_written = 0;
+		int    m_error = 0;
+	};
+
+	void SerializeWriter::write(const uint8_t* data, size_t len)
+	{
+		if (m_vec) {
+			m_vec->insert(m_vec->end(), data, data + len);
+			return;
+		}
+		if (len > STAGING_MAX / 4) {
+			// large items are written immediately, without staging
+			this->write_ref(data, len);
+			this->flush();
+			return;
+		}
+		if (m_staged + len > STAGING_MAX)
+			this->flush();
+		uint8_t* dst = &m_staging[m_staged];
+		std::memcpy(dst, data, len);
+		m_staged += len;
+		// extend the previous segment, when contiguous
+		if (!m_segments.empty() && m_segments.back().data + m_segments.back().len == dst) {
+			m_segments.back().len += len;
+			m_pending += len;
+		} else {
+			m_segments.push_back({dst, len});
+			m_pending += len;
+			if (m_segments.size() >= SEGMENTS_MAX)
+				this->flush();
+		}
+	}
+	void SerializeWriter::write_ref(const uint8_t* data, size_t len)
+	{
+		if (m_vec) {
+			m_vec->insert(m_vec->end(), data, data + len);
+			return;
+		}
+		m_segments.push_back({data, len});
+		m_pending += len;
+		if (m_segments.size() >= SEGMENTS_MAX)
+			this->flush();
+	}
+	void SerializeWriter::pad(size_t len)
+	{
+		static const std::array<uint8_t, Page::size()> zeroes {};
+		while (len > 0) {
+			const size_t chunk = std::min(len, zeroes.size());
+			this->write_ref(zeroes.data(), chunk);
+			len -= chunk;
+		}
+	}
+	int SerializeWriter::flush()
+	{
+		if (m_vec != nullptr || m_segments.empty() || m_error != 0) {
+			m_segments.clear();
+			m_staged = 0;
+			return m_error;
+		}
+		if (m_sink) {
+			for (const auto& seg : m_segments) {
+				if (!m_sink(seg.data, seg.len)) {
+					m_error = -EIO;
+					break;
+				}
+			}
+		} else {
+#ifndef WIN32
+			std::vector<struct iovec> iov(m_segments.size());
+			for (size_t i = 0; i < iov.size(); i++) {
+				iov[i].iov_base = (void*) m_segments[i].data;
+				iov[i].iov_len  = m_segments[i].len;
+			}
+			size_t i = 0;
+			while (i < iov.size())
+			{
+				const ssize_t res = writev(m_fd, &iov[i], std::min(iov.size() - i, (size_t) IOV_MAX));
+				if (res < 0) {
+					if (errno == EINTR) continue;
+					m_error = -errno;
+					break;
+				}
+				// skip past fully written buffers, and adjust partial ones
+				size_t bytes = res;
+				while (i < iov.size() && bytes >= iov[i].iov_len) {
+					bytes -= iov[i].iov_len;
+					i++;
+				}
+				if (i < iov.size()) {
+					iov[i].iov_base = (char*) iov[i].iov_base + bytes;
+					iov[i].iov_len -= bytes;
+				}
+			}
+#else
+			for (const auto& seg : m_segments) {
+				if (::write(m_fd, seg.data, seg.len) != (int) seg.len) {
+					m_error = -EIO;
+					break;
+				}
+			}
+#endif
+		}
+		m_written += m_pending;
+		m_pending = 0;
+		m_segments.clear();
+		m_staged = 0;
+		return m_error;
+	}
+
+	// Snapshot input, either from memory, or streamed from a file
+	// descriptor or source. Streamed input is read through a buffer,
+	// except for reads of at least BUFFER_MAX bytes.
+	struct DeserializeReader
+	{
+		static constexpr size_t BUFFER_MAX = 65536;
+
+		DeserializeReader(const uint8_t* data, size_t size)
+			: m_data(data), m_size(size) {}
+		DeserializeReader(serialize_source_t source)
+			: m_source(std::move(source)), m_buffer(new uint8_t[BUFFER_MAX]) {}
+
+		template <typename T>
+		bool read(T& value) { return this->read((uint8_t*) &value, sizeof(T)); }
+		bool read(uint8_t* dst, size_t len);
+		bool skip(size_t len);
+		// Gives direct access to the next @len bytes, when reading
+		// from memory, otherwise returns nullptr
+		const uint8_t* view(size_t len);
+		size_t offset() const noexcept { return m_offset; }
+		bool in_memory() const noexcept { return m_data != nullptr; }
+		size_t size() const noexcept { return m_size; }
+
+	private:
+		bool fill();
+		const uint8_t* m_data = nullptr;
+		size_t m_size = 0;
+		size_t m_offset = 0;
+		serialize_source_t m_source = nullptr;
+		std::unique_ptr<uint8_t[]> m_buffer = nullptr;
+		size_t m_buffer_pos = 0;
+		size_t m_buffer_len = 0;
+	};
+
+	bool DeserializeReader::fill()
+	{
+		m_buffer_pos = 0;
+		m_buffer_len = 0;
+		const int64_t res = m_source(m_buffer.get(), BUFFER_MAX);
+		if (res <= 0)
+			return false;
+		m_buffer_len = res;
+		return true;
+	}
+	bool DeserializeReader::read(uint8_t* dst, size_t len)
+	{
+		if (m_data != nullptr) {
+			if (len > m_size - m_offset)
+				return false;
+			std::memcpy(dst, &m_data[m_offset], len);
+			m_offset += len;
+			return true;
+		}
+		while (len > 0)
+		{
+			if (m_buffer_pos == m_buffer_len) {
+				// large reads go directly to the destination
+				if (len >= BUFFER_MAX) {
+					const int64_t res = m_source(dst, len);
+					if (res <= 0) return false;
+					dst += res; len -= res; m_offset += res;
+					continue;
+				}
+				if (!this->fill())
+					return false;
+			}
+			const size_t chunk = std::min(len, m_buffer_len - m_buffer_pos);
+			std::memcpy(dst, &m_buffer[m_buffer_pos], chunk);
+			m_buffer_pos += chunk;
+			m_offset += chunk;
+			dst += chunk;
+			len -= chunk;
+		}
+		return true;
+	}
+	bool DeserializeReader::skip(size_t len)
+	{
+		if (m_data != nullptr) {
+			if (len > m_size - m_offset)
+				return false;
+			m_offset += len;
+			return true;
+		}
+		while (len > 0)
+		{
+			if (m_buffer_pos == m_buffer_len && !this->fill())
+				return false;
+			const size_t chunk = std::min(len, m_buffer_len - m_buffer_pos);
+			m_buffer_pos += chunk;
+			m_offset += chunk;
+			len -= chunk;
+		}
+		return true;
+	}
+	const uint8_t* DeserializeReader::view(size_t len)
+	{
+		if (m_data == nullptr || len > m_size - m_offset)
+			return nullptr;
+		const uint8_t* ptr = &m_data[m_offset];
+		m_offset += len;
+		return ptr;
+	}
+
+	template <typename T>
+	static inline void serialize_append(std::vector<uint8_t>& vec, const T& value)
+	{
+		auto* ptr = (const uint8_t*) &value;
+		vec.insert(vec.end(), ptr, ptr + sizeof(T));
+	}
+	// Reads a T at @off, advancing it. Returns false if out of bounds.
+	template <typename T>
+	static inline bool deserialize_read(const uint8_t* data, size_t size, size_t& off, T& value)
+	{
+		if (size < sizeof(T) || off > size - sizeof(T))
+			return false;
+		std::memcpy(&value, &data[off], sizeof(T));
+		off += sizeof(T);
+		return true;
+	}
+	// CoW pages are writable pages that have not been written to yet,
+	// and ownership is decided when restoring
+	static inline PageAttributes serialized_attr(PageAttributes attr)
+	{
+		attr.write = attr.write || attr.is_cow;
+		attr.is_cow = false;
+		attr.non_owning = false;
+		return attr;
+	}
+	static inline bool same_serialized_attr(const PageAttributes& a, const PageAttributes& b)
+	{
+		return a.read == b.read && a.write == b.write && a.exec == b.exec
+			&& a.dont_fork == b.dont_fork && a.cacheable == b.cacheable
+			&& a.user_defined == b.user_defined;
+	}
+	static inline bool is_zero_backed(const Page& page)
+	{
+		return page.has_data() && page.data() == Page::cow_page().data();
+	}
+	static inline bool is_zero_page(const Page& page)
+	{
+		return is_zero_backed(page)
+			|| std::memcmp(page.data(), Page::cow_page().data(), Page::size()) == 0;
+	}
+
+	template <int W>
+	static void serialize_threads(const MultiThreading<W>& mt, std::vector<uint8_t>& vec)
+	{
+		uint32_t n_blocked = 0, n_futex_waiters = 0;
+		for (const auto& it : mt.m_blocked)
+			n_blocked += it.second.size();
+		for (const auto& it : mt.m_futex_queues)
+			n_futex_waiters += it.second.size();
+		serialize_append(vec, SerializedThreads {
+			.counter = mt.thread_counter,
+			.current = mt.get_tid(),
+			.n_threads   = (uint32_t) mt.m_threads.size(),
+			.n_suspended = (uint32_t) mt.m_suspended.size(),
+			.n_blocked   = n_blocked,
+			.n_futex_waiters = n_futex_waiters
+		});
+		for (const auto& it : mt.m_threads)
+		{
+			const auto& thread = it.second;
+			serialize_append(vec, SerializedThread<W> {
+				.tid = thread.tid,
+				.block_reason = thread.block_reason,
+				.stack_base = thread.stack_base,
+				.stack_size = thread.stack_size,
+				.clear_tid  = thread.clear_tid,
+				.regs = thread.stored_regs
+			});
+		}
+		// the scheduling order is kept
+		mt.m_suspended.for_each([&] (const auto* thread) {
+			serialize_append(vec, (int32_t) thread->tid);
+		});
+		for (const auto& it : mt.m_blocked)
+		{
+			it.second.for_each([&] (const auto* thread) {
+				serialize_append(vec, (int32_t) thread->tid);
+			});
+		}
+		for (const auto& it : mt.m_futex_queues)
+		{
+			it.second.for_each([&] (const auto* thread) {
+				serialize_append(vec, SerializedFutexWaiter {
+					.tid = thread->tid,
+					.bitset = thread->futex_bitset,
+					.addr = thread->futex_addr,
+					.timed = thread->futex_timed,
+					.reserved = 0
+				});
+			});
+		}
+		// Priorities come last, so that older readers can skip them
+		uint32_t n_priorities = 0;
+		for (const auto& it : mt.m_threads)
+			n_priorities += (it.second.priority != 0);
+		serialize_append(vec, n_priorities);
+		for (const auto& it : mt.m_threads)
+		{
+			if (it.second.priority != 0)
+				serialize_append(vec, SerializedThreadPriority {
+					.tid = it.second.tid,
+					.priority = it.second.priority
+				});
+		}
+	}
+	template <int W>
+	static bool deserialize_threads(MultiThreading<W>& mt, const uint8_t* data, size_t size)
+	{
+		size_t off = 0;
+		SerializedThreads state;
+		if (!deserialize_read(data, size, off, state))
+			return false;
+		mt.m_suspended.clear();
+		mt.m_blocked.clear();
+		mt.m_futex_queues.clear();
+		mt.m_threads.clear();
+		mt.m_current = nullptr;
+		mt.thread_counter = state.counter;
+
+		for (size_t i = 0; i < state.n_threads; i++)
+		{
+			SerializedThread<W> st;
+			if (!deserialize_read(data, size, off, st))
+				return false;
+			auto it = mt.m_threads.try_emplace(st.tid,
+				mt, st.tid, 0x0, 0x0, st.stack_base, st.stack_size);
+			auto& thread = it.first->second;
+			thread.stored_regs  = st.regs;
+			thread.clear_tid    = st.clear_tid;
+			thread.block_reason = st.block_reason;
+		}
+		mt.m_current = mt.get_thread(state.current);
+		if (mt.m_current == nullptr)
+			return false;
+
+		// The run queue depends on the priorities at the end
+		std::vector<Thread<W>*> suspended, blocked;
+		auto restore_list = [&] (auto& list, size_t count) {
+			for (size_t i = 0; i < count; i++) {
+				int32_t tid;
+				if (!deserialize_read(data, size, off, tid))
+					return false;
+				auto* thread = mt.get_thread(tid);
+				if (thread == nullptr)
+					return false;
+				list.push_back(thread);
+			}
+			return true;
+		};
+		if (!restore_list(suspended, state.n_suspended)
+			|| !restore_list(blocked, state.n_blocked))
+			return false;
+		for (size_t i = 0; i < state.n_futex_waiters; i++)
+		{
+			SerializedFutexWaiter waiter;
+			if (!deserialize_read(data, size, off, waiter))
+				return false;
+			auto* thread = mt.get_thread(waiter.tid);
+			if (thread == nullptr || waiter.bitset == 0)
+				return false;
+			thread->futex_addr   = waiter.addr;
+			thread->futex_bitset = waiter.bitset;
+			thread->futex_timed  = waiter.timed != 0;
+			thread->state = Thread<W>::FUTEX_WAIT;
+			mt.m_futex_queues[waiter.addr].push_back(thread);
+		}
+		uint32_t n_priorities = 0;
+		if (off < size && !deserialize_read(data, size, off, n_priorities))
+			return false;
+		for (size_t i = 0; i < n_priorities; i++)
+		{
+			SerializedThreadPriority prio;
+			if (!deserialize_read(data, size, off, prio))
+				return false;
+			auto* thread = mt.get_thread(prio.tid);
+			if (thread == nullptr || prio.priority < RunQueue<W>::PRIORITY_MIN
+				|| prio.priority > RunQueue<W>::PRIORITY_MAX)
+				return false;
+			thread->priority = prio.priority;
+		}
+		for (auto* thread : suspended)
+			mt.m_suspended.push_back(thread);
+		for (auto* thread : blocked) {
+			thread->state = Thread<W>::BLOCKED;
+			mt.m_blocked[thread->block_reason].push_back(thread);
+		}
+		return true;
+	}
+
+#ifndef WIN32
+	// The absolute path of a VirtualFS node, found by walking up the tree
+	// (the root is its own parent)
+	static std::string virtual_path(const VirtualFS::Node* node)
+	{
+		std::string path;
+		for (; node->parent != nullptr && node->parent != node; node = node->parent) {
+			for (const auto& [name, child] : node->parent->children) {
+				if (child == node) {
+					path = "/" + name + path;
+					break;
+				}
+			}
+		}
+		return path.empty() ? "/" : path;
+	}
+	// Open files are stored by path, flags and offset, so that they can be
+	// re-opened on restore. Sockets and anonymous files (pipes etc.) cannot
+	// be re-created, and are dropped.
+	static void serialize_fds(const FileDescriptors& fds, std::vector<uint8_t>& vec)
+	{
+		const size_t state_offset = vec.size();
+		SerializedFileDescriptors state {
+			.file_counter = fds.file_counter,
+			.socket_counter = fds.socket_counter,
+			.n_files = 0,
+			.n_virtual = 0,
+			.virtual_counter = fds.virtual_counter,
+			.reserved = 0
+		};
+		serialize_append(vec, state);
+
+		for (const auto& it : fds.translation)
+		{
+			if (fds.is_socket(it.first)) continue;
+			char procpath[64];
+			snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", it.second);
+			char path[PATH_MAX];
+			const ssize_t len = readlink(procpath, path, sizeof(path));
+			if (len <= 0 || len >= (ssize_t) sizeof(path) || path[0] != '/')
+				continue;
+			const int flags = fcntl(it.second, F_GETFL);
+			if (flags < 0)
+				continue;
+			serialize_append(vec, SerializedFile {
+				.vfd = it.first,
+				.flags = flags,
+				.offset = lseek(it.second, 0, SEEK_CUR),
+				.path_len = (uint32_t) len,
+				.reserved = 0
+			});
+			vec.insert(vec.end(), path, path + len);
+			state.n_files ++;
+		}
+		// VirtualFS files are looked up again by path on restore
+		for (const auto& [vfd, file] : fds.virtual_files)
+		{
+			const std::string path = virtual_path(file.node);
+			serialize_append(vec, SerializedFile {
+				.vfd = vfd,
+				.flags = file.flags,
+				.offset = (int64_t) file.offset,
+				.path_len = (uint32_t) path.size(),
+				.reserved = 0
+			});
+			vec.insert(vec.end(), path.begin(), path.end());
+			state.n_virtual ++;
+		}
+		std::memcpy(&vec[state_offset], &state, sizeof(state));
+	}
+	struct DeserializedFile {
+		SerializedFile file;
+		std::string path;
+	};
+	static bool deserialize_fds(const uint8_t* data, size_t size,
+		SerializedFileDescriptors& state, std::vector<DeserializedFile>& files)
+	{
+		size_t off = 0;
+		if (!deserialize_read(data, size, off, state))
+			return false;
+		// host files first, followed by the VirtualFS files
+		for (size_t i = 0; i < size_t(state.n_files) + state.n_virtual; i++)
+		{
+			SerializedFile file;
+			if (!deserialize_read(data, size, off, file))
+				return false;
+			if (file.path_len >= PATH_MAX || size - off < file.path_len)
+				return false;
+			files.push_back({file, std::string((const char*) &data[off], file.path_len)});
+			off += file.path_len;
+		}
+		return true;
+	}
+	// Files are re-opened with the permissions of the machine being restored
+	template <int W>
+	static void restore_fds(Machine<W>& machine, FileDescriptors& fds,
+		const SerializedFileDescriptors& state, const std::vector<DeserializedFile>& files)
+	{
+		for (const auto& it : fds.translation) {
+			::close(it.second);
+		}
+		fds.translation.clear();
+		fds.file_counter = state.file_counter;
+		fds.socket_counter = state.socket_counter;
+		// VirtualFS files of this machine never outlive the restore
+		fds.virtual_files.clear();
+		fds.virtual_counter = state.virtual_counter;
+
+		for (size_t i = state.n_files; i < files.size(); i++)
+		{
+			const auto& [file, path] = files[i];
+			if (fds.vfs == nullptr)
+				continue;
+			int error;
+			const auto* node = fds.vfs->lookup(nullptr, path, false, error);
+			if (node == nullptr)
+				continue;
+			fds.virtual_files.emplace(file.vfd, VirtualFile {
+				.node = node,
+				.offset = (uint64_t) file.offset,
+				.flags = file.flags
+			});
+		}
+
+		for (size_t i = 0; i < state.n_files; i++)
+		{
+			const auto& [file, path] = files[i];
+			if (!fds.permit_filesystem) continue;
+			if (fds.filter_open != nullptr) {
+				if (!fds.filter_open(machine.template get_userdata<void>(), path.c_str()))
+					continue;
+			}
+			const int flags = file.flags & ~(O_CREAT | O_EXCL | O_TRUNC);
+			const int real_fd = open(path.c_str(), flags);
+			if (real_fd < 0)
+				continue;
+			if (file.offset > 0)
+				lseek(real_fd, file.offset, SEEK_SET);
+			fds.translation.emplace(file.vfd, real_fd);
+		}
+	}
+#endif
 
 	template <int W>
-	void Machine<W>::serialize_to(std::vector<uint8_t>& vec)
+	static void serialize_signals(Signals<W>& signals, std::vector<uint8_t>& vec)
+	{
+		for (const auto& action : signals.signals) {
+			serialize_append(vec, SerializedSignalAction {
+				.handler  = action.handler,
+				.altstack = action.altstack,
+				.reserved = 0
+			});
+		}
+		const auto& per_thread = signals.per_thread_map();
+		serialize_append(vec, (uint32_t) per_thread.size());
+		for (const auto& it : per_thread) {
+			serialize_append(vec, SerializedSignalThread<W> {
+				.tid = it.first,
+				.ss_flags = it.second.stack.ss_flags,
+				.ss_sp    = it.second.stack.ss_sp,
+				.ss_size  = it.second.stack.ss_size,
+				.sigret   = it.second.sigret.regs
+			});
+		}
+	}
+	template <int W>
+	static bool deserialize_signals(Signals<W>& signals, const uint8_t* data, size_t size)
+	{
+		size_t off = 0;
+		for (auto& action : signals.signals) {
+			SerializedSignalAction sa;
+			if (!deserialize_read(data, size, off, sa))
+				return false;
+			action.handler  = sa.handler;
+			action.altstack = sa.altstack != 0;
+		}
+		uint32_t n_threads;
+		if (!deserialize_read(data, size, off, n_threads))
+			return false;
+		for (size_t i = 0; i < n_threads; i++) {
+			SerializedSignalThread<W> st;
+			if (!deserialize_read(data, size, off, st))
+				return false;
+			auto& per_thread = signals.per_thread(st.tid);
+			per_thread.stack.ss_sp    = st.ss_sp;
+			per_thread.stack.ss_flags = st.ss_flags;
+			per_thread.stack.ss_size  = st.ss_size;
+			per_thread.sigret.regs    = st.sigret;
+		}
+		return true;
+	}
+
+	// Small sections are built in memory, so that their size is known
+	template <typename Func>
+	static void serialize_section(SerializeWriter& writer, uint32_t id, Func func)
+	{
+		std::vector<uint8_t> payload;
+		func(payload);
+		writer.append(SerializedSection { .id = id, .flags = 0, .size = payload.size() });
+		writer.write(payload.data(), payload.size());
+	}
+
+	template <int W>
+	void Machine<W>::serialize_to(SerializeWriter& writer, const SerializeOptions& options)
 	{
 		const SerializedMachine<W> header {
 			.magic    = MAGiC_V4LUE,
-			.n_pages  = (unsigned) memory.owned_pages_active(),
+			.n_pages  = (uint32_t) this->memory.serialized_page_count(),
 			.reg_size = sizeof(Registers<W>),
 			.page_size = Page::size(),
 			.attr_size = sizeof(PageAttributes),
-			.reserved = 0,
+			.version  = SERIALIZE_VERSION,
 			.cpu_offset = sizeof(SerializedMachine<W>),
 			.mem_offset = sizeof(SerializedMachine<W>),
 
@@ -48,47 +838,257 @@ namespace riscv
 			.stack_address = memory.stack_initial(),
 			.exit_address  = memory.exit_address(),
 		};
-		const auto* hptr = (const uint8_t*) &header;
-		vec.insert(vec.end(), hptr, hptr + sizeof(header));
-		this->cpu.serialize_to(vec);
-		this->memory.serialize_to(vec);
+		writer.append(header);
+
+		serialize_section(writer, SECTION_CPU, [&] (auto& vec) {
+			this->cpu.serialize_to(vec);
+		});
+		if (m_mt != nullptr) {
+			serialize_section(writer, SECTION_THREADS, [&] (auto& vec) {
+				serialize_threads(*m_mt, vec);
+			});
+		}
+		if (m_arena != nullptr) {
+			serialize_section(writer, SECTION_ARENA, [&] (auto& vec) {
+				m_arena->serialize_to(vec);
+			});
+		}
+#ifndef WIN32
+		if (m_fds != nullptr) {
+			serialize_section(writer, SECTION_FDS, [&] (auto& vec) {
+				serialize_fds(*m_fds, vec);
+			});
+		}
+#endif
+		if (m_signals != nullptr) {
+			serialize_section(writer, SECTION_SIGNALS, [&] (auto& vec) {
+				serialize_signals(*m_signals, vec);
+			});
+		}
+		if (memory.mapped_segments() > 0) {
+			serialize_section(writer, SECTION_SEGMENTS, [&] (auto& vec) {
+				this->memory.serialize_segments(vec);
+			});
+		}
+		// memory is the largest section, and so it goes last,
+		// delimited by its terminating page run
+		writer.append(SerializedSection { .id = SECTION_MEMORY, .flags = SECTION_UNSIZED, .size = 0 });
+		this->memory.serialize_to(writer, options);
+		writer.append(SerializedSection { .id = SECTION_END, .flags = 0, .size = 0 });
 	}
 	template <int W>
-	void CPU<W>::serialize_to(std::vector<uint8_t>& /* vec */)
+	void Machine<W>::serialize_to(std::vector<uint8_t>& vec, const SerializeOptions& options)
 	{
+		SerializeWriter writer { vec };
+		this->serialize_to(writer, options);
 	}
 	template <int W>
-	void Memory<W>::serialize_to(std::vector<uint8_t>& vec)
+	int Machine<W>::serialize_to(int fd, const SerializeOptions& options)
 	{
-		const size_t est_page_bytes =
-			this->m_pages.size() * (sizeof(SerializedPage) + Page::size());
-		vec.reserve(vec.size() + est_page_bytes);
-
+		SerializeWriter writer { fd };
+		this->serialize_to(writer, options);
+		return writer.flush();
+	}
+	template <int W>
+	int Machine<W>::serialize_to(serialize_sink_t sink, const SerializeOptions& options)
+	{
+		SerializeWriter writer { std::move(sink) };
+		this->serialize_to(writer, options);
+		return writer.flush();
+	}
+	template <int W>
+	void CPU<W>::serialize_to(std::vector<uint8_t>& vec)
+	{
+#ifdef RISCV_EXT_ATOMICS
+		// outstanding load-reserved addresses
+		const auto& reservations = this->m_atomics.reservations();
+		serialize_append(vec, (uint64_t) reservations.size());
+		for (const auto addr : reservations)
+			serialize_append(vec, (uint64_t) addr);
+#else
+		(void) vec;
+#endif
+	}
+	template <int W>
+	size_t Memory<W>::serialize_to(SerializeWriter& writer, const SerializeOptions& options) const
+	{
+		struct StoredPage {
+			address_t   pageno;
+			const Page* page;
+			PageAttributes attr;
+			bool        zero;
+		};
+		std::vector<StoredPage> pages;
+		pages.reserve(this->m_pages.size());
 		for (const auto& it : this->m_pages)
 		{
 			const auto& page = it.second;
-			assert(!page.attr.is_cow && "Should never have CoW pages stored");
-			// we want to ignore shared/non-owned pages
-			if (page.attr.non_owning) continue;
-			const SerializedPage spage {
-				.addr = it.first,
-				.attr = page.attr
-			};
-			auto* sptr = (const uint8_t*) &spage;
-			vec.insert(vec.end(), sptr, sptr + sizeof(SerializedPage));
-			// page data
-			auto* pptr = page.data();
-			vec.insert(vec.end(), pptr, pptr + Page::size());
+			if (!is_serialized(it.first, page))
+				continue;
+			auto attr = serialized_attr(page.attr);
+			// pages of cached guest JIT code are write-protected while
+			// the segment lives, and are stored with their own permission
+			if (is_dynamic_page(it.first))
+				attr.write = attr.write || m_dynamic_pages.at(it.first);
+			pages.push_back({it.first, &page, attr, is_zero_page(page)});
+		}
+		// runs are formed from pages in ascending order
+		std::sort(pages.begin(), pages.end(),
+			[] (const auto& a, const auto& b) { return a.pageno < b.pageno; });
+
+		const bool compress = options.compress && !options.page_aligned;
+		writer.append(SerializedMemory {
+			.mmap_address = this->m_mmap_address,
+			.reserved = 0
+		});
+		std::array<uint8_t, Page::size()> cbuffer;
+
+		size_t i = 0;
+		while (i < pages.size())
+		{
+			const auto& first = pages[i];
+			const auto& attr = first.attr;
+			size_t count = 1;
+			while (i + count < pages.size())
+			{
+				const auto& next = pages[i + count];
+				if (next.pageno != first.pageno + count || next.zero != first.zero
+					|| !same_serialized_attr(next.attr, attr))
+					break;
+				count++;
+			}
+			uint16_t flags = 0;
+			if (first.zero)
+				flags = RUN_ZERO;
+			else if (options.page_aligned)
+				flags = RUN_ALIGNED;
+			else if (compress)
+				flags = RUN_COMPRESSED;
+			writer.append(SerializedPageRun {
+				.pageno = first.pageno,
+				.count  = (uint32_t) count,
+				.flags  = flags,
+				.reserved = 0,
+				.attr   = attr
+			});
+			if (flags & RUN_ALIGNED) {
+				const size_t misalign = writer.offset() & (Page::size()-1);
+				if (misalign != 0)
+					writer.pad(Page::size() - misalign);
+			}
+
+			for (size_t p = i; p < i + count && !first.zero; p++)
+			{
+				const auto* pdata = pages[p].page->data();
+				if (compress) {
+					// incompressible pages are stored as-is
+					const uint32_t clen = lz_compress(pdata, Page::size(),
+						cbuffer.data(), cbuffer.size() - 1);
+					if (clen != 0) {
+						writer.append(clen);
+						writer.write(cbuffer.data(), clen);
+						continue;
+					}
+					writer.append((uint32_t) Page::size());
+				}
+				// page data is not copied when streaming
+				writer.write_ref(pdata, Page::size());
+			}
+			i += count;
+		}
+		// terminating run
+		writer.append(SerializedPageRun {});
+		return pages.size();
+	}
+
+	template <int W>
+	bool Memory<W>::is_serialized(address_t pageno, const Page& page) const noexcept
+	{
+		// we want to ignore shared/non-owned pages, except for
+		// copy-on-write pages that are backed by the zero page,
+		// by a previously restored snapshot image, by the
+		// process-wide page store or by mapped host files
+		return !page.attr.non_owning || is_zero_backed(page) || is_image_backed(page)
+			|| is_shared_backed(page) || is_host_mapped(pageno);
+	}
+	template <int W>
+	size_t Memory<W>::serialized_page_count() const
+	{
+		size_t count = 0;
+		for (const auto& it : this->m_pages) {
+			if (is_serialized(it.first, it.second))
+				count++;
 		}
+		return count;
 	}
 
+	template <int W>
+	struct Memory<W>::Snapshot
+	{
+		decltype(Memory<W>::m_pages) pages;
+		std::vector<MappedSegment> mapped;
+		address_t mmap_address = 0;
+		std::shared_ptr<const uint8_t> image;
+		size_t image_size = 0;
+	};
+
 	template <int W>
 	int Machine<W>::deserialize_from(const std::vector<uint8_t>& vec)
 	{
-		if (vec.size() < sizeof(SerializedMachine<W>)) {
-			return -1;
+		DeserializeReader reader { vec.data(), vec.size() };
+		return this->deserialize_from(reader, nullptr);
+	}
+	template <int W>
+	int Machine<W>::deserialize_from(serialize_source_t source)
+	{
+		DeserializeReader reader { std::move(source) };
+		return this->deserialize_from(reader, nullptr);
+	}
+	template <int W>
+	int Machine<W>::deserialize_from(int fd)
+	{
+		return this->deserialize_from(
+			[fd] (uint8_t* dst, size_t len) -> int64_t {
+				while (true) {
+					const auto res = ::read(fd, dst, len);
+					if (res >= 0 || errno != EINTR)
+						return res;
+				}
+			});
+	}
+	template <int W>
+	int Machine<W>::deserialize_mapped(const std::string& filename)
+	{
+#ifndef WIN32
+		const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return -7;
+		struct stat st;
+		if (fstat(fd, &st) < 0 || st.st_size == 0) {
+			close(fd);
+			return -7;
 		}
-		const auto& header = *(const SerializedMachine<W>*) vec.data();
+		const size_t size = st.st_size;
+		// a private read-only mapping shares the page cache
+		void* ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (ptr == MAP_FAILED)
+			return -7;
+		std::shared_ptr<const uint8_t> image { (const uint8_t*) ptr,
+			[size] (const uint8_t* data) { munmap((void*) data, size); } };
+		DeserializeReader reader { image.get(), size };
+		return this->deserialize_from(reader, std::move(image));
+#else
+		(void) filename;
+		return -7;
+#endif
+	}
+	template <int W>
+	int Machine<W>::deserialize_from(DeserializeReader& reader, std::shared_ptr<const uint8_t> image)
+	{
+		SerializedMachine<W> header;
+		if (!reader.read(header))
+			return -1;
 		if (header.magic != MAGiC_V4LUE)
 			return -1;
 		if (header.reg_size != sizeof(Registers<W>))
@@ -97,13 +1097,126 @@ namespace riscv
 			return -3;
 		if (header.attr_size != sizeof(PageAttributes))
 			return -4;
+		if (header.version > SERIALIZE_VERSION)
+			return -5;
+		// the whole snapshot is read before any of it is applied,
+		// so that a failed restore leaves the machine as it was
+		typename Memory<W>::Snapshot snapshot;
+		if (header.version < 2) {
+			if (header.mem_offset < reader.offset() || !reader.skip(header.mem_offset - reader.offset()))
+				return -6;
+			const int res = memory.deserialize_from(reader, header, std::move(image), snapshot);
+			if (res < 0)
+				return res;
+			this->m_counter = header.counter;
+			memory.restore_from(header, std::move(snapshot));
+			cpu.deserialize_from(nullptr, 0, header);
+			return 0;
+		}
+		if (header.cpu_offset < reader.offset() || !reader.skip(header.cpu_offset - reader.offset()))
+			return -6;
+
+		// read the sections, skipping unknown ones, while the
+		// memory section is streamed directly into the snapshot
+		std::array<std::vector<uint8_t>, SECTION_COUNT> sections {};
+		std::array<bool, SECTION_COUNT> present {};
+		while (true)
+		{
+			SerializedSection section;
+			if (!reader.read(section))
+				return -6;
+			if (section.id == SECTION_END)
+				break;
+			if (section.id == SECTION_MEMORY) {
+				if (present[SECTION_MEMORY])
+					return -6;
+				const size_t begin = reader.offset();
+				const int res = memory.deserialize_from(reader, header, std::move(image), snapshot);
+				if (res < 0)
+					return res;
+				if (!(section.flags & SECTION_UNSIZED)) {
+					const size_t consumed = reader.offset() - begin;
+					if (consumed > section.size || !reader.skip(section.size - consumed))
+						return -6;
+				}
+				present[SECTION_MEMORY] = true;
+			} else if (section.flags & SECTION_UNSIZED) {
+				return -6;
+			} else if (section.id < SECTION_COUNT) {
+				if (section.size > std::min(SECTION_SIZE_MAX, memory.memory_max()))
+					return -6;
+				auto& payload = sections[section.id];
+				payload.resize(section.size);
+				if (!reader.read(payload.data(), payload.size()))
+					return -6;
+				present[section.id] = true;
+			} else if (!reader.skip(section.size)) {
+				return -6;
+			}
+		}
+		if (!present[SECTION_MEMORY])
+			return -6;
+
+		const auto& segments = sections[SECTION_SEGMENTS];
+		if (memory.deserialize_segments(segments.data(), segments.size(), snapshot) < 0)
+			return -6;
+
+		// optional state is restored or reset, depending on the snapshot
+		std::unique_ptr<MultiThreading<W>> mt;
+		const auto& threads = sections[SECTION_THREADS];
+		if (present[SECTION_THREADS]) {
+			mt.reset(new MultiThreading<W>(*this));
+			if (!deserialize_threads(*mt, threads.data(), threads.size()))
+				return -6;
+		}
+		// the arena is only restored into a machine that has one
+		std::unique_ptr<Arena<W>> arena;
+		const auto& arenasec = sections[SECTION_ARENA];
+		if (present[SECTION_ARENA] && m_arena != nullptr) {
+			arena.reset(new Arena<W>(0, 0));
+			if (arena->deserialize_from(arenasec.data(), arenasec.size()) < 0)
+				return -6;
+		}
+#ifndef WIN32
+		// files can only be re-opened with the permissions of this machine
+		SerializedFileDescriptors fdstate {};
+		std::vector<DeserializedFile> files;
+		const auto& fds = sections[SECTION_FDS];
+		const bool restore_files = present[SECTION_FDS] && m_fds != nullptr;
+		if (restore_files) {
+			if (!deserialize_fds(fds.data(), fds.size(), fdstate, files))
+				return -6;
+		}
+#endif
+		std::unique_ptr<Signals<W>> signals;
+		const auto& sigsec = sections[SECTION_SIGNALS];
+		if (present[SECTION_SIGNALS]) {
+			signals.reset(new Signals<W>);
+			if (!deserialize_signals(*signals, sigsec.data(), sigsec.size()))
+				return -6;
+		}
+
+		// nothing can fail from here on
 		this->m_counter = header.counter;
-		cpu.deserialize_from(vec, header);
-		memory.deserialize_from(vec, header);
+		memory.restore_from(header, std::move(snapshot));
+		const auto& cpusec = sections[SECTION_CPU];
+		cpu.deserialize_from(cpusec.data(), cpusec.size(), header);
+
+		if (mt != nullptr)
+			m_mt = std::move(mt);
+		else if (m_mt != nullptr)
+			m_mt.reset(new MultiThreading<W>(*this));
+		if (arena != nullptr)
+			m_arena = std::move(arena);
+#ifndef WIN32
+		if (restore_files)
+			restore_fds(*this, *m_fds, fdstate, files);
+#endif
+		m_signals = std::move(signals);
 		return 0;
 	}
 	template <int W>
-	void CPU<W>::deserialize_from(const std::vector<uint8_t>& /* vec */,
+	void CPU<W>::deserialize_from(const uint8_t* data, size_t size,
 					const SerializedMachine<W>& state)
 	{
 		// restore CPU registers and counters
@@ -111,50 +1224,203 @@ namespace riscv
 		this->m_cache = {};
 #ifdef RISCV_EXT_ATOMICS
 		this->m_atomics = {};
+		size_t off = 0;
+		uint64_t count = 0;
+		if (deserialize_read(data, size, off, count))
+		{
+			for (size_t i = 0; i < count && i < AtomicMemory<W>::MAX_RESV; i++) {
+				uint64_t addr;
+				if (!deserialize_read(data, size, off, addr))
+					break;
+				this->m_atomics.reservations().insert(addr);
+			}
+		}
+#else
+		(void) data; (void) size;
 #endif
 		this->aligned_jump(this->pc());
 	}
 	template <int W>
-	void Memory<W>::deserialize_from(const std::vector<uint8_t>& vec,
-					const SerializedMachine<W>& state)
+	void Memory<W>::serialize_segments(std::vector<uint8_t>& vec) const
+	{
+		serialize_append(vec, (uint32_t) m_mapped.size());
+		for (const auto& seg : m_mapped) {
+			serialize_append(vec, SerializedSegment {
+				.begin  = seg.begin,
+				.end    = seg.end,
+				.offset = seg.offset,
+				.attr   = seg.attr
+			});
+		}
+	}
+	template <int W>
+	int Memory<W>::deserialize_segments(const uint8_t* data, size_t size, Snapshot& snapshot) const
+	{
+		if (size == 0)
+			return 0;
+		size_t off = 0;
+		uint32_t count;
+		if (!deserialize_read(data, size, off, count))
+			return -1;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			SerializedSegment seg;
+			if (!deserialize_read(data, size, off, seg))
+				return -1;
+			// the segment must be inside the binary of this machine
+			const uint64_t npages = seg.end - seg.begin;
+			if (seg.end <= seg.begin || seg.end - 1 > (uint64_t) address_t(-1) >> Page::SHIFT
+				|| npages > m_binary.size() / Page::size()
+				|| seg.offset > m_binary.size() - npages * Page::size())
+				return -1;
+			snapshot.mapped.push_back({
+				.begin  = (address_t) seg.begin,
+				.end    = (address_t) seg.end,
+				.offset = (size_t) seg.offset,
+				.attr   = seg.attr
+			});
+		}
+		return 0;
+	}
+	template <int W>
+	bool Memory<W>::is_image_backed(const Page& page) const noexcept
+	{
+		if (m_image == nullptr || !page.has_data())
+			return false;
+		const auto* data = page.data();
+		return data >= m_image.get() && data < m_image.get() + m_image_size;
+	}
+	template <int W>
+	int Memory<W>::deserialize_from(DeserializeReader& reader,
+		const SerializedMachine<W>& state, std::shared_ptr<const uint8_t> image, Snapshot& snapshot) const
+	{
+		snapshot.image_size = (image != nullptr) ? reader.size() : 0;
+		snapshot.image = std::move(image);
+		snapshot.mmap_address = this->m_mmap_address;
+
+		// later pages replace earlier ones with the same number
+		auto restore_page = [&snapshot] (address_t pageno, auto&&... args) -> Page& {
+			snapshot.pages.erase(pageno);
+			return snapshot.pages.emplace(std::piecewise_construct,
+				std::forward_as_tuple(pageno),
+				std::forward_as_tuple(args...)).first->second;
+		};
+
+		if (state.version == 0)
+		{
+			for (size_t p = 0; p < state.n_pages; p++) {
+				SerializedPage spage;
+				if (!reader.read(spage))
+					return -6;
+				// when we serialized non-owning pages, we lost the connection
+				// so now we own the page data
+				PageAttributes new_attr = spage.attr;
+				new_attr.non_owning = false;
+				Page& page = restore_page(spage.addr, new_attr);
+				if (!reader.read(page.data(), Page::size()))
+					return -6;
+			}
+			return 0;
+		}
+
+		if (state.version >= 2) {
+			SerializedMemory mstate;
+			if (!reader.read(mstate))
+				return -6;
+			snapshot.mmap_address = mstate.mmap_address;
+		}
+
+		auto* zero_data = const_cast<PageData*> (&Page::cow_page().page());
+		std::array<uint8_t, Page::size()> cbuffer;
+
+		while (true)
+		{
+			SerializedPageRun run;
+			if (!reader.read(run))
+				return -6;
+			if (run.count == 0)
+				break;
+			if (run.flags & RUN_ALIGNED) {
+				const size_t misalign = reader.offset() & (Page::size()-1);
+				if (misalign != 0 && !reader.skip(Page::size() - misalign))
+					return -6;
+			}
+			// page-aligned data in a mapped image is shared until written to
+			const bool shared = (run.flags & RUN_ALIGNED) && snapshot.image != nullptr;
+
+			for (size_t p = 0; p < run.count; p++)
+			{
+				const address_t pageno = run.pageno + p;
+				if (run.flags & RUN_ZERO) {
+					// zero pages share the CoW zero page until written to
+					PageAttributes attr = run.attr;
+					attr.is_cow = attr.write;
+					attr.write  = false;
+					restore_page(pageno, attr, zero_data);
+					continue;
+				}
+				if (shared) {
+					const uint8_t* data = reader.view(Page::size());
+					if (data == nullptr)
+						return -6;
+					PageAttributes attr = run.attr;
+					attr.is_cow = attr.write;
+					attr.write  = false;
+					restore_page(pageno, attr, (PageData*) data);
+					continue;
+				}
+				uint32_t clen = Page::size();
+				if (run.flags & RUN_COMPRESSED) {
+					if (!reader.read(clen) || clen > Page::size())
+						return -6;
+				}
+				Page& page = restore_page(pageno, run.attr);
+				if (clen == Page::size()) {
+					// page data is copied into the new page
+					if (!reader.read(page.data(), Page::size()))
+						return -6;
+				} else {
+					if (!reader.read(cbuffer.data(), clen))
+						return -6;
+					if (lz_decompress(cbuffer.data(), clen, page.data(), Page::size()) != Page::size())
+						return -6;
+				}
+			}
+		}
+		return 0;
+	}
+	template <int W>
+	void Memory<W>::restore_from(const SerializedMachine<W>& state, Snapshot&& snapshot)
 	{
 		this->m_start_address = state.start_address;
 		this->m_stack_address = state.stack_address;
 		this->m_exit_address  = state.exit_address;
+		this->m_mmap_address  = snapshot.mmap_address;
 
-		[[maybe_unused]]
-		const size_t page_bytes =
-			state.n_pages * (sizeof(SerializedPage) + Page::size());
-		assert(vec.size() >= state.mem_offset + page_bytes);
 		// completely reset the paging system as
 		// all pages will be completely replaced
+		this->invalidate_dynamic_segments();
+		this->m_dynamic_writes.clear();
 		this->clear_all_pages();
+		// pages from any previous image are gone now
+		this->m_image = std::move(snapshot.image);
+		this->m_image_size = snapshot.image_size;
+		// mapped segments are re-installed from the snapshot, if any
+		this->m_mapped = std::move(snapshot.mapped);
 
-		if (m_exec_pagedata != nullptr && m_exec_pagedata_size > 0)
+		for (const auto& seg : m_exec)
 		{
 			// NOTE: this only works if you restore to the same machine
 			// TODO: serialize the executable memory separately?
 			this->insert_non_owned_memory(
-				m_exec_pagedata_base, m_exec_pagedata.get(), m_exec_pagedata_size, {
+				seg->pagedata_base(), seg->pagedata(), seg->pagedata_size(), {
 					.read = true, .write = false, .exec = true
 				});
 		}
-
-		size_t off = state.mem_offset;
-		for (size_t p = 0; p < state.n_pages; p++) {
-			const auto& page = *(SerializedPage*) &vec[off];
-			off += sizeof(SerializedPage);
-			const auto& data = *(PageData*) &vec[off];
-			// when we serialized non-owning pages, we lost the connection
-			// so now we own the page data
-			PageAttributes new_attr = page.attr;
-			new_attr.non_owning = false;
-			m_pages.emplace(std::piecewise_construct,
-				std::forward_as_tuple(page.addr),
-				std::forward_as_tuple(new_attr, data)
-			);
-
-			off += Page::size();
+		// restored pages replace anything already in the page tables
+		for (auto& it : snapshot.pages) {
+			m_pages.erase(it.first);
+			m_pages.emplace(it.first, std::move(it.second));
 		}
 		// page tables have been changed
 		this->invalidate_reset_cache();
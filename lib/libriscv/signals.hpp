@@ -40,6 +40,7 @@ struct Signals {
 
 	// TODO: Lock this in the future, for multiproessing
 	auto& per_thread(int tid) { return m_per_thread[tid]; }
+	const auto& per_thread_map() const noexcept { return m_per_thread; }
 
 	Signals();
 	~Signals();
@@ -9,6 +9,10 @@
 
 #ifndef WIN32
 #include <sys/socket.h>
+#include "linux/iovec.hpp"
+#ifdef RISCV_IO_URING
+#include "linux/io_uring.hpp"
+#endif
 #else
 #include "win32/ws2.hpp"
 WSADATA riscv::ws2::global_winsock_data;
@@ -99,19 +103,31 @@ static void syscall_accept(Machine<W>& machine)
 
 	SYSPRINT("SYSCALL accept, sockfd: %d addr: 0x%lX\n",
 		sockfd, (long)g_addr);
+#ifdef RISCV_IO_URING
+	if (machine.has_async_io() && machine.async_io().submit_accept())
+		return;
+#endif
 
 	if (machine.has_file_descriptors() && machine.fds().permit_sockets) {
 
 		const auto real_fd = machine.fds().translate(sockfd);
 		alignas(16) char buffer[128];
 		socklen_t addrlen = sizeof(buffer);
+		// The size of the guest sockaddr
+		uint32_t guest_len = 0;
+		if (g_addr != 0)
+			machine.copy_from_guest(&guest_len, g_addrlen, sizeof(guest_len));
 
 		int res = accept(real_fd, (struct sockaddr *)buffer, &addrlen);
 		if (res >= 0) {
 			// Assign and translate the new fd to virtual fd
 			res = machine.fds().assign_socket(res);
-			machine.copy_to_guest(g_addr, buffer, addrlen);
-			machine.copy_to_guest(g_addrlen, &addrlen, sizeof(addrlen));
+			if (g_addr != 0) {
+				// Truncated to the guest sockaddr, with the full length returned
+				const uint32_t full_len = addrlen;
+				machine.copy_to_guest(g_addr, buffer, std::min(guest_len, full_len));
+				machine.copy_to_guest(g_addrlen, &full_len, sizeof(full_len));
+			}
 		}
 		machine.set_result_or_error(res);
 		return;
@@ -175,6 +191,124 @@ static void syscall_setsockopt(Machine<W>& machine)
 	machine.set_result(-EBADF);
 }
 
+#ifndef WIN32
+template <int W>
+struct guest_msghdr {
+	address_type<W> msg_name;
+	uint32_t        msg_namelen;
+	address_type<W> msg_iov;
+	address_type<W> msg_iovlen;
+	address_type<W> msg_control;
+	address_type<W> msg_controllen;
+	int32_t         msg_flags;
+};
+
+// sendto, recvfrom, sendmsg and recvmsg all become sendmsg or recvmsg
+// with host iovecs over the guest buffers. The socket address is copied,
+// and control messages are not passed on, as they can carry host fds.
+template <int W, bool Send>
+static ssize_t socket_message(Machine<W>& machine, int sockfd, int flags,
+	HostIovecs<W>& iov, address_type<W> g_addr, uint32_t& addrlen, int& msg_flags)
+{
+	const auto real_fd = machine.fds().translate(sockfd);
+	alignas(16) char buffer[128];
+	if (addrlen > sizeof(buffer)) {
+		// Socket addresses larger than sockaddr_storage are invalid
+		if (Send && g_addr != 0) {
+			machine.set_result(-EINVAL);
+			return -EINVAL;
+		}
+		addrlen = sizeof(buffer);
+	}
+	struct msghdr msg {};
+	msg.msg_iov = const_cast<struct iovec*> (iov.iov());
+	msg.msg_iovlen = iov.count();
+	if (g_addr != 0) {
+		if constexpr (Send)
+			machine.copy_from_guest(buffer, g_addr, addrlen);
+		msg.msg_name = buffer;
+		msg.msg_namelen = addrlen;
+	}
+	ssize_t res;
+	if constexpr (Send) {
+		res = sendmsg(real_fd, &msg, flags);
+	} else {
+		res = recvmsg(real_fd, &msg, flags & ~MSG_CMSG_CLOEXEC);
+		if (res >= 0 && g_addr != 0) {
+			machine.copy_to_guest(g_addr, buffer, std::min(addrlen, (uint32_t)msg.msg_namelen));
+			addrlen = msg.msg_namelen;
+		}
+		msg_flags = msg.msg_flags;
+	}
+	machine.set_result_or_error(res);
+	return res;
+}
+
+template <int W, bool Send>
+static void syscall_sendto_recvfrom(Machine<W>& machine)
+{
+	const auto [sockfd, g_buf, len, flags, g_addr, g_addrlen] =
+		machine.template sysargs<int, address_type<W>, address_type<W>, int,
+			address_type<W>, address_type<W>> ();
+
+	SYSPRINT("SYSCALL %s, sockfd: %d len: %lu flags: %x\n",
+		Send ? "sendto" : "recvfrom", sockfd, (long)len, flags);
+
+	if (machine.has_file_descriptors() && machine.fds().permit_sockets) {
+		HostIovecs<W> iov;
+		iov.gather(machine.memory, g_buf, len, !Send);
+		// sendto has the address length as argument, recvfrom a pointer
+		uint32_t addrlen = 0;
+		if constexpr (Send)
+			addrlen = g_addrlen;
+		else if (g_addr != 0)
+			machine.copy_from_guest(&addrlen, g_addrlen, sizeof(addrlen));
+		int msg_flags;
+		const ssize_t res = socket_message<W, Send> (machine, sockfd, flags, iov, g_addr, addrlen, msg_flags);
+		if (!Send && g_addr != 0 && res >= 0)
+			machine.copy_to_guest(g_addrlen, &addrlen, sizeof(addrlen));
+		return;
+	}
+	machine.set_result(-EBADF);
+}
+
+template <int W, bool Send>
+static void syscall_sendmsg_recvmsg(Machine<W>& machine)
+{
+	const auto [sockfd, g_msg, flags] =
+		machine.template sysargs<int, address_type<W>, int> ();
+
+	SYSPRINT("SYSCALL %s, sockfd: %d msg: 0x%lX flags: %x\n",
+		Send ? "sendmsg" : "recvmsg", sockfd, (long)g_msg, flags);
+
+	if (machine.has_file_descriptors() && machine.fds().permit_sockets) {
+		guest_msghdr<W> msg;
+		machine.copy_from_guest(&msg, g_msg, sizeof(msg));
+		if (Send && msg.msg_controllen != 0) {
+			machine.set_result(-EOPNOTSUPP);
+			return;
+		}
+		HostIovecs<W> iov;
+		if (!iov.gather_guest_iovecs(machine, msg.msg_iov, msg.msg_iovlen, !Send)) {
+			machine.set_result(-EMSGSIZE);
+			return;
+		}
+		int msg_flags = 0;
+		const ssize_t res = socket_message<W, Send> (machine, sockfd, flags, iov,
+			msg.msg_name, msg.msg_namelen, msg_flags);
+		if (!Send && res >= 0) {
+			if (msg.msg_controllen != 0)
+				msg_flags |= MSG_CTRUNC;
+			msg.msg_controllen = 0;
+			msg.msg_flags = msg_flags;
+			machine.copy_to_guest(g_msg, &msg, sizeof(msg));
+		}
+		return;
+	}
+	machine.set_result(-EBADF);
+}
+#endif
+
 template <int W>
 void add_socket_syscalls(Machine<W>& machine)
 {
@@ -184,6 +318,12 @@ void add_socket_syscalls(Machine<W>& machine)
 	machine.install_syscall_handler(202, syscall_accept<W>);
 	machine.install_syscall_handler(203, syscall_connect<W>);
 	machine.install_syscall_handler(208, syscall_setsockopt<W>);
+#ifndef WIN32
+	machine.install_syscall_handler(206, syscall_sendto_recvfrom<W, true>);
+	machine.install_syscall_handler(207, syscall_sendto_recvfrom<W, false>);
+	machine.install_syscall_handler(211, syscall_sendmsg_recvmsg<W, true>);
+	machine.install_syscall_handler(212, syscall_sendmsg_recvmsg<W, false>);
+#endif
 
 }
 
@@ -1,4 +1,7 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <cerrno>
 #include <cstdio>
 #include <stdexcept>
 #include <unordered_map>
@@ -37,6 +40,18 @@ struct Thread
 	address_t clear_tid = 0;
 	// The current or last blocked reason
 	int block_reason = 0;
+	// The futex word this thread waits on, and the wait bitset,
+	// which is zero when the thread is not waiting
+	address_t futex_addr = 0;
+	uint32_t  futex_bitset = 0;
+	bool      futex_timed = false;
+	// Scheduling priority, like nice: lower values run first
+	int priority = 0;
+	// Where the thread is, and its links in that list
+	enum State : uint8_t { RUNNING, SUSPENDED, BLOCKED, FUTEX_WAIT };
+	State   state = RUNNING;
+	Thread* sched_prev = nullptr;
+	Thread* sched_next = nullptr;
 
 	Thread(MultiThreading<W>&, int tid, address_t tls,
 		address_t stack, address_t stkbase, address_t stksize);
@@ -50,6 +65,59 @@ struct Thread
 	void resume();
 };
 
+// Intrusive FIFO of threads, with O(1) insertion and removal
+template <int W>
+struct ThreadList
+{
+	using thread_t = Thread<W>;
+
+	bool      empty() const noexcept { return m_head == nullptr; }
+	size_t    size() const noexcept { return m_size; }
+	thread_t* front() const noexcept { return m_head; }
+	void      push_back(thread_t*) noexcept;
+	thread_t* pop_front() noexcept;
+	void      remove(thread_t*) noexcept;
+	void      clear() noexcept { m_head = m_tail = nullptr; m_size = 0; }
+	template <typename Func>
+	void      for_each(Func func) const;
+
+	ThreadList() = default;
+	ThreadList(const ThreadList&) = delete;
+	ThreadList& operator=(const ThreadList&) = delete;
+private:
+	thread_t* m_head = nullptr;
+	thread_t* m_tail = nullptr;
+	size_t    m_size = 0;
+};
+
+// Runnable threads, in one FIFO per priority level, where
+// a bitmap of the non-empty levels finds the next thread in O(1)
+template <int W>
+struct RunQueue
+{
+	using thread_t = Thread<W>;
+	static constexpr int PRIORITY_MIN = -20;
+	static constexpr int PRIORITY_MAX = 19;
+	static constexpr int LEVELS = PRIORITY_MAX - PRIORITY_MIN + 1;
+
+	bool      empty() const noexcept { return m_bitmap == 0; }
+	size_t    size() const noexcept { return m_size; }
+	// The priority of the next thread to run. Must not be empty.
+	int       top_priority() const noexcept { return __builtin_ctzll(m_bitmap) + PRIORITY_MIN; }
+	void      push_back(thread_t*) noexcept;
+	thread_t* pop_front() noexcept;
+	void      remove(thread_t*) noexcept;
+	void      clear() noexcept;
+	// Visits the threads in the order they will run
+	template <typename Func>
+	void      for_each(Func func) const;
+
+private:
+	std::array<ThreadList<W>, LEVELS> m_levels;
+	uint64_t m_bitmap = 0;
+	size_t   m_size = 0;
+};
+
 template <int W>
 struct MultiThreading
 {
@@ -68,15 +136,37 @@ struct MultiThreading
 	bool      block(int reason);
 	void      unblock(int tid);
 	bool      wakeup_blocked(int reason);
+	bool      make_runnable(int tid, address_t return_value);
+	// Futex wait queues, where waiting threads are not scheduled until woken
+	bool      futex_wait(address_t addr, uint32_t bitset, bool timed);
+	unsigned  futex_wake(address_t addr, unsigned count, uint32_t bitset = ~0u);
+	unsigned  futex_requeue(address_t addr, unsigned wake, address_t addr2, unsigned requeue);
+	bool      futex_timeout();
+	static constexpr int FUTEX_BLOCK_REASON = -0x20000;
+	// True when every thread is blocked or waiting, and the machine is
+	// stopped until the host makes a blocked thread runnable again
+	bool      idle() const noexcept { return m_idle; }
+	// Preemptive scheduling, after the current thread has run for
+	// the time slice, in instructions. Zero disables preemption.
+	void      set_time_slice(uint64_t instructions) noexcept { time_slice = instructions; }
+	bool      preempt();
+	bool      set_priority(int tid, int priority);
 
 	MultiThreading(Machine<W>&);
 	MultiThreading(Machine<W>&, const MultiThreading&);
 	Machine<W>& machine;
-	std::vector<thread_t*> m_blocked;
-	std::vector<thread_t*> m_suspended;
+	// Blocked threads, by block reason
+	std::unordered_map<int, ThreadList<W>> m_blocked;
+	RunQueue<W> m_suspended;
 	std::unordered_map<int, thread_t> m_threads;
+	std::unordered_map<address_t, ThreadList<W>> m_futex_queues;
 	int        thread_counter = 0;
+	uint64_t   time_slice = 0;
 	thread_t*  m_current = nullptr;
+	bool       m_idle = false;
+
+private:
+	void      unlink(thread_t*);
 };
 
 /** Implementation **/
@@ -102,23 +192,34 @@ inline MultiThreading<W>::MultiThreading(Machine<W>& mach, const MultiThreading<
 		m_threads.try_emplace(tid, *this, it.second);
 	}
 	/* Copy each suspended by pointer lookup */
-	m_suspended.reserve(other.m_suspended.size());
-	for (const auto* t : other.m_suspended) {
+	other.m_suspended.for_each([this] (const thread_t* t) {
 		m_suspended.push_back(get_thread(t->tid));
+	});
+	/* Copy each blocked and futex wait list, in order */
+	for (const auto& it : other.m_blocked) {
+		auto& list = m_blocked[it.first];
+		it.second.for_each([&] (const thread_t* t) {
+			list.push_back(get_thread(t->tid));
+		});
 	}
-	/* Copy each blocked by pointer lookup */
-	m_blocked.reserve(other.m_blocked.size());
-	for (const auto* t : other.m_blocked) {
-		m_blocked.push_back(get_thread(t->tid));
+	for (const auto& it : other.m_futex_queues) {
+		auto& queue = m_futex_queues[it.first];
+		it.second.for_each([&] (const thread_t* t) {
+			queue.push_back(get_thread(t->tid));
+		});
 	}
 	/* Copy current thread */
-	m_current = get_thread(other.m_current->tid);
+	if (other.m_current != nullptr)
+		m_current = get_thread(other.m_current->tid);
+	this->time_slice = other.time_slice;
+	this->m_idle = other.m_idle;
 }
 
 template <int W>
 inline void Thread<W>::resume()
 {
 	threading.m_current = this;
+	this->state = RUNNING;
 	auto& m = threading.machine;
 	// restore registers
 	m.cpu.registers() = this->stored_regs;
@@ -152,8 +253,9 @@ inline void Thread<W>::block(int reason)
 {
 	this->stored_regs = threading.machine.cpu.registers();
 	this->block_reason = reason;
+	this->state = BLOCKED;
 	// add to blocked (NB: can throw)
-	threading.m_blocked.push_back(this);
+	threading.m_blocked[reason].push_back(this);
 }
 
 template <int W>
@@ -181,12 +283,21 @@ inline Thread<W>* MultiThreading<W>::get_thread(int tid)
 template <int W>
 inline void MultiThreading<W>::wakeup_next()
 {
-	// resume a waiting thread
-	assert(!m_suspended.empty());
-	auto* next = m_suspended.front();
-	m_suspended.erase(m_suspended.begin());
-	// resume next thread
-	next->resume();
+	if (UNLIKELY(m_suspended.empty()))
+	{
+		// threads blocked on eg. I/O are made runnable by the host,
+		// so the machine stops until then (see: make_runnable)
+		if (!m_blocked.empty()) {
+			m_idle = true;
+			machine.stop();
+			return;
+		}
+		// a timed futex wait ends when nothing else can run
+		if (!futex_timeout())
+			machine.cpu.trigger_exception(DEADLOCK_REACHED);
+	}
+	// resume the next thread
+	m_suspended.pop_front()->resume();
 }
 
 template <int W>
@@ -204,13 +315,17 @@ inline Thread<W>::Thread(
 	MultiThreading<W>& mt, const Thread& other)
 	: threading(mt), tid(other.tid), stored_regs(other.stored_regs),
 	  stack_base(other.stack_base), stack_size(other.stack_size),
-	  clear_tid(other.clear_tid), block_reason(other.block_reason)
+	  clear_tid(other.clear_tid), block_reason(other.block_reason),
+	  futex_addr(other.futex_addr), futex_bitset(other.futex_bitset),
+	  futex_timed(other.futex_timed), priority(other.priority),
+	  state(other.state)
 {}
 
 template <int W>
 inline void Thread<W>::activate()
 {
 	threading.m_current = this;
+	this->state = RUNNING;
 	auto& cpu = threading.machine.cpu;
 	cpu.reg(REG_TP) = this->stored_regs.get(REG_TP);
 	cpu.reg(REG_SP) = this->stored_regs.get(REG_SP);
@@ -230,6 +345,8 @@ inline bool Thread<W>::exit()
 				this->tid, (long)this->clear_tid);
 		threading.machine.memory.
 			template write<address_type<W>> (this->clear_tid, 0);
+		// and wake up a thread joining this one
+		threading.futex_wake(this->clear_tid, 1);
 	}
 	// Delete this thread (except main thread)
 	if (tid != 0) {
@@ -254,6 +371,9 @@ inline Thread<W>* MultiThreading<W>::create(
 	const int tid = ++this->thread_counter;
 	auto it = m_threads.emplace(tid, Thread{*this, tid, tls, stack, stkbase, stksize});
 	auto* thread = &it.first->second;
+	// threads inherit the priority of their creator
+	if (m_current != nullptr)
+		thread->priority = m_current->priority;
 
 	// flag for write child TID
 	if (flags & CHILD_SETTID) {
@@ -273,8 +393,9 @@ template <int W>
 inline bool MultiThreading<W>::suspend_and_yield()
 {
 	auto* thread = get_thread();
-	// don't go through the ardous yielding process when alone
-	if (m_suspended.empty()) {
+	// don't go through the ardous yielding process when alone,
+	// or when every other thread has a lower priority
+	if (m_suspended.empty() || m_suspended.top_priority() > thread->priority) {
 		// set the return value for sched_yield
 		machine.cpu.reg(REG_ARG0) = 0;
 		return false;
@@ -320,13 +441,8 @@ inline bool MultiThreading<W>::yield_to(int tid, bool store_retval)
 		thread->suspend(0);
 	else
 		thread->suspend();
-	// remove the next thread from suspension
-	for (auto it = m_suspended.begin(); it != m_suspended.end(); ++it) {
-		if (*it == next) {
-			m_suspended.erase(it);
-			break;
-		}
-	}
+	// remove the next thread from where it waits
+	this->unlink(next);
 	// resume next thread
 	next->resume();
 	return true;
@@ -335,18 +451,15 @@ inline bool MultiThreading<W>::yield_to(int tid, bool store_retval)
 template <int W>
 inline void MultiThreading<W>::unblock(int tid)
 {
-	for (auto it = m_blocked.begin(); it != m_blocked.end(); )
+	auto* thread = get_thread(tid);
+	if (thread != nullptr && thread->state == thread_t::BLOCKED)
 	{
-		if ((*it)->tid == tid)
-		{
-			// suspend current thread
-			get_thread()->suspend(0);
-			// resume this thread
-			(*it)->resume();
-			m_blocked.erase(it);
-			return;
-		}
-		else ++it;
+		this->unlink(thread);
+		// suspend current thread
+		get_thread()->suspend(0);
+		// resume this thread
+		thread->resume();
+		return;
 	}
 	// given thread id was not blocked
 	machine.cpu.reg(REG_ARG0) = -1;
@@ -354,30 +467,291 @@ inline void MultiThreading<W>::unblock(int tid)
 template <int W>
 inline bool MultiThreading<W>::wakeup_blocked(int reason)
 {
-	for (auto it = m_blocked.begin(); it != m_blocked.end(); )
+	auto it = m_blocked.find(reason);
+	if (it == m_blocked.end())
+		return false; // nothing to wake up
+	auto* thread = it->second.pop_front();
+	if (it->second.empty())
+		m_blocked.erase(it);
+	// suspend current thread
+	get_thread()->suspend(0);
+	// resume this thread
+	thread->resume();
+	return true;
+}
+
+template <int W>
+inline bool MultiThreading<W>::make_runnable(int tid, address_t return_value)
+{
+	auto* thread = get_thread(tid);
+	if (thread == nullptr || thread->state != thread_t::BLOCKED)
+		return false; // given thread id was not blocked
+	// queue the thread without switching to it
+	this->unlink(thread);
+	thread->stored_regs.get(REG_ARG0) = return_value;
+	m_suspended.push_back(thread);
+	if (m_idle) {
+		// Resume a thread on the stopped machine, after the
+		// system call instruction that it was blocked on
+		m_idle = false;
+		this->wakeup_next();
+		machine.cpu.aligned_jump(machine.cpu.pc() + 4);
+	}
+	return true;
+}
+
+template <int W>
+inline bool MultiThreading<W>::futex_wait(address_t addr, uint32_t bitset, bool timed)
+{
+	auto* thread = get_thread();
+	if (m_suspended.empty() && m_blocked.empty()) {
+		// a timed wait times out immediately, otherwise
+		// another timed waiter has to give up instead
+		if (timed || !futex_timeout())
+			return false;
+	}
+	// block thread, returning 0 when woken up
+	thread->stored_regs = machine.cpu.registers();
+	thread->stored_regs.get(REG_ARG0) = 0;
+	thread->block_reason = FUTEX_BLOCK_REASON;
+	thread->futex_addr   = addr;
+	thread->futex_bitset = bitset;
+	thread->futex_timed  = timed;
+	thread->state = thread_t::FUTEX_WAIT;
+	m_futex_queues[addr].push_back(thread);
+	// resume some other thread
+	this->wakeup_next();
+	return true;
+}
+
+template <int W>
+inline unsigned MultiThreading<W>::futex_wake(address_t addr, unsigned count, uint32_t bitset)
+{
+	auto it = m_futex_queues.find(addr);
+	if (it == m_futex_queues.end())
+		return 0;
+	auto& queue = it->second;
+	// wake up to count waiters in FIFO order, skipping other bitsets
+	unsigned woken = 0;
+	for (auto* thread = queue.front(); thread != nullptr && woken < count; )
+	{
+		auto* next = thread->sched_next;
+		if (thread->futex_bitset & bitset) {
+			queue.remove(thread);
+			thread->futex_bitset = 0;
+			m_suspended.push_back(thread);
+			woken++;
+		}
+		thread = next;
+	}
+	if (queue.empty())
+		m_futex_queues.erase(it);
+	return woken;
+}
+
+template <int W>
+inline unsigned MultiThreading<W>::futex_requeue(
+	address_t addr, unsigned wake, address_t addr2, unsigned requeue)
+{
+	const unsigned woken = futex_wake(addr, wake);
+	auto it = m_futex_queues.find(addr);
+	if (it == m_futex_queues.end() || addr == addr2 || requeue == 0)
+		return woken;
+	// move the next waiters over to the other futex
+	auto& queue = it->second;
+	auto& target = m_futex_queues[addr2];
+	unsigned moved = 0;
+	for (; moved < requeue && !queue.empty(); moved++) {
+		auto* thread = queue.pop_front();
+		thread->futex_addr = addr2;
+		target.push_back(thread);
+	}
+	if (queue.empty())
+		m_futex_queues.erase(addr);
+	return woken + moved;
+}
+
+template <int W>
+inline bool MultiThreading<W>::futex_timeout()
+{
+	// There are no timers, so a timed waiter times out only
+	// once every other thread is waiting too, and none are blocked
+	for (auto& it : m_futex_queues)
 	{
-		// compare against block reason
-		if ((*it)->block_reason == reason)
+		for (auto* thread = it.second.front(); thread != nullptr; thread = thread->sched_next)
 		{
-			// suspend current thread
-			get_thread()->suspend(0);
-			// resume this thread
-			(*it)->resume();
-			m_blocked.erase(it);
+			if (!thread->futex_timed)
+				continue;
+			this->unlink(thread);
+			thread->futex_bitset = 0;
+			thread->stored_regs.get(REG_ARG0) = -ETIMEDOUT;
+			m_suspended.push_back(thread);
 			return true;
 		}
-		else ++it;
 	}
-	// nothing to wake up
 	return false;
 }
 
+template <int W>
+inline bool MultiThreading<W>::preempt()
+{
+	auto* thread = get_thread();
+	// keep running when every other thread has a lower priority
+	if (m_suspended.empty() || m_suspended.top_priority() > thread->priority)
+		return false;
+	// Threads are otherwise always suspended in a system call, and
+	// resume after it. A preempted thread is stored the same way.
+	thread->suspend();
+	thread->stored_regs.pc -= 4;
+	m_suspended.pop_front()->resume();
+	machine.cpu.aligned_jump(machine.cpu.pc() + 4);
+	return true;
+}
+
+template <int W>
+inline bool MultiThreading<W>::set_priority(int tid, int priority)
+{
+	auto* thread = get_thread(tid);
+	if (thread == nullptr)
+		return false;
+	priority = std::clamp(priority, RunQueue<W>::PRIORITY_MIN, RunQueue<W>::PRIORITY_MAX);
+	// a runnable thread moves to its new run queue
+	const bool queued = (thread->state == thread_t::SUSPENDED);
+	if (queued)
+		m_suspended.remove(thread);
+	thread->priority = priority;
+	if (queued)
+		m_suspended.push_back(thread);
+	return true;
+}
+
+template <int W>
+inline void MultiThreading<W>::unlink(thread_t* thread)
+{
+	auto remove_from = [thread] (auto& lists, auto key) {
+		auto it = lists.find(key);
+		it->second.remove(thread);
+		if (it->second.empty())
+			lists.erase(it);
+	};
+	switch (thread->state) {
+	case thread_t::SUSPENDED:
+		m_suspended.remove(thread);
+		break;
+	case thread_t::BLOCKED:
+		remove_from(m_blocked, thread->block_reason);
+		break;
+	case thread_t::FUTEX_WAIT:
+		remove_from(m_futex_queues, thread->futex_addr);
+		break;
+	case thread_t::RUNNING:
+		break;
+	}
+	thread->state = thread_t::RUNNING;
+}
+
 template <int W>
 inline void MultiThreading<W>::erase_thread(int tid)
 {
 	auto it = m_threads.find(tid);
 	assert(it != m_threads.end());
+	// forget any scheduling of the thread
+	this->unlink(&it->second);
+	if (m_current == &it->second)
+		m_current = nullptr;
 	m_threads.erase(it);
 }
 
+template <int W>
+inline void ThreadList<W>::push_back(thread_t* thread) noexcept
+{
+	thread->sched_prev = m_tail;
+	thread->sched_next = nullptr;
+	if (m_tail != nullptr)
+		m_tail->sched_next = thread;
+	else
+		m_head = thread;
+	m_tail = thread;
+	m_size++;
+}
+
+template <int W>
+inline Thread<W>* ThreadList<W>::pop_front() noexcept
+{
+	auto* thread = m_head;
+	this->remove(thread);
+	return thread;
+}
+
+template <int W>
+inline void ThreadList<W>::remove(thread_t* thread) noexcept
+{
+	if (thread->sched_prev != nullptr)
+		thread->sched_prev->sched_next = thread->sched_next;
+	else
+		m_head = thread->sched_next;
+	if (thread->sched_next != nullptr)
+		thread->sched_next->sched_prev = thread->sched_prev;
+	else
+		m_tail = thread->sched_prev;
+	thread->sched_prev = nullptr;
+	thread->sched_next = nullptr;
+	m_size--;
+}
+
+template <int W>
+template <typename Func>
+inline void ThreadList<W>::for_each(Func func) const
+{
+	for (const auto* thread = m_head; thread != nullptr; thread = thread->sched_next)
+		func(thread);
+}
+
+template <int W>
+inline void RunQueue<W>::push_back(thread_t* thread) noexcept
+{
+	const int level = thread->priority - PRIORITY_MIN;
+	m_levels[level].push_back(thread);
+	m_bitmap |= uint64_t(1) << level;
+	m_size++;
+	thread->state = thread_t::SUSPENDED;
+}
+
+template <int W>
+inline Thread<W>* RunQueue<W>::pop_front() noexcept
+{
+	const int level = __builtin_ctzll(m_bitmap);
+	auto* thread = m_levels[level].front();
+	this->remove(thread);
+	return thread;
+}
+
+template <int W>
+inline void RunQueue<W>::remove(thread_t* thread) noexcept
+{
+	const int level = thread->priority - PRIORITY_MIN;
+	auto& list = m_levels[level];
+	list.remove(thread);
+	if (list.empty())
+		m_bitmap &= ~(uint64_t(1) << level);
+	m_size--;
+}
+
+template <int W>
+inline void RunQueue<W>::clear() noexcept
+{
+	for (auto& list : m_levels)
+		list.clear();
+	m_bitmap = 0;
+	m_size = 0;
+}
+
+template <int W>
+template <typename Func>
+inline void RunQueue<W>::for_each(Func func) const
+{
+	for (uint64_t bits = m_bitmap; bits != 0; bits &= bits - 1)
+		m_levels[__builtin_ctzll(bits)].for_each(func);
+}
+
 } // riscv
@@ -22,7 +22,9 @@ namespace riscv
 
 		size_t copy_to(char* dst, size_t dstlen) const;
 		void   copy_to(std::vector<uint8_t>&) const;
-		void   foreach(std::function<void(const char*, size_t)> cb);
+		// cb(const char* data, size_t len) for each chunk
+		template <typename Callback>
+		void   foreach(Callback&& cb) const;
 		std::string to_string() const;
 
 		Buffer() = default;
@@ -50,7 +52,8 @@ namespace riscv
 		}
 	}
 
-	inline void Buffer::foreach(std::function<void(const char*, size_t)> cb)
+	template <typename Callback>
+	inline void Buffer::foreach(Callback&& cb) const
 	{
 		for (const auto& entry : m_data) {
 			cb(entry.first, entry.second);
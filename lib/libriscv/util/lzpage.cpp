@@ -0,0 +1,164 @@
+#include "lzpage.hpp"
+#include <cstring>
+
+namespace riscv {
+
+static constexpr size_t MINMATCH = 4;
+static constexpr size_t LAST_LITERALS = 5;
+static constexpr size_t MFLIMIT = 12;
+static constexpr unsigned HASH_LOG = 11;
+
+static inline uint32_t lz_read32(const uint8_t* p) noexcept {
+	uint32_t value;
+	std::memcpy(&value, p, sizeof(value));
+	return value;
+}
+static inline uint32_t lz_hash(uint32_t value) noexcept {
+	return (value * 2654435761u) >> (32 - HASH_LOG);
+}
+static inline uint8_t* lz_write_length(uint8_t* op, size_t len) noexcept {
+	while (len >= 255) {
+		*op++ = 255; len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+// Worst-case encoded size of a sequence
+static inline size_t lz_sequence_bound(size_t litlen, size_t matchlen) noexcept {
+	return 1 + (litlen / 255 + 1) + litlen + 2 + (matchlen / 255 + 1);
+}
+
+size_t lz_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t dstlen)
+{
+	if (len > LZ_BLOCK_MAX)
+		return 0;
+	const uint8_t* ip = src;
+	const uint8_t* anchor = src;
+	const uint8_t* const iend = src + len;
+	uint8_t* op = dst;
+	uint8_t* const oend = dst + dstlen;
+
+	if (len >= MFLIMIT)
+	{
+		uint16_t table[1u << HASH_LOG] = {};
+		const uint8_t* const mflimit = iend - MFLIMIT;
+		const uint8_t* const matchlimit = iend - LAST_LITERALS;
+
+		while (ip < mflimit)
+		{
+			const uint32_t sequence = lz_read32(ip);
+			const uint32_t h = lz_hash(sequence);
+			const uint8_t* ref = src + table[h];
+			table[h] = ip - src;
+			if (ref >= ip || lz_read32(ref) != sequence) {
+				ip++;
+				continue;
+			}
+			// Extend the match backwards into pending literals
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--; ref--;
+			}
+			const uint8_t* mp = ip + MINMATCH;
+			const uint8_t* mr = ref + MINMATCH;
+			while (mp < matchlimit && *mp == *mr) {
+				mp++; mr++;
+			}
+			const size_t litlen = ip - anchor;
+			const size_t matchlen = (mp - ip) - MINMATCH;
+			if (lz_sequence_bound(litlen, matchlen) > size_t(oend - op))
+				return 0;
+
+			uint8_t* token = op++;
+			*token = (litlen >= 15 ? 15 : litlen) << 4;
+			if (litlen >= 15)
+				op = lz_write_length(op, litlen - 15);
+			std::memcpy(op, anchor, litlen);
+			op += litlen;
+
+			const size_t offset = ip - ref;
+			*op++ = offset & 0xFF;
+			*op++ = offset >> 8;
+			*token |= (matchlen >= 15 ? 15 : matchlen);
+			if (matchlen >= 15)
+				op = lz_write_length(op, matchlen - 15);
+
+			ip = anchor = mp;
+			if (ip < mflimit)
+				table[lz_hash(lz_read32(ip - 2))] = (ip - 2) - src;
+		}
+	}
+
+	// The last sequence contains only literals
+	const size_t litlen = iend - anchor;
+	if (1 + (litlen / 255 + 1) + litlen > size_t(oend - op))
+		return 0;
+	*op = (litlen >= 15 ? 15 : litlen) << 4;
+	op++;
+	if (litlen >= 15)
+		op = lz_write_length(op, litlen - 15);
+	std::memcpy(op, anchor, litlen);
+	op += litlen;
+	return op - dst;
+}
+
+size_t lz_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t dstlen)
+{
+	const uint8_t* ip = src;
+	const uint8_t* const iend = src + len;
+	uint8_t* op = dst;
+	uint8_t* const oend = dst + dstlen;
+
+	while (ip < iend)
+	{
+		const unsigned token = *ip++;
+		size_t litlen = token >> 4;
+		if (litlen == 15) {
+			uint8_t b;
+			do {
+				if (ip >= iend) return 0;
+				b = *ip++;
+				litlen += b;
+			} while (b == 255);
+		}
+		if (litlen > size_t(iend - ip) || litlen > size_t(oend - op))
+			return 0;
+		std::memcpy(op, ip, litlen);
+		op += litlen;
+		ip += litlen;
+		// The last sequence has no match
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return 0;
+		const size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > size_t(op - dst))
+			return 0;
+		size_t matchlen = token & 0xF;
+		if (matchlen == 15) {
+			uint8_t b;
+			do {
+				if (ip >= iend) return 0;
+				b = *ip++;
+				matchlen += b;
+			} while (b == 255);
+		}
+		matchlen += MINMATCH;
+		if (matchlen > size_t(oend - op))
+			return 0;
+
+		const uint8_t* ref = op - offset;
+		if (offset >= matchlen) {
+			std::memcpy(op, ref, matchlen);
+		} else {
+			// Overlapping match, eg. a repeating pattern
+			for (size_t i = 0; i < matchlen; i++)
+				op[i] = ref[i];
+		}
+		op += matchlen;
+	}
+	return op - dst;
+}
+
+} // riscv
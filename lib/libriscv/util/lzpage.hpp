@@ -0,0 +1,20 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace riscv {
+
+// A small, dependency-free LZ77 codec using the LZ4 block format.
+// Intended for compressing individual pages in machine snapshots,
+// and so blocks are limited to 64 KiB.
+static constexpr size_t LZ_BLOCK_MAX = 65536;
+
+// Compress @len bytes from @src into @dst, which has room for @dstlen bytes.
+// Returns the compressed length, or 0 if the output did not fit.
+extern size_t lz_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t dstlen);
+
+// Decompress @len bytes from @src into @dst, which has room for @dstlen bytes.
+// Returns the decompressed length, or 0 if the input is malformed.
+extern size_t lz_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t dstlen);
+
+} // riscv
@@ -0,0 +1,124 @@
+#include "memspan.hpp"
+#include <cstring>
+
+static inline size_t strnlen_scalar(const char* s, size_t maxlen)
+{
+	size_t i = 0;
+	// 8 bytes at a time, until a word contains a zero byte
+	for (; i + 8 <= maxlen; i += 8) {
+		uint64_t v;
+		std::memcpy(&v, s + i, sizeof(v));
+		if ((v - 0x0101010101010101ull) & ~v & 0x8080808080808080ull)
+			break;
+	}
+	while (i < maxlen && s[i] != 0) i++;
+	return i;
+}
+
+static inline size_t mismatch_scalar(const uint8_t* s1, const uint8_t* s2, size_t len)
+{
+	size_t i = 0;
+	// 8 bytes at a time
+	for (; i + 8 <= len; i += 8) {
+		uint64_t a, b;
+		std::memcpy(&a, s1 + i, sizeof(a));
+		std::memcpy(&b, s2 + i, sizeof(b));
+		if (a != b) {
+		#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			return i + __builtin_ctzll(a ^ b) / 8;
+		#else
+			return i + __builtin_clzll(a ^ b) / 8;
+		#endif
+		}
+	}
+	while (i < len && s1[i] == s2[i]) i++;
+	return i;
+}
+
+#ifdef __x86_64__
+#include <immintrin.h>
+
+__attribute__ ((target ("avx2")))
+static size_t strnlen_avx2(const char* s, size_t maxlen)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 32 <= maxlen; i += 32) {
+		const __m256i v = _mm256_loadu_si256((const __m256i*) (s + i));
+		const unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return i + strnlen_scalar(s + i, maxlen - i);
+}
+
+__attribute__ ((target ("avx2")))
+static size_t mismatch_avx2(const uint8_t* s1, const uint8_t* s2, size_t len)
+{
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		const __m256i a = _mm256_loadu_si256((const __m256i*) (s1 + i));
+		const __m256i b = _mm256_loadu_si256((const __m256i*) (s2 + i));
+		const unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+		if (mask != 0xFFFFFFFF)
+			return i + __builtin_ctz(~mask);
+	}
+	return i + mismatch_scalar(s1 + i, s2 + i, len - i);
+}
+
+// SSE2 is always available on x86-64
+static size_t strnlen_sse2(const char* s, size_t maxlen)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= maxlen; i += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+		const unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return i + strnlen_scalar(s + i, maxlen - i);
+}
+
+static size_t mismatch_sse2(const uint8_t* s1, const uint8_t* s2, size_t len)
+{
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		const __m128i a = _mm_loadu_si128((const __m128i*) (s1 + i));
+		const __m128i b = _mm_loadu_si128((const __m128i*) (s2 + i));
+		const unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+		if (mask != 0xFFFF)
+			return i + __builtin_ctz(~mask);
+	}
+	return i + mismatch_scalar(s1 + i, s2 + i, len - i);
+}
+#endif
+
+namespace riscv
+{
+	size_t span_strnlen(const char* s, size_t maxlen)
+	{
+	#ifdef __x86_64__
+		if (__builtin_cpu_supports ("avx2"))
+		{
+			return strnlen_avx2(s, maxlen);
+		}
+		return strnlen_sse2(s, maxlen);
+	#else
+		return strnlen_scalar(s, maxlen);
+	#endif
+	}
+
+	size_t span_mismatch(const uint8_t* s1, const uint8_t* s2, size_t len)
+	{
+	#ifdef __x86_64__
+		if (__builtin_cpu_supports ("avx2"))
+		{
+			return mismatch_avx2(s1, s2, len);
+		}
+		return mismatch_sse2(s1, s2, len);
+	#else
+		return mismatch_scalar(s1, s2, len);
+	#endif
+	}
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace riscv {
+
+// Vectorized primitives for contiguous spans of guest memory, eg. the
+// part of a page touched by a memory helper. They never read outside of
+// the span, and use AVX2 or SSE2 when available, with a scalar fallback.
+
+// Returns the length of the string at @s, but at most @maxlen.
+extern size_t span_strnlen(const char* s, size_t maxlen);
+
+// Returns the offset of the first byte that differs, or @len if equal.
+extern size_t span_mismatch(const uint8_t* s1, const uint8_t* s2, size_t len);
+
+} // riscv
@@ -0,0 +1,257 @@
+#include "vfs.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+namespace riscv
+{
+	static constexpr int MAX_SYMLINK_DEPTH = 40;
+
+	// Takes the next path component, skipping slashes
+	static std::string_view next_component(std::string_view& path)
+	{
+		while (!path.empty() && path.front() == '/')
+			path.remove_prefix(1);
+		const size_t end = std::min(path.find('/'), path.size());
+		const auto component = path.substr(0, end);
+		path.remove_prefix(end);
+		return component;
+	}
+	static bool only_slashes(std::string_view path) {
+		return path.find_first_not_of('/') == std::string_view::npos;
+	}
+
+	VirtualFS::VirtualFS()
+	{
+		m_nodes.push_back(std::make_unique<Node>());
+		m_root = m_nodes.back().get();
+		m_root->mode = TYPE_DIR | 0755;
+		m_root->ino  = 1;
+		m_root->parent = m_root;
+	}
+
+	size_t VirtualFS::Node::read(uint64_t offset, void* dst, size_t len) const noexcept
+	{
+		if (offset >= size)
+			return 0;
+		len = std::min(len, size_t(size - offset));
+		std::memcpy(dst, data() + offset, len);
+		return len;
+	}
+
+	VirtualFS::Node& VirtualFS::create(Node& dir, std::string_view name, uint32_t mode)
+	{
+		auto it = dir.children.find(name);
+		if (it != dir.children.end()) {
+			Node& existing = *it->second;
+			if (existing.is_dir() || (mode & TYPE_MASK) == TYPE_DIR) {
+				if (existing.is_dir() && (mode & TYPE_MASK) == TYPE_DIR)
+					return existing;
+				throw MachineException(ILLEGAL_OPERATION,
+					"VirtualFS: File and directory have the same name");
+			}
+			// Replace the file, keeping the inode number
+			const uint64_t ino = existing.ino;
+			existing = Node {};
+			existing.mode = mode;
+			existing.ino  = ino;
+			existing.parent = &dir;
+			return existing;
+		}
+		m_nodes.push_back(std::make_unique<Node>());
+		Node& node = *m_nodes.back();
+		node.mode = mode;
+		node.ino  = m_nodes.size();
+		node.parent = &dir;
+		dir.children.emplace(std::string(name), &node);
+		return node;
+	}
+
+	VirtualFS::Node& VirtualFS::make_parents(std::string_view& path)
+	{
+		Node* dir = m_root;
+		while (true)
+		{
+			const auto name = next_component(path);
+			if (only_slashes(path)) {
+				if (name.empty() || name == "." || name == "..")
+					throw MachineException(ILLEGAL_OPERATION, "VirtualFS: Invalid path");
+				path = name;
+				return *dir;
+			}
+			if (name == ".") continue;
+			if (name == "..") { dir = dir->parent; continue; }
+			dir = &create(*dir, name, TYPE_DIR | 0755);
+		}
+	}
+
+	VirtualFS::Node& VirtualFS::add_file(std::string_view path, std::string_view data,
+		uint32_t mode, int64_t mtime)
+	{
+		Node& dir = make_parents(path);
+		Node& node = create(dir, path, TYPE_REG | (mode & 07777));
+		node.mtime = mtime;
+		node.size  = data.size();
+		node.pages.resize((data.size() + Page::size()-1) / Page::size());
+		if (!data.empty())
+			std::memcpy(node.pages[0].buffer8.data(), data.data(), data.size());
+		return node;
+	}
+
+	VirtualFS::Node& VirtualFS::add_directory(std::string_view path, uint32_t mode)
+	{
+		if (only_slashes(path))
+			return *m_root;
+		Node& dir = make_parents(path);
+		Node& node = create(dir, path, TYPE_DIR);
+		node.mode = TYPE_DIR | (mode & 07777);
+		return node;
+	}
+
+	VirtualFS::Node& VirtualFS::add_symlink(std::string_view path, std::string_view target)
+	{
+		Node& dir = make_parents(path);
+		Node& node = create(dir, path, TYPE_LNK | 0777);
+		node.target = std::string(target);
+		node.size   = target.size();
+		return node;
+	}
+
+	static const VirtualFS::Node* walk(const VirtualFS::Node* root, const VirtualFS::Node* dir,
+		std::string_view path, bool follow, int& error, int& depth)
+	{
+		if (path.empty()) {
+			error = -ENOENT;
+			return nullptr;
+		}
+		if (dir == nullptr || path.front() == '/')
+			dir = root;
+		const bool trailing_slash = (path.back() == '/');
+		const VirtualFS::Node* node = dir;
+		while (true)
+		{
+			const auto name = next_component(path);
+			if (name.empty())
+				break;
+			if (!node->is_dir()) {
+				error = -ENOTDIR;
+				return nullptr;
+			}
+			if (name == ".") continue;
+			if (name == "..") { node = node->parent; continue; }
+
+			auto it = node->children.find(name);
+			if (it == node->children.end()) {
+				error = -ENOENT;
+				return nullptr;
+			}
+			const VirtualFS::Node* next = it->second;
+			const bool last = only_slashes(path);
+			if (next->is_symlink() && (!last || follow || trailing_slash)) {
+				if (++depth > MAX_SYMLINK_DEPTH) {
+					error = -ELOOP;
+					return nullptr;
+				}
+				next = walk(root, node, next->target, true, error, depth);
+				if (next == nullptr)
+					return nullptr;
+			}
+			node = next;
+		}
+		if (trailing_slash && !node->is_dir()) {
+			error = -ENOTDIR;
+			return nullptr;
+		}
+		return node;
+	}
+
+	const VirtualFS::Node* VirtualFS::lookup(const Node* base, std::string_view path,
+		bool follow, int& error) const
+	{
+		int depth = 0;
+		return walk(m_root, base, path, follow, error, depth);
+	}
+
+	void VirtualFS::load_directory(const std::string& host_path, std::string_view prefix)
+	{
+		namespace fs = std::filesystem;
+		const std::string base = std::string(prefix) + "/";
+		for (const auto& entry : fs::recursive_directory_iterator(host_path))
+		{
+			const auto status = entry.symlink_status();
+			const std::string path = base
+				+ entry.path().lexically_relative(host_path).generic_string();
+			const uint32_t perms = uint32_t(status.permissions()) & 07777;
+
+			if (fs::is_symlink(status)) {
+				this->add_symlink(path, fs::read_symlink(entry.path()).generic_string());
+			} else if (fs::is_directory(status)) {
+				this->add_directory(path, perms);
+			} else if (fs::is_regular_file(status)) {
+				std::ifstream file(entry.path(), std::ios::binary);
+				const std::string data { std::istreambuf_iterator<char>(file), {} };
+				this->add_file(path, data, perms);
+			}
+		}
+	}
+
+	static uint64_t tar_octal(const char* field, size_t len)
+	{
+		uint64_t value = 0;
+		for (size_t i = 0; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+			value = (value << 3) | (field[i] - '0');
+		return value;
+	}
+
+	void VirtualFS::load_tar(const uint8_t* data, size_t size, std::string_view prefix)
+	{
+		const std::string base = std::string(prefix) + "/";
+		std::string long_name;
+		size_t pos = 0;
+		while (pos + 512 <= size)
+		{
+			const char* hdr = (const char*) &data[pos];
+			// Two zero blocks end the archive
+			if (hdr[0] == 0)
+				break;
+			std::string name { hdr, strnlen(hdr, 100) };
+			if (std::memcmp(&hdr[257], "ustar", 5) == 0 && hdr[345] != 0)
+				name = std::string(&hdr[345], strnlen(&hdr[345], 155)) + "/" + name;
+			if (!long_name.empty()) {
+				name = std::move(long_name);
+				long_name.clear();
+			}
+			const uint32_t mode  = tar_octal(&hdr[100], 8);
+			const uint64_t fsize = tar_octal(&hdr[124], 12);
+			const int64_t  mtime = tar_octal(&hdr[136], 12);
+			const char type = hdr[156];
+			pos += 512;
+			if (fsize > size - pos)
+				throw MachineException(ILLEGAL_OPERATION, "VirtualFS: Truncated tar archive");
+			const std::string_view contents { (const char*) &data[pos], fsize };
+
+			switch (type) {
+			case '0':
+			case '\0':
+				this->add_file(base + name, contents, mode, mtime);
+				break;
+			case '5':
+				this->add_directory(base + name, mode);
+				break;
+			case '2':
+				this->add_symlink(base + name,
+					std::string_view(&hdr[157], strnlen(&hdr[157], 100)));
+				break;
+			case 'L': // GNU long name of the next entry
+				long_name = std::string(contents.data(), strnlen(contents.data(), fsize));
+				break;
+			default: // Hard links, devices and extended headers are skipped
+				break;
+			}
+			pos += (fsize + 511) & ~uint64_t(511);
+		}
+	}
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include "page.hpp"
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace riscv
+{
+	// An in-memory filesystem tree for guests, which replaces the host
+	// filesystem for path-based system calls (see: FileDescriptors::vfs).
+	// The tree is built before it is given to machines, and is then shared
+	// read-only between any number of them, so guest file I/O is only a
+	// copy from host memory, and never touches the host filesystem.
+	struct VirtualFS
+	{
+		// File types, as in the Linux st_mode
+		static constexpr uint32_t TYPE_MASK = 0170000;
+		static constexpr uint32_t TYPE_DIR  = 0040000;
+		static constexpr uint32_t TYPE_REG  = 0100000;
+		static constexpr uint32_t TYPE_LNK  = 0120000;
+
+		struct Node {
+			uint32_t mode;     // file type and permissions
+			uint64_t ino;
+			int64_t  mtime = 0;
+			size_t   size = 0; // file size, or the length of a symlink target
+			// file contents, page-aligned so that they can be mapped
+			std::vector<PageData> pages;
+			std::string target; // symlink target
+			std::map<std::string, Node*, std::less<>> children;
+			Node* parent = nullptr;
+
+			bool is_dir() const noexcept { return (mode & TYPE_MASK) == TYPE_DIR; }
+			bool is_file() const noexcept { return (mode & TYPE_MASK) == TYPE_REG; }
+			bool is_symlink() const noexcept { return (mode & TYPE_MASK) == TYPE_LNK; }
+			const uint8_t* data() const noexcept {
+				return pages.empty() ? nullptr : pages[0].buffer8.data();
+			}
+			// Copies file contents at @offset, and returns the bytes copied
+			size_t read(uint64_t offset, void* dst, size_t len) const noexcept;
+		};
+
+		// Adds a file, creating its parent directories, and replacing any
+		// existing file of the same name
+		Node& add_file(std::string_view path, std::string_view data,
+			uint32_t mode = 0644, int64_t mtime = 0);
+		Node& add_directory(std::string_view path, uint32_t mode = 0755);
+		Node& add_symlink(std::string_view path, std::string_view target);
+		// Loads a host directory, recursively, into @prefix
+		void load_directory(const std::string& host_path, std::string_view prefix = "/");
+		// Loads the files in a tar archive (ustar format) into @prefix
+		void load_tar(const uint8_t* data, size_t size, std::string_view prefix = "/");
+
+		// Resolves @path from the directory @base (or the root for absolute
+		// paths), following symlinks, except a final one when @follow is false.
+		// Returns nullptr and sets @error (as a negated errno) on failure.
+		const Node* lookup(const Node* base, std::string_view path,
+			bool follow, int& error) const;
+		const Node* lookup(std::string_view path) const {
+			int error; return lookup(nullptr, path, true, error);
+		}
+		const Node& root() const noexcept { return *m_root; }
+		size_t nodes() const noexcept { return m_nodes.size(); }
+
+		VirtualFS();
+		VirtualFS(const VirtualFS&) = delete;
+		VirtualFS& operator=(const VirtualFS&) = delete;
+	private:
+		Node& create(Node& dir, std::string_view name, uint32_t mode);
+		Node& make_parents(std::string_view& path);
+
+		std::vector<std::unique_ptr<Node>> m_nodes;
+		Node* m_root;
+	};
+
+	// A guest file descriptor opened on a VirtualFS node
+	struct VirtualFile {
+		const VirtualFS::Node* node;
+		uint64_t offset = 0; // file position, or the next directory entry
+		int flags = 0;
+	};
+}
@@ -156,7 +156,7 @@ static void syscall_read(Machine<W> &machine) {
         // Gather up to 1MB of pages we can read into
         riscv::vBuffer buffers[256];
         size_t cnt =
-                machine.memory.gather_buffers_from_range(256, buffers, address, len);
+                machine.memory.gather_writable_buffers_from_range(256, buffers, address, len);
 
         size_t bytes = 0;
         for (size_t i = 0; i < cnt; i++) {
@@ -0,0 +1,177 @@
+#include <libriscv/machine.hpp>
+#include <libriscv/native_heap.hpp>
+#include <list>
+#include <random>
+#include "benchmark.hpp"
+using namespace riscv;
+using arena_t = Arena<RISCV64>;
+using PointerType = arena_t::PointerType;
+
+static constexpr PointerType BEGIN = 0x40000000;
+static constexpr PointerType END   = 0x50000000;
+
+// The previous first-fit allocator, as the baseline: a list of chunks
+// in address order, which is scanned on every malloc and free
+struct FirstFitArena
+{
+	struct Chunk { PointerType data; size_t size; bool free; };
+	std::list<Chunk> chunks { { BEGIN, END - BEGIN, true } };
+
+	PointerType malloc(size_t size) {
+		size = std::max((size + 7) & ~size_t(7), size_t(8));
+		for (auto it = chunks.begin(); it != chunks.end(); ++it) {
+			if (it->free && it->size >= size) {
+				chunks.insert(std::next(it), { it->data + PointerType(size), it->size - size, true });
+				it->size = size;
+				it->free = false;
+				return it->data;
+			}
+		}
+		return 0;
+	}
+	int free(PointerType ptr) {
+		for (auto it = chunks.begin(); it != chunks.end(); ++it) {
+			if (!it->free && it->data == ptr) {
+				it->free = true;
+				auto next = std::next(it);
+				if (next != chunks.end() && next->free) {
+					it->size += next->size;
+					chunks.erase(next);
+				}
+				if (it != chunks.begin() && std::prev(it)->free) {
+					std::prev(it)->size += it->size;
+					chunks.erase(it);
+				}
+				return 0;
+			}
+		}
+		return -1;
+	}
+};
+
+// A trace is a list of allocations (size > 0) and frees (size == 0)
+// of numbered objects, like the native heap system calls would see
+struct Operation { uint32_t object; uint32_t size; };
+
+// Many short-lived small objects, eg. strings and list nodes
+static std::vector<Operation> small_objects_trace(std::mt19937& rng, size_t live, size_t ops)
+{
+	std::geometric_distribution<uint32_t> small(0.05);
+	std::vector<Operation> trace;
+	std::vector<uint32_t> objects;
+	uint32_t next = 0;
+	while (trace.size() < ops) {
+		if (objects.empty() || (objects.size() < live && rng() % 3 != 0)) {
+			trace.push_back({ next, 8 + small(rng) });
+			objects.push_back(next++);
+		} else {
+			const size_t idx = rng() % objects.size();
+			trace.push_back({ objects[idx], 0 });
+			objects[idx] = objects.back();
+			objects.pop_back();
+		}
+	}
+	return trace;
+}
+// Mostly small objects, some buffers and a few large arrays
+static std::vector<Operation> mixed_trace(std::mt19937& rng, size_t live, size_t ops)
+{
+	std::vector<Operation> trace;
+	std::vector<uint32_t> objects;
+	uint32_t next = 0;
+	while (trace.size() < ops) {
+		if (objects.empty() || (objects.size() < live && rng() % 3 != 0)) {
+			const unsigned kind = rng() % 100;
+			const uint32_t size = (kind < 90) ? 8 + rng() % 248
+				: (kind < 99) ? 256 + rng() % 3840 : 4096 + rng() % 262144;
+			trace.push_back({ next, size });
+			objects.push_back(next++);
+		} else {
+			// recently allocated objects are more likely to be freed
+			const size_t n = objects.size();
+			const size_t idx = n - 1 - std::min(n - 1, size_t(rng() % 64 == 0 ? rng() % n : rng() % 8));
+			trace.push_back({ objects[idx], 0 });
+			objects.erase(objects.begin() + idx);
+		}
+	}
+	return trace;
+}
+// Growing arrays, reallocated by freeing and allocating a bigger one,
+// interleaved with small allocations that stay alive
+static std::vector<Operation> growth_trace(std::mt19937& rng, size_t live, size_t ops)
+{
+	std::vector<Operation> trace;
+	uint32_t next = 0;
+	while (trace.size() < ops) {
+		std::vector<uint32_t> smalls;
+		uint32_t array = next++;
+		trace.push_back({ array, 16 });
+		for (uint32_t size = 32; size <= 1u << 20 && trace.size() < ops; size *= 2) {
+			for (int i = 0; i < 4 && smalls.size() < live; i++) {
+				trace.push_back({ next, 8 + uint32_t(rng() % 120) });
+				smalls.push_back(next++);
+			}
+			trace.push_back({ array, 0 });
+			array = next++;
+			trace.push_back({ array, size });
+		}
+		trace.push_back({ array, 0 });
+		for (auto obj : smalls)
+			trace.push_back({ obj, 0 });
+	}
+	return trace;
+}
+
+template <typename T>
+static void replay(T& arena, const std::vector<Operation>& trace, std::vector<PointerType>& ptrs)
+{
+	for (const auto& op : trace) {
+		if (op.size != 0) {
+			ptrs[op.object] = arena.malloc(op.size);
+			if (ptrs[op.object] == 0) {
+				fprintf(stderr, "Out of memory in trace!\n");
+				exit(1);
+			}
+		} else if (arena.free(ptrs[op.object]) != 0) {
+			fprintf(stderr, "Invalid free in trace!\n");
+			exit(1);
+		}
+	}
+}
+
+static void run(const char* name, const std::vector<Operation>& trace)
+{
+	uint32_t objects = 0;
+	for (const auto& op : trace)
+		objects = std::max(objects, op.object + 1);
+	std::vector<PointerType> ptrs(objects);
+	char title[64];
+
+	const double baseline = measure(1, [&] {
+		FirstFitArena arena;
+		replay(arena, trace, ptrs);
+	});
+	snprintf(title, sizeof(title), "%s first-fit", name);
+	report(title, baseline);
+
+	size_t used = 0, chunks = 0;
+	const double binned = measure(1, [&] {
+		arena_t arena { BEGIN, END };
+		replay(arena, trace, ptrs);
+		used = arena.bytes_used();
+		chunks = arena.chunks_used();
+	});
+	snprintf(title, sizeof(title), "%s size-class", name);
+	report(title, binned);
+	printf("%-32s %10.1f ns/op, %zu ops, %zu chunks in use (%zu bytes)\n\n",
+		name, binned / trace.size(), trace.size(), chunks, used);
+}
+
+int main()
+{
+	std::mt19937 rng { 1234 };
+	run("small objects", small_objects_trace(rng, 2000, 200'000));
+	run("mixed", mixed_trace(rng, 2000, 200'000));
+	run("array growth", growth_trace(rng, 1000, 200'000));
+	return 0;
+}
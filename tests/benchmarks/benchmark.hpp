@@ -0,0 +1,25 @@
+#pragma once
+#include <chrono>
+#include <cstdio>
+
+// Returns the average time in nanoseconds of @samples calls to @func
+template <typename T>
+inline double measure(unsigned samples, T func)
+{
+	const auto t0 = std::chrono::high_resolution_clock::now();
+	for (unsigned i = 0; i < samples; i++) {
+		func();
+	}
+	const auto t1 = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration<double, std::nano>(t1 - t0).count() / samples;
+}
+
+inline void report(const char* name, double nanos, size_t bytes = 0)
+{
+	if (bytes != 0) {
+		printf("%-32s %10.1f us  %8.1f MB/s\n", name, nanos / 1e3,
+			bytes / (nanos / 1e9) / 1e6);
+	} else {
+		printf("%-32s %10.1f us\n", name, nanos / 1e3);
+	}
+}
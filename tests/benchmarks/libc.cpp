@@ -0,0 +1,134 @@
+#include <libriscv/machine.hpp>
+#include "benchmark.hpp"
+using namespace riscv;
+using machine_t = Machine<RISCV64>;
+using address_t = address_type<RISCV64>;
+
+static constexpr uint64_t MAX_MEMORY = 64ull << 20;
+static constexpr address_t CODE = 0x10000;
+static constexpr address_t STR1 = 0x100000 + 100;
+static constexpr address_t STR2 = 0x200000 + 3000;
+static constexpr address_t DST  = 0x300000 + 7;
+static constexpr int NATIVE_MEMORY_BASE = 6;
+static const size_t sizes[] = { 16, 256, 4096, 65536 };
+
+// Hand-assembled RV64 instructions, for the interpreted variants
+enum : uint32_t { T0 = 5, T1 = 6, A0 = 10, A1 = 11, A2 = 12, A7 = 17 };
+static constexpr uint32_t r_type(uint32_t f7, uint32_t rs2, uint32_t rs1, uint32_t f3, uint32_t rd) {
+	return (f7 << 25) | (rs2 << 20) | (rs1 << 15) | (f3 << 12) | (rd << 7) | 0x33;
+}
+static constexpr uint32_t i_type(int32_t imm, uint32_t rs1, uint32_t f3, uint32_t rd, uint32_t op) {
+	return (uint32_t(imm & 0xFFF) << 20) | (rs1 << 15) | (f3 << 12) | (rd << 7) | op;
+}
+static constexpr uint32_t s_type(int32_t imm, uint32_t rs2, uint32_t rs1, uint32_t f3) {
+	return (uint32_t((imm >> 5) & 0x7F) << 25) | (rs2 << 20) | (rs1 << 15)
+		| (f3 << 12) | (uint32_t(imm & 0x1F) << 7) | 0x23;
+}
+static constexpr uint32_t b_type(int32_t imm, uint32_t rs2, uint32_t rs1, uint32_t f3) {
+	return (uint32_t((imm >> 12) & 1) << 31) | (uint32_t((imm >> 5) & 0x3F) << 25)
+		| (rs2 << 20) | (rs1 << 15) | (f3 << 12)
+		| (uint32_t((imm >> 1) & 0xF) << 8) | (uint32_t((imm >> 11) & 1) << 7) | 0x63;
+}
+static constexpr uint32_t LBU(uint32_t rd, uint32_t rs1) { return i_type(0, rs1, 4, rd, 0x03); }
+static constexpr uint32_t SB(uint32_t rs2, uint32_t rs1) { return s_type(0, rs2, rs1, 0); }
+static constexpr uint32_t ADDI(uint32_t rd, uint32_t rs1, int32_t imm) { return i_type(imm, rs1, 0, rd, 0x13); }
+static constexpr uint32_t SUB(uint32_t rd, uint32_t rs1, uint32_t rs2) { return r_type(0x20, rs2, rs1, 0, rd); }
+static constexpr uint32_t BEQ(uint32_t rs1, uint32_t rs2, int32_t imm) { return b_type(imm, rs2, rs1, 0); }
+static constexpr uint32_t BNE(uint32_t rs1, uint32_t rs2, int32_t imm) { return b_type(imm, rs2, rs1, 1); }
+static constexpr uint32_t ECALL = 0x73;
+// Every program ends with the exit system call
+#define EXIT ADDI(A7, 0, 93), ECALL
+
+// Byte-wise loops, like a simple guest libc would have them
+static const std::vector<uint32_t> interpreted_strcmp {
+	LBU(T0, A0), LBU(T1, A1), ADDI(A0, A0, 1), ADDI(A1, A1, 1),
+	BNE(T0, T1, 8), BNE(T0, 0, -20),
+	SUB(A0, T0, T1), EXIT
+};
+static const std::vector<uint32_t> interpreted_memchr {
+	BEQ(A2, 0, 24), LBU(T0, A0), BEQ(T0, A1, 20),
+	ADDI(A0, A0, 1), ADDI(A2, A2, -1), BNE(A2, 0, -16),
+	ADDI(A0, 0, 0), EXIT
+};
+static const std::vector<uint32_t> interpreted_strcpy {
+	LBU(T0, A1), SB(T0, A0), ADDI(A0, A0, 1), ADDI(A1, A1, 1),
+	BNE(T0, 0, -16), EXIT
+};
+static std::vector<uint32_t> native(int sysno) {
+	return { ADDI(A7, 0, NATIVE_MEMORY_BASE + sysno), ECALL, EXIT };
+}
+
+static address_t install(machine_t& m, const std::vector<uint32_t>& code)
+{
+	static address_t next = CODE;
+	const address_t addr = next;
+	m.memory.memcpy(addr, code.data(), code.size() * 4);
+	m.memory.set_page_attr(addr, Page::size(), { .read = true, .write = false, .exec = true });
+	next += Page::size();
+	return addr;
+}
+static address_t run(machine_t& m, address_t program, address_t a0, address_t a1, address_t a2 = 0)
+{
+	m.cpu.reg(REG_ARG0) = a0;
+	m.cpu.reg(REG_ARG1) = a1;
+	m.cpu.reg(REG_ARG2) = a2;
+	return m.vmcall(program);
+}
+
+int main()
+{
+	const std::vector<uint8_t> empty;
+	machine_t machine { empty, { .memory_max = MAX_MEMORY } };
+	machine.setup_linux_syscalls(false, false);
+	machine.setup_native_memory(NATIVE_MEMORY_BASE);
+
+	const auto strcmp_i = install(machine, interpreted_strcmp);
+	const auto strcmp_n = install(machine, native(6));
+	const auto memchr_i = install(machine, interpreted_memchr);
+	const auto memchr_n = install(machine, native(4));
+	const auto strcpy_i = install(machine, interpreted_strcpy);
+	const auto strcpy_n = install(machine, native(8));
+
+	for (const size_t size : sizes)
+	{
+		const unsigned samples = std::max(size_t(10), 1'000'000 / size);
+		// Two equal strings of length size-1, with a zero-terminator
+		machine.memory.memset(STR1, 'a', size - 1);
+		machine.memory.memset(STR1 + size - 1, 0, 1);
+		machine.memory.memset(STR2, 'a', size - 1);
+		machine.memory.memset(STR2 + size - 1, 0, 1);
+
+		if (run(machine, strcmp_i, STR1, STR2, size) != 0
+			|| run(machine, strcmp_n, STR1, STR2, size) != 0
+			|| run(machine, memchr_i, STR1, 0, size) != STR1 + size - 1
+			|| run(machine, memchr_n, STR1, 0, size) != STR1 + size - 1) {
+			fprintf(stderr, "Mismatch in results!\n");
+			return 1;
+		}
+		char title[64];
+		snprintf(title, sizeof(title), "strncmp %zu interpreted", size);
+		report(title, measure(samples, [&] {
+			run(machine, strcmp_i, STR1, STR2, size); }), size);
+		snprintf(title, sizeof(title), "strncmp %zu native", size);
+		report(title, measure(samples, [&] {
+			run(machine, strcmp_n, STR1, STR2, size); }), size);
+		snprintf(title, sizeof(title), "memchr %zu interpreted", size);
+		report(title, measure(samples, [&] {
+			run(machine, memchr_i, STR1, 0, size); }), size);
+		snprintf(title, sizeof(title), "memchr %zu native", size);
+		report(title, measure(samples, [&] {
+			run(machine, memchr_n, STR1, 0, size); }), size);
+		snprintf(title, sizeof(title), "strcpy %zu interpreted", size);
+		report(title, measure(samples, [&] {
+			run(machine, strcpy_i, DST, STR1); }), size);
+		snprintf(title, sizeof(title), "strcpy %zu native", size);
+		report(title, measure(samples, [&] {
+			run(machine, strcpy_n, DST, STR1); }), size);
+		if (machine.memory.strncmp(DST, STR1, size) != 0) {
+			fprintf(stderr, "Mismatch in strcpy!\n");
+			return 1;
+		}
+		printf("\n");
+	}
+	return 0;
+}
@@ -0,0 +1,123 @@
+#include <libriscv/machine.hpp>
+#include <cstring>
+#include "benchmark.hpp"
+using namespace riscv;
+using machine_t = Machine<RISCV64>;
+using address_t = address_type<RISCV64>;
+
+static constexpr uint64_t MAX_MEMORY = 64ull << 20;
+static constexpr address_t AREA1 = 0x100000;
+static constexpr address_t AREA2 = 0x800000;
+// Misaligned offsets, so that all but the smallest sizes cross pages
+static constexpr address_t OFFSET1 = 100;
+static constexpr address_t OFFSET2 = 3000;
+static const size_t sizes[] = { 64, 1000, 4096, 65536, 1 << 20 };
+
+// Byte- and word-wise equivalents of the helpers, which read and
+// write through the generic page lookup path, as the baseline
+static size_t baseline_strlen(machine_t& m, address_t addr, size_t maxlen)
+{
+	size_t len = 0;
+	while (len < maxlen) {
+		const uint8_t c = m.memory.read<uint8_t> (addr + len);
+		if (c == 0) break;
+		len++;
+	}
+	return len;
+}
+static int baseline_memcmp(machine_t& m, address_t p1, address_t p2, size_t len)
+{
+	uint8_t v1 = 0, v2 = 0;
+	while (len > 0) {
+		v1 = m.memory.get_readable_pageno(p1 >> Page::SHIFT).data()[p1 % Page::size()];
+		v2 = m.memory.get_readable_pageno(p2 >> Page::SHIFT).data()[p2 % Page::size()];
+		if (v1 != v2) break;
+		p1++; p2++; len--;
+	}
+	return len == 0 ? 0 : (v1 - v2);
+}
+static void baseline_memcpy(machine_t& m, address_t dst, address_t src, size_t len)
+{
+	if ((dst & 7) == (src & 7)) {
+		while ((src & 7) != 0 && len > 0) {
+			m.memory.write<uint8_t> (dst++, m.memory.read<uint8_t> (src++));
+			len--;
+		}
+		while (len >= 8) {
+			m.memory.write<uint64_t> (dst, m.memory.read<uint64_t> (src));
+			dst += 8; src += 8; len -= 8;
+		}
+	}
+	while (len > 0) {
+		m.memory.write<uint8_t> (dst++, m.memory.read<uint8_t> (src++));
+		len--;
+	}
+}
+static void baseline_memset(machine_t& m, address_t dst, uint8_t value, size_t len)
+{
+	while (len > 0) {
+		m.memory.write<uint8_t> (dst++, value);
+		len--;
+	}
+}
+
+static void compare(const char* name, size_t size, double baseline, double helper)
+{
+	char title[64];
+	snprintf(title, sizeof(title), "%s %zu baseline", name, size);
+	report(title, baseline, size);
+	snprintf(title, sizeof(title), "%s %zu spans", name, size);
+	report(title, helper, size);
+}
+
+static void check(bool ok, const char* what)
+{
+	if (!ok) {
+		fprintf(stderr, "Mismatch in %s!\n", what);
+		exit(1);
+	}
+}
+
+int main()
+{
+	const std::vector<uint8_t> empty;
+	machine_t machine { empty, { .memory_max = MAX_MEMORY } };
+	auto& mem = machine.memory;
+
+	for (const size_t size : sizes)
+	{
+		const address_t p1 = AREA1 + OFFSET1;
+		const address_t p2 = AREA2 + OFFSET2;
+		const unsigned samples = (size < 65536) ? 20000 : 50;
+		// A string of @size characters, and an identical copy of it,
+		// except for the very last byte
+		mem.memset(p1, 'a', size);
+		mem.write<uint8_t> (p1 + size, 0);
+		mem.memset(p2, 'a', size);
+		mem.write<uint8_t> (p2 + size - 1, 'b');
+
+		check(mem.strlen(p1, size + 1) == size, "strlen");
+		check(baseline_strlen(machine, p1, size + 1) == size, "strlen");
+		compare("strlen", size,
+			measure(samples, [&] { baseline_strlen(machine, p1, size + 1); }),
+			measure(samples, [&] { mem.strlen(p1, size + 1); }));
+
+		check(mem.memcmp(p1, p2, size) == baseline_memcmp(machine, p1, p2, size), "memcmp");
+		check(mem.memcmp(p1, p2, size) < 0, "memcmp");
+		compare("memcmp", size,
+			measure(samples, [&] { baseline_memcmp(machine, p1, p2, size); }),
+			measure(samples, [&] { mem.memcmp(p1, p2, size); }));
+
+		compare("memcpy", size,
+			measure(samples, [&] { baseline_memcpy(machine, p2, p1, size); }),
+			measure(samples, [&] { mem.memcpy(p2, machine, p1, size); }));
+		check(mem.memcmp(p1, p2, size) == 0, "memcpy");
+
+		compare("memset", size,
+			measure(samples, [&] { baseline_memset(machine, p2, 'c', size); }),
+			measure(samples, [&] { mem.memset(p2, 'c', size); }));
+		check(mem.strlen(p2, size) == size, "memset");
+		printf("\n");
+	}
+	return 0;
+}
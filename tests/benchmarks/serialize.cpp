@@ -0,0 +1,172 @@
+#include <libriscv/machine.hpp>
+#include <cassert>
+#include <random>
+#include <unistd.h>
+#include "benchmark.hpp"
+using namespace riscv;
+using machine_t = Machine<RISCV64>;
+
+static constexpr uint64_t MAX_MEMORY = 256ull << 20;
+static constexpr uint64_t AREA_BASE  = 0x100000;
+static constexpr size_t   AREA_PAGES = 4096; // 16 MB
+static constexpr uint64_t CODE_BASE  = 0x10000;
+
+// Half of the pages are zero (eg. .bss and untouched heap), a quarter
+// contain repetitive data (strings, tables) and the rest is random.
+static void populate(machine_t& machine)
+{
+	std::mt19937 rng {1234};
+	std::vector<uint8_t> page(Page::size());
+	static const char text[] = "The quick brown fox jumps over the lazy dog. ";
+	for (size_t p = 0; p < AREA_PAGES; p++)
+	{
+		const uint64_t addr = AREA_BASE + p * Page::size();
+		switch (p % 4) {
+		case 0:
+		case 1:
+			machine.memory.memset(addr, 0, Page::size());
+			break;
+		case 2:
+			for (size_t i = 0; i < page.size(); i++)
+				page[i] = text[(i + p) % (sizeof(text)-1)];
+			machine.copy_to_guest(addr, page.data(), page.size());
+			break;
+		default:
+			for (auto& b : page) b = rng();
+			machine.copy_to_guest(addr, page.data(), page.size());
+		}
+	}
+}
+
+// Restoring the CPU jumps to its pc, which has to be executable,
+// so the machine is left at a page of NOPs
+static void add_code(machine_t& machine)
+{
+	const std::vector<uint32_t> nops(Page::size() / 4, 0x00000013);
+	machine.copy_to_guest(CODE_BASE, nops.data(), Page::size());
+	machine.memory.set_page_attr(CODE_BASE, Page::size(),
+		{ .read = true, .write = false, .exec = true });
+	machine.cpu.aligned_jump(CODE_BASE);
+}
+
+static bool verify(machine_t& a, machine_t& b)
+{
+	std::vector<uint8_t> pa(Page::size()), pb(Page::size());
+	for (size_t p = 0; p < AREA_PAGES; p++)
+	{
+		const uint64_t addr = AREA_BASE + p * Page::size();
+		a.copy_from_guest(pa.data(), addr, pa.size());
+		b.copy_from_guest(pb.data(), addr, pb.size());
+		if (pa != pb) return false;
+	}
+	return true;
+}
+
+static void benchmark(machine_t& source, const char* name, const SerializeOptions& options)
+{
+	const size_t bytes = AREA_PAGES * Page::size();
+	std::vector<uint8_t> state;
+	char title[64];
+
+	snprintf(title, sizeof(title), "%s serialize", name);
+	report(title, measure(20, [&] {
+		state.clear();
+		source.serialize_to(state, options);
+	}), bytes);
+
+	const std::vector<uint8_t> empty;
+	machine_t restored { empty, { .memory_max = MAX_MEMORY } };
+	snprintf(title, sizeof(title), "%s deserialize", name);
+	report(title, measure(20, [&] {
+		if (restored.deserialize_from(state) != 0) {
+			fprintf(stderr, "Deserialization failed!\n");
+			exit(1);
+		}
+	}), bytes);
+	if (!verify(source, restored)) {
+		fprintf(stderr, "Restored memory did not match!\n");
+		exit(1);
+	}
+	printf("%-32s %10zu kB (%.1f%% of %zu kB)\n\n", "Snapshot size",
+		state.size() / 1024, 100.0 * state.size() / bytes, bytes / 1024);
+}
+
+static void benchmark_mapped(machine_t& source)
+{
+	const size_t bytes = AREA_PAGES * Page::size();
+	std::vector<uint8_t> state;
+	source.serialize_to(state, { .page_aligned = true });
+
+	char filename[] = "/tmp/rvsnapshot-XXXXXX";
+	const int fd = mkstemp(filename);
+	if (fd < 0 || write(fd, state.data(), state.size()) != (ssize_t) state.size()) {
+		fprintf(stderr, "Could not write snapshot image\n");
+		exit(1);
+	}
+	close(fd);
+
+	const std::vector<uint8_t> empty;
+	machine_t restored { empty, { .memory_max = MAX_MEMORY } };
+	report("Mapped deserialize", measure(20, [&] {
+		if (restored.deserialize_mapped(filename) != 0) {
+			fprintf(stderr, "Mapped deserialization failed!\n");
+			exit(1);
+		}
+	}), bytes);
+	unlink(filename);
+	if (!verify(source, restored)) {
+		fprintf(stderr, "Restored memory did not match!\n");
+		exit(1);
+	}
+	printf("%-32s %10zu kB (%.1f%% of %zu kB)\n\n", "Snapshot image size",
+		state.size() / 1024, 100.0 * state.size() / bytes, bytes / 1024);
+}
+
+static void benchmark_streamed(machine_t& source)
+{
+	const size_t bytes = AREA_PAGES * Page::size();
+	char filename[] = "/tmp/rvsnapshot-XXXXXX";
+	const int fd = mkstemp(filename);
+	if (fd < 0) {
+		fprintf(stderr, "Could not create snapshot file\n");
+		exit(1);
+	}
+	report("Streamed serialize", measure(20, [&] {
+		lseek(fd, 0, SEEK_SET);
+		if (source.serialize_to(fd) != 0) {
+			fprintf(stderr, "Streamed serialization failed!\n");
+			exit(1);
+		}
+	}), bytes);
+
+	const std::vector<uint8_t> empty;
+	machine_t restored { empty, { .memory_max = MAX_MEMORY } };
+	report("Streamed deserialize", measure(20, [&] {
+		lseek(fd, 0, SEEK_SET);
+		if (restored.deserialize_from(fd) != 0) {
+			fprintf(stderr, "Streamed deserialization failed!\n");
+			exit(1);
+		}
+	}), bytes);
+	close(fd);
+	unlink(filename);
+	if (!verify(source, restored)) {
+		fprintf(stderr, "Restored memory did not match!\n");
+		exit(1);
+	}
+	printf("\n");
+}
+
+int main()
+{
+	const std::vector<uint8_t> empty;
+	machine_t machine { empty, { .memory_max = MAX_MEMORY } };
+	populate(machine);
+	add_code(machine);
+
+	benchmark(machine, "Plain", {});
+	benchmark(machine, "Compressed", { .compress = true });
+	benchmark_mapped(machine);
+	benchmark_streamed(machine);
+	return 0;
+}
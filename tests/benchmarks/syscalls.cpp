@@ -0,0 +1,105 @@
+#include <libriscv/machine.hpp>
+#include <functional>
+#include "benchmark.hpp"
+using namespace riscv;
+using machine_t = Machine<RISCV64>;
+using address_t = address_type<RISCV64>;
+
+static constexpr uint64_t MAX_MEMORY = 64ull << 20;
+static constexpr address_t BUFFER = 0x100000 + 100;
+static constexpr address_t IOVEC  = 0x80000;
+static constexpr int SYSCALL_WRITEV = 66;
+static constexpr int SYSCALL_WRITE  = 64;
+static const size_t sizes[] = { 16, 256, 4096, 65536 };
+
+// The previous way of viewing guest memory from a system call:
+// gathering buffers, and a std::function callback for each of them
+static size_t baseline_write(machine_t& m, address_t addr, size_t len,
+	const std::function<void(const char*, size_t)>& callback)
+{
+	riscv::vBuffer buffers[64];
+	const size_t cnt =
+		m.memory.gather_buffers_from_range(64, buffers, addr, len);
+	for (size_t i = 0; i < cnt; i++) {
+		callback(buffers[i].ptr, buffers[i].len);
+	}
+	return len;
+}
+static size_t spans_write(machine_t& m, address_t addr, size_t len,
+	const std::function<void(const char*, size_t)>& callback)
+{
+	for (const auto span : m.memory.spans(addr, len)) {
+		callback((const char *)span.data, span.size);
+	}
+	return len;
+}
+
+static void report_ns(const char* name, double nanos)
+{
+	printf("%-32s %10.1f ns\n", name, nanos);
+}
+
+static size_t invoke(machine_t& m, int nr, address_t a0, address_t a1, address_t a2)
+{
+	m.cpu.reg(REG_ARG0) = a0;
+	m.cpu.reg(REG_ARG1) = a1;
+	m.cpu.reg(REG_ARG2) = a2;
+	m.system_call(nr);
+	return m.return_value<size_t>();
+}
+
+int main()
+{
+	const std::vector<uint8_t> empty;
+	machine_t machine { empty, { .memory_max = MAX_MEMORY } };
+	machine.setup_linux_syscalls(false, false);
+	size_t printed = 0;
+	machine.set_printer([&] (const char*, size_t len) { printed += len; });
+	const std::function<void(const char*, size_t)> callback =
+		[&] (const char*, size_t len) { printed += len; };
+
+	for (const size_t size : sizes)
+	{
+		const unsigned samples = 200000;
+		machine.memory.memset(BUFFER, 'a', size);
+
+		printed = 0;
+		if (invoke(machine, SYSCALL_WRITE, 1, BUFFER, size) != size || printed != size) {
+			fprintf(stderr, "Mismatch in write!\n");
+			return 1;
+		}
+		char title[64];
+		snprintf(title, sizeof(title), "write %zu gather", size);
+		report_ns(title, measure(samples, [&] {
+			baseline_write(machine, BUFFER, size, callback); }));
+		snprintf(title, sizeof(title), "write %zu spans", size);
+		report_ns(title, measure(samples, [&] {
+			spans_write(machine, BUFFER, size, callback); }));
+		snprintf(title, sizeof(title), "write %zu system call", size);
+		report_ns(title, measure(samples, [&] {
+			invoke(machine, SYSCALL_WRITE, 1, BUFFER, size); }));
+
+		// Four iovecs splitting the buffer
+		const address_t part = size / 4;
+		for (int i = 0; i < 4; i++) {
+			machine.memory.write<uint64_t> (IOVEC + i * 16 + 0, BUFFER + i * part);
+			machine.memory.write<uint64_t> (IOVEC + i * 16 + 8, part);
+		}
+		snprintf(title, sizeof(title), "writev %zu system call", size);
+		report_ns(title, measure(samples, [&] {
+			invoke(machine, SYSCALL_WRITEV, 1, IOVEC, 4); }));
+
+		// Buffered output, counting the calls into the printer
+		size_t writes = 0, printer_calls = 0;
+		machine.set_printer([&] (const char*, size_t len) { printed += len; printer_calls++; });
+		machine.set_output_buffering(16384);
+		snprintf(title, sizeof(title), "write %zu buffered", size);
+		report_ns(title, measure(samples, [&] {
+			invoke(machine, SYSCALL_WRITE, 1, BUFFER, size); writes++; }));
+		machine.set_output_buffering(0);
+		printf("%-32s %10.3f\n", "printer calls per write", double(printer_calls) / writes);
+		machine.set_printer([&] (const char*, size_t len) { printed += len; });
+		printf("\n");
+	}
+	return 0;
+}
@@ -0,0 +1,206 @@
+#include <libriscv/machine.hpp>
+#include <libriscv/threads.hpp>
+#include "benchmark.hpp"
+using namespace riscv;
+using machine_t = Machine<RISCV64>;
+using address_t = address_type<RISCV64>;
+
+static constexpr uint64_t MAX_MEMORY = 64ull << 20;
+static constexpr address_t CODE    = 0x10000;
+static constexpr address_t LOCK    = 0x100000;
+static constexpr address_t COUNTER = 0x100100;
+static constexpr unsigned ITERATIONS = 1000;
+static const unsigned thread_counts[] = { 2, 4, 16, 64 };
+static const unsigned yield_counts[] = { 2, 64, 1024, 16384 };
+static const uint64_t time_slices[] = { 0, 100000, 10000, 1000 };
+
+// Hand-assembled RV64 instructions
+enum : uint32_t { ZERO = 0, T0 = 5, T1 = 6, T2 = 7, S0 = 8, S1 = 9,
+	A0 = 10, A1 = 11, A2 = 12, A3 = 13, A7 = 17, S2 = 18, S3 = 19, S4 = 20 };
+static constexpr uint32_t i_type(int32_t imm, uint32_t rs1, uint32_t f3, uint32_t rd, uint32_t op) {
+	return (uint32_t(imm & 0xFFF) << 20) | (rs1 << 15) | (f3 << 12) | (rd << 7) | op;
+}
+static constexpr uint32_t s_type(int32_t imm, uint32_t rs2, uint32_t rs1, uint32_t f3) {
+	return (uint32_t((imm >> 5) & 0x7F) << 25) | (rs2 << 20) | (rs1 << 15)
+		| (f3 << 12) | (uint32_t(imm & 0x1F) << 7) | 0x23;
+}
+static constexpr uint32_t b_type(int32_t imm, uint32_t rs2, uint32_t rs1, uint32_t f3) {
+	return (uint32_t((imm >> 12) & 1) << 31) | (uint32_t((imm >> 5) & 0x3F) << 25)
+		| (rs2 << 20) | (rs1 << 15) | (f3 << 12)
+		| (uint32_t((imm >> 1) & 0xF) << 8) | (uint32_t((imm >> 11) & 1) << 7) | 0x63;
+}
+static constexpr uint32_t j_type(int32_t imm, uint32_t rd) {
+	return (uint32_t((imm >> 20) & 1) << 31) | (uint32_t((imm >> 1) & 0x3FF) << 21)
+		| (uint32_t((imm >> 11) & 1) << 20) | (uint32_t((imm >> 12) & 0xFF) << 12)
+		| (rd << 7) | 0x6F;
+}
+static constexpr uint32_t ADDI(uint32_t rd, uint32_t rs1, int32_t imm) { return i_type(imm, rs1, 0, rd, 0x13); }
+static constexpr uint32_t LW(uint32_t rd, uint32_t rs1) { return i_type(0, rs1, 2, rd, 0x03); }
+static constexpr uint32_t SW(uint32_t rs2, uint32_t rs1) { return s_type(0, rs2, rs1, 2); }
+static constexpr uint32_t BEQ(uint32_t rs1, uint32_t rs2, int32_t imm) { return b_type(imm, rs2, rs1, 0); }
+static constexpr uint32_t BNE(uint32_t rs1, uint32_t rs2, int32_t imm) { return b_type(imm, rs2, rs1, 1); }
+static constexpr uint32_t JAL(uint32_t rd, int32_t imm) { return j_type(imm, rd); }
+// AMOSWAP.W.AQ rd, rs2, (rs1)
+static constexpr uint32_t AMOSWAP_W(uint32_t rd, uint32_t rs2, uint32_t rs1) {
+	return (0b0000110u << 25) | (rs2 << 20) | (rs1 << 15) | (2 << 12) | (rd << 7) | 0x2F;
+}
+static constexpr uint32_t ECALL = 0x73;
+static constexpr int SYSCALL_EXIT = 93, SYSCALL_FUTEX = 98, SYSCALL_YIELD = 124;
+static constexpr int FUTEX_WAIT_PRIVATE = 128, FUTEX_WAKE_PRIVATE = 129;
+
+// Every thread takes a simple futex lock S2 times, and increments
+// the counter while holding it. The lock holder yields in the
+// critical section, so that the other threads find the lock taken.
+// The main thread (S4 != 0) then waits for the counter to reach S3.
+static const std::vector<uint32_t> lock_loop {
+	/*  0 */ ADDI(T0, ZERO, 1), AMOSWAP_W(T1, T0, S0), BEQ(T1, ZERO, 32),
+	/* 12 */ ADDI(A0, S0, 0), ADDI(A1, ZERO, FUTEX_WAIT_PRIVATE), ADDI(A2, ZERO, 1),
+	/* 24 */ ADDI(A3, ZERO, 0), ADDI(A7, ZERO, SYSCALL_FUTEX), ECALL, JAL(ZERO, -36),
+	/* 40 */ ADDI(A7, ZERO, SYSCALL_YIELD), ECALL,
+	/* 48 */ LW(T2, S1), ADDI(T2, T2, 1), SW(T2, S1), SW(ZERO, S0),
+	/* 64 */ ADDI(A0, S0, 0), ADDI(A1, ZERO, FUTEX_WAKE_PRIVATE), ADDI(A2, ZERO, 1),
+	/* 76 */ ADDI(A7, ZERO, SYSCALL_FUTEX), ECALL, ADDI(S2, S2, -1), BNE(S2, ZERO, -88),
+	/* 92 */ BNE(S4, ZERO, 12), ADDI(A7, ZERO, SYSCALL_EXIT), ECALL,
+	/*104 */ LW(T2, S1), BEQ(T2, S3, 16), ADDI(A7, ZERO, SYSCALL_YIELD), ECALL, JAL(ZERO, -16),
+	/*124 */ ADDI(A7, ZERO, SYSCALL_EXIT), ECALL
+};
+// Every thread yields to the next, forever
+static const std::vector<uint32_t> yield_loop {
+	ADDI(A7, ZERO, SYSCALL_YIELD), ECALL, JAL(ZERO, -8)
+};
+// Every thread counts, forever
+static const std::vector<uint32_t> busy_loop {
+	ADDI(T0, T0, 1), JAL(ZERO, -4)
+};
+
+// The previous futex: waiting threads stay runnable, and retry
+// whenever they are scheduled, while waking up just yields
+static void spin_yield_futex(machine_t& machine)
+{
+	const auto addr = machine.sysarg<address_t> (0);
+	const int futex_op = machine.sysarg<int> (1);
+	const int      val = machine.sysarg<int> (2);
+	if ((futex_op & 0xF) == 0) {
+		while (machine.memory.read<address_t> (addr) == (address_t)val) {
+			if (machine.threads().suspend_and_yield())
+				return;
+			machine.cpu.trigger_exception(DEADLOCK_REACHED);
+		}
+		machine.set_result(0);
+	} else {
+		if (machine.threads().suspend_and_yield())
+			return;
+		machine.set_result(0);
+	}
+}
+
+// Creates the other threads as copies of the main thread. Suspended
+// threads resume after the system call they were suspended in.
+static void create_threads(machine_t& machine, unsigned nthreads)
+{
+	auto& mt = machine.threads();
+	for (unsigned i = 1; i < nthreads; i++) {
+		auto* thread = mt.create(0, 0, 0, 0, 0, 0, 0);
+		thread->stored_regs = machine.cpu.registers();
+		thread->stored_regs.pc -= 4;
+		mt.m_suspended.push_back(thread);
+	}
+}
+
+static void install(machine_t& machine, const std::vector<uint32_t>& code)
+{
+	machine.setup_posix_threads();
+	machine.memory.memcpy(CODE, code.data(), code.size() * 4);
+	machine.memory.set_page_attr(CODE, Page::size(), { .read = true, .write = false, .exec = true });
+	machine.cpu.registers().pc = CODE;
+}
+
+static void report_ns(const char* name, double nanos)
+{
+	printf("%-32s %10.2f ns\n", name, nanos);
+}
+
+static uint64_t run_threads(const machine_t::syscall_table_t& table, unsigned nthreads)
+{
+	const std::vector<uint8_t> empty;
+	machine_t machine { empty, { .memory_max = MAX_MEMORY } };
+	install(machine, lock_loop);
+	machine.set_syscall_table(table);
+	machine.memory.memzero(LOCK, Page::size());
+
+	auto& cpu = machine.cpu;
+	cpu.reg(S0) = LOCK;
+	cpu.reg(S1) = COUNTER;
+	cpu.reg(S2) = ITERATIONS;
+	cpu.reg(S3) = nthreads * ITERATIONS;
+	cpu.reg(S4) = 0;
+	create_threads(machine, nthreads);
+	cpu.reg(S4) = 1;
+	machine.simulate();
+	if (machine.memory.read<uint32_t> (COUNTER) != nthreads * ITERATIONS) {
+		fprintf(stderr, "Mismatch in lock counter!\n");
+		exit(1);
+	}
+	return machine.instruction_counter();
+}
+
+int main()
+{
+	static machine_t::syscall_table_t spin_yield = machine_t::syscall_handlers;
+	{
+		// Install the posix threads system calls
+		const std::vector<uint8_t> empty;
+		machine_t machine { empty, { .memory_max = MAX_MEMORY } };
+		machine.setup_posix_threads();
+		spin_yield = machine_t::syscall_handlers;
+		spin_yield[SYSCALL_FUTEX] = spin_yield_futex;
+	}
+
+	for (const unsigned nthreads : thread_counts)
+	{
+		const unsigned samples = 20;
+		char title[64];
+		uint64_t instructions = 0;
+		snprintf(title, sizeof(title), "lock %u threads spin-yield", nthreads);
+		report(title, measure(samples, [&] {
+			instructions = run_threads(spin_yield, nthreads); }));
+		printf("%-32s %10.1f\n", "instructions per lock", double(instructions) / (nthreads * ITERATIONS));
+
+		snprintf(title, sizeof(title), "lock %u threads wait queues", nthreads);
+		report(title, measure(samples, [&] {
+			instructions = run_threads(machine_t::syscall_handlers, nthreads); }));
+		printf("%-32s %10.1f\n", "instructions per lock", double(instructions) / (nthreads * ITERATIONS));
+		printf("\n");
+	}
+
+	// Switching threads costs the same for any number of threads
+	for (const unsigned nthreads : yield_counts)
+	{
+		const std::vector<uint8_t> empty;
+		machine_t machine { empty, { .memory_max = MAX_MEMORY } };
+		install(machine, yield_loop);
+		create_threads(machine, nthreads);
+		constexpr uint64_t SWITCHES = 100000;
+		char title[64];
+		snprintf(title, sizeof(title), "sched_yield %u threads", nthreads);
+		report_ns(title, measure(10, [&] {
+			machine.simulate<false>(SWITCHES * yield_loop.size()); }) / SWITCHES);
+	}
+	printf("\n");
+
+	// Preempting busy threads, which would otherwise never switch
+	for (const uint64_t slice : time_slices)
+	{
+		const std::vector<uint8_t> empty;
+		machine_t machine { empty, { .memory_max = MAX_MEMORY } };
+		install(machine, busy_loop);
+		create_threads(machine, 16);
+		machine.threads().set_time_slice(slice);
+		constexpr uint64_t INSTRUCTIONS = 10'000'000;
+		char title[64];
+		snprintf(title, sizeof(title), "16 busy threads slice %lu", (unsigned long)slice);
+		report_ns(title, measure(10, [&] {
+			machine.simulate<false>(INSTRUCTIONS); }) / INSTRUCTIONS);
+	}
+	return 0;
+}
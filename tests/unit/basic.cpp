@@ -2,6 +2,7 @@
 #include <catch2/matchers/catch_matchers_string.hpp>
 
 #include <libriscv/machine.hpp>
+#include <libriscv/page_store.hpp>
 extern std::vector<uint8_t> build_and_load(
 	const std::string& code, const std::string& args = "-O2 -static");
 static const uint64_t MAX_MEMORY = 8ul << 20; /* 8MB */
@@ -38,6 +39,159 @@ TEST_CASE("Instantiate machine using shared ELF", "[Instantiate]")
 	}());
 }
 
+TEST_CASE("Execute position-independent ELF", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+	int main() {
+		return 666;
+	})M", "-O2 -static-pie");
+	riscv::Machine<RISCV64> machine { binary, { .memory_max = MAX_MEMORY } };
+	// Position-independent programs are loaded at a fixed base
+	REQUIRE(machine.memory.elf_base() == machine.memory.DYLINK_BASE);
+	REQUIRE(machine.memory.start_address() > machine.memory.DYLINK_BASE);
+
+	machine.setup_linux_syscalls();
+	machine.setup_linux({"program"}, {"LC_TYPE=C", "LC_ALL=C"});
+	machine.simulate(MAX_INSTRUCTIONS);
+
+	REQUIRE(machine.return_value<int>() == 666);
+}
+
+TEST_CASE("Share identical pages between machines", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+	static const char table[65536] = { 1, 2, 3 };
+	static char data[65536] = { 4, 5, 6 };
+	int main(int argc, char** argv) {
+		data[argc] = table[argc];
+		return data[1] + data[2];
+	})M");
+	const auto before = SharedPages::stats();
+	riscv::Machine<RISCV64> machine1 { binary,
+		{ .memory_max = MAX_MEMORY, .deduplicate_pages = true } };
+	riscv::Machine<RISCV64> machine2 { binary,
+		{ .memory_max = MAX_MEMORY, .deduplicate_pages = true } };
+	// The second machine shares every page with the first
+	const auto after = SharedPages::stats();
+	REQUIRE(after.pages > before.pages);
+	REQUIRE(after.bytes_saved() - before.bytes_saved() >= 65536);
+
+	// Shared pages are copy-on-write in every machine
+	machine1.setup_linux_syscalls();
+	machine1.setup_linux({"program"}, {"LC_TYPE=C", "LC_ALL=C"});
+	machine1.simulate(MAX_INSTRUCTIONS);
+	REQUIRE(machine1.return_value<int>() == 2 + 6);
+
+	machine2.setup_linux_syscalls();
+	machine2.setup_linux({"program", "arg"}, {"LC_TYPE=C", "LC_ALL=C"});
+	machine2.simulate(MAX_INSTRUCTIONS);
+	REQUIRE(machine2.return_value<int>() == 5 + 3);
+}
+
+TEST_CASE("Re-protect lazily mapped segments", "[Instantiate]")
+{
+	const auto binary = build_and_load(R"M(
+	#include <sys/mman.h>
+	static const char table[4 * 4096] __attribute__((aligned(4096))) = { 1, 2, 3 };
+	int main() {
+		// The page has not been touched, and is not installed yet
+		char* page = (char*) &table[2 * 4096];
+		if (mprotect(page, 4096, PROT_READ | PROT_WRITE) != 0)
+			return -1;
+		page[0] = 4;
+		return (page[0] == 4 && table[1] == 2) ? 666 : -2;
+	})M");
+	riscv::Machine<RISCV64> machine { binary,
+		{ .memory_max = MAX_MEMORY, .map_segments = true } };
+	REQUIRE(machine.memory.mapped_segments() > 0);
+
+	machine.setup_linux_syscalls();
+	machine.setup_linux({"program"}, {"LC_TYPE=C", "LC_ALL=C"});
+	machine.simulate(MAX_INSTRUCTIONS);
+
+	REQUIRE(machine.return_value<int>() == 666);
+}
+
+// A minimal 64-bit ELF with one executable segment at @vaddr,
+// and a PT_INTERP header when @interp is set
+static std::vector<uint8_t> make_elf(uint16_t type, uint64_t vaddr,
+	const std::vector<uint32_t>& code, const char* interp = nullptr)
+{
+	using Ehdr = riscv::Elf<8>::Ehdr;
+	using Phdr = riscv::Elf<8>::Phdr;
+	std::vector<uint8_t> elf(0x2000);
+	Ehdr ehdr {};
+	std::memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+	ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+	ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr.e_type = type;
+	ehdr.e_machine = EM_RISCV;
+	ehdr.e_version = EV_CURRENT;
+	ehdr.e_entry = vaddr;
+	ehdr.e_phoff = sizeof(Ehdr);
+	ehdr.e_ehsize = sizeof(Ehdr);
+	ehdr.e_phentsize = sizeof(Phdr);
+	ehdr.e_phnum = (interp != nullptr) ? 2 : 1;
+	std::memcpy(&elf[0], &ehdr, sizeof(ehdr));
+
+	Phdr load {};
+	load.p_type = PT_LOAD;
+	load.p_flags = PF_R | PF_X;
+	load.p_offset = 0x1000;
+	load.p_vaddr = vaddr;
+	load.p_filesz = code.size() * 4;
+	load.p_memsz = code.size() * 4;
+	load.p_align = 0x1000;
+	std::memcpy(&elf[sizeof(Ehdr)], &load, sizeof(load));
+	std::memcpy(&elf[0x1000], code.data(), code.size() * 4);
+	if (interp != nullptr) {
+		Phdr phdr {};
+		phdr.p_type = PT_INTERP;
+		phdr.p_flags = PF_R;
+		phdr.p_offset = 0x800;
+		phdr.p_filesz = std::strlen(interp) + 1;
+		phdr.p_memsz = phdr.p_filesz;
+		std::memcpy(&elf[sizeof(Ehdr) + sizeof(Phdr)], &phdr, sizeof(phdr));
+		std::memcpy(&elf[0x800], interp, phdr.p_filesz);
+	}
+	return elf;
+}
+
+TEST_CASE("Execute dynamically linked ELF", "[Instantiate]")
+{
+	// li a0, 666; li a7, 93; ecall
+	const auto binary = make_elf(ET_EXEC, 0x10000,
+		{ 0x29a00513, 0x05d00893, 0x00000073 }, "/lib/ld.so");
+	// Finds AT_ENTRY after argv and envp on the stack, and jumps there
+	const auto interp = make_elf(ET_DYN, 0x1000, {
+		0x00013283, 0x01010313, 0x00329293, 0x00530333, 0x00033383,
+		0x00830313, 0xfe039ce3, 0x00900e93, 0x00033383, 0x00833e03,
+		0x01030313, 0xffd39ae3, 0x000e0067 });
+
+	REQUIRE_THROWS_WITH([&] {
+		riscv::Machine<RISCV64> machine(binary, MachineOptions<RISCV64>{ .memory_max = MAX_MEMORY });
+	}(), Catch::Matchers::ContainsSubstring("no interpreter"));
+
+	riscv::Machine<RISCV64> machine { binary, {
+		.memory_max = MAX_MEMORY,
+		.interpreter = std::string_view((const char*)interp.data(), interp.size())
+	} };
+	// The interpreter starts, and jumps to the program entry when done
+	const auto base = machine.memory.interpreter_base();
+	REQUIRE(base != 0);
+	REQUIRE(machine.memory.start_address() == base + 0x1000);
+	REQUIRE(machine.memory.program_entry() == 0x10000);
+	REQUIRE(machine.memory.mmap_address() > base);
+	REQUIRE(machine.memory.execute_segments().size() == 2);
+
+	machine.setup_linux_syscalls();
+	machine.setup_linux({"program"}, {"LC_TYPE=C", "LC_ALL=C"});
+	machine.simulate(MAX_INSTRUCTIONS);
+
+	REQUIRE(machine.return_value<int>() == 666);
+}
+
 TEST_CASE("Execute minimal machine", "[Minimal]")
 {
 	const auto binary = build_and_load(R"M(
@@ -54,6 +208,39 @@ TEST_CASE("Execute minimal machine", "[Minimal]")
 	REQUIRE(machine.return_value<int>() == 666);
 }
 
+TEST_CASE("Per-machine system call tables", "[Minimal]")
+{
+	const auto binary = build_and_load(R"M(
+	__asm__(".global _start\n"
+	"_start:\n"
+	"	li a0, 666\n"
+	"	li a7, 1\n"
+	"	ecall\n"
+	"	li a7, 2\n"
+	"	ecall\n");
+	)M", "-static -ffreestanding -nostartfiles");
+	riscv::Machine<RISCV64>::install_syscall_handler(1,
+		[] (auto& machine) { machine.stop(); });
+	static auto table = riscv::Machine<RISCV64>::syscall_handlers;
+	table[1] = [] (auto& machine) { machine.set_result(123); };
+	table[2] = [] (auto& machine) { machine.stop(); };
+
+	riscv::Machine<RISCV64> machine1 { binary, { .memory_max = MAX_MEMORY } };
+	riscv::Machine<RISCV64> machine2 { binary, { .memory_max = MAX_MEMORY } };
+	machine2.set_syscall_table(table);
+	REQUIRE(&machine1.syscall_table() == &riscv::Machine<RISCV64>::syscall_handlers);
+	REQUIRE(&machine2.syscall_table() == &table);
+
+	machine1.simulate(3);
+	REQUIRE(machine1.return_value<int>() == 666);
+	machine2.simulate(5);
+	REQUIRE(machine2.return_value<int>() == 123);
+
+	// Forks inherit the table of the machine they were forked from
+	riscv::Machine<RISCV64> fork { machine2 };
+	REQUIRE(&fork.syscall_table() == &table);
+}
+
 TEST_CASE("Execution timeout", "[Minimal]")
 {
 	const auto binary = build_and_load(R"M(
@@ -131,6 +318,714 @@ TEST_CASE("Catch output from write system call", "[Output]")
 	REQUIRE(output_is_hello_world);
 }
 
+#include <unistd.h>
+TEST_CASE("Park machine waiting in poll", "[Runtime]")
+{
+	const auto binary = build_and_load(R"M(
+	#include <poll.h>
+	#include <stdlib.h>
+	#include <unistd.h>
+	int main(int argc, char** argv) {
+		struct pollfd pfd = { .fd = atoi(argv[1]), .events = POLLIN };
+		if (poll(&pfd, 1, -1) != 1 || !(pfd.revents & POLLIN))
+			return -1;
+		char buffer[16];
+		return (read(pfd.fd, buffer, sizeof(buffer)) == 5) ? 666 : -1;
+	})M");
+	int pipefd[2];
+	REQUIRE(pipe(pipefd) == 0);
+
+	riscv::Machine<RISCV64> machine { binary, { .memory_max = MAX_MEMORY } };
+	machine.setup_linux_syscalls();
+	const int vfd = machine.fds().assign_file(pipefd[0]);
+	machine.setup_linux({"program", std::to_string(vfd)}, {"LC_TYPE=C", "LC_ALL=C"});
+
+	int parked_fd = -1;
+	machine.fds().on_park = [&] (void*, const auto& fds, int timeout) {
+		REQUIRE(timeout == -1);
+		parked_fd = fds.at(0).fd;
+		return true;
+	};
+	// The machine stops, instead of blocking in poll()
+	machine.simulate(MAX_INSTRUCTIONS);
+	REQUIRE(parked_fd == pipefd[0]);
+	REQUIRE(machine.fds().parked);
+
+	REQUIRE(write(pipefd[1], "Hello", 5) == 5);
+	machine.simulate(MAX_INSTRUCTIONS);
+
+	REQUIRE(machine.return_value<int>() == 666);
+	close(pipefd[1]);
+}
+
+TEST_CASE("Select the standard file descriptors", "[Runtime]")
+{
+	const auto binary = build_and_load(R"M(
+	#include <errno.h>
+	#include <sys/select.h>
+	static unsigned long big[0x1001 / (8 * sizeof(long)) + 1];
+	int main() {
+		struct timeval tv = { 0, 0 };
+		fd_set wfds;
+		FD_ZERO(&wfds);
+		FD_SET(1, &wfds);
+		if (select(2, NULL, &wfds, NULL, &tv) != 1 || !FD_ISSET(1, &wfds))
+			return -1;
+		// Files and sockets are numbered beyond what an fd_set can hold
+		if (select(0x1001, (fd_set*)big, NULL, NULL, &tv) != -1 || errno != ENOSYS)
+			return -2;
+		return 666;
+	})M");
+
+	riscv::Machine<RISCV64> machine { binary, { .memory_max = MAX_MEMORY } };
+	machine.setup_linux_syscalls();
+	machine.setup_linux({"program"}, {"LC_TYPE=C", "LC_ALL=C"});
+	machine.simulate(MAX_INSTRUCTIONS);
+
+	REQUIRE(machine.return_value<int>() == 666);
+}
+
+TEST_CASE("Vectored and positional file I/O", "[Runtime]")
+{
+	const auto binary = build_and_load(R"M(
+	#include <stdlib.h>
+	#include <string.h>
+	#include <sys/uio.h>
+	#include <unistd.h>
+	static char big[3 * 4096];
+	int main(int argc, char** argv) {
+		const int fd = atoi(argv[1]);
+		memset(big, 'x', sizeof(big));
+		if (pwrite(fd, big, sizeof(big), 100) != sizeof(big))
+			return -1;
+		struct iovec wiov[2] = { { "Hello ", 6 }, { "World", 5 } };
+		if (pwritev(fd, wiov, 2, 0) != 11)
+			return -2;
+		char a[6], b[8];
+		struct iovec riov[2] = { { a, 6 }, { b, 5 } };
+		if (lseek(fd, 0, SEEK_SET) != 0 || readv(fd, riov, 2) != 11)
+			return -3;
+		if (memcmp(a, "Hello ", 6) != 0 || memcmp(b, "World", 5) != 0)
+			return -4;
+		memset(big, 0, sizeof(big));
+		if (pread(fd, big, sizeof(big), 100) != sizeof(big) || big[5000] != 'x')
+			return -5;
+		return 666;
+	})M");
+	FILE* file = tmpfile();
+	REQUIRE(file != nullptr);
+
+	riscv::Machine<RISCV64> machine { binary, { .memory_max = MAX_MEMORY } };
+	machine.setup_linux_syscalls();
+	machine.fds().permit_file_write = true;
+	const int vfd = machine.fds().assign_file(dup(fileno(file)));
+	machine.setup_linux({"program", std::to_string(vfd)}, {"LC_TYPE=C", "LC_ALL=C"});
+	machine.simulate(MAX_INSTRUCTIONS);
+
+	REQUIRE(machine.return_value<int>() == 666);
+	fclose(file);
+}
+
+TEST_CASE("Map host file into guest memory", "[Runtime]")
+{
+	const auto binary = build_and_load(R"M(
+	#include <stdlib.h>
+	#include <string.h>
+	#include <sys/mman.h>
+	int main(int argc, char** argv) {
+		char* data = mmap(0, 8192, PROT_READ | PROT_WRITE, MAP_PRIVATE, atoi(argv[1]), 0);
+		if (data == MAP_FAILED)
+			return -1;
+		if (memcmp(data, "Hello World", 11) != 0 || data[5000] != 0)
+			return -2;
+		// Private mappings are copy-on-write
+		data[0] = 'J';
+		return (data[0] == 'J') ? 666 : -3;
+	})M");
+	FILE* file = tmpfile();
+	REQUIRE(file != nullptr);
+	REQUIRE(fwrite("Hello World", 1, 11, file) == 11);
+	fflush(file);
+
+	riscv::Machine<RISCV64> machine { binary, { .memory_max = MAX_MEMORY } };
+	machine.setup_linux_syscalls();
+	const int vfd = machine.fds().assign_file(dup(fileno(file)));
+	machine.setup_linux({"program", std::to_string(vfd)}, {"LC_TYPE=C", "LC_ALL=C"});
+	machine.simulate(MAX_INSTRUCTIONS);
+
+	REQUIRE(machine.return_value<int>() == 666);
+	REQUIRE(machine.memory.host_mappings() == 1);
+	// The file is unchanged
+	char buffer[5] {};
+	REQUIRE(pread(fileno(file), buffer, 5, 0) == 5);
+	REQUIRE(std::string(buffer, 5) == "Hello");
+	fclose(file);
+}
+
+TEST_CASE("Re-protect and unmap a shared file mapping", "[Runtime]")
+{
+	const auto binary = build_and_load(R"M(
+	#include <stdlib.h>
+	#include <sys/mman.h>
+	int main(int argc, char** argv) {
+		const int fd = atoi(argv[1]);
+		char* data = mmap(0, 8192, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED)
+			return -1;
+		data[0] = 'J';
+		if (mprotect(data, 4096, PROT_NONE) != 0 || mprotect(data, 4096, PROT_READ | PROT_WRITE) != 0)
+			return -2;
+		data[1] = 'E';
+		// Read-only private mappings become copy-on-write
+		char* priv = mmap(0, 4096, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (priv == MAP_FAILED || mprotect(priv, 4096, PROT_READ | PROT_WRITE) != 0)
+			return -3;
+		priv[2] = 'Z';
+		if (munmap(data, 8192) != 0 || munmap(priv, 4096) != 0)
+			return -4;
+		return 666;
+	})M");
+	FILE* file = tmpfile();
+	REQUIRE(file != nullptr);
+	REQUIRE(fwrite("Hello World", 1, 11, file) == 11);
+	fflush(file);
+
+	riscv::Machine<RISCV64> machine { binary, { .memory_max = MAX_MEMORY } };
+	machine.setup_linux_syscalls();
+	machine.fds().permit_file_write = true;
+	const int vfd = machine.fds().assign_file(dup(fileno(file)));
+	machine.setup_linux({"program", std::to_string(vfd)}, {"LC_TYPE=C", "LC_ALL=C"});
+	machine.simulate(MAX_INSTRUCTIONS);
+
+	REQUIRE(machine.return_value<int>() == 666);
+	REQUIRE(machine.memory.host_mappings() == 0);
+	// Only the shared mapping writes to the file
+	char buffer[5] {};
+	REQUIRE(pread(fileno(file), buffer, 5, 0) == 5);
+	REQUIRE(std::string(buffer, 5) == "JEllo");
+	fclose(file);
+}
+
+TEST_CASE("Read files from a virtual filesystem", "[Runtime]")
+{
+	const auto binary = build_and_load(R"M(
+	#include <dirent.h>
+	#include <fcntl.h>
+	#include <string.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+	int main() {
+		char buffer[64] = {};
+		const int fd = open("/data/hello.txt", O_RDONLY);
+		if (fd < 0 || read(fd, buffer, sizeof(buffer)) != 11)
+			return -1;
+		if (strcmp(buffer, "Hello World") != 0)
+			return -2;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size != 11 || !S_ISREG(st.st_mode))
+			return -3;
+		const char* data = mmap(0, 4096, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED || memcmp(data, "Hello", 5) != 0)
+			return -4;
+		// The virtual filesystem is read-only, and the host is unreachable
+		if (open("/data/hello.txt", O_WRONLY) >= 0 || open("/etc/passwd", O_RDONLY) >= 0)
+			return -5;
+		DIR* dir = opendir("/data");
+		int entries = 0;
+		while (dir && readdir(dir)) entries++;
+		return (entries == 3) ? 666 : -6;
+	})M");
+
+	auto vfs = std::make_shared<VirtualFS>();
+	vfs->add_file("/data/hello.txt", "Hello World");
+
+	riscv::Machine<RISCV64> machine { binary, { .memory_max = MAX_MEMORY } };
+	machine.setup_linux_syscalls();
+	machine.fds().vfs = vfs;
+	machine.setup_linux({"program"}, {"LC_TYPE=C", "LC_ALL=C"});
+	machine.simulate(MAX_INSTRUCTIONS);
+
+	REQUIRE(machine.return_value<int>() == 666);
+}
+
+TEST_CASE("Read the time from the shared time page", "[Runtime]")
+{
+	const auto binary = build_and_load(R"M(
+	#include <time.h>
+	struct time_page { unsigned long long sequence; long long rt_sec, rt_nsec, mono_sec, mono_nsec; };
+	static const volatile struct time_page* get_time_page() {
+		register long a0 asm("a0");
+		register long syscall_id asm("a7") = 380;
+		asm volatile ("ecall" : "=r"(a0) : "r"(syscall_id));
+		return (const volatile struct time_page*) a0;
+	}
+	int main() {
+		const volatile struct time_page* page = get_time_page();
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		const long long diff = ts.tv_sec - page->rt_sec;
+		if (page->sequence == 0 || diff < -1 || diff > 1)
+			return -1;
+		return 666;
+	})M");
+
+	riscv::Machine<RISCV64> machine { binary, { .memory_max = MAX_MEMORY } };
+	machine.setup_linux_syscalls();
+	machine.setup_native_time(380);
+	machine.setup_linux({"program"}, {"LC_TYPE=C", "LC_ALL=C"});
+	machine.simulate(MAX_INSTRUCTIONS);
+
+	REQUIRE(machine.return_value<int>() == 666);
+	REQUIRE(machine.time_page() != 0);
+}
+
+TEST_CASE("The time page advances during long runs", "[Runtime]")
+{
+	const auto binary = build_and_load(R"M(
+	#include <sys/mman.h>
+	struct time_page { unsigned long long sequence; long long rt_sec, rt_nsec, mono_sec, mono_nsec; };
+	static const volatile struct time_page* get_time_page() {
+		register long a0 asm("a0");
+		register long syscall_id asm("a7") = 380;
+		asm volatile ("ecall" : "=r"(a0) : "r"(syscall_id));
+		return (const volatile struct time_page*) a0;
+	}
+	int main() {
+		const volatile struct time_page* page = get_time_page();
+		// The page can never be made writable
+		if (mprotect((void*) page, 4096, PROT_READ) != 0)
+			return -1;
+		const unsigned long long sequence = page->sequence;
+		for (int i = 0; i < 1000000; i++) {
+			if (page->sequence != sequence)
+				return 666;
+		}
+		return -2;
+	})M");
+
+	riscv::Machine<RISCV64> machine { binary, { .memory_max = MAX_MEMORY } };
+	machine.setup_linux_syscalls();
+	machine.setup_native_time(380);
+	machine.setup_linux({"program"}, {"LC_TYPE=C", "LC_ALL=C"});
+	machine.simulate(MAX_INSTRUCTIONS);
+
+	REQUIRE(machine.return_value<int>() == 666);
+	REQUIRE_THROWS(machine.memory.set_page_attr(machine.time_page(), Page::size(),
+		{ .read = true, .write = true }));
+}
+
+TEST_CASE("Buffered guest output", "[Runtime]")
+{
+	const auto binary = build_and_load(R"M(
+	#include <unistd.h>
+	int main() {
+		for (int i = 0; i < 1000; i++)
+			write(1, "Hello World!\n", 13);
+		return 666;
+	})M");
+
+	riscv::Machine<RISCV64> machine { binary, { .memory_max = MAX_MEMORY } };
+	machine.setup_linux_syscalls();
+	machine.setup_linux({"program"}, {"LC_TYPE=C", "LC_ALL=C"});
+	std::string output;
+	size_t calls = 0;
+	machine.set_printer([&] (const char* data, size_t size) {
+		output.append(data, size);
+		calls++;
+	});
+	machine.set_output_buffering(4096);
+	machine.simulate(MAX_INSTRUCTIONS);
+
+	REQUIRE(machine.return_value<int>() == 666);
+	// Everything was printed when the machine stopped, in a few calls
+	REQUIRE(output.size() == 13000);
+	REQUIRE(calls <= 4);
+}
+
+TEST_CASE("Transfer files on the host with sendfile", "[Runtime]")
+{
+	const auto binary = build_and_load(R"M(
+	#define _GNU_SOURCE
+	#include <stdlib.h>
+	#include <sys/sendfile.h>
+	#include <unistd.h>
+	int main(int argc, char** argv) {
+		const int in = atoi(argv[1]);
+		const int out = atoi(argv[2]);
+		off_t offset = 6;
+		if (sendfile(1, in, &offset, 5) != 5 || offset != 11)
+			return -1;
+		loff_t off_in = 0, off_out = 0;
+		if (copy_file_range(in, &off_in, out, &off_out, 11, 0) != 11)
+			return -2;
+		return 666;
+	})M");
+	FILE* in = tmpfile();
+	FILE* out = tmpfile();
+	REQUIRE(fwrite("Hello World", 1, 11, in) == 11);
+	fflush(in);
+
+	riscv::Machine<RISCV64> machine { binary, { .memory_max = MAX_MEMORY } };
+	machine.setup_linux_syscalls();
+	machine.fds().permit_file_write = true;
+	const int vin = machine.fds().assign_file(dup(fileno(in)));
+	const int vout = machine.fds().assign_file(dup(fileno(out)));
+	machine.setup_linux({"program", std::to_string(vin), std::to_string(vout)},
+		{"LC_TYPE=C", "LC_ALL=C"});
+	std::string output;
+	machine.set_printer([&] (const char* data, size_t size) {
+		output.append(data, size);
+	});
+	machine.simulate(MAX_INSTRUCTIONS);
+
+	REQUIRE(machine.return_value<int>() == 666);
+	REQUIRE(output == "World");
+	char buffer[11];
+	REQUIRE(pread(fileno(out), buffer, 11, 0) == 11);
+	REQUIRE(std::string(buffer, 11) == "Hello World");
+	fclose(in);
+	fclose(out);
+}
+
+TEST_CASE("Contended locks with futex wait queues", "[Runtime]")
+{
+	const auto binary = build_and_load(R"M(
+	#include <pthread.h>
+	#include <sched.h>
+	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+	static int counter = 0;
+	static void* worker(void*) {
+		for (int i = 0; i < 100; i++) {
+			pthread_mutex_lock(&mutex);
+			sched_yield(); // others find the lock taken
+			counter++;
+			pthread_cond_broadcast(&cond);
+			pthread_mutex_unlock(&mutex);
+		}
+		return NULL;
+	}
+	int main() {
+		pthread_t threads[4];
+		for (int i = 0; i < 4; i++)
+			pthread_create(&threads[i], NULL, worker, NULL);
+		pthread_mutex_lock(&mutex);
+		while (counter < 400)
+			pthread_cond_wait(&cond, &mutex);
+		pthread_mutex_unlock(&mutex);
+		for (int i = 0; i < 4; i++)
+			pthread_join(threads[i], NULL);
+		return 666;
+	})M", "-O2 -static -pthread");
+
+	riscv::Machine<RISCV64> machine { binary, { .memory_max = MAX_MEMORY } };
+	machine.setup_linux_syscalls();
+	machine.setup_posix_threads();
+	machine.setup_linux({"program"}, {"LC_TYPE=C", "LC_ALL=C"});
+	machine.simulate(MAX_INSTRUCTIONS);
+
+	REQUIRE(machine.return_value<int>() == 666);
+}
+
+#include <libriscv/threads.hpp>
+TEST_CASE("Preempt busy guest threads", "[Runtime]")
+{
+	const auto binary = build_and_load(R"M(
+	#include <pthread.h>
+	static volatile int started = 0;
+	static volatile int done = 0;
+	static void* worker(void*) {
+		started = 1;
+		while (!done); // never makes a system call
+		return NULL;
+	}
+	int main() {
+		pthread_t thread;
+		pthread_create(&thread, NULL, worker, NULL);
+		while (!started); // neither does the main thread
+		done = 1;
+		pthread_join(thread, NULL);
+		return 666;
+	})M", "-O2 -static -pthread");
+
+	riscv::Machine<RISCV64> machine { binary, { .memory_max = MAX_MEMORY } };
+	machine.setup_linux_syscalls();
+	machine.setup_posix_threads();
+	machine.threads().set_time_slice(10'000);
+	machine.setup_linux({"program"}, {"LC_TYPE=C", "LC_ALL=C"});
+	machine.simulate(MAX_INSTRUCTIONS);
+
+	REQUIRE(machine.return_value<int>() == 666);
+}
+
+#include <libriscv/native_heap.hpp>
+TEST_CASE("Resume a snapshot of a threaded guest", "[Runtime]")
+{
+	const auto binary = build_and_load(R"M(
+	#include <pthread.h>
+	#include <sched.h>
+	#include <stdlib.h>
+	#include <string.h>
+	#include <unistd.h>
+	static volatile int go = 0;
+	static void* worker(void*) {
+		while (!go) sched_yield();
+		return (void*)42;
+	}
+	int main(int argc, char** argv) {
+		const int fd = atoi(argv[1]);
+		char a[6], b[5];
+		if (read(fd, a, 6) != 6 || memcmp(a, "Hello ", 6) != 0)
+			return -1;
+		pthread_t thread;
+		pthread_create(&thread, NULL, worker, NULL);
+		register long a7 __asm__("a7") = 380;
+		__asm__ volatile("ecall" : : "r"(a7) : "memory"); // snapshot
+		go = 1;
+		void* result;
+		pthread_join(thread, &result);
+		if (result != (void*)42)
+			return -2;
+		if (read(fd, b, 5) != 5 || memcmp(b, "World", 5) != 0)
+			return -3;
+		return 666;
+	})M", "-O2 -static -pthread");
+	char path[] = "/tmp/libriscv-snapshot-XXXXXX";
+	const int fd = mkstemp(path);
+	REQUIRE(fd >= 0);
+	REQUIRE(write(fd, "Hello World", 11) == 11);
+	REQUIRE(lseek(fd, 0, SEEK_SET) == 0);
+	riscv::Machine<RISCV64>::install_syscall_handler(380,
+		[] (auto& machine) { machine.stop(); });
+
+	std::vector<uint8_t> snapshot;
+	int vfd;
+	riscv::Machine<RISCV64>::address_t chunk;
+	{
+		riscv::Machine<RISCV64> machine { binary, { .memory_max = MAX_MEMORY } };
+		machine.setup_linux_syscalls();
+		machine.setup_posix_threads();
+		machine.setup_native_heap(370, 0x40000000, 1u << 20);
+		chunk = machine.arena().malloc(100);
+		vfd = machine.fds().assign_file(fd);
+		machine.setup_linux({"program", std::to_string(vfd)}, {"LC_TYPE=C", "LC_ALL=C"});
+		machine.simulate(MAX_INSTRUCTIONS);
+		REQUIRE(machine.stopped());
+		REQUIRE(machine.threads().m_threads.size() == 2);
+		machine.serialize_to(snapshot);
+	}
+
+	riscv::Machine<RISCV64> machine { binary, { .memory_max = MAX_MEMORY } };
+	machine.setup_linux_syscalls();
+	machine.setup_posix_threads();
+	machine.setup_native_heap(370, 0x40000000, 1u << 20);
+	machine.fds().permit_filesystem = true;
+	REQUIRE(machine.deserialize_from(snapshot) == 0);
+
+	REQUIRE(machine.threads().m_threads.size() == 2);
+	REQUIRE(machine.arena().chunks_used() == 1);
+	REQUIRE(machine.arena().size(chunk) >= 100);
+	REQUIRE(machine.fds().translation.count(vfd) == 1);
+	REQUIRE(lseek(machine.fds().translate(vfd), 0, SEEK_CUR) == 6);
+
+	machine.simulate(MAX_INSTRUCTIONS);
+	REQUIRE(machine.return_value<int>() == 666);
+	unlink(path);
+}
+
+#ifdef RISCV_IO_URING
+#include <libriscv/linux/io_uring.hpp>
+TEST_CASE("Call into the guest with a time slice set", "[Runtime]")
+{
+	const auto binary = build_and_load(R"M(
+	#include <pthread.h>
+	static void* spinner(void* arg) {
+		while (1);
+		return arg;
+	}
+	__attribute__((used, noinline))
+	long sum(long n) {
+		volatile long s = 0;
+		for (long i = 1; i <= n; i++) s += i;
+		return s;
+	}
+	int main() {
+		pthread_t thread;
+		pthread_create(&thread, NULL, spinner, NULL);
+		return 666;
+	})M", "-O2 -static -pthread");
+
+	riscv::Machine<RISCV64> machine { binary, { .memory_max = MAX_MEMORY } };
+	machine.setup_linux_syscalls();
+	machine.setup_posix_threads();
+	machine.threads().set_time_slice(1'000);
+	machine.setup_linux({"program"}, {"LC_TYPE=C", "LC_ALL=C"});
+	machine.simulate(MAX_INSTRUCTIONS);
+	REQUIRE(machine.return_value<int>() == 666);
+
+	// The spinning thread is never switched to during a call
+	const int tid = machine.gettid();
+	REQUIRE(machine.vmcall("sum", 10000) == 50005000);
+	REQUIRE(machine.gettid() == tid);
+	REQUIRE(machine.preempt("sum", 100) == 5050);
+	REQUIRE(machine.gettid() == tid);
+}
+
+TEST_CASE("Asynchronous read with io_uring", "[Runtime]")
+{
+	const auto binary = build_and_load(R"M(
+	#include <stdlib.h>
+	#include <string.h>
+	#include <unistd.h>
+	int main(int argc, char** argv) {
+		char buffer[16];
+		if (read(atoi(argv[1]), buffer, sizeof(buffer)) != 5)
+			return -1;
+		if (memcmp(buffer, "Hello", 5) != 0)
+			return -1;
+		return 666;
+	})M");
+	int pipefd[2];
+	REQUIRE(pipe(pipefd) == 0);
+	IoUring ring;
+
+	riscv::Machine<RISCV64> machine { binary, { .memory_max = MAX_MEMORY } };
+	machine.setup_linux_syscalls();
+	machine.setup_io_uring(ring);
+	const int vfd = machine.fds().assign_file(pipefd[0]);
+	machine.setup_linux({"program", std::to_string(vfd)}, {"LC_TYPE=C", "LC_ALL=C"});
+
+	// The machine stops, waiting for the read to complete
+	machine.simulate(MAX_INSTRUCTIONS);
+	REQUIRE(machine.async_io().waiting());
+
+	REQUIRE(write(pipefd[1], "Hello", 5) == 5);
+	REQUIRE(ring.poll(1) == 1);
+	REQUIRE(!machine.async_io().waiting());
+	machine.simulate(MAX_INSTRUCTIONS);
+
+	REQUIRE(machine.return_value<int>() == 666);
+	close(pipefd[1]);
+}
+
+TEST_CASE("Join a thread blocked on io_uring", "[Runtime]")
+{
+	const auto binary = build_and_load(R"M(
+	#include <pthread.h>
+	#include <stdlib.h>
+	#include <string.h>
+	#include <unistd.h>
+	static char buffer[16];
+	static void* reader(void* arg) {
+		return (void*)(long) read((int)(long) arg, buffer, sizeof(buffer));
+	}
+	int main(int argc, char** argv) {
+		pthread_t t;
+		void* result;
+		pthread_create(&t, NULL, reader, (void*)(long) atoi(argv[1]));
+		pthread_join(t, &result);
+		if ((long) result != 5 || memcmp(buffer, "Hello", 5) != 0)
+			return -1;
+		return 666;
+	})M");
+	int pipefd[2];
+	REQUIRE(pipe(pipefd) == 0);
+	IoUring ring;
+
+	riscv::Machine<RISCV64> machine { binary, { .memory_max = MAX_MEMORY } };
+	machine.setup_linux_syscalls();
+	machine.setup_posix_threads();
+	machine.setup_io_uring(ring);
+	const int vfd = machine.fds().assign_file(pipefd[0]);
+	machine.setup_linux({"program", std::to_string(vfd)}, {"LC_TYPE=C", "LC_ALL=C"});
+
+	// The main thread waits for the reader, which waits for the read
+	machine.simulate(MAX_INSTRUCTIONS);
+	REQUIRE(machine.async_io().waiting());
+
+	REQUIRE(write(pipefd[1], "Hello", 5) == 5);
+	REQUIRE(ring.poll(1) == 1);
+	REQUIRE(!machine.async_io().waiting());
+	machine.simulate(MAX_INSTRUCTIONS);
+
+	REQUIRE(machine.return_value<int>() == 666);
+	close(pipefd[1]);
+}
+
+TEST_CASE("Read a virtual file with io_uring", "[Runtime]")
+{
+	const auto binary = build_and_load(R"M(
+	#include <fcntl.h>
+	#include <string.h>
+	#include <unistd.h>
+	int main() {
+		char buffer[64] = {};
+		const int fd = open("/data/hello.txt", O_RDONLY);
+		if (fd < 0 || read(fd, buffer, sizeof(buffer)) != 11)
+			return -1;
+		if (strcmp(buffer, "Hello World") != 0)
+			return -2;
+		// Writes to the read-only filesystem fail as without io_uring
+		if (write(fd, buffer, 5) >= 0)
+			return -3;
+		return 666;
+	})M");
+
+	auto vfs = std::make_shared<VirtualFS>();
+	vfs->add_file("/data/hello.txt", "Hello World");
+	IoUring ring;
+
+	riscv::Machine<RISCV64> machine { binary, { .memory_max = MAX_MEMORY } };
+	machine.setup_linux_syscalls();
+	machine.setup_io_uring(ring);
+	machine.fds().vfs = vfs;
+	machine.fds().permit_file_write = true;
+	machine.setup_linux({"program"}, {"LC_TYPE=C", "LC_ALL=C"});
+	machine.simulate(MAX_INSTRUCTIONS);
+
+	REQUIRE(!machine.async_io().waiting());
+	REQUIRE(machine.return_value<int>() == 666);
+}
+#endif
+
+TEST_CASE("Execute generated code", "[Runtime]")
+{
+	const auto binary = build_and_load(R"M(
+	#include <sys/mman.h>
+	typedef int (*func_t)();
+	static void emit(unsigned* code, int value) {
+		code[0] = 0x00000513 | (value << 20); // li a0, value
+		code[1] = 0x00008067; // ret
+		__asm__ volatile("fence.i" ::: "memory");
+	}
+	int main() {
+		unsigned* code = mmap(0, 4096, PROT_READ | PROT_WRITE | PROT_EXEC,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		emit(code, 111);
+		if (((func_t)code)() != 111)
+			return -1;
+		// Modifying the code invalidates it
+		emit(code, 222);
+		if (((func_t)code)() != 222)
+			return -1;
+		// W^X code generation
+		mprotect(code, 4096, PROT_READ | PROT_WRITE);
+		emit(code, 333);
+		mprotect(code, 4096, PROT_READ | PROT_EXEC);
+		if (((func_t)code)() != 333)
+			return -1;
+		return 666;
+	})M");
+
+	riscv::Machine<RISCV64> machine { binary, { .memory_max = MAX_MEMORY } };
+	machine.setup_linux_syscalls();
+	machine.setup_linux({"jit"}, {"LC_TYPE=C", "LC_ALL=C"});
+	machine.simulate(MAX_INSTRUCTIONS);
+
+	REQUIRE(machine.return_value<int>() == 666);
+}
+
 TEST_CASE("Calculate fib(50)", "[Compute]")
 {
 	const auto binary = build_and_load(R"M(
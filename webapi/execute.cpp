@@ -45,6 +45,8 @@ protected_execute(const Request& req, Response& res, const ContentReader& creade
 	machine.set_printer([&output] (const char* text, size_t len) {
 		output.append(text, len);
 	});
+	// Gather the guest output, instead of appending every little write
+	machine.set_output_buffering(16384);
 
 	struct BenchmarkState {
 		bool benchmark = false;
@@ -98,6 +100,7 @@ protected_execute(const Request& req, Response& res, const ContentReader& creade
 		machine.simulate(MAX_INSTRUCTIONS);
 	} catch (std::exception& e) {
 		res.set_header("X-Exception", e.what());
+		machine.flush_output();
 	}
 	asm("" : : : "memory");
 	const uint64_t st2 = micros_now();